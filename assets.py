@@ -0,0 +1,154 @@
+import argparse
+import struct
+import zlib
+
+# see main/assets.c
+ASSETS_MAGIC = 0x414e5953
+ASSETS_VERSION = 1
+ASSETS_ALIGNMENT = 4
+HEADER_FORMAT = "<IHHII"
+ENTRY_FORMAT = "<BBHIII"
+
+# see main/sampler.c
+SAMPLE_MAGIC = 0x4d53
+SAMPLE_FLAG_LOOP = 0x01
+SAMPLE_HEADER_FORMAT = "<HBBBBHIIII"
+
+# see asset_type_t in main/assets.h
+ASSET_TYPES = {
+    "preset": 1,
+    "wavetable": 2,
+    "sample": 3,
+}
+
+
+def align(offset):
+    return (offset + ASSETS_ALIGNMENT - 1) // ASSETS_ALIGNMENT * ASSETS_ALIGNMENT
+
+
+def build(assets):
+    """Returns the bundle for a list of (type, index, data) tuples."""
+    assets = sorted(assets, key=lambda asset: (asset[0], asset[1]))
+    offset = struct.calcsize(HEADER_FORMAT) + len(assets) * struct.calcsize(ENTRY_FORMAT)
+
+    directory = b""
+    data = b""
+    for asset_type, index, asset_data in assets:
+        padding = align(offset + len(data)) - (offset + len(data))
+        data += bytes(padding)
+        directory += struct.pack(ENTRY_FORMAT, asset_type, 0, index, offset + len(data), len(asset_data),
+                                 zlib.crc32(asset_data))
+        data += asset_data
+
+    header = struct.pack(HEADER_FORMAT, ASSETS_MAGIC, ASSETS_VERSION, len(assets), offset + len(data),
+                         zlib.crc32(directory))
+    return header + directory + data
+
+
+def read_wav(data):
+    """Returns the frames, sampling rate, root key and loop (start, end) of a
+    16-bit mono WAV file. The root key and the loop are taken from the smpl chunk
+    (middle C and no loop without it)."""
+    if data[0:4] != b"RIFF" or data[8:12] != b"WAVE":
+        raise ValueError("Not a WAV file")
+    frames = None
+    sampling_freq = None
+    root_key = 60
+    loop = None
+    offset = 12
+    while offset + 8 <= len(data):
+        chunk_id, size = struct.unpack_from("<4sI", data, offset)
+        body = data[offset + 8:offset + 8 + size]
+        if chunk_id == b"fmt ":
+            audio_format, channels, sampling_freq, _, _, bits = struct.unpack_from("<HHIIHH", body)
+            if audio_format != 1 or channels != 1 or bits != 16:
+                raise ValueError("Only 16-bit mono PCM is supported")
+        elif chunk_id == b"data":
+            frames = body
+        elif chunk_id == b"smpl":
+            root_key = struct.unpack_from("<I", body, 12)[0]
+            if struct.unpack_from("<I", body, 28)[0]:     # number of loops
+                start, end = struct.unpack_from("<II", body, 44)
+                loop = (start, end + 1)     # the end is inclusive in the smpl chunk
+        offset += 8 + size + (size & 1)
+    if frames is None or sampling_freq is None:
+        raise ValueError("No fmt or data chunk")
+    return frames, sampling_freq, root_key, loop
+
+
+def build_samples(samples):
+    """Returns the (index, data) tuples of the sample assets for a list of
+    (index, WAV data) tuples. Each sample is played for the keys closest to its
+    root key."""
+    samples = sorted(((index,) + read_wav(data) for index, data in samples), key=lambda sample: sample[3])
+    roots = [sample[3] for sample in samples]
+    assets = []
+    for i, (index, frames, sampling_freq, root_key, loop) in enumerate(samples):
+        low_key = (roots[i - 1] + root_key) // 2 + 1 if i > 0 else 0
+        high_key = (root_key + roots[i + 1]) // 2 if i < len(samples) - 1 else 127
+        loop_start, loop_end = loop or (0, 0)
+        header = struct.pack(SAMPLE_HEADER_FORMAT, SAMPLE_MAGIC, root_key, SAMPLE_FLAG_LOOP if loop else 0,
+                             low_key, high_key, 0, sampling_freq, len(frames) // 2, loop_start, loop_end)
+        assets.append((index, header + frames))
+    return assets
+
+
+def parse(bundle):
+    """Returns the (type, index, data) tuples of a bundle, after checking it."""
+    magic, version, count, size, crc = struct.unpack_from(HEADER_FORMAT, bundle)
+    if magic != ASSETS_MAGIC or version != ASSETS_VERSION:
+        raise ValueError("Not an asset bundle (version {})".format(ASSETS_VERSION))
+    start = struct.calcsize(HEADER_FORMAT)
+    directory = bundle[start:start + count * struct.calcsize(ENTRY_FORMAT)]
+    if size > len(bundle) or zlib.crc32(directory) != crc:
+        raise ValueError("Corrupted asset bundle")
+
+    assets = []
+    for asset_type, _, index, offset, length, crc in struct.iter_unpack(ENTRY_FORMAT, directory):
+        data = bundle[offset:offset + length]
+        if len(data) != length or zlib.crc32(data) != crc:
+            raise ValueError("Corrupted asset {}/{}".format(asset_type, index))
+        assets.append((asset_type, index, data))
+    return assets
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Build the asset bundle that is flashed to the assets partition",
+                                     epilog="Presets are the PRESET<n> files read out from the storage, "
+                                            "wavetables raw 16-bit little-endian mono files, samples 16-bit mono "
+                                            "WAV files (numbered from 0, with the root key and loop in the smpl "
+                                            "chunk).")
+    subparsers = parser.add_subparsers(dest="command", required=True)
+    build_parser = subparsers.add_parser("build")
+    build_parser.add_argument("filename", help="bundle (.bin) file")
+    for name in ASSET_TYPES:
+        build_parser.add_argument("--" + name, nargs=2, action="append", default=[], metavar=("INDEX", "FILE"))
+    list_parser = subparsers.add_parser("list")
+    list_parser.add_argument("filename", help="bundle (.bin) file")
+    args = parser.parse_args()
+
+    if args.command == "build":
+        assets = []
+        samples = []
+        for name, asset_type in ASSET_TYPES.items():
+            for index, filename in getattr(args, name):
+                with open(filename, "rb") as f:
+                    if asset_type == ASSET_TYPES["sample"]:
+                        samples.append((int(index), f.read()))
+                    else:
+                        assets.append((asset_type, int(index), f.read()))
+        assets += [(ASSET_TYPES["sample"], index, data) for index, data in build_samples(samples)]
+        bundle = build(assets)
+        with open(args.filename, "wb") as f:
+            f.write(bundle)
+        print("{} assets ({} bytes) written to {}".format(len(assets), len(bundle), args.filename))
+    else:
+        with open(args.filename, "rb") as f:
+            assets = parse(f.read())
+        names = {asset_type: name for name, asset_type in ASSET_TYPES.items()}
+        for asset_type, index, data in assets:
+            print("{} {}: {} bytes".format(names.get(asset_type, asset_type), index, len(data)))
+
+
+if __name__ == "__main__":
+    main()
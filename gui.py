@@ -4,13 +4,14 @@ from PyQt5.QtCore import Qt, QIODevice, pyqtSignal
 from PyQt5.QtWidgets import QApplication, QWidget, QLabel, QGridLayout, QSizePolicy
 from PyQt5.QtSerialPort import QSerialPort
 
-from widgets import (WaveformSelectorWidget, PresetSelectorWidget, PushButtonWidget,
-                     ToggleButtonWidget, SliderWidget)
+from widgets import (WaveformSelectorWidget, LfoSyncSelectorWidget, PresetSelectorWidget,
+                     PushButtonWidget, ToggleButtonWidget, SliderWidget)
 
 MIDI_SB_CONTROL_CHANGE = (0b1011 << 4)
 
 MIDI_CC_LFO_FREQ           = (0x4a)
 MIDI_CC_LFO_ON_OFF         = (0x4d)
+MIDI_CC_LFO_SYNC           = (0x4b)
 MIDI_CC_OSC2_FREQ          = (0x4c)
 MIDI_CC_OSC2_AMP           = (0x49)
 MIDI_CC_OSC2_SYNC_ON_OFF   = (0x47)
@@ -60,6 +61,7 @@ class GUI(QWidget):
         self.add_control(MIDI_CC_WF_OSC1, WaveformSelectorWidget())
         self.add_control(MIDI_CC_WF_OSC2, WaveformSelectorWidget())
         self.add_control(MIDI_CC_WF_LFO, WaveformSelectorWidget())
+        self.add_control(MIDI_CC_LFO_SYNC, LfoSyncSelectorWidget())
 
         # set up preset selector and save button
         self.add_control(MIDI_CC_SELECT_PRESET, PresetSelectorWidget())
@@ -89,6 +91,7 @@ class GUI(QWidget):
         layout.addWidget(self.cc_map[MIDI_CC_LFO_FREQ], 2, 3)
         layout.addWidget(self.cc_map[MIDI_CC_LFO_ON_OFF], 3, 3)
         layout.addWidget(self.cc_map[MIDI_CC_WF_LFO], 4, 3)
+        layout.addWidget(self.cc_map[MIDI_CC_LFO_SYNC], 5, 3)
 
         layout.addWidget(QLabel("<b>Envelope</b>"), 0, 4)
         layout.addWidget(QLabel("Attack"), 1, 4)
@@ -114,7 +117,7 @@ class GUI(QWidget):
         for i in range(layout.columnCount()):
             spacer = QWidget()
             spacer.setSizePolicy(QSizePolicy.Expanding, QSizePolicy.Minimum)
-            layout.addWidget(spacer, 5, i)
+            layout.addWidget(spacer, 6, i)
             layout.setColumnStretch(i, 1)
 
         self.port.readyRead.connect(self.on_ready_read)
@@ -150,7 +153,7 @@ class GUI(QWidget):
             if i < 0:
                 break
 
-            line = self.line_buffer[:i].strip(b"\r\n").decode("utf-8")
+            line = self.line_buffer[:i].strip(b"\r\n").decode("utf-8", errors="replace")
             print("[LOG]", line)
 
             if line == "MIDI_VALUES_END":
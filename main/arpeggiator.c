@@ -0,0 +1,294 @@
+#include "arpeggiator.h"
+#include "synth.h"
+#include "tempo.h"
+#include "sequencer.h"
+
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "esp_system.h"
+
+/* length of each note, as a fraction of a step */
+#define ARP_GATE                (0.5)
+
+typedef struct {
+    uint8_t channel;
+    uint8_t key;
+    uint8_t velocity;
+} arp_note_t;
+
+static const uint8_t m_ticks_per_step[] = {
+    [ARP_RATE_QUARTER] = TEMPO_PPQN,
+    [ARP_RATE_EIGHTH] = TEMPO_PPQN / 2,
+    [ARP_RATE_SIXTEENTH] = TEMPO_PPQN / 4,
+    [ARP_RATE_THIRTYSECOND] = TEMPO_PPQN / 8,
+};
+
+/* The notes are kept twice, in the order they were played and sorted by pitch,
+ * so that every mode picks its next note in constant time. Only pressing and
+ * releasing keys costs O(held notes). Both lists are changed by the MIDI task
+ * and read by the render loop under the lock.
+ */
+static arp_note_t m_played[ARP_MAX_NOTES];
+static arp_note_t m_sorted[ARP_MAX_NOTES];
+static uint8_t m_count;
+/* keys that are held on each channel, the other notes are latched */
+static uint8_t m_keys_down[16][128 / 8];
+static uint8_t m_keys_down_count;
+static portMUX_TYPE m_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static volatile arp_mode_t m_mode;
+static volatile uint8_t m_octaves = 1;
+static volatile arp_rate_t m_rate = ARP_RATE_SIXTEENTH;
+static volatile uint8_t m_latch;
+
+/* set when the first note is pressed, the arpeggio then starts on that note */
+static uint8_t m_restart;
+static uint32_t m_restart_sample;
+
+/* only used by the render loop */
+static tempo_steps_t m_steps;
+static uint32_t m_position;
+
+/* not threadsafe, should be called with the lock held */
+static int arp_key_is_down(uint8_t channel, uint8_t key)
+{
+    return (m_keys_down[channel][key / 8] >> (key % 8)) & 0x01;
+}
+
+/* not threadsafe, should be called with the lock held */
+static void arp_remove_note(arp_note_t *notes, uint8_t channel, uint8_t key)
+{
+    for(int i = 0; i < m_count; i++) {
+        if((notes[i].channel == channel) && (notes[i].key == key)) {
+            memmove(&notes[i], &notes[i + 1], (m_count - i - 1) * sizeof(arp_note_t));
+            return;
+        }
+    }
+}
+
+/* not threadsafe, should be called with the lock held */
+static void arp_remove(uint8_t channel, uint8_t key)
+{
+    arp_remove_note(m_played, channel, key);
+    arp_remove_note(m_sorted, channel, key);
+    m_count--;
+}
+
+/* not threadsafe, should be called with the lock held */
+static int arp_contains(uint8_t channel, uint8_t key)
+{
+    for(int i = 0; i < m_count; i++) {
+        if((m_played[i].channel == channel) && (m_played[i].key == key))
+            return 1;
+    }
+
+    return 0;
+}
+
+void arp_set_mode(arp_mode_t mode)
+{
+    /* the notes that are held when the arpeggiator is switched on are not
+     * known, so it always starts empty
+     */
+    portENTER_CRITICAL(&m_lock);
+    if((mode == ARP_MODE_OFF) || (m_mode == ARP_MODE_OFF)) {
+        m_count = 0;
+        memset(m_keys_down, 0, sizeof(m_keys_down));
+        m_keys_down_count = 0;
+    }
+    m_mode = mode;
+    portEXIT_CRITICAL(&m_lock);
+}
+
+arp_mode_t arp_get_mode(void)
+{
+    return m_mode;
+}
+
+void arp_set_octaves(uint8_t octaves)
+{
+    if(octaves < 1)
+        octaves = 1;
+    if(octaves > ARP_MAX_OCTAVES)
+        octaves = ARP_MAX_OCTAVES;
+    m_octaves = octaves;
+}
+
+uint8_t arp_get_octaves(void)
+{
+    return m_octaves;
+}
+
+void arp_set_rate(arp_rate_t rate)
+{
+    m_rate = rate;
+}
+
+arp_rate_t arp_get_rate(void)
+{
+    return m_rate;
+}
+
+void arp_set_latch(uint8_t latch)
+{
+    portENTER_CRITICAL(&m_lock);
+    m_latch = latch;
+    /* drop the latched notes */
+    if(!latch) {
+        for(int i = m_count - 1; i >= 0; i--) {
+            if(!arp_key_is_down(m_played[i].channel, m_played[i].key))
+                arp_remove(m_played[i].channel, m_played[i].key);
+        }
+    }
+    portEXIT_CRITICAL(&m_lock);
+}
+
+uint8_t arp_get_latch(void)
+{
+    return m_latch;
+}
+
+int arp_key_press(uint32_t sample, uint8_t channel, uint8_t key, uint8_t velocity)
+{
+    arp_note_t note = {
+        .channel = channel,
+        .key = key,
+        .velocity = velocity,
+    };
+    int i;
+
+    if(m_mode == ARP_MODE_OFF)
+        return 0;
+
+    portENTER_CRITICAL(&m_lock);
+
+    /* with latch, a new chord replaces the latched one */
+    if(m_latch && (m_keys_down_count == 0))
+        m_count = 0;
+
+    if(!arp_key_is_down(channel, key)) {
+        m_keys_down[channel][key / 8] |= 1 << (key % 8);
+        m_keys_down_count++;
+    }
+
+    if((m_count < ARP_MAX_NOTES) && !arp_contains(channel, key)) {
+        if(m_count == 0) {
+            m_restart = 1;
+            m_restart_sample = sample;
+        }
+
+        m_played[m_count] = note;
+        for(i = m_count; (i > 0) && (m_sorted[i - 1].key > key); i--) {
+            m_sorted[i] = m_sorted[i - 1];
+        }
+        m_sorted[i] = note;
+        m_count++;
+    }
+
+    portEXIT_CRITICAL(&m_lock);
+
+    return 1;
+}
+
+/* Only the release of a key that the arpeggiator took is its own. Other keys
+ * were pressed before it was switched on and are playing on the synth, which
+ * has to release them.
+ */
+int arp_key_release(uint32_t sample, uint8_t channel, uint8_t key)
+{
+    int taken = 0;
+
+    if(m_mode == ARP_MODE_OFF)
+        return 0;
+
+    portENTER_CRITICAL(&m_lock);
+
+    if(arp_key_is_down(channel, key)) {
+        m_keys_down[channel][key / 8] &= ~(1 << (key % 8));
+        m_keys_down_count--;
+        if(!m_latch && arp_contains(channel, key))
+            arp_remove(channel, key);
+        taken = 1;
+    }
+
+    portEXIT_CRITICAL(&m_lock);
+
+    return taken;
+}
+
+/* index into the notes (extended by the octave range) for the given position */
+static int arp_index(uint32_t position, int length)
+{
+    uint32_t period;
+
+    switch(m_mode) {
+    case ARP_MODE_DOWN:
+        return length - 1 - position % length;
+    case ARP_MODE_UP_DOWN:
+        /* the highest and lowest notes are not repeated */
+        if(length < 2)
+            return 0;
+        period = 2 * length - 2;
+        position %= period;
+        return (position < length) ? position : period - position;
+    case ARP_MODE_RANDOM:
+        return esp_random() % length;
+    case ARP_MODE_UP:
+    case ARP_MODE_AS_PLAYED:
+    default:
+        return position % length;
+    }
+}
+
+static void arp_play_step(int32_t step, uint32_t sample, float samples_per_step)
+{
+    arp_note_t note;
+    int index;
+    int key;
+
+    portENTER_CRITICAL(&m_lock);
+    if(m_count == 0) {
+        portEXIT_CRITICAL(&m_lock);
+        return;
+    }
+    index = arp_index(m_position++, m_count * m_octaves);
+    note = (m_mode == ARP_MODE_AS_PLAYED) ? m_played[index % m_count] : m_sorted[index % m_count];
+    key = note.key + 12 * (index / m_count);
+    portEXIT_CRITICAL(&m_lock);
+
+    if(key > 127)
+        return;
+
+    synth_schedule_key_press(sample, note.channel, key, note.velocity);
+    synth_schedule_key_release(sample + (uint32_t) (ARP_GATE * samples_per_step), note.channel, key);
+}
+
+void arp_process_block(uint32_t block_start, uint32_t block_size)
+{
+    uint8_t restart;
+    uint32_t restart_sample;
+
+    if((m_mode == ARP_MODE_OFF) || (m_count == 0)) {
+        tempo_steps_stop(&m_steps);
+        return;
+    }
+
+    portENTER_CRITICAL(&m_lock);
+    restart = m_restart;
+    restart_sample = m_restart_sample;
+    m_restart = 0;
+    portEXIT_CRITICAL(&m_lock);
+
+    /* the internal clock starts with the first note, the MIDI clock keeps its
+     * own grid
+     */
+    if(restart) {
+        m_position = 0;
+        tempo_steps_start(&m_steps, restart_sample);
+    }
+
+    tempo_steps_process(&m_steps, block_start, block_size, sequencer_get_tempo(), m_ticks_per_step[m_rate],
+                        arp_play_step);
+}
@@ -0,0 +1,60 @@
+#ifndef ARPEGGIATOR_H
+#define ARPEGGIATOR_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ARP_MAX_NOTES           (16)
+#define ARP_MAX_OCTAVES         (4)
+
+typedef enum {
+    ARP_MODE_OFF,
+    ARP_MODE_UP,
+    ARP_MODE_DOWN,
+    ARP_MODE_UP_DOWN,
+    ARP_MODE_RANDOM,
+    ARP_MODE_AS_PLAYED,
+} arp_mode_t;
+
+/* note length, as a fraction of a quarter note */
+typedef enum {
+    ARP_RATE_QUARTER,
+    ARP_RATE_EIGHTH,
+    ARP_RATE_SIXTEENTH,
+    ARP_RATE_THIRTYSECOND,
+} arp_rate_t;
+
+void arp_set_mode(arp_mode_t mode);
+arp_mode_t arp_get_mode(void);
+void arp_set_octaves(uint8_t octaves);
+uint8_t arp_get_octaves(void);
+void arp_set_rate(arp_rate_t rate);
+arp_rate_t arp_get_rate(void);
+
+/* with latch, the notes keep playing after the keys are released, until a key
+ * is pressed again
+ */
+void arp_set_latch(uint8_t latch);
+uint8_t arp_get_latch(void);
+
+/* called by the MIDI task for every note; return 1 if the arpeggiator takes the
+ * note, in which case it should not be passed to the synth: every note that is
+ * pressed while it is on, and the release of those notes (keys are tracked per
+ * channel); the notes are played on the channel they were received on
+ */
+int arp_key_press(uint32_t sample, uint8_t channel, uint8_t key, uint8_t velocity);
+int arp_key_release(uint32_t sample, uint8_t channel, uint8_t key);
+
+/* called by the render loop for every block, before the note events of that
+ * block are applied; schedules the notes that fall into the block
+ */
+void arp_process_block(uint32_t block_start, uint32_t block_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ARPEGGIATOR_H
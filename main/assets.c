@@ -0,0 +1,172 @@
+#include "assets.h"
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_crc.h"
+#include "esp_partition.h"
+
+static const char *TAG = "ASSETS";
+
+/* The bundle is little-endian:
+ *
+ *     header | count directory entries | assets
+ *
+ * Every asset starts at a multiple of 4 bytes, so that tables of 16- and 32-bit
+ * values can be used in place. The CRC-32 of the directory is in the header,
+ * the CRC-32 of each asset in its entry. The layout is the same in assets.py.
+ */
+#define ASSETS_MAGIC            (0x414e5953)    // "SYNA"
+#define ASSETS_VERSION          (1)
+#define ASSETS_ALIGNMENT        (4)
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;
+    uint32_t size;          // of the whole bundle
+    uint32_t crc;           // of the directory
+} assets_header_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t type;           // asset_type_t
+    uint8_t reserved;
+    uint16_t index;
+    uint32_t offset;        // from the start of the bundle
+    uint32_t size;
+    uint32_t crc;
+} assets_entry_t;
+
+static const uint8_t *m_bundle;
+static const assets_entry_t *m_entries;
+static uint16_t m_count;
+
+static spi_flash_mmap_handle_t m_mmap_handle;
+
+static const void *assets_map(const char *name, size_t *size)
+{
+    const esp_partition_t *partition;
+    const void *data;
+
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, name);
+    if(partition == NULL) {
+        ESP_LOGE(TAG, "No %s partition", name);
+        return NULL;
+    }
+
+    if(esp_partition_mmap(partition, 0, partition->size, SPI_FLASH_MMAP_DATA, &data, &m_mmap_handle) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to map the %s partition", name);
+        return NULL;
+    }
+
+    *size = partition->size;
+    return data;
+}
+
+static void assets_unmap(const void *data)
+{
+    spi_flash_munmap(m_mmap_handle);
+}
+
+/* Everything is checked once, when the bundle is opened, so that lookups are
+ * only a search of the directory. A bundle with a single bad asset is rejected
+ * as a whole.
+ */
+static int assets_check(const uint8_t *data, size_t size)
+{
+    assets_header_t header;
+    const assets_entry_t *entries;
+    size_t directory_size;
+
+    if(size < sizeof(header)) {
+        ESP_LOGE(TAG, "Truncated bundle");
+        return -1;
+    }
+    memcpy(&header, data, sizeof(header));
+
+    /* an erased partition reads as 0xff */
+    if(header.magic != ASSETS_MAGIC) {
+        ESP_LOGE(TAG, "No asset bundle");
+        return -1;
+    }
+    if(header.version != ASSETS_VERSION) {
+        ESP_LOGE(TAG, "Unsupported bundle version: %d", header.version);
+        return -1;
+    }
+
+    directory_size = header.count * sizeof(assets_entry_t);
+    if((header.size > size) || (sizeof(header) + directory_size > header.size)) {
+        ESP_LOGE(TAG, "Invalid bundle size: %u bytes", header.size);
+        return -1;
+    }
+
+    entries = (const assets_entry_t *) &data[sizeof(header)];
+    if(esp_crc32_le(0, (const uint8_t *) entries, directory_size) != header.crc) {
+        ESP_LOGE(TAG, "Invalid bundle directory CRC");
+        return -1;
+    }
+
+    for(int i = 0; i < header.count; i++) {
+        if((entries[i].offset % ASSETS_ALIGNMENT) || (entries[i].offset > header.size)
+                || (entries[i].size > header.size - entries[i].offset)) {
+            ESP_LOGE(TAG, "Invalid asset %d/%d", entries[i].type, entries[i].index);
+            return -1;
+        }
+        if(esp_crc32_le(0, &data[entries[i].offset], entries[i].size) != entries[i].crc) {
+            ESP_LOGE(TAG, "Invalid CRC of asset %d/%d", entries[i].type, entries[i].index);
+            return -1;
+        }
+    }
+
+    return header.count;
+}
+
+int assets_open(const char *name)
+{
+    const uint8_t *data;
+    size_t size;
+    int count;
+
+    assets_close();
+
+    data = assets_map(name, &size);
+    if(data == NULL)
+        return -1;
+
+    count = assets_check(data, size);
+    if(count < 0) {
+        assets_unmap(data);
+        return -1;
+    }
+
+    m_bundle = data;
+    m_entries = (const assets_entry_t *) &data[sizeof(assets_header_t)];
+    m_count = count;
+
+    ESP_LOGI(TAG, "%d assets in %s", count, name);
+
+    return 0;
+}
+
+void assets_close(void)
+{
+    if(m_bundle == NULL)
+        return;
+
+    assets_unmap(m_bundle);
+    m_bundle = NULL;
+    m_entries = NULL;
+    m_count = 0;
+}
+
+const void *assets_find(asset_type_t type, uint16_t index, size_t *size)
+{
+    for(int i = 0; i < m_count; i++) {
+        if((m_entries[i].type == type) && (m_entries[i].index == index)) {
+            *size = m_entries[i].size;
+            return &m_bundle[m_entries[i].offset];
+        }
+    }
+
+    return NULL;
+}
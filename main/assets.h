@@ -0,0 +1,37 @@
+#ifndef ASSETS_H
+#define ASSETS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A read-only bundle of presets, wavetables and samples, built with assets.py.
+ * It is stored in the "assets" partition, which is mapped into the data address
+ * space. The assets are accessed in place, they are never copied into RAM.
+ */
+typedef enum {
+    ASSET_PRESET = 1,       // a preset record, as stored in /spiffs/PRESET<n> (see preset.c)
+    ASSET_WAVETABLE = 2,    // one period, int16_t
+    ASSET_SAMPLE = 3,       // a zone of the multisample (see sampler.c)
+} asset_type_t;
+
+/* maps and checks the bundle; name is the partition label; returns -1 if there
+ * is no valid bundle, in which case no assets are found
+ */
+int assets_open(const char *name);
+void assets_close(void);
+
+/* returns a pointer to the asset (4-byte aligned) and sets its size in bytes,
+ * or returns NULL if the bundle has no such asset; the pointer stays valid
+ * until assets_close()
+ */
+const void *assets_find(asset_type_t type, uint16_t index, size_t *size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ASSETS_H
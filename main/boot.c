@@ -0,0 +1,52 @@
+#include "boot.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+static const char *TAG = "BOOT";
+
+#define BOOT_MAX_PHASES         (16)
+
+typedef struct {
+    const char *name;
+    int64_t start_us;
+    int64_t end_us;
+} boot_phase_t;
+
+/* phases run in several tasks, see app_main() */
+static portMUX_TYPE m_lock = portMUX_INITIALIZER_UNLOCKED;
+static boot_phase_t m_phases[BOOT_MAX_PHASES];
+static int m_phase_count;
+
+void boot_phase(const char *name, int64_t start_us)
+{
+    int64_t end_us = esp_timer_get_time();
+
+    portENTER_CRITICAL(&m_lock);
+    if(m_phase_count < BOOT_MAX_PHASES) {
+        m_phases[m_phase_count].name = name;
+        m_phases[m_phase_count].start_us = start_us;
+        m_phases[m_phase_count].end_us = end_us;
+        m_phase_count++;
+    }
+    portEXIT_CRITICAL(&m_lock);
+}
+
+void boot_report(void)
+{
+    boot_phase_t phase;
+    int count;
+
+    portENTER_CRITICAL(&m_lock);
+    count = m_phase_count;
+    portEXIT_CRITICAL(&m_lock);
+
+    for(int i = 0; i < count; i++) {
+        phase = m_phases[i];
+        ESP_LOGI(TAG, "%-16s %6.1f ... %6.1f ms (%6.1f ms)", phase.name, phase.start_us / 1000.0,
+                    phase.end_us / 1000.0, (phase.end_us - phase.start_us) / 1000.0);
+    }
+}
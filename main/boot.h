@@ -0,0 +1,24 @@
+#ifndef BOOT_H
+#define BOOT_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* records a boot phase that started at start_us (esp_timer_get_time()) and ends
+ * now; can be called from any task, phases beyond BOOT_MAX_PHASES are dropped
+ */
+void boot_phase(const char *name, int64_t start_us);
+
+/* prints all phases with their start and end, in ms since the timer started
+ * (shortly after reset, the bootloader is not included)
+ */
+void boot_report(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BOOT_H
@@ -106,6 +106,14 @@ static void sketch_waveform(waveform_t waveform, int x, int y, int width, int am
         draw::line(lcd, srect16(x + width/2, y + amplitude, x + width, y + amplitude), color);
         draw::line(lcd, srect16(x + width, y + amplitude, x + width, y), color);
         break;
+    case WAVEFORM_SAMPLE:
+        /* some recorded wave */
+        draw::line(lcd, srect16(x, y, x + width/6, y - amplitude), color);
+        draw::line(lcd, srect16(x + width/6, y - amplitude, x + width/3, y + amplitude/2), color);
+        draw::line(lcd, srect16(x + width/3, y + amplitude/2, x + width/2, y - amplitude/2), color);
+        draw::line(lcd, srect16(x + width/2, y - amplitude/2, x + 3*width/4, y + amplitude), color);
+        draw::line(lcd, srect16(x + 3*width/4, y + amplitude, x + width, y), color);
+        break;
     }
 }
 
@@ -287,6 +295,9 @@ static void display_task(void *pvParameters)
 {
     int preset_index;
 
+    /* draw gray background */
+    draw::filled_rectangle(lcd, (srect16) lcd.bounds(), lcd_color::gray);
+
     for(;;) {
         /* get oscillator params */
         synth_get_params(&osc1_params, &osc2_params, &lfo_params, &envelope_params, &synth_params);
@@ -311,8 +322,5 @@ void display_init(void)
         abort();
     }
 
-    /* draw gray background */
-    draw::filled_rectangle(lcd, (srect16) lcd.bounds(), lcd_color::gray);
-
     xTaskCreatePinnedToCore(display_task, "display_task", 4096, NULL, 1, NULL, 0);
 }
\ No newline at end of file
@@ -0,0 +1,289 @@
+#include "latency.h"
+#include "pinout.h"
+#include "synth.h"
+#include "logger.h"
+
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "driver/gpio.h"
+
+static const char *TAG = "LATENCY";
+
+/* number of timestamps buffered per source (must be a power of two) */
+#define RX_FIFO_SIZE            (64)
+
+/* histogram resolution is 1 ms, the last bin collects everything above */
+#define HISTOGRAM_BINS          (64)
+
+#define REPORT_INTERVAL_MS      (5000)
+
+/* The arrival of a byte is detected with a GPIO interrupt on the falling edge of
+ * its start bit. The data bits can produce more falling edges, but those all happen
+ * within 9 bit periods after the start bit, whereas the next start bit comes at
+ * least 10 bit periods later (after the stop bit).
+ */
+/* Byte n (counted by the reader) has the timestamp of start bit n (counted by
+ * the interrupt), in slot n % RX_FIFO_SIZE. If the reader falls more than
+ * RX_FIFO_SIZE bytes behind, the oldest timestamps are overwritten; those bytes
+ * get their read time instead and are counted as lost, the following ones keep
+ * their own timestamps. When the UART input is flushed, both counts are set
+ * equal again (see latency_flush()).
+ */
+typedef struct {
+    int gpio_num;
+    int64_t min_byte_time_us;
+    int64_t last_start_us;
+    int64_t timestamps[RX_FIFO_SIZE];
+    uint32_t head;          // start bits seen
+    uint32_t tail;          // bytes read
+    uint32_t lost;          // bytes whose timestamp was overwritten
+    uint32_t flushes;
+} rx_source_t;
+
+typedef struct {
+    const char *name;
+    uint32_t bins[HISTOGRAM_BINS];
+    uint32_t count;
+    int64_t sum_us;
+    int64_t min_us;
+    int64_t max_us;
+} histogram_t;
+
+typedef enum {
+    NOTE_IDLE,
+    NOTE_RECEIVED,
+    NOTE_TRIGGERED,
+    NOTE_RENDERED,
+} note_state_t;
+
+static portMUX_TYPE m_lock = portMUX_INITIALIZER_UNLOCKED;
+static portMUX_TYPE m_fifo_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static rx_source_t m_sources[LATENCY_SOURCE_COUNT] = {
+    [LATENCY_SOURCE_UART0] = {
+        .gpio_num = CONSOLE_UART_RX_GPIO,
+        .min_byte_time_us = 9 * 1000000 / CONFIG_ESP_CONSOLE_UART_BAUDRATE + 1,
+    },
+    [LATENCY_SOURCE_UART2] = {
+        .gpio_num = MIDI_UART_RX_GPIO,
+        .min_byte_time_us = 9 * 1000000 / 31250 + 1,
+    },
+};
+
+/* only one note is tracked at a time, notes arriving in the meantime are ignored */
+static struct {
+    note_state_t state;
+    uint8_t channel;
+    uint8_t key;
+    int64_t arrival_us;
+    int64_t render_us;
+    uint32_t trigger_sample;
+} m_note;
+
+static histogram_t m_input = { .name = "MIDI in -> render" };
+static histogram_t m_output = { .name = "render -> I2S out" };
+static histogram_t m_total = { .name = "MIDI in -> I2S out" };
+
+static void IRAM_ATTR latency_rx_isr(void *arg)
+{
+    rx_source_t *source = (rx_source_t *) arg;
+    int64_t t_us = esp_timer_get_time();
+
+    if(t_us - source->last_start_us < source->min_byte_time_us)
+        return;
+
+    source->last_start_us = t_us;
+
+    /* a full FIFO overwrites the oldest timestamp, see rx_source_t */
+    portENTER_CRITICAL_ISR(&m_fifo_lock);
+    source->timestamps[source->head % RX_FIFO_SIZE] = t_us;
+    source->head++;
+    portEXIT_CRITICAL_ISR(&m_fifo_lock);
+}
+
+int64_t latency_byte_read(latency_source_t source)
+{
+    rx_source_t *s = &m_sources[source];
+    int64_t t_us = -1;
+
+    portENTER_CRITICAL(&m_fifo_lock);
+    if(s->head - s->tail > RX_FIFO_SIZE) {
+        s->lost++;
+    } else if(s->head != s->tail) {
+        t_us = s->timestamps[s->tail % RX_FIFO_SIZE];
+    }
+    /* a byte without a start bit (e.g. a missed edge) does not move the head */
+    if(s->head != s->tail)
+        s->tail++;
+    portEXIT_CRITICAL(&m_fifo_lock);
+
+    return (t_us < 0) ? esp_timer_get_time() : t_us;
+}
+
+void latency_flush(latency_source_t source)
+{
+    rx_source_t *s = &m_sources[source];
+
+    portENTER_CRITICAL(&m_fifo_lock);
+    s->tail = s->head;
+    s->flushes++;
+    portEXIT_CRITICAL(&m_fifo_lock);
+}
+
+void latency_note_on(int64_t arrival_us, uint8_t channel, uint8_t key)
+{
+    portENTER_CRITICAL(&m_lock);
+    if(m_note.state == NOTE_IDLE) {
+        m_note.arrival_us = arrival_us;
+        m_note.channel = channel;
+        m_note.key = key;
+        m_note.state = NOTE_RECEIVED;
+    }
+    portEXIT_CRITICAL(&m_lock);
+}
+
+void latency_note_dropped(uint8_t channel, uint8_t key)
+{
+    portENTER_CRITICAL(&m_lock);
+    if((m_note.state == NOTE_RECEIVED) && (m_note.channel == channel) && (m_note.key == key))
+        m_note.state = NOTE_IDLE;
+    portEXIT_CRITICAL(&m_lock);
+}
+
+/* only the note that was received triggers the measurement, not e.g. a note of
+ * the sequencer that happens to start in the meantime
+ */
+void latency_note_triggered(uint32_t sample, uint8_t channel, uint8_t key)
+{
+    portENTER_CRITICAL(&m_lock);
+    if((m_note.state == NOTE_RECEIVED) && (m_note.channel == channel) && (m_note.key == key)) {
+        m_note.trigger_sample = sample;
+        m_note.state = NOTE_TRIGGERED;
+    }
+    portEXIT_CRITICAL(&m_lock);
+}
+
+void latency_block_rendered(uint32_t block_offset, uint32_t block_size)
+{
+    portENTER_CRITICAL(&m_lock);
+    if((m_note.state == NOTE_TRIGGERED) && (m_note.trigger_sample - block_offset < block_size)) {
+        m_note.render_us = esp_timer_get_time();
+        m_note.state = NOTE_RENDERED;
+    }
+    portEXIT_CRITICAL(&m_lock);
+}
+
+static void histogram_add(histogram_t *histogram, int64_t latency_us)
+{
+    int bin = latency_us / 1000;
+
+    if(bin < 0)
+        bin = 0;
+    if(bin >= HISTOGRAM_BINS)
+        bin = HISTOGRAM_BINS - 1;
+
+    histogram->bins[bin]++;
+    if((histogram->count == 0) || (latency_us < histogram->min_us))
+        histogram->min_us = latency_us;
+    if((histogram->count == 0) || (latency_us > histogram->max_us))
+        histogram->max_us = latency_us;
+    histogram->sum_us += latency_us;
+    histogram->count++;
+}
+
+void latency_block_written(uint32_t block_offset, uint32_t block_size, uint32_t queued_frames)
+{
+    int64_t output_us;
+    uint32_t frames_until_output;
+
+    portENTER_CRITICAL(&m_lock);
+    if((m_note.state == NOTE_RENDERED) && (m_note.trigger_sample - block_offset < block_size)) {
+        /* the end of the block leaves the I2S bus after queued_frames, the trigger
+         * sample comes (block_size - index in block) frames earlier
+         */
+        frames_until_output = queued_frames - (block_size - (m_note.trigger_sample - block_offset));
+        output_us = esp_timer_get_time() + (int64_t) frames_until_output * 1000000 / SYNTH_SAMPLING_FREQ;
+
+        histogram_add(&m_input, m_note.render_us - m_note.arrival_us);
+        histogram_add(&m_output, output_us - m_note.render_us);
+        histogram_add(&m_total, output_us - m_note.arrival_us);
+
+        m_note.state = NOTE_IDLE;
+    }
+    portEXIT_CRITICAL(&m_lock);
+}
+
+static void histogram_print(histogram_t *histogram)
+{
+    printf("%s: n=%u min=%.2f ms avg=%.2f ms max=%.2f ms\n", histogram->name, histogram->count,
+            histogram->min_us / 1000.0, (float) histogram->sum_us / histogram->count / 1000.0,
+            histogram->max_us / 1000.0);
+
+    for(int i = 0; i < HISTOGRAM_BINS; i++) {
+        if(histogram->bins[i] == 0)
+            continue;
+        printf("  %s%2d ms: %u\n", (i == HISTOGRAM_BINS - 1) ? ">=" : "  ", i, histogram->bins[i]);
+    }
+}
+
+static void latency_task(void *pvParameters)
+{
+    histogram_t input;
+    histogram_t output;
+    histogram_t total;
+    uint32_t count_last_reported = 0;
+
+    for(;;) {
+        vTaskDelay(REPORT_INTERVAL_MS / portTICK_PERIOD_MS);
+
+        /* copy the histograms so that we do not print while holding the lock */
+        portENTER_CRITICAL(&m_lock);
+        memcpy(&input, &m_input, sizeof(histogram_t));
+        memcpy(&output, &m_output, sizeof(histogram_t));
+        memcpy(&total, &m_total, sizeof(histogram_t));
+        portEXIT_CRITICAL(&m_lock);
+
+        if(total.count == count_last_reported)
+            continue;
+        count_last_reported = total.count;
+
+        logger_console_lock();
+        printf("LATENCY_REPORT_START\n");
+        histogram_print(&input);
+        histogram_print(&output);
+        histogram_print(&total);
+        for(int i = 0; i < LATENCY_SOURCE_COUNT; i++) {
+            printf("source %d: %u timestamps lost, %u flushes\n", i, m_sources[i].lost, m_sources[i].flushes);
+        }
+        printf("LATENCY_REPORT_END\n");
+        fflush(stdout);
+        logger_console_unlock();
+    }
+}
+
+void latency_init(void)
+{
+    esp_err_t err;
+
+    /* another driver may have installed the service already */
+    err = gpio_install_isr_service(0);
+    if(err != ESP_ERR_INVALID_STATE)
+        ESP_ERROR_CHECK(err);
+
+    for(int i = 0; i < LATENCY_SOURCE_COUNT; i++) {
+        /* the pins stay routed to the UARTs, we only add an edge interrupt */
+        ESP_ERROR_CHECK(gpio_set_intr_type(m_sources[i].gpio_num, GPIO_INTR_NEGEDGE));
+        ESP_ERROR_CHECK(gpio_isr_handler_add(m_sources[i].gpio_num, latency_rx_isr, &m_sources[i]));
+        ESP_ERROR_CHECK(gpio_intr_enable(m_sources[i].gpio_num));
+    }
+
+    ESP_LOGI(TAG, "Latency measurement enabled");
+
+    xTaskCreatePinnedToCore(latency_task, "latency_task", 3072, NULL, 0, NULL, 0);
+}
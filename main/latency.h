@@ -0,0 +1,56 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* set to 1 to enable the MIDI-to-audio latency measurement mode */
+#define LATENCY_MEASUREMENT         0
+
+/* MIDI sources whose byte arrival is timestamped */
+typedef enum {
+    LATENCY_SOURCE_UART0,
+    LATENCY_SOURCE_UART2,
+    LATENCY_SOURCE_COUNT,
+} latency_source_t;
+
+void latency_init(void);
+
+/* called by the MIDI task for every byte read from the UART; returns the arrival
+ * time of that byte (in us, esp_timer_get_time() time base)
+ */
+int64_t latency_byte_read(latency_source_t source);
+
+/* called by the MIDI task whenever it flushes the UART input, so that the
+ * following bytes are matched with their own timestamps again
+ */
+void latency_flush(latency_source_t source);
+
+/* called by the MIDI task just before a note on is passed to the synth, and if
+ * the note does not reach the synth after all (e.g. the arpeggiator takes it)
+ */
+void latency_note_on(int64_t arrival_us, uint8_t channel, uint8_t key);
+void latency_note_dropped(uint8_t channel, uint8_t key);
+
+/* called by the synth (with the parameter semaphore taken) when the note is
+ * scheduled at the given sample position, or dropped if it starts no voice
+ */
+void latency_note_triggered(uint32_t sample, uint8_t channel, uint8_t key);
+
+/* called by the render loop after a block was calculated */
+void latency_block_rendered(uint32_t block_offset, uint32_t block_size);
+
+/* called by the render loop after a block was handed over to the I2S driver;
+ * queued_frames is the depth of the DMA buffers in frames, i.e. the number of
+ * frames that will be played until the end of this block has left the I2S bus
+ */
+void latency_block_written(uint32_t block_offset, uint32_t block_size, uint32_t queued_frames);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LATENCY_H
@@ -0,0 +1,270 @@
+#include "logger.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "esp_log.h"
+
+/* number of records in the ring (must be a power of two) */
+#define LOGGER_RING_SIZE            (128)
+#define LOGGER_FLUSH_INTERVAL_MS    (20)
+#define LOGGER_LINE_LENGTH          (128)
+#define LOGGER_SPEC_LENGTH          (16)
+
+typedef union {
+    int32_t i;
+    float f;
+} logger_arg_t;
+
+/* The ring is a bounded multi-producer queue as described in
+ * https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+ * Each record carries a sequence number that tells producers whether the slot
+ * is free and the consumer whether it has been completely written.
+ */
+typedef struct {
+    atomic_uint sequence;
+    uint8_t id;
+    logger_arg_t args[LOGGER_MAX_ARGS];
+} logger_record_t;
+
+typedef struct {
+    const char *format;
+    uint8_t argc;
+    uint8_t float_mask;     // bit i is set if argument i is a floating point value
+} logger_format_t;
+
+#define LOGGER_FORMAT(id, format)   { format, 0, 0 },
+
+static logger_format_t m_formats[LOG_MESSAGE_COUNT] = {
+    LOGGER_MESSAGES(LOGGER_FORMAT)
+};
+
+#undef LOGGER_FORMAT
+
+static logger_record_t m_ring[LOGGER_RING_SIZE];
+static atomic_uint m_enqueue_pos;
+static uint32_t m_dequeue_pos;      // there is only one consumer (logger_task)
+static atomic_uint m_dropped;
+static SemaphoreHandle_t m_console_mutex;
+
+static int logger_is_float_conversion(char c)
+{
+    return strchr("eEfFgGaA", c) != NULL;
+}
+
+/* returns the length of the conversion specification at spec (which points to
+ * a '%'), or 0 if it is "%%"
+ */
+static int logger_spec_length(const char *spec)
+{
+    int length = 1;
+
+    if(spec[1] == '%')
+        return 0;
+
+    /* flags, width and precision */
+    while((spec[length] != '\0') && (strchr("-+ #0123456789.", spec[length]) != NULL))
+        length++;
+
+    /* conversion character */
+    if(spec[length] != '\0')
+        length++;
+
+    return length;
+}
+
+void logger_log(logger_message_t id, ...)
+{
+    logger_record_t *record;
+    logger_format_t *format = &m_formats[id];
+    unsigned int pos = atomic_load_explicit(&m_enqueue_pos, memory_order_relaxed);
+    unsigned int sequence;
+    int diff;
+    va_list ap;
+
+    /* reserve a slot */
+    for(;;) {
+        record = &m_ring[pos % LOGGER_RING_SIZE];
+        sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+        diff = (int) (sequence - pos);
+        if(diff == 0) {
+            if(atomic_compare_exchange_weak_explicit(&m_enqueue_pos, &pos, pos + 1,
+                                                        memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if(diff < 0) {
+            /* the ring is full */
+            atomic_fetch_add_explicit(&m_dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&m_enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    record->id = id;
+
+    va_start(ap, id);
+    for(int i = 0; i < format->argc; i++) {
+        if(format->float_mask & (1 << i)) {
+            record->args[i].f = (float) va_arg(ap, double);
+        } else {
+            record->args[i].i = va_arg(ap, int);
+        }
+    }
+    va_end(ap);
+
+    /* publish the record */
+    atomic_store_explicit(&record->sequence, pos + 1, memory_order_release);
+}
+
+static void logger_print(const logger_record_t *record)
+{
+    const logger_format_t *format = &m_formats[record->id];
+    const char *p = format->format;
+    char line[LOGGER_LINE_LENGTH];
+    char spec[LOGGER_SPEC_LENGTH];
+    int length = 0;
+    int spec_length;
+    int arg = 0;
+
+    while((*p != '\0') && (length < LOGGER_LINE_LENGTH - 1)) {
+        if(*p != '%') {
+            line[length++] = *p++;
+            continue;
+        }
+
+        spec_length = logger_spec_length(p);
+        if(spec_length == 0) {
+            line[length++] = '%';
+            p += 2;
+            continue;
+        }
+
+        if(spec_length >= LOGGER_SPEC_LENGTH)
+            spec_length = LOGGER_SPEC_LENGTH - 1;
+        memcpy(spec, p, spec_length);
+        spec[spec_length] = '\0';
+        p += spec_length;
+
+        if(format->float_mask & (1 << arg)) {
+            length += snprintf(&line[length], LOGGER_LINE_LENGTH - length, spec, (double) record->args[arg].f);
+        } else {
+            length += snprintf(&line[length], LOGGER_LINE_LENGTH - length, spec, record->args[arg].i);
+        }
+        arg++;
+
+        /* snprintf returns the length it would have written */
+        if(length > LOGGER_LINE_LENGTH - 1)
+            length = LOGGER_LINE_LENGTH - 1;
+    }
+    line[length] = '\0';
+
+    logger_console_lock();
+    fputs(line, stdout);
+    fflush(stdout);
+    logger_console_unlock();
+}
+
+/* prints the records that were logged since the last call, and the number of
+ * records that were dropped in the meantime
+ */
+static void logger_flush(void)
+{
+    static unsigned int dropped_reported;
+    logger_record_t record;
+    logger_record_t *slot;
+    unsigned int dropped;
+
+    for(;;) {
+        slot = &m_ring[m_dequeue_pos % LOGGER_RING_SIZE];
+        if(atomic_load_explicit(&slot->sequence, memory_order_acquire) != m_dequeue_pos + 1)
+            break;
+
+        /* copy the record and hand the slot back to the producers before printing */
+        record.id = slot->id;
+        memcpy(record.args, slot->args, sizeof(record.args));
+        atomic_store_explicit(&slot->sequence, m_dequeue_pos + LOGGER_RING_SIZE, memory_order_release);
+        m_dequeue_pos++;
+
+        logger_print(&record);
+    }
+
+    dropped = atomic_load_explicit(&m_dropped, memory_order_relaxed);
+    if(dropped != dropped_reported) {
+        logger_console_lock();
+        printf("%u log messages dropped\n", dropped - dropped_reported);
+        fflush(stdout);
+        logger_console_unlock();
+        dropped_reported = dropped;
+    }
+}
+
+static void logger_task(void *pvParameters)
+{
+    for(;;) {
+        logger_flush();
+        vTaskDelay(LOGGER_FLUSH_INTERVAL_MS / portTICK_PERIOD_MS);
+    }
+}
+
+void logger_console_lock(void)
+{
+    xSemaphoreTakeRecursive(m_console_mutex, portMAX_DELAY);
+}
+
+void logger_console_unlock(void)
+{
+    xSemaphoreGiveRecursive(m_console_mutex);
+}
+
+/* ESP_LOGx output of all tasks */
+static int logger_console_vprintf(const char *format, va_list args)
+{
+    int length;
+
+    logger_console_lock();
+    length = vprintf(format, args);
+    fflush(stdout);
+    logger_console_unlock();
+
+    return length;
+}
+
+void logger_init(void)
+{
+    const char *p;
+    int spec_length;
+
+    /* find out the number and types of the arguments of each message, so that
+     * logger_log() does not need to parse the format strings
+     */
+    for(int i = 0; i < LOG_MESSAGE_COUNT; i++) {
+        for(p = strchr(m_formats[i].format, '%'); p != NULL; p = strchr(p, '%')) {
+            spec_length = logger_spec_length(p);
+            if(spec_length == 0) {
+                p += 2;
+                continue;
+            }
+            if(m_formats[i].argc < LOGGER_MAX_ARGS) {
+                if(logger_is_float_conversion(p[spec_length - 1]))
+                    m_formats[i].float_mask |= 1 << m_formats[i].argc;
+                m_formats[i].argc++;
+            }
+            p += spec_length;
+        }
+    }
+
+    for(int i = 0; i < LOGGER_RING_SIZE; i++) {
+        atomic_init(&m_ring[i].sequence, i);
+    }
+
+    m_console_mutex = xSemaphoreCreateRecursiveMutex();
+    esp_log_set_vprintf(logger_console_vprintf);
+
+    xTaskCreatePinnedToCore(logger_task, "logger_task", 3072, NULL, 0, NULL, 0);
+}
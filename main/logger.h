@@ -0,0 +1,82 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Deferred logger for the MIDI and parameter update paths: instead of formatting
+ * and printing in the caller's context (which blocks for milliseconds on the
+ * 115200 baud console), a compact binary record (message id + arguments) is
+ * pushed into a lock-free ring and printed later by a low-priority task.
+ *
+ * Arguments must be int-sized integers or floating point values, matching the
+ * conversions in the format string; at most LOGGER_MAX_ARGS are supported.
+ */
+#define LOGGER_MAX_ARGS     (3)
+
+#define LOGGER_MESSAGES(X) \
+    X(LOG_MIDI_MESSAGE_0,       "%02X\n") \
+    X(LOG_MIDI_MESSAGE_1,       "%02X %02X\n") \
+    X(LOG_MIDI_MESSAGE_2,       "%02X %02X %02X\n") \
+    X(LOG_MIDI_SYSEX,           "F0 (SysEx, %u bytes, truncated: %d)\n") \
+    X(LOG_MIDI_OVERFLOW,        "UART%d overflow\n") \
+    X(LOG_CONTROL_CHANGE,       "Control change: %02X = %02X\n") \
+    X(LOG_CALCULATION_LOAD,     "Calculation load: %u %%\n") \
+    X(LOG_INVALID_FREQUENCY,    "Invalid frequency\n") \
+    X(LOG_INVALID_ATTACK,       "Invalid attack value: %.2f\n") \
+    X(LOG_INVALID_DECAY,        "Invalid decay value: %.2f\n") \
+    X(LOG_INVALID_SUSTAIN,      "Invalid sustain value: %.2f\n") \
+    X(LOG_INVALID_RELEASE,      "Invalid release value: %.2f\n") \
+    X(LOG_INVALID_WAVEFORM,     "Invalid waveform: %d %d %d\n") \
+    X(LOG_INVALID_TUNING,       "Invalid tuning: %d\n") \
+    X(LOG_OSC1_FREQ,            "Updating OSC1 frequency: %.2f Hz\n") \
+    X(LOG_OSC1_WAVEFORM,        "Updating OSC1 waveform: %d\n") \
+    X(LOG_OSC1_AMP,             "Updating OSC1 amplitude: %.2f\n") \
+    X(LOG_OSC2_FREQ,            "Updating OSC2 frequency: %.2f Hz\n") \
+    X(LOG_OSC2_WAVEFORM,        "Updating OSC2 waveform: %d\n") \
+    X(LOG_OSC2_AMP,             "Updating OSC2 amplitude: %.2f\n") \
+    X(LOG_LFO_FREQ,             "Updating LFO frequency: %.2f Hz\n") \
+    X(LOG_LFO_WAVEFORM,         "Updating LFO waveform: %d\n") \
+    X(LOG_ENV_ATTACK,           "Updating envelope attack: %.2f s\n") \
+    X(LOG_ENV_DECAY,            "Updating envelope decay: %.2f s\n") \
+    X(LOG_ENV_SUSTAIN,          "Updating envelope sustain: %.2f %%\n") \
+    X(LOG_ENV_RELEASE,          "Updating envelope release: %.2f s\n") \
+    X(LOG_TRANSPORT_START,      "Transport start\n") \
+    X(LOG_TRANSPORT_CONTINUE,   "Transport continue\n") \
+    X(LOG_TRANSPORT_STOP,       "Transport stop, tempo: %.1f BPM\n") \
+    X(LOG_EVENT_QUEUE_FULL,     "Note event queue full\n") \
+    X(LOG_PRESET_SELECT,        "Preset %d selected in %u us\n") \
+    X(LOG_AUDIO_STARTED,        "Audio started %u ms after boot\n") \
+    X(LOG_SAMPLE_UNDERRUN,      "Sample streams late: %u frames skipped\n")
+
+#define LOGGER_ENUM(id, format)     id,
+
+typedef enum {
+    LOGGER_MESSAGES(LOGGER_ENUM)
+    LOG_MESSAGE_COUNT,
+} logger_message_t;
+
+#undef LOGGER_ENUM
+
+void logger_init(void);
+
+/* never blocks; if the ring is full, the record is dropped and counted */
+void logger_log(logger_message_t id, ...);
+
+/* The console (UART0) carries the log output, ESP_LOGx output and the SysEx
+ * replies to the host, which must not be interleaved with text. The logger and
+ * ESP_LOGx hold this lock while they print; other output that has to stay in
+ * one piece (binary replies, multi-line reports) takes it around the whole
+ * output and waits until it has been sent. The lock is recursive.
+ */
+void logger_console_lock(void);
+void logger_console_unlock(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LOGGER_H
@@ -1,36 +1,79 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_spiffs.h"
 #include "esp_system.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "driver/ledc.h"
 #include "driver/i2c.h"
 
 #include "sgtl5000.h"
 #include "midi_input.h"
+#include "smf_player.h"
+#include "sequencer.h"
+#include "preset.h"
+#include "assets.h"
+#include "session.h"
+#include "boot.h"
+#include "tuning.h"
+#include "sampler.h"
 #include "synth.h"
 #include "display.h"
+#include "latency.h"
+#include "logger.h"
 #include "pinout.h"
 
 #define MCLK_FREQ               (11289600)
+#define CODEC_I2C_ADDRESS       (0b0001010)
+#define CODEC_READY_TIMEOUT_MS  (500)       // after MCLK is started
 
 static const char *TAG = "APP";
 
-void app_main(void)
+static SemaphoreHandle_t m_storage_ready;
+
+/* Mounting SPIFFS and checking the asset bundle read through most of the flash,
+ * but only the presets, patterns, songs and the MIDI learn map need them, not
+ * the audio path. They are done in this task while the codec and the synth are
+ * brought up. It runs on the core of the render loop, below its priority, which
+ * is otherwise idle during boot.
+ */
+static void storage_task(void *pvParameters)
 {
-    /* set up SPIFFS */
-    esp_err_t ret;
+    int64_t start_us = esp_timer_get_time();
     esp_vfs_spiffs_conf_t spiffs_conf = {
         .base_path = "/spiffs",
         .format_if_mount_failed = true,
         .max_files = 5,
         .partition_label = "storage",
     };
-    ret = esp_vfs_spiffs_register(&spiffs_conf);
-    ESP_ERROR_CHECK(ret);   
+
+    ESP_ERROR_CHECK(esp_vfs_spiffs_register(&spiffs_conf));
+    boot_phase("SPIFFS", start_us);
+
+    /* the asset bundle is optional, without it there are no factory presets */
+    start_us = esp_timer_get_time();
+    assets_open("assets");
+    boot_phase("assets", start_us);
+
+    xSemaphoreGive(m_storage_ready);
+    vTaskDelete(NULL);
+}
+
+void app_main(void)
+{
+    int64_t start_us;
+    int64_t mclk_us;
+
+    /* start the deferred logger first, so that all other modules can use it */
+    logger_init();
+
+    m_storage_ready = xSemaphoreCreateBinary();
+    xTaskCreatePinnedToCore(storage_task, "storage_task", 4096, NULL, 0, NULL, 1);
 
     /* set up I2C bus */
+    start_us = esp_timer_get_time();
     i2c_port_t i2c_master_port = 1;
     i2c_config_t conf = {
         .mode = I2C_MODE_MASTER,
@@ -63,13 +106,16 @@ void app_main(void)
         .timer_sel = LEDC_TIMER_0
     };
     ledc_channel_config(&ledc_channel);
+    mclk_us = esp_timer_get_time();
+    boot_phase("I2C, MCLK", start_us);
 
-    vTaskDelay(500 / portTICK_PERIOD_MS);
-
-    /* initialize audio codec */
-    sgtl5000_init(i2c_master_port, 0b0001010);
+    /* the session and the synth's tables are prepared while the codec comes up */
+    start_us = esp_timer_get_time();
+    session_init();
+    boot_phase("session", start_us);
 
     /* initialize signal generator (including I2S bus) */
+    start_us = esp_timer_get_time();
     oscillator_params_t osc1_params = {
         .amplitude = 10000.0,
         .waveform = WAVEFORM_SINUS,
@@ -98,9 +144,44 @@ void app_main(void)
         .noise_amplitude = 0.0,
     };
     synth_init(&osc1_params, &osc2_params, &lfo_params, &envelope_params, &synth_params);
+    session_restore();
+    boot_phase("synth", start_us);
+
+    /* initialize audio codec, as soon as it answers instead of after a fixed
+     * delay
+     */
+    sgtl5000_wait_ready(i2c_master_port, CODEC_I2C_ADDRESS, CODEC_READY_TIMEOUT_MS);
+    boot_phase("codec ready", mclk_us);
+    start_us = esp_timer_get_time();
+    sgtl5000_init(i2c_master_port, CODEC_I2C_ADDRESS);
+    boot_phase("codec", start_us);
 
+    synth_start();
+
+    /* the display draws its background in its own task */
+    start_us = esp_timer_get_time();
     display_init();
+    boot_phase("display", start_us);
+
+#if LATENCY_MEASUREMENT
+    latency_init();
+#endif
 
+    start_us = esp_timer_get_time();
+    xSemaphoreTake(m_storage_ready, portMAX_DELAY);
+    boot_phase("storage wait", start_us);
+
+    start_us = esp_timer_get_time();
+    /* before any notes can be played */
+    tuning_init();
+    sampler_init();
     midi_init();
+    smf_player_init();
+    sequencer_init();
+    preset_init();
+    session_start();
+    boot_phase("MIDI, presets", start_us);
+
+    boot_report();
     midi_loop();
 }
\ No newline at end of file
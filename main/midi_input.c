@@ -3,222 +3,624 @@
 
 #include "driver/uart.h"
 
+#include "esp_timer.h"
+
+#include <string.h>
+
 #include "midi_input.h"
 #include "synth.h"
 #include "pinout.h"
-#include "preset.h"
-
-#define MIDI_SB_CONTROL_CHANGE  (0b1011 << 4)
-#define MIDI_SB_NOTE_ON         (0b1001 << 4)
-#define MIDI_SB_NOTE_OFF        (0b1000 << 4)
-
-#define MIDI_CC_LFO_FREQ            (0x4a)
-#define MIDI_CC_LFO_ON_OFF          (0x4d)
-#define MIDI_CC_OSC2_FREQ           (0x4c)
-#define MIDI_CC_OSC2_AMP            (0x49)
-#define MIDI_CC_OSC2_SYNC_ON_OFF    (0x47)
-#define MIDI_CC_WF_OSC1             (0x4e)
-#define MIDI_CC_WF_OSC2             (0x4f)
-#define MIDI_CC_WF_LFO              (0x5b)
-#define MIDI_CC_ENV_ATTACK          (0x5d)
-#define MIDI_CC_ENV_DECAY           (0x5e)
-#define MIDI_CC_ENV_SUSTAIN         (0x0a)
-#define MIDI_CC_ENV_RELEASE         (0x5c)
-#define MIDI_CC_SELECT_PRESET       (0x07)
-#define MIDI_CC_SAVE_PRESET         (0x46)
-#define MIDI_CC_DUMP_PARAMS         (0x42)
-#define MIDI_CC_NOISE_AMP           (0x43)
-#define MIDI_CC_OSC1_AMP            (0x44)
+#include "latency.h"
+#include "midi_parser.h"
+#include "logger.h"
+#include "params.h"
+#include "midi_learn.h"
+#include "tempo.h"
+#include "sysex.h"
+#include "sequencer.h"
+#include "arpeggiator.h"
+
+/* see https://www.midi.org/specifications-old/item/table-3-control-change-messages-data-bytes-2 */
+#define MIDI_CC_MODULATION          (0x01)
+#define MIDI_CC_DATA_ENTRY_MSB      (0x06)
+#define MIDI_CC_LSB_OFFSET          (0x20)
+#define MIDI_CC_MODULATION_LSB      (0x21)
+#define MIDI_CC_DATA_ENTRY_LSB      (0x26)
+#define MIDI_CC_SUSTAIN             (0x40)
+#define MIDI_CC_NRPN_LSB            (0x62)
+#define MIDI_CC_NRPN_MSB            (0x63)
+#define MIDI_CC_RPN_LSB             (0x64)
+#define MIDI_CC_RPN_MSB             (0x65)
+
+#define MIDI_RPN_PITCH_BEND_RANGE   (0x0000)
+#define MIDI_PITCH_BEND_CENTER      (0x2000)
 
 #define MIDI_UART_BAUDRATE      (31250)
 #define UART_BUFFER_SIZE        (1024 * 2)
+#define UART_EVENT_QUEUE_SIZE   (20)
+#define MIDI_READ_CHUNK_SIZE    (64)
+#define MIDI_INPUT_COUNT        (2)
+#define MIDI_SYSEX_BUFFER_SIZE  (256)
+#define CONTROL_BLOCK_US        (10000)     // same as the synth's buffer time
+#define INJECT_QUEUE_SIZE       (16)
+#define MIDI_CHANNEL_COUNT      (16)
+
+/* set to 1 to forward the messages of both inputs to the TX pin of UART2 */
+#define MIDI_THRU               0
+
+/* time it takes to receive one byte (start bit, 8 data bits, stop bit) */
+#define MIDI_BYTE_TIME_US(baudrate)     (10 * 1000000 / (baudrate))
+
+typedef struct {
+    uart_port_t uart_num;
+    QueueHandle_t event_queue;
+    latency_source_t latency_source;
+    int64_t byte_time_us;
+    midi_parser_t parser;
+    uint8_t sysex_buffer[MIDI_SYSEX_BUFFER_SIZE];
+    int64_t arrival_us;     // arrival time of the first byte of the current message
+    sysex_send_t send;      // for SysEx replies, NULL if the input has no output
+    /* bytes that were read from the driver but not parsed yet, with their
+     * (estimated) arrival times
+     */
+    uint8_t buffer[MIDI_READ_CHUNK_SIZE];
+    int64_t timestamps[MIDI_READ_CHUNK_SIZE];
+    int length;
+    int index;
+    midi_input_stats_t stats;
+} midi_input_t;
+
+_Static_assert(MIDI_SYSEX_BUFFER_SIZE >= SYSEX_MAX_LENGTH, "SysEx buffer too small for a preset or track");
+
+static void midi_send_console(const uint8_t *data, size_t length);
 
-static oscillator_params_t osc1_params;
-static oscillator_params_t osc2_params;
-static oscillator_params_t lfo_params;
-static envelope_params_t envelope_params;
-static synth_params_t synth_params;
+static midi_input_t m_inputs[MIDI_INPUT_COUNT] = {
+    /* UART0 is connected to the host, replies are sent back on the console */
+    {
+        .uart_num = UART_NUM_0,
+        .latency_source = LATENCY_SOURCE_UART0,
+        .byte_time_us = MIDI_BYTE_TIME_US(CONFIG_ESP_CONSOLE_UART_BAUDRATE),
+        .send = midi_send_console,
+    },
+    /* the TX pin of UART2 is only used for MIDI thru */
+    {
+        .uart_num = UART_NUM_2,
+        .latency_source = LATENCY_SOURCE_UART2,
+        .byte_time_us = MIDI_BYTE_TIME_US(MIDI_UART_BAUDRATE),
+    },
+};
+static QueueSetHandle_t m_queue_set;
 
-static void dump_params(void)
+/* messages from local sources (e.g. the SMF player), processed like live input */
+typedef struct {
+    midi_message_t message;
+    uint32_t sample;
+} midi_injected_t;
+
+static QueueHandle_t m_inject_queue;
+
+/* Parameter changes are coalesced: a knob sweep can send dozens of CCs per control
+ * block, but only the latest value of each parameter is applied, once per block.
+ */
+_Static_assert(PARAM_COUNT <= 64, "the dirty set is a 64-bit mask");
+static uint16_t m_param_values[PARAM_COUNT];
+static uint64_t m_param_dirty;
+static int64_t m_params_last_applied_us;
+
+/* currently selected NRPN and RPN (PARAM_RAW_MAX is the "null" parameter); only
+ * one of them can be selected at a time
+ */
+static uint16_t m_nrpn = PARAM_RAW_MAX;
+static uint16_t m_rpn = PARAM_RAW_MAX;
+
+/* 14-bit values of the controllers that are handled by the synth directly, per
+ * channel
+ */
+static uint16_t m_modulation[MIDI_CHANNEL_COUNT];
+static uint16_t m_bend_range[MIDI_CHANNEL_COUNT] = {
+    [0 ... MIDI_CHANNEL_COUNT - 1] = 2 << 7,    // semitones in the MSB, cents in the LSB
+};
+
+/* The console output of the other tasks bypasses the driver's TX buffer, so
+ * the console is held until the reply has left the UART. This blocks the MIDI
+ * task for the transmission time (about 7 ms for a preset).
+ */
+static void midi_send_console(const uint8_t *data, size_t length)
 {
-    synth_get_params(&osc1_params, &osc2_params, &lfo_params, &envelope_params, &synth_params);
+    logger_console_lock();
+    uart_write_bytes(UART_NUM_0, (const char *) data, length);
+    uart_wait_tx_done(UART_NUM_0, portMAX_DELAY);
+    logger_console_unlock();
+}
+
+void midi_dump_params(void)
+{
+    synth_patch_t patch;
+    const param_desc_t *desc;
+    param_id_t id;
+
+    synth_get_patch(&patch);
 
+    logger_console_lock();
     printf("MIDI_VALUES_START\n");
-    printf("%02X:%02X\n", MIDI_CC_OSC1_AMP, (uint8_t) (osc1_params.amplitude / 15000.0 * 127.0));
-    printf("%02X:%02X\n", MIDI_CC_OSC2_FREQ, (uint8_t) ((osc2_params.frequency - 100.0) / 1900.0 * 127.0));
-    printf("%02X:%02X\n", MIDI_CC_OSC2_AMP, (uint8_t) (osc2_params.amplitude / 15000.0 * 127.0));
-    printf("%02X:%02X\n", MIDI_CC_LFO_FREQ, (uint8_t) ((lfo_params.frequency - 0.1) / 19.9 * 127.0));
-    printf("%02X:%02X\n", MIDI_CC_LFO_ON_OFF, (uint8_t) synth_params.lfo_enabled);
-    printf("%02X:%02X\n", MIDI_CC_OSC2_SYNC_ON_OFF, (uint8_t) synth_params.osc2_sync_enabled);
-    printf("%02X:%02X\n", MIDI_CC_WF_OSC1, (uint8_t) (osc1_params.waveform * 16));
-    printf("%02X:%02X\n", MIDI_CC_WF_OSC2, (uint8_t) (osc2_params.waveform * 16));
-    printf("%02X:%02X\n", MIDI_CC_WF_LFO, (uint8_t) (lfo_params.waveform * 16));
-    printf("%02X:%02X\n", MIDI_CC_ENV_ATTACK, (uint8_t) ((envelope_params.attack - 0.01) / 0.99 * 127.0));
-    printf("%02X:%02X\n", MIDI_CC_ENV_DECAY, (uint8_t) ((envelope_params.decay - 0.01) / 0.99 * 127.0));
-    printf("%02X:%02X\n", MIDI_CC_ENV_SUSTAIN, (uint8_t) (envelope_params.sustain * 127.0));
-    printf("%02X:%02X\n", MIDI_CC_ENV_RELEASE, (uint8_t) ((envelope_params.release - 0.01) / 0.99 * 127.0));
-    printf("%02X:%02X\n", MIDI_CC_NOISE_AMP, (uint8_t) (synth_params.noise_amplitude / 15000.0 * 127.0));
-    printf("%02X:%02X\n", MIDI_CC_SELECT_PRESET, (uint8_t) preset_get_current_index() * 20);
+    for(int cc = 0; cc < 128; cc++) {
+        id = midi_learn_get_param(cc);
+        if(id == PARAM_NONE)
+            continue;
+        desc = param_get_desc(id);
+        if(desc->get == NULL)
+            continue;
+        printf("%02X:%02X\n", cc, param_to_raw(id, desc->get(&patch)) >> 7);
+    }
     printf("MIDI_VALUES_END\n");
+    fflush(stdout);
+    logger_console_unlock();
 }
 
-static void midi_process_cc(uint8_t *midi_frame)
+static void midi_apply_pending_params(void)
 {
-    printf("Control change: %02X = %02X\n", midi_frame[1], midi_frame[2]);
-    switch(midi_frame[1]) {
-    case MIDI_CC_OSC2_FREQ:
-        /* map the MIDI value (0...127) to a frequency between 100 and 2000 Hz */
-        synth_update_osc2_freq(100.0 + (float) midi_frame[2] * 1900.0 / 127.0);
-        break;
-    case MIDI_CC_OSC2_AMP:
-        /* map the MIDI value (0...127) to an amplitude between 0 and 15000 */
-        synth_update_osc2_amp((float) midi_frame[2] * 15000.0 / 127.0);
-        break;
-    case MIDI_CC_OSC1_AMP:
-        /* map the MIDI value (0...127) to an amplitude between 0 and 15000 */
-        synth_update_osc1_amp((float) midi_frame[2] * 15000.0 / 127.0);
-        break;
-    case MIDI_CC_LFO_FREQ:
-        /* map the MIDI value (0...127) to an LFO frequency between 0.1 and 20 Hz */
-        synth_update_lfo_freq(0.1 + (float) midi_frame[2] * 19.9 / 127.0);
-        break;
-    case MIDI_CC_LFO_ON_OFF:
-        synth_enable_lfo(midi_frame[2]);
-        break;
-    case MIDI_CC_OSC2_SYNC_ON_OFF:
-        synth_enable_osc2_sync(midi_frame[2]);
+    uint64_t dirty = m_param_dirty;
+    param_id_t id;
+
+    m_param_dirty = 0;
+    while(dirty) {
+        id = __builtin_ctzll(dirty);
+        dirty &= dirty - 1;
+        param_apply_raw(id, m_param_values[id]);
+    }
+
+    m_params_last_applied_us = esp_timer_get_time();
+}
+
+static void midi_set_param(param_id_t id, uint16_t raw)
+{
+    m_param_values[id] = raw;
+
+    if(param_get_desc(id)->flags & PARAM_FLAG_IMMEDIATE) {
+        /* these act on the complete set of parameters, so everything received
+         * before has to be applied first
+         */
+        midi_apply_pending_params();
+        param_apply_raw(id, raw);
+    } else {
+        /* only keep the latest value, it is applied with the next control block */
+        m_param_dirty |= 1ULL << id;
+    }
+}
+
+/* a 7-bit value is scaled to the full 14-bit range by repeating it in the
+ * lower bits, so that 0x7f maps to PARAM_RAW_MAX
+ */
+static uint16_t midi_raw_from_msb(uint8_t value)
+{
+    return (value << 7) | value;
+}
+
+static void midi_set_rpn(uint8_t channel, uint16_t value)
+{
+    switch(m_rpn) {
+    case MIDI_RPN_PITCH_BEND_RANGE:
+        m_bend_range[channel] = value;
+        synth_set_pitch_bend_range(channel, (value >> 7) + (value & 0x7f) / 100.0);
         break;
-    case MIDI_CC_WF_OSC1:
-        synth_update_osc1_waveform((midi_frame[2] / 16) % 3);
+    }
+}
+
+static void midi_process_cc(const midi_message_t *message)
+{
+    uint8_t channel = message->status & 0x0f;
+    uint8_t cc = message->data[0];
+    uint8_t value = message->data[1];
+    param_id_t id;
+
+    logger_log(LOG_CONTROL_CHANGE, cc, value);
+
+    if(midi_learn_process_cc(cc))
+        return;
+
+    switch(cc) {
+    case MIDI_CC_MODULATION:
+        m_modulation[channel] = midi_raw_from_msb(value);
+        synth_set_modulation(channel, (float) m_modulation[channel] / PARAM_RAW_MAX);
+        return;
+    case MIDI_CC_MODULATION_LSB:
+        m_modulation[channel] = (m_modulation[channel] & (0x7f << 7)) | value;
+        synth_set_modulation(channel, (float) m_modulation[channel] / PARAM_RAW_MAX);
+        return;
+    case MIDI_CC_SUSTAIN:
+        synth_set_sustain(channel, value >= 64);
+        return;
+    case MIDI_CC_NRPN_MSB:
+        m_nrpn = (value << 7) | (m_nrpn & 0x7f);
+        m_rpn = PARAM_RAW_MAX;
+        return;
+    case MIDI_CC_NRPN_LSB:
+        m_nrpn = (m_nrpn & (0x7f << 7)) | value;
+        m_rpn = PARAM_RAW_MAX;
+        return;
+    case MIDI_CC_RPN_MSB:
+        m_rpn = (value << 7) | (m_rpn & 0x7f);
+        m_nrpn = PARAM_RAW_MAX;
+        return;
+    case MIDI_CC_RPN_LSB:
+        m_rpn = (m_rpn & (0x7f << 7)) | value;
+        m_nrpn = PARAM_RAW_MAX;
+        return;
+    case MIDI_CC_DATA_ENTRY_MSB:
+        if(m_nrpn < PARAM_COUNT)
+            midi_set_param(m_nrpn, midi_raw_from_msb(value));
+        else if(m_rpn == MIDI_RPN_PITCH_BEND_RANGE)
+            /* the LSB (cents) is reset, as it does not scale with the MSB */
+            midi_set_rpn(channel, value << 7);
+        return;
+    case MIDI_CC_DATA_ENTRY_LSB:
+        if(m_nrpn < PARAM_COUNT)
+            midi_set_param(m_nrpn, (m_param_values[m_nrpn] & (0x7f << 7)) | value);
+        else if(m_rpn == MIDI_RPN_PITCH_BEND_RANGE)
+            midi_set_rpn(channel, (m_bend_range[channel] & (0x7f << 7)) | value);
+        return;
+    }
+
+    id = midi_learn_get_param(cc);
+    if(id != PARAM_NONE) {
+        midi_set_param(id, midi_raw_from_msb(value));
+        return;
+    }
+
+    /* controllers 32...63 are the LSBs of controllers 0...31 */
+    if((cc >= MIDI_CC_LSB_OFFSET) && (cc < 2 * MIDI_CC_LSB_OFFSET)) {
+        id = midi_learn_get_param(cc - MIDI_CC_LSB_OFFSET);
+        if(id != PARAM_NONE)
+            midi_set_param(id, (m_param_values[id] & (0x7f << 7)) | value);
+    }
+}
+
+/* sample is the position on the synth's sample clock at which the message takes
+ * effect; arrival_us is 0 for injected messages
+ */
+static void midi_process_message(const midi_message_t *message, int64_t arrival_us, uint32_t sample)
+{
+    uint8_t channel = message->status & 0x0f;
+
+    switch(message->status & 0xf0) {
+    case MIDI_SB_CONTROL_CHANGE:
+        midi_process_cc(message);
         break;
-    case MIDI_CC_WF_OSC2:
-        synth_update_osc2_waveform((midi_frame[2] / 16) % 3);
+    case MIDI_SB_NOTE_ON:
+        if(message->data[1] == 0x00) {
+            if(!arp_key_release(sample, channel, message->data[0]))
+                synth_schedule_key_release(sample, channel, message->data[0]);
+        } else {
+#if LATENCY_MEASUREMENT
+            if(arrival_us != 0)
+                latency_note_on(arrival_us, channel, message->data[0]);
+#endif
+            /* notes go through the arpeggiator if it is on */
+            if(arp_key_press(sample, channel, message->data[0], message->data[1])
+                    || (synth_schedule_key_press(sample, channel, message->data[0], message->data[1]) != 0)) {
+                /* taken by the arpeggiator, or the event queue is full */
+#if LATENCY_MEASUREMENT
+                latency_note_dropped(channel, message->data[0]);
+#endif
+            }
+            /* only notes that are played, not the sequencer's own notes */
+            if(arrival_us != 0)
+                sequencer_record_note(message->data[0], message->data[1]);
+        }
         break;
-    case MIDI_CC_WF_LFO:
-        synth_update_lfo_waveform((midi_frame[2] / 16) % 3);
+    case MIDI_SB_NOTE_OFF:
+        if(!arp_key_release(sample, channel, message->data[0]))
+            synth_schedule_key_release(sample, channel, message->data[0]);
         break;
-    case MIDI_CC_ENV_ATTACK:
-        /* map the MIDI value (0...127) to an attack time between 0.01 and 1 s */
-        synth_update_env_attack(0.01 + (float) midi_frame[2] * 0.99 / 127.0);
+    case MIDI_SB_PITCH_BEND:
+        synth_set_pitch_bend(channel, (float) (((message->data[1] << 7) | message->data[0]) - MIDI_PITCH_BEND_CENTER)
+                                / MIDI_PITCH_BEND_CENTER);
         break;
-    case MIDI_CC_ENV_DECAY:
-        /* map the MIDI value (0...127) to a decay time between 0.01 and 1 s */
-        synth_update_env_decay(0.01 + (float) midi_frame[2] * 0.99 / 127.0);
+    case MIDI_SB_CHANNEL_PRESSURE:
+        synth_set_pressure(channel, message->data[0] / 127.0);
         break;
-    case MIDI_CC_ENV_SUSTAIN:
-        /* map the MIDI value (0...127) to a sustain value between 0 and 100 % */
-        synth_update_env_sustain((float) midi_frame[2] / 127.0);
+    case MIDI_SB_POLY_PRESSURE:
+        synth_set_key_pressure(channel, message->data[0], message->data[1] / 127.0);
         break;
-    case MIDI_CC_ENV_RELEASE:
-        /* map the MIDI value (0...127) to a release time between 0.01 and 1 s */
-        synth_update_env_release(0.01 + (float) midi_frame[2] * 0.99 / 127.0);
+    }
+
+    switch(message->status) {
+    case MIDI_SB_CLOCK:
+        tempo_clock(sample);
         break;
-    case MIDI_CC_NOISE_AMP:
-        /* map the MIDI value (0...127) to an amplitude between 0 and 15000 */
-        synth_update_noise_amp((float) midi_frame[2] * 15000.0 / 127.0);
+    case MIDI_SB_START:
+        logger_log(LOG_TRANSPORT_START);
+        tempo_start();
         break;
-    case MIDI_CC_SELECT_PRESET:
-        /* map the MIDI value (0...127) to a preset value (0...6) */
-        preset_select(midi_frame[2] / 20);
+    case MIDI_SB_CONTINUE:
+        logger_log(LOG_TRANSPORT_CONTINUE);
+        tempo_continue();
         break;
-    case MIDI_CC_SAVE_PRESET:
-        preset_save();
+    case MIDI_SB_STOP:
+        logger_log(LOG_TRANSPORT_STOP, tempo_get_bpm());
+        tempo_stop();
         break;
-    case MIDI_CC_DUMP_PARAMS:
-        dump_params();
+    case MIDI_SB_SONG_POSITION:
+        tempo_set_song_position((message->data[1] << 7) | message->data[0]);
         break;
     }
 }
 
-static void midi_process_frame(uint8_t *midi_frame)
+#if MIDI_THRU
+/* Messages are forwarded when they are complete and always with their status
+ * byte, so that the messages of the two inputs can be interleaved without
+ * breaking running status. The data is copied into the driver's TX buffer.
+ */
+static void midi_thru(const midi_message_t *message)
 {
-    switch(midi_frame[0] & 0xf0) {
-    case MIDI_SB_CONTROL_CHANGE:
-        midi_process_cc(midi_frame);
-        break;
-    case MIDI_SB_NOTE_ON:
-        if(midi_frame[2] == 0x00) {
-            synth_key_release(midi_frame[1]);
-        } else {
-            synth_key_press(midi_frame[1], midi_frame[2]);
-        }
-        break;
-    case MIDI_SB_NOTE_OFF:
-        synth_key_release(midi_frame[1]);
-        break;
+    uint8_t buffer[1 + sizeof(message->data)];
+    const uint8_t sysex_end = MIDI_SB_SYSEX_END;
+
+    if(message->status == MIDI_SB_SYSEX_START) {
+        if(message->sysex_truncated)
+            return;
+        uart_write_bytes(UART_NUM_2, (const char *) &message->status, 1);
+        uart_write_bytes(UART_NUM_2, (const char *) message->sysex, message->sysex_length);
+        uart_write_bytes(UART_NUM_2, (const char *) &sysex_end, 1);
+        return;
     }
+
+    buffer[0] = message->status;
+    memcpy(&buffer[1], message->data, message->length);
+    uart_write_bytes(UART_NUM_2, (const char *) buffer, 1 + message->length);
+}
+#endif
+
+static void midi_parse_byte(midi_input_t *input, uint8_t byte, int64_t arrival_us)
+{
+    midi_message_t message;
+
+    /* remember when the first byte of a message arrived, real-time bytes can be
+     * interleaved and are complete messages on their own
+     */
+    if(!MIDI_IS_REALTIME(byte) && (MIDI_IS_STATUS(byte) || (input->parser.index == 0))) {
+        input->arrival_us = arrival_us;
+    }
+
+    if(!midi_parser_feed(&input->parser, byte, &message)) {
+        return;
+    }
+
+    input->stats.messages++;
+#if MIDI_THRU
+    midi_thru(&message);
+#endif
+
+    if(MIDI_IS_REALTIME(message.status)) {
+        midi_process_message(&message, arrival_us, synth_get_sample_position(arrival_us));
+        return;
+    }
+
+    if(message.status == MIDI_SB_SYSEX_START) {
+        input->stats.sysex++;
+        logger_log(LOG_MIDI_SYSEX, message.sysex_length, message.sysex_truncated);
+        if(!message.sysex_truncated)
+            sysex_process(message.sysex, message.sysex_length, input->send);
+        return;
+    }
+
+    /* log MIDI message */
+    if(message.length == 2) {
+        logger_log(LOG_MIDI_MESSAGE_2, message.status, message.data[0], message.data[1]);
+    } else if(message.length == 1) {
+        logger_log(LOG_MIDI_MESSAGE_1, message.status, message.data[0]);
+    } else {
+        logger_log(LOG_MIDI_MESSAGE_0, message.status);
+    }
+    /* live messages are due when they arrived, i.e. they are applied as soon as
+     * possible
+     */
+    midi_process_message(&message, input->arrival_us, synth_get_sample_position(input->arrival_us));
 }
 
-static void midi_poll_uart(uart_port_t uart_num, uint8_t *midi_frame)
+/* reads the next chunk from the driver once the previous one is parsed */
+static void midi_read_uart(midi_input_t *input)
 {
     size_t length;
-    uint8_t first_byte;
+    int bytes_read;
+    int64_t read_us;
+    int64_t arrival_us;
 
-    ESP_ERROR_CHECK(uart_get_buffered_data_len(uart_num, &length));
+    if(input->index < input->length)
+        return;
 
-    if(length > 0) {
-        uart_read_bytes(uart_num, &first_byte, 1, 100);
+    input->index = 0;
+    input->length = 0;
 
-        /* ignore active sense
-         * http://midi.teragonaudio.com/tech/midispec/sense.htm
-         */
-        if(first_byte == 0xfe) {
-            return;
+    ESP_ERROR_CHECK(uart_get_buffered_data_len(input->uart_num, &length));
+    if(length == 0)
+        return;
+
+    read_us = esp_timer_get_time();
+    bytes_read = uart_read_bytes(input->uart_num, input->buffer,
+                                    length < sizeof(input->buffer) ? length : sizeof(input->buffer), 0);
+    if(bytes_read <= 0)
+        return;
+
+    /* The driver signals every byte, so the last byte that is buffered has just
+     * arrived and the ones before it arrived one byte time apart. This is what
+     * the two inputs are merged by, the reading order does not matter.
+     */
+    for(int i = 0; i < bytes_read; i++) {
+        arrival_us = read_us - (int64_t) (length - 1 - i) * input->byte_time_us;
+#if LATENCY_MEASUREMENT
+        /* the start bits are timestamped, use that instead of the estimate */
+        arrival_us = latency_byte_read(input->latency_source);
+#endif
+        /* never earlier than the byte before it (e.g. after the task was late) */
+        if((i > 0) && (arrival_us < input->timestamps[i - 1]))
+            arrival_us = input->timestamps[i - 1];
+        input->timestamps[i] = arrival_us;
+    }
+    input->length = bytes_read;
+    input->stats.bytes += bytes_read;
+}
+
+/* Everything that is pending on both inputs is parsed as one stream, ordered by
+ * arrival time. Each input keeps its own parser (and running status), only the
+ * completed messages are interleaved.
+ */
+static void midi_read_inputs(void)
+{
+    midi_input_t *next;
+    midi_input_t *input;
+    int pending;
+
+    for(;;) {
+        pending = 0;
+        for(int i = 0; i < MIDI_INPUT_COUNT; i++) {
+            midi_read_uart(&m_inputs[i]);
+            pending |= m_inputs[i].index < m_inputs[i].length;
         }
+        if(!pending)
+            return;
 
-        /* if the first byte is not a status byte, read only
-         * one more byte and keep the previous status byte
-         * (see "running status", e.g. in
-         * https://www.cs.cmu.edu/~music/cmsip/readings/Standard-MIDI-file-format-updated.pdf)
+        /* merge until one of the chunks is used up, it has to be refilled
+         * before its next bytes can be compared
          */
-        if((first_byte & 0b10000000) == 0) {
-            midi_frame[1] = first_byte;
-            uart_read_bytes(uart_num, &midi_frame[2], 1, 100);
-        } else {
-            midi_frame[0] = first_byte;
-            /* read rest of a 3 byte MIDI frame */
-            uart_read_bytes(uart_num, &midi_frame[1], 2, 100);
-        }
+        do {
+            next = NULL;
+            for(int i = 0; i < MIDI_INPUT_COUNT; i++) {
+                input = &m_inputs[i];
+                if((input->index < input->length) &&
+                        ((next == NULL) || (input->timestamps[input->index] < next->timestamps[next->index]))) {
+                    next = input;
+                }
+            }
+            midi_parse_byte(next, next->buffer[next->index], next->timestamps[next->index]);
+            next->index++;
+        } while(next->index < next->length);
+    }
+}
 
-        /* print MIDI frame */
-        for(int i = 0; i < 3; i++) {
-            printf("%02X ", midi_frame[i]);
-        }
-        printf("\n");
-        midi_process_frame(midi_frame);
+static void midi_handle_uart_event(midi_input_t *input)
+{
+    uart_event_t event;
+
+    if(xQueueReceive(input->event_queue, &event, 0) != pdTRUE) {
+        return;
+    }
+
+    switch(event.type) {
+    case UART_DATA:
+        /* the other input may have data that arrived earlier */
+        midi_read_inputs();
+        break;
+    case UART_FIFO_OVF:
+    case UART_BUFFER_FULL:
+        /* we cannot keep up, drop everything and resynchronize on the next status byte */
+        logger_log(LOG_MIDI_OVERFLOW, input->uart_num);
+        input->stats.overflows++;
+        uart_flush_input(input->uart_num);
+#if LATENCY_MEASUREMENT
+        latency_flush(input->latency_source);
+#endif
+        xQueueReset(input->event_queue);
+        input->index = 0;
+        input->length = 0;
+        midi_parser_init(&input->parser, input->sysex_buffer, sizeof(input->sysex_buffer));
+        break;
+    default:
+        break;
     }
 }
 
-// #define BPM                 (120)
-// #define NOTE_DURATION_MS    (1000 * 60 / BPM)
+void midi_dump_stats(void)
+{
+    midi_input_t *input;
 
-void midi_loop(void)
+    logger_console_lock();
+    printf("MIDI_STATS_START\n");
+    for(int i = 0; i < MIDI_INPUT_COUNT; i++) {
+        input = &m_inputs[i];
+        printf("UART%d: %u bytes, %u messages, %u SysEx, %u overflows\n", input->uart_num,
+                input->stats.bytes, input->stats.messages, input->stats.sysex, input->stats.overflows);
+    }
+    printf("MIDI_STATS_END\n");
+    fflush(stdout);
+    logger_console_unlock();
+}
+
+int midi_inject(const midi_message_t *message, uint32_t sample, int wait)
 {
-    uint8_t midi_frame_uart0[3] = {0};
-    uint8_t midi_frame_uart2[3] = {0};
+    midi_injected_t injected = {
+        .message = *message,
+        .sample = sample,
+    };
 
-    for(;;) {
-        midi_poll_uart(UART_NUM_0, midi_frame_uart0);
-        midi_poll_uart(UART_NUM_2, midi_frame_uart2);
+    /* SysEx data is only valid while the sender's parser is not fed */
+    if(message->status == MIDI_SB_SYSEX_START)
+        return -1;
+
+    return (xQueueSend(m_inject_queue, &injected, wait ? portMAX_DELAY : 0) == pdTRUE) ? 0 : -1;
+}
+
+/* one pass of the MIDI task: blocks until one of the UART drivers signals data,
+ * or until the next control block if there are pending control changes
+ */
+static void midi_process_queues(void)
+{
+    QueueSetMemberHandle_t queue;
+    midi_injected_t injected;
+    TickType_t timeout;
+    int64_t next_block_us;
+
+    timeout = portMAX_DELAY;
+    if(m_param_dirty) {
+        next_block_us = m_params_last_applied_us + CONTROL_BLOCK_US - esp_timer_get_time();
+        timeout = (next_block_us > 0) ? (next_block_us + 999) / 1000 / portTICK_PERIOD_MS : 0;
+    }
+    queue = xQueueSelectFromSet(m_queue_set, timeout);
+
+    for(int i = 0; i < MIDI_INPUT_COUNT; i++) {
+        if(queue == m_inputs[i].event_queue) {
+            midi_handle_uart_event(&m_inputs[i]);
+        }
+    }
 
-        // TODO: can we wait for queue events instead?
-        vTaskDelay(10 / portTICK_PERIOD_MS);
+    if((queue == m_inject_queue) && (xQueueReceive(m_inject_queue, &injected, 0) == pdTRUE)) {
+        midi_process_message(&injected.message, 0, injected.sample);
     }
 
-    // for(;;) {
-    //     synth_key_press(0x45, 0x7f);
-    //     vTaskDelay(NOTE_DURATION_MS / 2 / portTICK_PERIOD_MS);
-    //     synth_key_release(0x45);
-    //     vTaskDelay(NOTE_DURATION_MS / 2 / portTICK_PERIOD_MS);
-    //     synth_key_press(0x47, 0x7f);
-    //     vTaskDelay(NOTE_DURATION_MS / 2 / portTICK_PERIOD_MS);
-    //     synth_key_release(0x47);
-    //     vTaskDelay(NOTE_DURATION_MS / 2 / portTICK_PERIOD_MS);
-    // }
+    if(m_param_dirty && (esp_timer_get_time() - m_params_last_applied_us >= CONTROL_BLOCK_US)) {
+        midi_apply_pending_params();
+    }
+}
+
+void midi_loop(void)
+{
+    for(;;) {
+        midi_process_queues();
+    }
+}
+
+static void midi_install_uart(midi_input_t *input)
+{
+    /* install UART driver with an event queue */
+    ESP_ERROR_CHECK(uart_driver_install(input->uart_num, UART_BUFFER_SIZE, \
+                                            UART_BUFFER_SIZE, UART_EVENT_QUEUE_SIZE, &input->event_queue, 0));
+
+    /* signal data after every byte and after one byte time of silence, instead
+     * of waiting for the FIFO to fill up or for the default timeout
+     */
+    ESP_ERROR_CHECK(uart_set_rx_full_threshold(input->uart_num, 1));
+    ESP_ERROR_CHECK(uart_set_rx_timeout(input->uart_num, 1));
+
+    xQueueAddToSet(input->event_queue, m_queue_set);
+
+    midi_parser_init(&input->parser, input->sysex_buffer, sizeof(input->sysex_buffer));
 }
 
 void midi_init(void)
 {
+    /* set up controller assignment */
+    midi_learn_init();
+
     /* set up UART */
     uart_config_t uart_config = {
         .baud_rate = MIDI_UART_BAUDRATE,
@@ -228,14 +630,20 @@ void midi_init(void)
         .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
     };
     ESP_ERROR_CHECK(uart_param_config(UART_NUM_2, &uart_config));
+#if MIDI_THRU
+    ESP_ERROR_CHECK(uart_set_pin(UART_NUM_2, MIDI_UART_TX_GPIO, MIDI_UART_RX_GPIO, \
+                                    UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
+#else
     ESP_ERROR_CHECK(uart_set_pin(UART_NUM_2, UART_PIN_NO_CHANGE, MIDI_UART_RX_GPIO, \
                                     UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
+#endif
+
+    m_queue_set = xQueueCreateSet(MIDI_INPUT_COUNT * UART_EVENT_QUEUE_SIZE + INJECT_QUEUE_SIZE);
 
-    /* install UART driver */
-    ESP_ERROR_CHECK(uart_driver_install(UART_NUM_2, UART_BUFFER_SIZE, \
-                                            UART_BUFFER_SIZE, 0, NULL, 0));
+    for(int i = 0; i < MIDI_INPUT_COUNT; i++) {
+        midi_install_uart(&m_inputs[i]);
+    }
 
-    uart_config.baud_rate = 115200;
-    ESP_ERROR_CHECK(uart_driver_install(UART_NUM_0, UART_BUFFER_SIZE, \
-                                            UART_BUFFER_SIZE, 0, NULL, 0));
-}
\ No newline at end of file
+    m_inject_queue = xQueueCreate(INJECT_QUEUE_SIZE, sizeof(midi_injected_t));
+    xQueueAddToSet(m_inject_queue, m_queue_set);
+}
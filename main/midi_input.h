@@ -1,7 +1,32 @@
 #ifndef MIDI_INPUT_H
 #define MIDI_INPUT_H
 
+#include <stdint.h>
+
+#include "midi_parser.h"
+
 void midi_init(void);
 void midi_loop(void);
+void midi_dump_params(void);
+
+/* per-input counters, only changed by the MIDI task */
+typedef struct {
+    uint32_t bytes;
+    uint32_t messages;      // complete messages, including real-time and SysEx
+    uint32_t sysex;
+    uint32_t overflows;     // times the input was flushed because we could not keep up
+} midi_input_stats_t;
+
+/* prints the counters of both inputs, must be called from the MIDI task (e.g.
+ * from a parameter that is applied immediately)
+ */
+void midi_dump_stats(void);
+
+/* passes a message from a local source to the MIDI task, which processes it like
+ * a message from the MIDI inputs; notes take effect at the given position on the
+ * synth's sample clock, everything else when it is processed; if the queue is
+ * full, blocks if wait is set and fails otherwise (for the render loop)
+ */
+int midi_inject(const midi_message_t *message, uint32_t sample, int wait);
 
 #endif // MIDI_INPUT_H
@@ -0,0 +1,211 @@
+#include "midi_learn.h"
+#include "storage.h"
+#include "preset.h"
+
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "esp_log.h"
+
+static const char *TAG = "MIDI_LEARN";
+
+#define CC_MAP_NAME                 "CCMAP"
+
+/* default controller numbers; gui.py has its own copy of the ones it sends,
+ * which has to be kept in sync
+ */
+#define MIDI_CC_LFO_FREQ            (0x4a)
+#define MIDI_CC_LFO_ON_OFF          (0x4d)
+#define MIDI_CC_OSC2_FREQ           (0x4c)
+#define MIDI_CC_OSC2_AMP            (0x49)
+#define MIDI_CC_OSC2_SYNC_ON_OFF    (0x47)
+#define MIDI_CC_WF_OSC1             (0x4e)
+#define MIDI_CC_WF_OSC2             (0x4f)
+#define MIDI_CC_WF_LFO              (0x5b)
+#define MIDI_CC_ENV_ATTACK          (0x5d)
+#define MIDI_CC_ENV_DECAY           (0x5e)
+#define MIDI_CC_ENV_SUSTAIN         (0x0a)
+#define MIDI_CC_ENV_RELEASE         (0x5c)
+#define MIDI_CC_SELECT_PRESET       (0x07)
+#define MIDI_CC_SAVE_PRESET         (0x46)
+#define MIDI_CC_DUMP_PARAMS         (0x42)
+#define MIDI_CC_NOISE_AMP           (0x43)
+#define MIDI_CC_OSC1_AMP            (0x44)
+#define MIDI_CC_LEARN               (0x45)
+#define MIDI_CC_LFO_SYNC            (0x4b)
+#define MIDI_CC_PLAY_SONG           (0x48)
+#define MIDI_CC_SEQ_PLAY            (0x50)
+#define MIDI_CC_SEQ_TEMPO           (0x51)
+#define MIDI_CC_SEQ_RECORD          (0x52)
+#define MIDI_CC_ARP_MODE            (0x53)
+#define MIDI_CC_ARP_OCTAVES         (0x54)
+#define MIDI_CC_ARP_RATE            (0x55)
+#define MIDI_CC_ARP_LATCH           (0x56)
+#define MIDI_CC_PART                (0x57)
+#define MIDI_CC_PART_VOICES         (0x59)
+#define MIDI_CC_PART_VOLUME         (0x5a)
+#define MIDI_CC_PART_PAN            (0x08)
+#define MIDI_CC_MORPH               (0x58)
+#define MIDI_CC_MORPH_TARGET        (0x5f)
+#define MIDI_CC_TUNING              (0x09)
+
+/* controllers that cannot be learned: modulation wheel, data entry, the LSBs
+ * of 14-bit controllers 0...31 (32...63), sustain pedal, (N)RPN selection and
+ * channel mode messages
+ */
+#define MIDI_CC_IS_RESERVED(cc)     (((cc) == 0x01) || ((cc) == 0x06) || (((cc) >= 0x20) && ((cc) <= 0x40)) \
+                                        || (((cc) >= 0x60) && ((cc) <= 0x65)) || ((cc) >= 0x78))
+
+static const struct {
+    uint8_t cc;
+    param_id_t param;
+} m_default_cc_map[] = {
+    { MIDI_CC_LFO_FREQ,         PARAM_LFO_FREQ },
+    { MIDI_CC_LFO_ON_OFF,       PARAM_LFO_ON_OFF },
+    { MIDI_CC_OSC2_FREQ,        PARAM_OSC2_FREQ },
+    { MIDI_CC_OSC2_AMP,         PARAM_OSC2_AMP },
+    { MIDI_CC_OSC2_SYNC_ON_OFF, PARAM_OSC2_SYNC_ON_OFF },
+    { MIDI_CC_WF_OSC1,          PARAM_WF_OSC1 },
+    { MIDI_CC_WF_OSC2,          PARAM_WF_OSC2 },
+    { MIDI_CC_WF_LFO,           PARAM_WF_LFO },
+    { MIDI_CC_ENV_ATTACK,       PARAM_ENV_ATTACK },
+    { MIDI_CC_ENV_DECAY,        PARAM_ENV_DECAY },
+    { MIDI_CC_ENV_SUSTAIN,      PARAM_ENV_SUSTAIN },
+    { MIDI_CC_ENV_RELEASE,      PARAM_ENV_RELEASE },
+    { MIDI_CC_SELECT_PRESET,    PARAM_SELECT_PRESET },
+    { MIDI_CC_SAVE_PRESET,      PARAM_SAVE_PRESET },
+    { MIDI_CC_DUMP_PARAMS,      PARAM_DUMP_PARAMS },
+    { MIDI_CC_NOISE_AMP,        PARAM_NOISE_AMP },
+    { MIDI_CC_OSC1_AMP,         PARAM_OSC1_AMP },
+    { MIDI_CC_LEARN,            PARAM_LEARN },
+    { MIDI_CC_LFO_SYNC,         PARAM_LFO_SYNC },
+    { MIDI_CC_PLAY_SONG,        PARAM_PLAY_SONG },
+    { MIDI_CC_SEQ_PLAY,         PARAM_SEQ_PLAY },
+    { MIDI_CC_SEQ_TEMPO,        PARAM_SEQ_TEMPO },
+    { MIDI_CC_SEQ_RECORD,       PARAM_SEQ_RECORD },
+    { MIDI_CC_ARP_MODE,         PARAM_ARP_MODE },
+    { MIDI_CC_ARP_OCTAVES,      PARAM_ARP_OCTAVES },
+    { MIDI_CC_ARP_RATE,         PARAM_ARP_RATE },
+    { MIDI_CC_ARP_LATCH,        PARAM_ARP_LATCH },
+    { MIDI_CC_PART,             PARAM_PART },
+    { MIDI_CC_PART_VOICES,      PARAM_PART_VOICES },
+    { MIDI_CC_PART_VOLUME,      PARAM_PART_VOLUME },
+    { MIDI_CC_PART_PAN,         PARAM_PART_PAN },
+    { MIDI_CC_MORPH,            PARAM_MORPH },
+    { MIDI_CC_MORPH_TARGET,     PARAM_MORPH_TARGET },
+    { MIDI_CC_TUNING,           PARAM_TUNING },
+};
+
+/* parameter id for each controller number (PARAM_NONE if not assigned); the
+ * lookup is a single array access, no matter how many controllers are assigned
+ */
+static uint8_t m_cc_map[128];
+static portMUX_TYPE m_cc_map_lock = portMUX_INITIALIZER_UNLOCKED;   // changes vs. midi_learn_write()
+
+/* parameter waiting to be assigned (PARAM_NONE if not in learn mode) */
+static param_id_t m_learn_param = PARAM_NONE;
+
+static void midi_learn_set_defaults(void)
+{
+    memset(m_cc_map, PARAM_NONE, sizeof(m_cc_map));
+    for(int i = 0; i < sizeof(m_default_cc_map) / sizeof(m_default_cc_map[0]); i++) {
+        m_cc_map[m_default_cc_map[i].cc] = m_default_cc_map[i].param;
+    }
+}
+
+/* written with storage_write(), so that a power loss never leaves a partial map;
+ * the map of the defaults is written as well, it is read like a learned one
+ */
+void midi_learn_write(void)
+{
+    uint8_t cc_map[sizeof(m_cc_map)];
+
+    portENTER_CRITICAL(&m_cc_map_lock);
+    memcpy(cc_map, m_cc_map, sizeof(cc_map));
+    portEXIT_CRITICAL(&m_cc_map_lock);
+
+    storage_write(CC_MAP_NAME, cc_map, sizeof(cc_map));
+}
+
+static int midi_learn_check(const uint8_t *cc_map, size_t size, void *context)
+{
+    if(size != sizeof(m_cc_map)) {
+        ESP_LOGE(TAG, "Invalid controller map (%u bytes)", size);
+        return -1;
+    }
+
+    for(int i = 0; i < size; i++) {
+        if((cc_map[i] != PARAM_NONE) && (cc_map[i] >= PARAM_COUNT)) {
+            ESP_LOGE(TAG, "Invalid parameter %d for controller 0x%02X", cc_map[i], i);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void midi_learn_init(void)
+{
+    /* one more byte than the map, to detect files that are too long */
+    uint8_t cc_map[sizeof(m_cc_map) + 1];
+
+    midi_learn_set_defaults();
+
+    if(storage_read(CC_MAP_NAME, cc_map, sizeof(cc_map), midi_learn_check, NULL) != 0) {
+        ESP_LOGI(TAG, "No valid controller map stored, using defaults");
+        return;
+    }
+
+    memcpy(m_cc_map, cc_map, sizeof(m_cc_map));
+    ESP_LOGI(TAG, "Controller map loaded");
+}
+
+param_id_t midi_learn_get_param(uint8_t cc)
+{
+    return m_cc_map[cc];
+}
+
+void midi_learn_start(param_id_t id)
+{
+    ESP_LOGI(TAG, "Learning controller for %s", param_get_desc(id)->name);
+    m_learn_param = id;
+}
+
+void midi_learn_reset(void)
+{
+    ESP_LOGI(TAG, "Restoring default controller map");
+    m_learn_param = PARAM_NONE;
+
+    portENTER_CRITICAL(&m_cc_map_lock);
+    midi_learn_set_defaults();
+    portEXIT_CRITICAL(&m_cc_map_lock);
+
+    preset_write_cc_map();
+}
+
+int midi_learn_process_cc(uint8_t cc)
+{
+    if(m_learn_param == PARAM_NONE)
+        return 0;
+
+    /* the learn controller itself must stay assigned */
+    if(MIDI_CC_IS_RESERVED(cc) || (m_cc_map[cc] == PARAM_LEARN))
+        return 0;
+
+    /* a parameter is assigned to only one controller */
+    portENTER_CRITICAL(&m_cc_map_lock);
+    for(int i = 0; i < sizeof(m_cc_map); i++) {
+        if(m_cc_map[i] == m_learn_param)
+            m_cc_map[i] = PARAM_NONE;
+    }
+    m_cc_map[cc] = m_learn_param;
+    portEXIT_CRITICAL(&m_cc_map_lock);
+
+    ESP_LOGI(TAG, "Controller 0x%02X assigned to %s", cc, param_get_desc(m_learn_param)->name);
+    m_learn_param = PARAM_NONE;
+
+    preset_write_cc_map();
+
+    return 1;
+}
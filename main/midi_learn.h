@@ -0,0 +1,40 @@
+#ifndef MIDI_LEARN_H
+#define MIDI_LEARN_H
+
+#include <stdint.h>
+
+#include "params.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* loads the controller map from storage, or sets up the default map */
+void midi_learn_init(void);
+
+/* returns the parameter a controller is assigned to, or PARAM_NONE */
+param_id_t midi_learn_get_param(uint8_t cc);
+
+/* the next control change (on a controller that is not reserved) will be
+ * assigned to the given parameter
+ */
+void midi_learn_start(param_id_t id);
+
+/* restores the default controller map */
+void midi_learn_reset(void);
+
+/* called for every control change; returns 1 if the controller was assigned
+ * (learned), in which case the control change should not be processed further
+ */
+int midi_learn_process_cc(uint8_t cc);
+
+/* writes the controller map to storage; changes are queued to the preset task
+ * (see preset_write_cc_map()), which calls this
+ */
+void midi_learn_write(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MIDI_LEARN_H
@@ -0,0 +1,134 @@
+#include "midi_parser.h"
+
+/* number of data bytes following a status byte, indexed by the upper nibble for
+ * channel voice messages (0x80...0xE0) and by the lower nibble for system common
+ * messages (0xF0...0xF7); see https://www.midi.org/specifications-old/item/table-1-summary-of-midi-message
+ */
+static const uint8_t m_channel_lengths[8] = { 2, 2, 2, 2, 1, 1, 2, 0 };
+static const uint8_t m_system_common_lengths[8] = { 0, 1, 2, 1, 0, 0, 0, 0 };
+
+void midi_parser_init(midi_parser_t *parser, uint8_t *sysex_buffer, uint16_t sysex_size)
+{
+    parser->running_status = 0;
+    parser->index = 0;
+    parser->expected = 0;
+    parser->sysex_active = 0;
+    parser->sysex_truncated = 0;
+    parser->sysex_buffer = sysex_buffer;
+    parser->sysex_size = sysex_size;
+    parser->sysex_length = 0;
+}
+
+static int midi_parser_emit(midi_parser_t *parser, midi_message_t *message)
+{
+    message->status = parser->running_status;
+    message->data[0] = parser->data[0];
+    message->data[1] = parser->data[1];
+    message->length = parser->expected;
+    message->sysex = NULL;
+    message->sysex_length = 0;
+    message->sysex_truncated = 0;
+
+    parser->index = 0;
+
+    /* system common messages cancel running status */
+    if(parser->running_status >= 0xf0) {
+        parser->running_status = 0;
+        parser->expected = 0;
+    }
+
+    return 1;
+}
+
+int midi_parser_feed(midi_parser_t *parser, uint8_t byte, midi_message_t *message)
+{
+    /* real-time messages can appear anywhere, even in the middle of another
+     * message, and do not affect the parser state
+     */
+    if(MIDI_IS_REALTIME(byte)) {
+        /* 0xF9 and 0xFD are undefined */
+        if((byte == 0xf9) || (byte == 0xfd)) {
+            return 0;
+        }
+        message->status = byte;
+        message->length = 0;
+        message->sysex = NULL;
+        message->sysex_length = 0;
+        message->sysex_truncated = 0;
+        return 1;
+    }
+
+    if(MIDI_IS_STATUS(byte)) {
+        if(byte == MIDI_SB_SYSEX_END) {
+            if(!parser->sysex_active) {
+                return 0;
+            }
+            parser->sysex_active = 0;
+            message->status = MIDI_SB_SYSEX_START;
+            message->length = 0;
+            message->sysex = parser->sysex_buffer;
+            message->sysex_length = parser->sysex_length;
+            message->sysex_truncated = parser->sysex_truncated;
+            return 1;
+        }
+
+        /* any other status byte terminates a SysEx message; an unterminated
+         * message is dropped
+         */
+        parser->sysex_active = 0;
+        parser->index = 0;
+
+        if(byte == MIDI_SB_SYSEX_START) {
+            parser->running_status = 0;
+            parser->expected = 0;
+            parser->sysex_active = 1;
+            parser->sysex_truncated = 0;
+            parser->sysex_length = 0;
+            return 0;
+        }
+
+        parser->running_status = byte;
+        parser->expected = (byte < 0xf0)
+                            ? m_channel_lengths[(byte >> 4) & 0x07]
+                            : m_system_common_lengths[byte & 0x07];
+
+        /* undefined system common messages (0xF4, 0xF5) are ignored */
+        if((byte == 0xf4) || (byte == 0xf5)) {
+            parser->running_status = 0;
+            return 0;
+        }
+
+        /* messages without data bytes (tune request) are complete right away */
+        if(parser->expected == 0) {
+            return midi_parser_emit(parser, message);
+        }
+
+        return 0;
+    }
+
+    /* data byte */
+    if(parser->sysex_active) {
+        if(parser->sysex_length < parser->sysex_size) {
+            parser->sysex_buffer[parser->sysex_length++] = byte;
+        } else {
+            parser->sysex_truncated = 1;
+        }
+        return 0;
+    }
+
+    /* no status byte (yet), e.g. after power-up or after a system common message */
+    if(parser->running_status == 0) {
+        return 0;
+    }
+
+    parser->data[parser->index++] = byte;
+
+    if(parser->index < parser->expected) {
+        return 0;
+    }
+
+    /* the running status is kept for the next message (see "running status", e.g. in
+     * https://www.cs.cmu.edu/~music/cmsip/readings/Standard-MIDI-file-format-updated.pdf)
+     */
+    return midi_parser_emit(parser, message);
+}
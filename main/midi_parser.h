@@ -0,0 +1,75 @@
+#ifndef MIDI_PARSER_H
+#define MIDI_PARSER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* channel voice messages (upper nibble of the status byte) */
+#define MIDI_SB_NOTE_OFF            (0b1000 << 4)
+#define MIDI_SB_NOTE_ON             (0b1001 << 4)
+#define MIDI_SB_POLY_PRESSURE       (0b1010 << 4)
+#define MIDI_SB_CONTROL_CHANGE      (0b1011 << 4)
+#define MIDI_SB_PROGRAM_CHANGE      (0b1100 << 4)
+#define MIDI_SB_CHANNEL_PRESSURE    (0b1101 << 4)
+#define MIDI_SB_PITCH_BEND          (0b1110 << 4)
+
+/* system common messages */
+#define MIDI_SB_SYSEX_START         (0xf0)
+#define MIDI_SB_TIME_CODE           (0xf1)
+#define MIDI_SB_SONG_POSITION       (0xf2)
+#define MIDI_SB_SONG_SELECT         (0xf3)
+#define MIDI_SB_TUNE_REQUEST        (0xf6)
+#define MIDI_SB_SYSEX_END           (0xf7)
+
+/* system real-time messages */
+#define MIDI_SB_CLOCK               (0xf8)
+#define MIDI_SB_START               (0xfa)
+#define MIDI_SB_CONTINUE            (0xfb)
+#define MIDI_SB_STOP                (0xfc)
+#define MIDI_SB_ACTIVE_SENSE        (0xfe)
+#define MIDI_SB_RESET               (0xff)
+
+#define MIDI_IS_STATUS(byte)        ((byte) & 0x80)
+#define MIDI_IS_REALTIME(byte)      ((byte) >= 0xf8)
+
+typedef struct {
+    uint8_t status;             // including the channel for channel voice messages
+    uint8_t data[2];
+    uint8_t length;             // number of valid bytes in data
+    /* only valid for MIDI_SB_SYSEX_START messages; points into the parser's buffer
+     * and is only valid until the next byte is fed
+     */
+    const uint8_t *sysex;
+    uint16_t sysex_length;      // without the 0xf0 and 0xf7 framing bytes
+    uint8_t sysex_truncated;    // set if the message did not fit into the buffer
+} midi_message_t;
+
+typedef struct {
+    uint8_t running_status;     // 0 if there is no valid running status
+    uint8_t data[2];
+    uint8_t index;
+    uint8_t expected;
+    uint8_t sysex_active;
+    uint8_t sysex_truncated;
+    uint8_t *sysex_buffer;
+    uint16_t sysex_size;
+    uint16_t sysex_length;
+} midi_parser_t;
+
+/* the SysEx buffer is owned by the caller, the parser never allocates memory */
+void midi_parser_init(midi_parser_t *parser, uint8_t *sysex_buffer, uint16_t sysex_size);
+
+/* feeds one byte into the parser; returns 1 and fills in message when a complete
+ * message was received, 0 otherwise
+ */
+int midi_parser_feed(midi_parser_t *parser, uint8_t byte, midi_message_t *message);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MIDI_PARSER_H
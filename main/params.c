@@ -0,0 +1,269 @@
+#include "params.h"
+#include "preset.h"
+#include "midi_input.h"
+#include "midi_learn.h"
+#include "smf_player.h"
+#include "sequencer.h"
+#include "arpeggiator.h"
+#include "tuning.h"
+
+#include <math.h>
+
+static void set_osc1_waveform(float value) { synth_update_osc1_waveform((waveform_t) value); }
+static void set_osc2_waveform(float value) { synth_update_osc2_waveform((waveform_t) value); }
+static void set_lfo_waveform(float value) { synth_update_lfo_waveform((waveform_t) value); }
+static void set_lfo_on_off(float value) { synth_enable_lfo((uint8_t) value); }
+static void set_osc2_sync_on_off(float value) { synth_enable_osc2_sync((uint8_t) value); }
+static void select_preset(float value) { preset_select((int) value); }
+static void set_lfo_sync(float value) { synth_set_lfo_sync((lfo_sync_t) value); }
+static void save_preset(float value) { preset_save(); }
+static void dump_params(float value) { midi_dump_params(); midi_dump_stats(); }
+static void play_song(float value) { smf_player_play((int) value); }
+static void set_seq_play(float value) { sequencer_set_playing((uint8_t) value); }
+static void set_seq_record(float value) { sequencer_set_record((uint8_t) value); }
+static void set_arp_mode(float value) { arp_set_mode((arp_mode_t) value); }
+static void set_arp_octaves(float value) { arp_set_octaves((uint8_t) value + 1); }
+static void set_arp_rate(float value) { arp_set_rate((arp_rate_t) value); }
+static void set_arp_latch(float value) { arp_set_latch((uint8_t) value); }
+static void select_part(float value) { synth_select_part((uint8_t) value); }
+static void set_part_voices(float value) { synth_set_part_voices((uint8_t) value + 1); }
+static void set_morph_target(float value) { preset_set_morph_target((int) value); }
+static void set_tuning(float value) { synth_set_tuning((uint8_t) value); }
+
+static void learn(float value)
+{
+    if((value < PARAM_COUNT) && (value != PARAM_LEARN))
+        midi_learn_start((param_id_t) value);
+    else
+        midi_learn_reset();
+}
+
+static float get_osc1_amp(const synth_patch_t *patch) { return patch->osc1.amplitude; }
+static float get_osc2_freq(const synth_patch_t *patch) { return patch->osc2.frequency; }
+static float get_osc2_amp(const synth_patch_t *patch) { return patch->osc2.amplitude; }
+static float get_lfo_freq(const synth_patch_t *patch) { return patch->lfo.frequency; }
+static float get_lfo_on_off(const synth_patch_t *patch) { return patch->synth.lfo_enabled; }
+static float get_osc2_sync_on_off(const synth_patch_t *patch) { return patch->synth.osc2_sync_enabled; }
+static float get_osc1_waveform(const synth_patch_t *patch) { return patch->osc1.waveform; }
+static float get_osc2_waveform(const synth_patch_t *patch) { return patch->osc2.waveform; }
+static float get_lfo_waveform(const synth_patch_t *patch) { return patch->lfo.waveform; }
+static float get_env_attack(const synth_patch_t *patch) { return patch->envelope.attack; }
+static float get_env_decay(const synth_patch_t *patch) { return patch->envelope.decay; }
+static float get_env_sustain(const synth_patch_t *patch) { return patch->envelope.sustain; }
+static float get_env_release(const synth_patch_t *patch) { return patch->envelope.release; }
+static float get_noise_amp(const synth_patch_t *patch) { return patch->synth.noise_amplitude; }
+static float get_lfo_sync(const synth_patch_t *patch) { return patch->synth.lfo_sync; }
+static float get_preset(const synth_patch_t *patch) { return preset_get_current_index(); }
+static float get_seq_play(const synth_patch_t *patch) { return sequencer_is_playing(); }
+static float get_seq_tempo(const synth_patch_t *patch) { return sequencer_get_tempo(); }
+static float get_seq_record(const synth_patch_t *patch) { return sequencer_is_recording(); }
+static float get_arp_mode(const synth_patch_t *patch) { return arp_get_mode(); }
+static float get_arp_octaves(const synth_patch_t *patch) { return arp_get_octaves() - 1; }
+static float get_arp_rate(const synth_patch_t *patch) { return arp_get_rate(); }
+static float get_arp_latch(const synth_patch_t *patch) { return arp_get_latch(); }
+static float get_part(const synth_patch_t *patch) { return synth_get_selected_part(); }
+static float get_part_voices(const synth_patch_t *patch) { return synth_get_part_voices() - 1; }
+static float get_part_volume(const synth_patch_t *patch) { return synth_get_part_volume(); }
+static float get_part_pan(const synth_patch_t *patch) { return synth_get_part_pan(); }
+static float get_morph(const synth_patch_t *patch) { return synth_get_morph(); }
+static float get_morph_target(const synth_patch_t *patch) { return preset_get_morph_target(); }
+static float get_tuning(const synth_patch_t *patch) { return patch->synth.tuning; }
+
+static const param_desc_t m_params[PARAM_COUNT] = {
+    [PARAM_OSC1_AMP] = {
+        .name = "OSC1 amplitude", .min = 0.0, .max = 15000.0, .curve = PARAM_CURVE_LINEAR,
+        .set = synth_update_osc1_amp, .get = get_osc1_amp,
+    },
+    [PARAM_OSC2_FREQ] = {
+        .name = "OSC2 frequency", .min = 100.0, .max = 2000.0, .curve = PARAM_CURVE_EXPONENTIAL,
+        .set = synth_update_osc2_freq, .get = get_osc2_freq,
+    },
+    [PARAM_OSC2_AMP] = {
+        .name = "OSC2 amplitude", .min = 0.0, .max = 15000.0, .curve = PARAM_CURVE_LINEAR,
+        .set = synth_update_osc2_amp, .get = get_osc2_amp,
+    },
+    [PARAM_LFO_FREQ] = {
+        .name = "LFO frequency", .min = 0.1, .max = 20.0, .curve = PARAM_CURVE_EXPONENTIAL,
+        .set = synth_update_lfo_freq, .get = get_lfo_freq,
+    },
+    [PARAM_LFO_ON_OFF] = {
+        .name = "LFO on/off", .min = 0, .max = 1, .curve = PARAM_CURVE_TOGGLE,
+        .set = set_lfo_on_off, .get = get_lfo_on_off,
+    },
+    [PARAM_OSC2_SYNC_ON_OFF] = {
+        .name = "OSC2 sync on/off", .min = 0, .max = 1, .curve = PARAM_CURVE_TOGGLE,
+        .set = set_osc2_sync_on_off, .get = get_osc2_sync_on_off,
+    },
+    [PARAM_WF_OSC1] = {
+        .name = "OSC1 waveform", .min = 0, .max = WAVEFORM_SAMPLE, .curve = PARAM_CURVE_STEPPED, .step = 16,
+        .set = set_osc1_waveform, .get = get_osc1_waveform,
+    },
+    [PARAM_WF_OSC2] = {
+        .name = "OSC2 waveform", .min = 0, .max = WAVEFORM_SQUARE, .curve = PARAM_CURVE_STEPPED, .step = 16,
+        .set = set_osc2_waveform, .get = get_osc2_waveform,
+    },
+    [PARAM_WF_LFO] = {
+        .name = "LFO waveform", .min = 0, .max = WAVEFORM_SQUARE, .curve = PARAM_CURVE_STEPPED, .step = 16,
+        .set = set_lfo_waveform, .get = get_lfo_waveform,
+    },
+    [PARAM_ENV_ATTACK] = {
+        .name = "Envelope attack", .min = 0.01, .max = 1.0, .curve = PARAM_CURVE_EXPONENTIAL,
+        .set = synth_update_env_attack, .get = get_env_attack,
+    },
+    [PARAM_ENV_DECAY] = {
+        .name = "Envelope decay", .min = 0.01, .max = 1.0, .curve = PARAM_CURVE_EXPONENTIAL,
+        .set = synth_update_env_decay, .get = get_env_decay,
+    },
+    [PARAM_ENV_SUSTAIN] = {
+        .name = "Envelope sustain", .min = 0.0, .max = 1.0, .curve = PARAM_CURVE_LINEAR,
+        .set = synth_update_env_sustain, .get = get_env_sustain,
+    },
+    [PARAM_ENV_RELEASE] = {
+        .name = "Envelope release", .min = 0.01, .max = 1.0, .curve = PARAM_CURVE_EXPONENTIAL,
+        .set = synth_update_env_release, .get = get_env_release,
+    },
+    [PARAM_NOISE_AMP] = {
+        .name = "Noise amplitude", .min = 0.0, .max = 15000.0, .curve = PARAM_CURVE_LINEAR,
+        .set = synth_update_noise_amp, .get = get_noise_amp,
+    },
+    [PARAM_SELECT_PRESET] = {
+        .name = "Preset", .min = 0, .max = PRESET_COUNT - 1, .curve = PARAM_CURVE_STEPPED, .step = 20,
+        .flags = PARAM_FLAG_IMMEDIATE, .set = select_preset, .get = get_preset,
+    },
+    [PARAM_SAVE_PRESET] = {
+        .name = "Save preset", .curve = PARAM_CURVE_TOGGLE,
+        .flags = PARAM_FLAG_IMMEDIATE, .set = save_preset,
+    },
+    [PARAM_DUMP_PARAMS] = {
+        .name = "Dump parameters", .curve = PARAM_CURVE_TOGGLE,
+        .flags = PARAM_FLAG_IMMEDIATE, .set = dump_params,
+    },
+    [PARAM_LEARN] = {
+        .name = "MIDI learn", .min = 0, .max = 127, .curve = PARAM_CURVE_STEPPED, .step = 1,
+        .flags = PARAM_FLAG_IMMEDIATE, .set = learn,
+    },
+    [PARAM_LFO_SYNC] = {
+        .name = "LFO sync", .min = 0, .max = LFO_SYNC_SIXTEENTH, .curve = PARAM_CURVE_STEPPED, .step = 16,
+        .set = set_lfo_sync, .get = get_lfo_sync,
+    },
+    [PARAM_PLAY_SONG] = {
+        .name = "Play song", .min = 0, .max = 127, .curve = PARAM_CURVE_STEPPED, .step = 1,
+        .flags = PARAM_FLAG_IMMEDIATE, .set = play_song,
+    },
+    [PARAM_SEQ_PLAY] = {
+        .name = "Sequencer play", .min = 0, .max = 1, .curve = PARAM_CURVE_TOGGLE,
+        .set = set_seq_play, .get = get_seq_play,
+    },
+    [PARAM_SEQ_TEMPO] = {
+        .name = "Sequencer tempo", .min = 40.0, .max = 240.0, .curve = PARAM_CURVE_LINEAR,
+        .set = sequencer_set_tempo, .get = get_seq_tempo,
+    },
+    [PARAM_SEQ_RECORD] = {
+        .name = "Sequencer record", .min = 0, .max = 1, .curve = PARAM_CURVE_TOGGLE,
+        .set = set_seq_record, .get = get_seq_record,
+    },
+    [PARAM_ARP_MODE] = {
+        .name = "Arpeggiator mode", .min = 0, .max = ARP_MODE_AS_PLAYED, .curve = PARAM_CURVE_STEPPED, .step = 16,
+        .set = set_arp_mode, .get = get_arp_mode,
+    },
+    [PARAM_ARP_OCTAVES] = {
+        .name = "Arpeggiator octaves", .min = 0, .max = ARP_MAX_OCTAVES - 1, .curve = PARAM_CURVE_STEPPED, .step = 32,
+        .set = set_arp_octaves, .get = get_arp_octaves,
+    },
+    [PARAM_ARP_RATE] = {
+        .name = "Arpeggiator rate", .min = 0, .max = ARP_RATE_THIRTYSECOND, .curve = PARAM_CURVE_STEPPED, .step = 32,
+        .set = set_arp_rate, .get = get_arp_rate,
+    },
+    [PARAM_ARP_LATCH] = {
+        .name = "Arpeggiator latch", .min = 0, .max = 1, .curve = PARAM_CURVE_TOGGLE,
+        .set = set_arp_latch, .get = get_arp_latch,
+    },
+    [PARAM_PART] = {
+        .name = "Part", .min = 0, .max = SYNTH_PART_COUNT - 1, .curve = PARAM_CURVE_STEPPED, .step = 32,
+        .flags = PARAM_FLAG_IMMEDIATE, .set = select_part, .get = get_part,
+    },
+    [PARAM_PART_VOICES] = {
+        .name = "Part voices", .min = 0, .max = SYNTH_VOICE_COUNT - 1, .curve = PARAM_CURVE_STEPPED, .step = 16,
+        .set = set_part_voices, .get = get_part_voices,
+    },
+    [PARAM_PART_VOLUME] = {
+        .name = "Part volume", .min = 0.0, .max = 1.0, .curve = PARAM_CURVE_LINEAR,
+        .set = synth_set_part_volume, .get = get_part_volume,
+    },
+    [PARAM_PART_PAN] = {
+        .name = "Part pan", .min = -1.0, .max = 1.0, .curve = PARAM_CURVE_LINEAR,
+        .set = synth_set_part_pan, .get = get_part_pan,
+    },
+    [PARAM_MORPH] = {
+        .name = "Morph", .min = 0.0, .max = 1.0, .curve = PARAM_CURVE_LINEAR,
+        .set = synth_set_morph, .get = get_morph,
+    },
+    [PARAM_MORPH_TARGET] = {
+        .name = "Morph target", .min = 0, .max = PRESET_COUNT - 1, .curve = PARAM_CURVE_STEPPED, .step = 16,
+        .set = set_morph_target, .get = get_morph_target,
+    },
+    [PARAM_TUNING] = {
+        .name = "Tuning", .min = 0, .max = TUNING_COUNT - 1, .curve = PARAM_CURVE_STEPPED, .step = 16,
+        .set = set_tuning, .get = get_tuning,
+    },
+};
+
+const param_desc_t *param_get_desc(param_id_t id)
+{
+    return &m_params[id];
+}
+
+float param_from_raw(param_id_t id, uint16_t raw)
+{
+    const param_desc_t *desc = &m_params[id];
+    float x = (float) raw / PARAM_RAW_MAX;
+    int index;
+
+    switch(desc->curve) {
+    case PARAM_CURVE_LINEAR:
+        return desc->min + x * (desc->max - desc->min);
+    case PARAM_CURVE_EXPONENTIAL:
+        return desc->min * powf(desc->max / desc->min, x);
+    case PARAM_CURVE_STEPPED:
+        /* steps are defined in terms of 7-bit values */
+        index = (raw >> 7) / desc->step;
+        return (index > desc->max) ? desc->max : index;
+    case PARAM_CURVE_TOGGLE:
+        return (raw != 0) ? 1.0 : 0.0;
+    }
+
+    return desc->min;
+}
+
+uint16_t param_to_raw(param_id_t id, float value)
+{
+    const param_desc_t *desc = &m_params[id];
+    float x;
+
+    switch(desc->curve) {
+    case PARAM_CURVE_LINEAR:
+        x = (value - desc->min) / (desc->max - desc->min);
+        break;
+    case PARAM_CURVE_EXPONENTIAL:
+        x = logf(value / desc->min) / logf(desc->max / desc->min);
+        break;
+    case PARAM_CURVE_STEPPED:
+        return ((uint16_t) value * desc->step) << 7;
+    case PARAM_CURVE_TOGGLE:
+    default:
+        /* a 7-bit value of 1, so that it reads back as 1 from a 7-bit controller */
+        return (value != 0.0) ? (1 << 7) : 0;
+    }
+
+    if(x < 0.0)
+        x = 0.0;
+    if(x > 1.0)
+        x = 1.0;
+
+    return (uint16_t) (x * PARAM_RAW_MAX + 0.5);
+}
+
+void param_apply_raw(param_id_t id, uint16_t raw)
+{
+    m_params[id].set(param_from_raw(id, raw));
+}
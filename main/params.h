@@ -0,0 +1,94 @@
+#ifndef PARAMS_H
+#define PARAMS_H
+
+#include <stdint.h>
+
+#include "synth.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* parameter ids; these are also the NRPN numbers of the parameters */
+typedef enum {
+    PARAM_OSC1_AMP,
+    PARAM_OSC2_FREQ,
+    PARAM_OSC2_AMP,
+    PARAM_LFO_FREQ,
+    PARAM_LFO_ON_OFF,
+    PARAM_OSC2_SYNC_ON_OFF,
+    PARAM_WF_OSC1,
+    PARAM_WF_OSC2,
+    PARAM_WF_LFO,
+    PARAM_ENV_ATTACK,
+    PARAM_ENV_DECAY,
+    PARAM_ENV_SUSTAIN,
+    PARAM_ENV_RELEASE,
+    PARAM_NOISE_AMP,
+    PARAM_SELECT_PRESET,
+    PARAM_SAVE_PRESET,
+    PARAM_DUMP_PARAMS,
+    PARAM_LEARN,            // value is a parameter id: learn that parameter, otherwise restore default map
+    PARAM_LFO_SYNC,
+    PARAM_PLAY_SONG,        // value 0 stops the current song
+    PARAM_SEQ_PLAY,
+    PARAM_SEQ_TEMPO,
+    PARAM_SEQ_RECORD,
+    PARAM_ARP_MODE,
+    PARAM_ARP_OCTAVES,      // octaves above the notes that are held
+    PARAM_ARP_RATE,
+    PARAM_ARP_LATCH,
+    PARAM_PART,             // part that the sound parameters and presets apply to
+    PARAM_PART_VOICES,
+    PARAM_PART_VOLUME,
+    PARAM_PART_PAN,
+    PARAM_MORPH,            // 0 plays the part's own patch, 1 the morph target
+    PARAM_MORPH_TARGET,     // preset that the selected part morphs towards
+    PARAM_TUNING,
+    PARAM_COUNT,
+    PARAM_NONE = 0xff,
+} param_id_t;
+
+typedef enum {
+    PARAM_CURVE_LINEAR,         // min + x * (max - min)
+    PARAM_CURVE_EXPONENTIAL,    // min * (max / min)^x, for frequencies and times
+    PARAM_CURVE_STEPPED,        // one step every `step` 7-bit MIDI values, up to max
+    PARAM_CURVE_TOGGLE,         // 0 or 1
+} param_curve_t;
+
+/* parameters with this flag act on the whole parameter set and are applied
+ * immediately instead of being coalesced
+ */
+#define PARAM_FLAG_IMMEDIATE    (1 << 0)
+
+/* maximum value of a parameter's raw (14-bit) MIDI value */
+#define PARAM_RAW_MAX           (0x3fff)
+
+typedef struct {
+    const char *name;
+    float min;
+    float max;
+    param_curve_t curve;
+    uint8_t step;
+    uint8_t flags;
+    void (*set)(float value);
+    /* NULL for parameters that have no state (actions) */
+    float (*get)(const synth_patch_t *patch);
+} param_desc_t;
+
+const param_desc_t *param_get_desc(param_id_t id);
+
+/* maps a raw 14-bit MIDI value to the parameter's range */
+float param_from_raw(param_id_t id, uint16_t raw);
+
+/* maps a parameter value back to a raw 14-bit MIDI value */
+uint16_t param_to_raw(param_id_t id, float value);
+
+/* maps a raw 14-bit MIDI value and passes it to the parameter's setter */
+void param_apply_raw(param_id_t id, uint16_t raw);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PARAMS_H
@@ -24,6 +24,14 @@
 /* UART (MIDI in) pinout */
 #define MIDI_UART_RX_GPIO       (2)
 
+/* MIDI thru (only used if enabled in midi_input.c); IO12 is a strapping pin
+ * (flash voltage), the MIDI out driver must not pull it high during reset
+ */
+#define MIDI_UART_TX_GPIO       (12)
+
+/* UART0 (console) RX pin, also used as a second MIDI input */
+#define CONSOLE_UART_RX_GPIO    (3)
+
 /* I2C pinout */
 #define GPIO_NUM_SDA            (13)
 #define GPIO_NUM_SCL            (4)
@@ -1,80 +1,464 @@
 #include "preset.h"
-#include "synth.h"
+#include "sequencer.h"
+#include "logger.h"
+#include "assets.h"
+#include "storage.h"
+#include "midi_learn.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
 #include "esp_log.h"
-#include "esp_vfs_fat.h"
+#include "esp_crc.h"
+#include "esp_timer.h"
 
 static const char *TAG = "PRESET";
 
+#define PRESET_NAME_LENGTH      (16)
+
+/* bits of the preset task's notification value */
+#define PRESET_PENDING_PATCH(index)     (1 << (index))
+#define PRESET_PENDING_PATTERN(index)   (1 << (PRESET_COUNT + (index)))
+#define PRESET_PENDING_CC_MAP           (1 << (2 * PRESET_COUNT))
+
 static int current_preset_index;
+static int m_morph_target[SYNTH_PART_COUNT];    // preset index, per part
 
-static oscillator_params_t osc1_params;
-static oscillator_params_t osc2_params;
-static oscillator_params_t lfo_params;
-static synth_params_t synth_params;
-static envelope_params_t envelope_params;
+static synth_patch_t patch;
+
+/* All presets are kept in RAM (they are only a few dozen bytes each), so that
+ * selecting one never waits for the storage. Saved presets are written back by
+ * a background task.
+ */
+static synth_patch_t m_bank[PRESET_COUNT];
+static uint8_t m_bank_stored[PRESET_COUNT];     // if not set, there is no preset at this index
+static portMUX_TYPE m_bank_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t m_task;
 
 int preset_get_current_index(void)
 {
     return current_preset_index;
 }
 
+void preset_set_current_index(int index)
+{
+    if((index < 0) || (index >= PRESET_COUNT))
+        return;
+
+    current_preset_index = index;
+}
+
+/* Presets are stored as a record of a header and the patch fields, packed and
+ * little-endian:
+ *
+ *     magic (2 bytes) | version (1) | length (1) | CRC-32 of the fields (4) | fields
+ *
+ * Fields are only ever appended, so a record can be read by any version: fields
+ * that an older record does not have keep their defaults, fields of a newer one
+ * that are not known are skipped. The version is only bumped for incompatible
+ * changes, which are not read at all.
+ */
+#define PRESET_MAGIC            (0x5053)    // "SP"
+#define PRESET_VERSION          (1)
+
+/* files written before the record was introduced, by the first version: its
+ * parameter structs back to back, including their padding
+ */
+typedef struct __attribute__((packed)) {
+    float osc1_amplitude;
+    float osc1_frequency;
+    uint32_t osc1_waveform;
+    float osc2_amplitude;
+    float osc2_frequency;
+    uint32_t osc2_waveform;
+    float lfo_amplitude;
+    float lfo_frequency;
+    uint32_t lfo_waveform;
+    float attack;
+    float decay;
+    float sustain;
+    float release;
+    float envelope_amplitude;
+    uint8_t lfo_enabled;
+    uint8_t osc2_sync_enabled;
+    uint16_t padding;
+    float noise_amplitude;
+} preset_legacy_t;
+
+_Static_assert(sizeof(preset_legacy_t) == 64, "the layout of the first version");
+
+typedef struct __attribute__((packed)) {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t length;         // of the fields
+    uint32_t crc;
+} preset_header_t;
+
+typedef struct __attribute__((packed)) {
+    float osc1_amplitude;
+    float osc1_frequency;
+    uint8_t osc1_waveform;
+    float osc2_amplitude;
+    float osc2_frequency;
+    uint8_t osc2_waveform;
+    float lfo_amplitude;
+    float lfo_frequency;
+    uint8_t lfo_waveform;
+    float attack;
+    float decay;
+    float sustain;
+    float release;
+    float envelope_amplitude;
+    uint8_t lfo_enabled;
+    uint8_t osc2_sync_enabled;
+    float noise_amplitude;
+    uint8_t lfo_sync;
+    uint8_t tuning;
+    /* new fields go here */
+} preset_fields_t;
+
+typedef struct __attribute__((packed)) {
+    preset_header_t header;
+    preset_fields_t fields;
+} preset_record_t;
+
+_Static_assert(sizeof(preset_fields_t) <= UINT8_MAX, "the record length is a single byte");
+_Static_assert(sizeof(preset_record_t) <= PRESET_MAX_RECORD_SIZE, "the read buffer is too small");
+
+/* used for the fields a record does not have */
+static const preset_fields_t m_defaults = {
+    .osc1_amplitude = 10000.0,
+    .osc1_frequency = 440.0,
+    .osc1_waveform = WAVEFORM_SINUS,
+    .osc2_amplitude = 0.0,
+    .osc2_frequency = 523.25,
+    .osc2_waveform = WAVEFORM_SAWTOOTH,
+    .lfo_amplitude = 1.0,
+    .lfo_frequency = 10.0,
+    .lfo_waveform = WAVEFORM_SAWTOOTH,
+    .attack = 0.1,
+    .decay = 0.1,
+    .sustain = 0.5,
+    .release = 1.0,
+    .envelope_amplitude = 1.0,
+    .lfo_enabled = 0,
+    .osc2_sync_enabled = 0,
+    .noise_amplitude = 0.0,
+    .lfo_sync = LFO_SYNC_OFF,
+    .tuning = 0,
+};
+
+static void preset_from_fields(synth_patch_t *patch, const preset_fields_t *fields)
+{
+    patch->osc1.amplitude = fields->osc1_amplitude;
+    patch->osc1.frequency = fields->osc1_frequency;
+    patch->osc1.waveform = fields->osc1_waveform;
+    patch->osc2.amplitude = fields->osc2_amplitude;
+    patch->osc2.frequency = fields->osc2_frequency;
+    patch->osc2.waveform = fields->osc2_waveform;
+    patch->lfo.amplitude = fields->lfo_amplitude;
+    patch->lfo.frequency = fields->lfo_frequency;
+    patch->lfo.waveform = fields->lfo_waveform;
+    patch->envelope.attack = fields->attack;
+    patch->envelope.decay = fields->decay;
+    patch->envelope.sustain = fields->sustain;
+    patch->envelope.release = fields->release;
+    patch->envelope.amplitude = fields->envelope_amplitude;
+    patch->synth.lfo_enabled = fields->lfo_enabled;
+    patch->synth.osc2_sync_enabled = fields->osc2_sync_enabled;
+    patch->synth.noise_amplitude = fields->noise_amplitude;
+    patch->synth.lfo_sync = fields->lfo_sync;
+    patch->synth.tuning = fields->tuning;
+}
+
+static void preset_to_fields(preset_fields_t *fields, const synth_patch_t *patch)
+{
+    fields->osc1_amplitude = patch->osc1.amplitude;
+    fields->osc1_frequency = patch->osc1.frequency;
+    fields->osc1_waveform = patch->osc1.waveform;
+    fields->osc2_amplitude = patch->osc2.amplitude;
+    fields->osc2_frequency = patch->osc2.frequency;
+    fields->osc2_waveform = patch->osc2.waveform;
+    fields->lfo_amplitude = patch->lfo.amplitude;
+    fields->lfo_frequency = patch->lfo.frequency;
+    fields->lfo_waveform = patch->lfo.waveform;
+    fields->attack = patch->envelope.attack;
+    fields->decay = patch->envelope.decay;
+    fields->sustain = patch->envelope.sustain;
+    fields->release = patch->envelope.release;
+    fields->envelope_amplitude = patch->envelope.amplitude;
+    fields->lfo_enabled = patch->synth.lfo_enabled;
+    fields->osc2_sync_enabled = patch->synth.osc2_sync_enabled;
+    fields->noise_amplitude = patch->synth.noise_amplitude;
+    fields->lfo_sync = patch->synth.lfo_sync;
+    fields->tuning = patch->synth.tuning;
+}
+
+size_t preset_encode(const synth_patch_t *patch, uint8_t *data)
+{
+    preset_record_t record = {
+        .header = {
+            .magic = PRESET_MAGIC,
+            .version = PRESET_VERSION,
+            .length = sizeof(preset_fields_t),
+        },
+    };
+
+    preset_to_fields(&record.fields, patch);
+    record.header.crc = esp_crc32_le(0, (const uint8_t *) &record.fields, sizeof(record.fields));
+    memcpy(data, &record, sizeof(record));
+
+    return sizeof(record);
+}
+
+static int preset_validate(const preset_fields_t *fields, synth_patch_t *patch)
+{
+    synth_patch_t decoded;
+
+    preset_from_fields(&decoded, fields);
+    if(!synth_patch_is_valid(&decoded)) {
+        ESP_LOGE(TAG, "Preset out of range");
+        return -1;
+    }
+
+    *patch = decoded;
+    return 0;
+}
+
+/* the fields of a file of the first version; waveforms that do not fit the
+ * field are made invalid, so that they are not truncated into valid ones
+ */
+static void preset_legacy_to_fields(preset_fields_t *fields, const preset_legacy_t *legacy)
+{
+    fields->osc1_amplitude = legacy->osc1_amplitude;
+    fields->osc1_frequency = legacy->osc1_frequency;
+    fields->osc1_waveform = MIN(legacy->osc1_waveform, UINT8_MAX);
+    fields->osc2_amplitude = legacy->osc2_amplitude;
+    fields->osc2_frequency = legacy->osc2_frequency;
+    fields->osc2_waveform = MIN(legacy->osc2_waveform, UINT8_MAX);
+    fields->lfo_amplitude = legacy->lfo_amplitude;
+    fields->lfo_frequency = legacy->lfo_frequency;
+    fields->lfo_waveform = MIN(legacy->lfo_waveform, UINT8_MAX);
+    fields->attack = legacy->attack;
+    fields->decay = legacy->decay;
+    fields->sustain = legacy->sustain;
+    fields->release = legacy->release;
+    fields->envelope_amplitude = legacy->envelope_amplitude;
+    fields->lfo_enabled = legacy->lfo_enabled;
+    fields->osc2_sync_enabled = legacy->osc2_sync_enabled;
+    fields->noise_amplitude = legacy->noise_amplitude;
+}
+
+/* Both a record and a file of the first version only give a patch if all of
+ * its parameters are in range (see synth_patch_is_valid()).
+ */
+int preset_decode(const uint8_t *data, size_t size, synth_patch_t *patch)
+{
+    preset_header_t header;
+    preset_fields_t fields = m_defaults;
+    preset_legacy_t legacy;
+
+    if(size < sizeof(header)) {
+        ESP_LOGE(TAG, "Truncated preset: %u bytes", size);
+        return -1;
+    }
+    memcpy(&header, data, sizeof(header));
+
+    if(header.magic != PRESET_MAGIC) {
+        if(size != sizeof(legacy)) {
+            ESP_LOGE(TAG, "Invalid preset");
+            return -1;
+        }
+        memcpy(&legacy, data, sizeof(legacy));
+        preset_legacy_to_fields(&fields, &legacy);
+        return preset_validate(&fields, patch);
+    }
+
+    if(header.version > PRESET_VERSION) {
+        ESP_LOGE(TAG, "Unsupported preset version: %d", header.version);
+        return -1;
+    }
+
+    if(size != sizeof(header) + header.length) {
+        ESP_LOGE(TAG, "Invalid preset length: %u bytes, expected %u", size, sizeof(header) + header.length);
+        return -1;
+    }
+
+    if(esp_crc32_le(0, &data[sizeof(header)], header.length) != header.crc) {
+        ESP_LOGE(TAG, "Invalid preset CRC");
+        return -1;
+    }
+
+    memcpy(&fields, &data[sizeof(header)], MIN(header.length, sizeof(fields)));
+
+    return preset_validate(&fields, patch);
+}
+
+static int preset_check(const uint8_t *data, size_t size, void *context)
+{
+    return preset_decode(data, size, (synth_patch_t *) context);
+}
+
+static int preset_load(int index, synth_patch_t *patch)
+{
+    char name[PRESET_NAME_LENGTH];
+    uint8_t data[PRESET_MAX_RECORD_SIZE + 1];
+
+    snprintf(name, sizeof(name), "PRESET%d", index);
+
+    /* one more byte than the largest record, to detect files that are too long */
+    if(storage_read(name, data, sizeof(data), preset_check, patch) != 0) {
+        ESP_LOGE(TAG, "Failed to read %s", name);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* presets that were never saved come from the asset bundle, if it has them */
+static int preset_load_factory(int index, synth_patch_t *patch)
+{
+    const uint8_t *data;
+    size_t size;
+
+    data = assets_find(ASSET_PRESET, index, &size);
+    if(data == NULL)
+        return -1;
+
+    ESP_LOGI(TAG, "Factory preset %d", index);
+
+    return preset_decode(data, size, patch);
+}
+
+/* the record is written with storage_write(), so that a preset is never lost
+ * half written
+ */
+static int preset_store(int index, const synth_patch_t *patch)
+{
+    char name[PRESET_NAME_LENGTH];
+    uint8_t data[PRESET_MAX_RECORD_SIZE];
+    size_t size;
+
+    size = preset_encode(patch, data);
+
+    snprintf(name, sizeof(name), "PRESET%d", index);
+
+    return storage_write(name, data, size);
+}
+
+/* writes the presets, patterns and the controller map that were saved since
+ * the last time, so that saving never blocks the MIDI task on the storage
+ */
+static void preset_task(void *pvParameters)
+{
+    synth_patch_t patch;
+    uint32_t pending;
+
+    for(;;) {
+        xTaskNotifyWait(0, UINT32_MAX, &pending, portMAX_DELAY);
+
+        for(int i = 0; i < PRESET_COUNT; i++) {
+            if(pending & PRESET_PENDING_PATCH(i)) {
+                portENTER_CRITICAL(&m_bank_lock);
+                patch = m_bank[i];
+                portEXIT_CRITICAL(&m_bank_lock);
+                preset_store(i, &patch);
+            }
+            if(pending & PRESET_PENDING_PATTERN(i))
+                sequencer_write(i);
+        }
+
+        if(pending & PRESET_PENDING_CC_MAP)
+            midi_learn_write();
+    }
+}
+
+int preset_read(int index, synth_patch_t *patch)
+{
+    int stored;
+
+    portENTER_CRITICAL(&m_bank_lock);
+    stored = m_bank_stored[index];
+    if(stored)
+        *patch = m_bank[index];
+    portEXIT_CRITICAL(&m_bank_lock);
+
+    return stored ? 0 : -1;
+}
+
+int preset_write(int index, const synth_patch_t *patch)
+{
+    portENTER_CRITICAL(&m_bank_lock);
+    m_bank[index] = *patch;
+    m_bank_stored[index] = 1;
+    portEXIT_CRITICAL(&m_bank_lock);
+
+    xTaskNotify(m_task, PRESET_PENDING_PATCH(index), eSetBits);
+
+    return 0;
+}
+
+void preset_write_cc_map(void)
+{
+    xTaskNotify(m_task, PRESET_PENDING_CC_MAP, eSetBits);
+}
+
 void preset_select(int index)
 {
-    char *filename;
-    FILE *f;
-    size_t bytes_read = 0;
+    int64_t start_us;
 
     if(index == current_preset_index)
        return;
 
-    current_preset_index = index;
-
-    /* try to load preset from storage */
-    asprintf(&filename, "/spiffs/PRESET%d", index);
-    f = fopen(filename, "r");
-    free(filename);
-    if (f == NULL) {
-        ESP_LOGE(TAG, "Failed to open file for reading");
-        return;
-    }
+    start_us = esp_timer_get_time();
 
-    bytes_read += fread(&osc1_params, 1, sizeof(oscillator_params_t), f);
-    bytes_read += fread(&osc2_params, 1, sizeof(oscillator_params_t), f);
-    bytes_read += fread(&lfo_params, 1, sizeof(oscillator_params_t), f);
-    bytes_read += fread(&envelope_params, 1, sizeof(envelope_params_t), f);
-    bytes_read += fread(&synth_params, 1, sizeof(synth_params_t), f);
+    current_preset_index = index;
 
-    ESP_LOGI(TAG, "%u bytes read from PRESET%d", bytes_read, index);
+    /* the pattern belongs to the preset */
+    sequencer_load(index);
 
-    synth_update(&osc1_params, &osc2_params, &lfo_params, &envelope_params, &synth_params);
+    /* presets that were never saved leave the patch as it is */
+    if(preset_read(index, &patch) == 0)
+        synth_update(&patch.osc1, &patch.osc2, &patch.lfo, &patch.envelope, &patch.synth);
 
-    fclose(f);
+    logger_log(LOG_PRESET_SELECT, index, (uint32_t) (esp_timer_get_time() - start_us));
 }
 
-void preset_save(void)
+void preset_set_morph_target(int index)
 {
-    char *filename;
-    FILE *f;
-    size_t bytes_written = 0;
+    synth_patch_t target;
 
-    asprintf(&filename, "/spiffs/PRESET%d", current_preset_index);
-    f = fopen(filename, "w");
-    free(filename);
-    if (f == NULL) {
-        ESP_LOGE(TAG, "Failed to open file for writing");
+    if(preset_read(index, &target) != 0) {
+        ESP_LOGW(TAG, "No preset %d to morph to", index);
         return;
     }
 
-    synth_get_params(&osc1_params, &osc2_params, &lfo_params, &envelope_params, &synth_params);
+    m_morph_target[synth_get_selected_part()] = index;
+    synth_set_morph_target(&target);
+}
+
+int preset_get_morph_target(void)
+{
+    return m_morph_target[synth_get_selected_part()];
+}
 
-    bytes_written += fwrite(&osc1_params, 1, sizeof(oscillator_params_t), f);
-    bytes_written += fwrite(&osc2_params, 1, sizeof(oscillator_params_t), f);
-    bytes_written += fwrite(&lfo_params, 1, sizeof(oscillator_params_t), f);
-    bytes_written += fwrite(&envelope_params, 1, sizeof(envelope_params_t), f);
-    bytes_written += fwrite(&synth_params, 1, sizeof(synth_params_t), f);
+void preset_save(void)
+{
+    synth_get_patch(&patch);
+    sequencer_save(current_preset_index);
+    xTaskNotify(m_task, PRESET_PENDING_PATTERN(current_preset_index), eSetBits);
+    preset_write(current_preset_index, &patch);
+}
 
-    ESP_LOGI(TAG, "%u bytes written to PRESET%d", bytes_written, current_preset_index);
+void preset_init(void)
+{
+    for(int i = 0; i < PRESET_COUNT; i++) {
+        m_bank_stored[i] = (preset_load(i, &m_bank[i]) == 0) || (preset_load_factory(i, &m_bank[i]) == 0);
+    }
 
-    fclose(f);
-}
\ No newline at end of file
+    xTaskCreatePinnedToCore(preset_task, "preset_task", 3072, NULL, 0, &m_task, 0);
+}
@@ -1,14 +1,63 @@
 #ifndef PRESET_H
 #define PRESET_H
 
+#include <stddef.h>
+
+#include "synth.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#define PRESET_COUNT        (7)
+
+/* largest preset record that is read, a few bytes more than the current one */
+#define PRESET_MAX_RECORD_SIZE  (128)
+
+/* reads all presets into RAM and starts the task that writes saved presets
+ * back to storage
+ */
+void preset_init(void);
+
 void preset_select(int index);
 void preset_save(void);
 int preset_get_current_index(void);
 
+/* makes a preset the current one without changing the patch (which may have
+ * been edited), for restoring the last session before preset_init()
+ */
+void preset_set_current_index(int index);
+
+/* set and get the preset that the selected part morphs towards (see
+ * synth_set_morph()); the preset is copied, saving it again does not change the
+ * target
+ */
+void preset_set_morph_target(int index);
+int preset_get_morph_target(void);
+
+/* read and write a preset without selecting it; preset_read() returns -1 if
+ * there is no (valid) preset at that index, in which case patch is not changed;
+ * preset_write() returns immediately, the preset is written to storage in the
+ * background
+ */
+int preset_read(int index, synth_patch_t *patch);
+int preset_write(int index, const synth_patch_t *patch);
+
+/* returns immediately, the controller map is written by the same background
+ * task (see midi_learn_write())
+ */
+void preset_write_cc_map(void);
+
+/* Presets are stored and sent via SysEx as a versioned, CRC-checked record (see
+ * preset.c), independent of the layout of synth_patch_t. preset_encode()
+ * writes the record of a patch to data (PRESET_MAX_RECORD_SIZE bytes) and
+ * returns its size. preset_decode() extracts the patch from a record (or from
+ * a file of the first version), returns -1 if the record is not valid or a
+ * parameter is out of range, in which case patch is not changed.
+ */
+size_t preset_encode(const synth_patch_t *patch, uint8_t *data);
+int preset_decode(const uint8_t *data, size_t size, synth_patch_t *patch);
+
 #ifdef __cplusplus
 }
 #endif
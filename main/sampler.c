@@ -0,0 +1,329 @@
+#include "sampler.h"
+#include "synth.h"
+#include "tables.h"
+#include "assets.h"
+#include "logger.h"
+
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+
+static const char *TAG = "SAMPLER";
+
+/* A sample asset is a header followed by the frames (mono, int16_t), both
+ * little-endian. The header is 24 bytes, so that the frames are aligned like
+ * the asset. The layout is the same in assets.py.
+ */
+#define SAMPLER_MAGIC           (0x4d53)    // "SM"
+#define SAMPLER_FLAG_LOOP       (0x01)
+
+typedef struct __attribute__((packed)) {
+    uint16_t magic;
+    uint8_t root_key;
+    uint8_t flags;
+    uint8_t low_key;        // range of keys the zone is played for
+    uint8_t high_key;
+    uint16_t reserved;
+    uint32_t sampling_freq;
+    uint32_t frames;
+    uint32_t loop_start;    // in frames, the loop end is exclusive
+    uint32_t loop_end;
+} sampler_header_t;
+
+_Static_assert(sizeof(sampler_header_t) % 4 == 0, "the frames have to stay aligned");
+
+#define SAMPLER_STEP_BITS       (16)        // fractional bits of the playback position
+#define SAMPLER_MAX_STEP        (SAMPLER_MAX_RATIO << SAMPLER_STEP_BITS)
+#define SAMPLER_ENDLESS         (UINT32_MAX)
+
+_Static_assert(SAMPLER_MAX_RATIO * SYNTH_SAMPLING_FREQ / 100 < SAMPLER_RING_FRAMES,
+                "a block has to fit into the ring");
+_Static_assert(SAMPLER_MAX_RATIO * SYNTH_SAMPLING_FREQ / 100 < SAMPLER_HEAD_FRAMES,
+                "the head has to last until the ring is filled");
+
+typedef struct {
+    const int16_t *frames;  // in the asset bundle, i.e. in flash
+    uint32_t loop_start;
+    uint32_t loop_end;
+    uint32_t end;           // of the stream, SAMPLER_ENDLESS if it loops
+    uint8_t low_key;
+    uint8_t high_key;
+    float step_scale;       // playback step (with SAMPLER_STEP_BITS) per phase increment
+} sampler_zone_t;
+
+/* The stream of a voice is the zone's frames in the order they are played, i.e.
+ * with the loop unrolled; frame i of the stream is in the head for
+ * i < SAMPLER_HEAD_FRAMES, otherwise in the ring.
+ */
+typedef struct {
+    const sampler_zone_t *zone;     // NULL if the voice does not play a sample
+    const int16_t *head;
+    int16_t ring[SAMPLER_RING_FRAMES];
+    /* only changed by the render loop; position is read by the streaming task to
+     * know how far it can fill the ring
+     */
+    uint32_t position;
+    uint32_t fraction;
+    /* frames 0 ... filled - 1 of the stream can be read; only changed under
+     * m_stream_lock, by the render loop when it starts a stream and by the
+     * streaming task if the stream was not restarted in the meantime
+     */
+    uint32_t filled;
+    uint32_t generation;
+} sampler_stream_t;
+
+static sampler_zone_t m_zones[SAMPLER_ZONE_COUNT];
+static int16_t m_heads[SAMPLER_ZONE_COUNT][SAMPLER_HEAD_FRAMES];
+static int m_zone_count;
+
+static sampler_stream_t m_streams[SYNTH_VOICE_COUNT];
+static portMUX_TYPE m_stream_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t m_task;
+
+/* frames the render loop had to skip because the stream was not filled in time */
+static uint32_t m_underruns;
+
+/* returns the zone frame of a stream frame, and the number of frames that
+ * follow it without a jump
+ */
+static uint32_t sampler_zone_frame(const sampler_zone_t *zone, uint32_t index, uint32_t *run)
+{
+    uint32_t length = zone->loop_end - zone->loop_start;
+
+    if((zone->end != SAMPLER_ENDLESS) || (index < zone->loop_end)) {
+        *run = ((zone->end != SAMPLER_ENDLESS) ? zone->end : zone->loop_end) - index;
+        return index;
+    }
+
+    index = zone->loop_start + (index - zone->loop_start) % length;
+    *run = zone->loop_end - index;
+    return index;
+}
+
+/* copies the stream frames start ... end - 1 of a zone (in runs between the
+ * loop jumps) into a buffer of size frames, at index modulo size
+ */
+static void sampler_copy(const sampler_zone_t *zone, int16_t *buffer, uint32_t size, uint32_t start, uint32_t end)
+{
+    uint32_t source;
+    uint32_t slot;
+    uint32_t count;
+    uint32_t run;
+
+    while(start < end) {
+        source = sampler_zone_frame(zone, start, &run);
+        slot = start & (size - 1);
+        count = MIN(MIN(end - start, run), size - slot);
+        memcpy(&buffer[slot], &zone->frames[source], count * sizeof(int16_t));
+        start += count;
+    }
+}
+
+/* checks a sample asset and sets up its zone */
+static int sampler_load_zone(sampler_zone_t *zone, int16_t *head, const uint8_t *data, size_t size)
+{
+    sampler_header_t header;
+
+    if(size < sizeof(header)) {
+        ESP_LOGE(TAG, "Truncated sample");
+        return -1;
+    }
+    memcpy(&header, data, sizeof(header));
+
+    if(header.magic != SAMPLER_MAGIC) {
+        ESP_LOGE(TAG, "Invalid sample");
+        return -1;
+    }
+    if((header.frames < 2) || (header.frames > (size - sizeof(header)) / sizeof(int16_t))
+            || (header.low_key > header.high_key) || (header.root_key >= NOTE_COUNT)
+            || (header.sampling_freq == 0)) {
+        ESP_LOGE(TAG, "Invalid sample header");
+        return -1;
+    }
+    if((header.flags & SAMPLER_FLAG_LOOP)
+            && ((header.loop_start >= header.loop_end) || (header.loop_end > header.frames))) {
+        ESP_LOGE(TAG, "Invalid sample loop: %u ... %u", header.loop_start, header.loop_end);
+        return -1;
+    }
+
+    zone->frames = (const int16_t *) &data[sizeof(header)];
+    zone->loop_start = header.loop_start;
+    zone->loop_end = header.loop_end;
+    zone->end = (header.flags & SAMPLER_FLAG_LOOP) ? SAMPLER_ENDLESS : header.frames;
+    zone->low_key = header.low_key;
+    zone->high_key = header.high_key;
+    /* the root key is played at the sample's own rate */
+    zone->step_scale = (float) (1 << SAMPLER_STEP_BITS) * header.sampling_freq / SYNTH_SAMPLING_FREQ
+                        / note_phase_increments[header.root_key];
+
+    sampler_copy(zone, head, SAMPLER_HEAD_FRAMES, 0, MIN(zone->end, SAMPLER_HEAD_FRAMES));
+
+    return 0;
+}
+
+/* fills the ring of a stream up to SAMPLER_RING_FRAMES frames ahead of the
+ * render loop; the frames are copied outside of the lock, they are only
+ * published if the stream was not restarted in the meantime
+ */
+static void sampler_fill(sampler_stream_t *stream)
+{
+    const sampler_zone_t *zone;
+    uint32_t generation;
+    uint32_t filled;
+    uint32_t limit;
+
+    portENTER_CRITICAL(&m_stream_lock);
+    zone = stream->zone;
+    generation = stream->generation;
+    filled = stream->filled;
+    limit = stream->position + SAMPLER_RING_FRAMES;
+    portEXIT_CRITICAL(&m_stream_lock);
+
+    if(zone == NULL)
+        return;
+
+    limit = MIN(limit, zone->end);
+    if(filled >= limit)
+        return;
+
+    sampler_copy(zone, stream->ring, SAMPLER_RING_FRAMES, filled, limit);
+
+    portENTER_CRITICAL(&m_stream_lock);
+    if(stream->generation == generation)
+        stream->filled = limit;
+    portEXIT_CRITICAL(&m_stream_lock);
+}
+
+static void sampler_task(void *pvParameters)
+{
+    uint32_t underruns = 0;
+
+    for(;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        for(int i = 0; i < SYNTH_VOICE_COUNT; i++)
+            sampler_fill(&m_streams[i]);
+
+        if(m_underruns != underruns) {
+            logger_log(LOG_SAMPLE_UNDERRUN, m_underruns - underruns);
+            underruns = m_underruns;
+        }
+    }
+}
+
+void sampler_init(void)
+{
+    const void *data;
+    size_t size;
+
+    for(int i = 0; i < SAMPLER_ZONE_COUNT; i++) {
+        data = assets_find(ASSET_SAMPLE, i, &size);
+        if(data == NULL)
+            break;
+        if(sampler_load_zone(&m_zones[m_zone_count], m_heads[m_zone_count], data, size) != 0)
+            continue;
+        m_zone_count++;
+    }
+
+    if(m_zone_count == 0)
+        return;
+
+    ESP_LOGI(TAG, "%d zones", m_zone_count);
+
+    /* above the other tasks on this core, it only copies a few kB per block */
+    xTaskCreatePinnedToCore(sampler_task, "sampler_task", 3072, NULL, 2, &m_task, 0);
+}
+
+void sampler_start(uint8_t voice, uint8_t key)
+{
+    sampler_stream_t *stream = &m_streams[voice];
+    const sampler_zone_t *zone = NULL;
+
+    for(int i = 0; i < m_zone_count; i++) {
+        if((key >= m_zones[i].low_key) && (key <= m_zones[i].high_key)) {
+            zone = &m_zones[i];
+            break;
+        }
+    }
+
+    portENTER_CRITICAL(&m_stream_lock);
+    stream->zone = zone;
+    stream->head = (zone != NULL) ? m_heads[zone - m_zones] : NULL;
+    stream->position = 0;
+    stream->fraction = 0;
+    stream->filled = (zone != NULL) ? MIN(zone->end, SAMPLER_HEAD_FRAMES) : 0;
+    stream->generation++;
+    portEXIT_CRITICAL(&m_stream_lock);
+}
+
+void sampler_stop(uint8_t voice)
+{
+    sampler_stream_t *stream = &m_streams[voice];
+
+    if(stream->zone == NULL)
+        return;
+
+    portENTER_CRITICAL(&m_stream_lock);
+    stream->zone = NULL;
+    stream->generation++;
+    portEXIT_CRITICAL(&m_stream_lock);
+}
+
+static inline int16_t sampler_frame(const sampler_stream_t *stream, uint32_t index)
+{
+    return (index < SAMPLER_HEAD_FRAMES) ? stream->head[index] : stream->ring[index & (SAMPLER_RING_FRAMES - 1)];
+}
+
+/* linear interpolation between the two frames around the position */
+int sampler_read(uint8_t voice, uint32_t increment, float *values, int count)
+{
+    sampler_stream_t *stream = &m_streams[voice];
+    const sampler_zone_t *zone = stream->zone;
+    uint32_t filled = stream->filled;
+    uint32_t position = stream->position;
+    uint32_t fraction = stream->fraction;
+    uint32_t step;
+    float a;
+    float b;
+    int i;
+
+    if(zone == NULL) {
+        memset(values, 0, count * sizeof(float));
+        return 0;
+    }
+
+    step = MIN((uint32_t) (increment * zone->step_scale), SAMPLER_MAX_STEP);
+
+    for(i = 0; (i < count) && (position + 1 < filled); i++) {
+        a = sampler_frame(stream, position);
+        b = sampler_frame(stream, position + 1);
+        values[i] = (a + (b - a) * fraction * (1.0f / (1 << SAMPLER_STEP_BITS))) * (1.0f / 32768.0f);
+
+        fraction += step;
+        position += fraction >> SAMPLER_STEP_BITS;
+        fraction &= (1 << SAMPLER_STEP_BITS) - 1;
+    }
+    stream->position = position;
+    stream->fraction = fraction;
+
+    /* the rest is silent, either because the sample ended or because the ring
+     * was not filled in time
+     */
+    if(i < count) {
+        memset(&values[i], 0, (count - i) * sizeof(float));
+        if(position + 1 < zone->end)
+            m_underruns += count - i;
+    }
+
+    return (position + 1 >= zone->end) ? -1 : 0;
+}
+
+void sampler_refill(void)
+{
+    if(m_task != NULL)
+        xTaskNotifyGive(m_task);
+}
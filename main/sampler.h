@@ -0,0 +1,48 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Plays the multisample in the asset bundle (ASSET_SAMPLE 0, 1, ... see
+ * sampler.c for the format) as OSC1 of patches with WAVEFORM_SAMPLE. Each zone
+ * covers a key range and is pitched from its root key.
+ *
+ * The samples stay in flash. Each voice has a stream that plays one zone: the
+ * first SAMPLER_HEAD_FRAMES of every zone are copied into RAM once, so that a
+ * note can start at once, the rest is copied ahead of the playback position
+ * into a small ring per voice by a streaming task, after every block. The
+ * render loop only reads the RAM copies.
+ */
+#define SAMPLER_ZONE_COUNT      (8)
+#define SAMPLER_HEAD_FRAMES     (1024)
+#define SAMPLER_RING_FRAMES     (1024)      // a power of 2
+
+/* Playback is limited to one octave above the root key (at the synth's
+ * sampling rate), so that a block never reads more than the ring holds.
+ */
+#define SAMPLER_MAX_RATIO       (2)
+
+/* reads the zones from the asset bundle and starts the streaming task */
+void sampler_init(void);
+
+/* Called by the render loop. sampler_start() starts the stream of a voice with
+ * the zone of key (the voice is silent if no zone covers the key).
+ * sampler_read() reads count values (-1.0 ... 1.0) for the voice's
+ * (modulated) OSC1 phase increment, see tables.h; returns -1 once a sample
+ * that does not loop has ended. sampler_refill() lets the streaming task
+ * refill the rings, once a block has been rendered.
+ */
+void sampler_start(uint8_t voice, uint8_t key);
+void sampler_stop(uint8_t voice);
+int sampler_read(uint8_t voice, uint32_t increment, float *values, int count);
+void sampler_refill(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SAMPLER_H
@@ -0,0 +1,318 @@
+#include "sequencer.h"
+#include "synth.h"
+#include "tempo.h"
+#include "midi_input.h"
+#include "midi_parser.h"
+#include "preset.h"
+#include "storage.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "esp_log.h"
+#include "esp_crc.h"
+
+static const char *TAG = "SEQUENCER";
+
+#define SEQUENCER_DEFAULT_TEMPO     (120.0)
+#define SEQUENCER_DEFAULT_LENGTH    (16)
+#define SEQUENCER_TICKS_PER_STEP    (TEMPO_PPQN / 4)
+#define SEQUENCER_RECORD_GATE       (SEQUENCER_GATE_STEP / 2)
+#define SEQUENCER_NAME_LENGTH       (16)
+
+/* Patterns are stored as a record like the presets (see preset.c), with a
+ * 16-bit length as a pattern is larger than 255 bytes:
+ *
+ *     magic (2 bytes) | version (1) | reserved (1) | length (2) | CRC-32 of the pattern (4) | pattern
+ *
+ * The pattern is all bytes except for the tempo, so its layout is the same on
+ * any compiler. The version is bumped if it changes.
+ */
+#define SEQUENCER_MAGIC             (0x5153)    // "SQ"
+#define SEQUENCER_VERSION           (1)
+
+typedef struct __attribute__((packed)) {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t reserved;
+    uint16_t length;        // of the pattern
+    uint32_t crc;
+} sequencer_header_t;
+
+typedef struct __attribute__((packed)) {
+    sequencer_header_t header;
+    sequencer_pattern_t pattern;
+} sequencer_record_t;
+
+_Static_assert(sizeof(sequencer_pattern_t) == sizeof(float) + SEQUENCER_TRACK_COUNT * sizeof(sequencer_track_t),
+                "the pattern must not have padding");
+
+/* The pattern is edited by the MIDI task and read by the render loop. Steps
+ * are copied under the lock before they are played, so an edit is never seen
+ * half done.
+ */
+static sequencer_pattern_t m_pattern;
+static portMUX_TYPE m_pattern_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/* the patterns of all presets, loaded at boot so that switching presets does
+ * not touch the storage; also protected by the lock
+ */
+static sequencer_pattern_t m_bank[PRESET_COUNT];
+
+static volatile uint8_t m_playing;
+static volatile uint8_t m_recording;
+static uint8_t m_record_step;
+
+/* only used by the render loop */
+static tempo_steps_t m_steps;
+
+static void sequencer_clear(sequencer_pattern_t *pattern)
+{
+    memset(pattern, 0, sizeof(sequencer_pattern_t));
+    pattern->tempo = SEQUENCER_DEFAULT_TEMPO;
+    for(int i = 0; i < SEQUENCER_TRACK_COUNT; i++) {
+        pattern->tracks[i].channel = i;
+        for(int j = 0; j < SEQUENCER_MAX_STEPS; j++) {
+            pattern->tracks[i].steps[j].gate = SEQUENCER_GATE_STEP;
+            pattern->tracks[i].steps[j].cc = SEQUENCER_NO_CC;
+        }
+    }
+    pattern->tracks[0].length = SEQUENCER_DEFAULT_LENGTH;
+}
+
+void sequencer_set_playing(uint8_t playing)
+{
+    m_playing = playing;
+}
+
+uint8_t sequencer_is_playing(void)
+{
+    return m_playing;
+}
+
+/* A tempo outside of the range would make the steps of the internal clock
+ * (almost) endless, e.g. from a corrupt file. NaN fails both comparisons.
+ */
+static float sequencer_clamp_tempo(float bpm)
+{
+    if(isnan(bpm))
+        return SEQUENCER_DEFAULT_TEMPO;
+    if(bpm < TEMPO_BPM_MIN)
+        return TEMPO_BPM_MIN;
+    if(bpm > TEMPO_BPM_MAX)
+        return TEMPO_BPM_MAX;
+    return bpm;
+}
+
+void sequencer_set_tempo(float bpm)
+{
+    m_pattern.tempo = sequencer_clamp_tempo(bpm);
+}
+
+float sequencer_get_tempo(void)
+{
+    return m_pattern.tempo;
+}
+
+void sequencer_set_record(uint8_t record)
+{
+    m_record_step = 0;
+    m_recording = record;
+}
+
+uint8_t sequencer_is_recording(void)
+{
+    return m_recording;
+}
+
+void sequencer_record_note(uint8_t key, uint8_t velocity)
+{
+    sequencer_step_t *step;
+
+    if(!m_recording)
+        return;
+
+    portENTER_CRITICAL(&m_pattern_lock);
+    step = &m_pattern.tracks[0].steps[m_record_step];
+    step->note = key;
+    step->velocity = velocity;
+    step->gate = SEQUENCER_RECORD_GATE;
+    if(++m_record_step >= m_pattern.tracks[0].length)
+        m_record_step = 0;
+    portEXIT_CRITICAL(&m_pattern_lock);
+}
+
+void sequencer_get_track(int index, sequencer_track_t *track)
+{
+    portENTER_CRITICAL(&m_pattern_lock);
+    *track = m_pattern.tracks[index];
+    portEXIT_CRITICAL(&m_pattern_lock);
+}
+
+void sequencer_set_track(int index, const sequencer_track_t *track)
+{
+    portENTER_CRITICAL(&m_pattern_lock);
+    m_pattern.tracks[index] = *track;
+    if(m_pattern.tracks[index].length > SEQUENCER_MAX_STEPS)
+        m_pattern.tracks[index].length = SEQUENCER_MAX_STEPS;
+    portEXIT_CRITICAL(&m_pattern_lock);
+}
+
+/* checks a record and extracts the pattern from it */
+static int sequencer_decode(const uint8_t *data, size_t size, void *context)
+{
+    sequencer_pattern_t *pattern = context;
+    sequencer_header_t header;
+
+    if(size < sizeof(header)) {
+        ESP_LOGE(TAG, "Truncated pattern: %u bytes", size);
+        return -1;
+    }
+    memcpy(&header, data, sizeof(header));
+
+    if(header.magic != SEQUENCER_MAGIC) {
+        ESP_LOGE(TAG, "Invalid pattern");
+        return -1;
+    }
+    if(header.version != SEQUENCER_VERSION) {
+        ESP_LOGE(TAG, "Unsupported pattern version: %d", header.version);
+        return -1;
+    }
+    if((header.length != sizeof(sequencer_pattern_t)) || (size != sizeof(header) + header.length)) {
+        ESP_LOGE(TAG, "Invalid pattern length: %u bytes", size);
+        return -1;
+    }
+    if(esp_crc32_le(0, &data[sizeof(header)], header.length) != header.crc) {
+        ESP_LOGE(TAG, "Invalid pattern CRC");
+        return -1;
+    }
+    memcpy(pattern, &data[sizeof(header)], sizeof(sequencer_pattern_t));
+
+    pattern->tempo = sequencer_clamp_tempo(pattern->tempo);
+    for(int i = 0; i < SEQUENCER_TRACK_COUNT; i++) {
+        if(pattern->tracks[i].length > SEQUENCER_MAX_STEPS)
+            pattern->tracks[i].length = SEQUENCER_MAX_STEPS;
+    }
+
+    return 0;
+}
+
+/* presets without a pattern start with an empty one */
+static void sequencer_read(int index, sequencer_pattern_t *pattern)
+{
+    static uint8_t data[sizeof(sequencer_record_t) + 1];
+    char name[SEQUENCER_NAME_LENGTH];
+
+    snprintf(name, sizeof(name), "PATTERN%d", index);
+
+    /* one more byte than the record, to detect files that are too long */
+    if(storage_read(name, data, sizeof(data), sequencer_decode, pattern) != 0)
+        sequencer_clear(pattern);
+}
+
+int sequencer_load(int index)
+{
+    portENTER_CRITICAL(&m_pattern_lock);
+    m_pattern = m_bank[index];
+    portEXIT_CRITICAL(&m_pattern_lock);
+
+    return 0;
+}
+
+int sequencer_save(int index)
+{
+    portENTER_CRITICAL(&m_pattern_lock);
+    m_bank[index] = m_pattern;
+    portEXIT_CRITICAL(&m_pattern_lock);
+
+    return 0;
+}
+
+int sequencer_write(int index)
+{
+    static sequencer_record_t record = {
+        .header = {
+            .magic = SEQUENCER_MAGIC,
+            .version = SEQUENCER_VERSION,
+            .length = sizeof(sequencer_pattern_t),
+        },
+    };
+    char name[SEQUENCER_NAME_LENGTH];
+
+    portENTER_CRITICAL(&m_pattern_lock);
+    record.pattern = m_bank[index];
+    portEXIT_CRITICAL(&m_pattern_lock);
+
+    record.header.crc = esp_crc32_le(0, (const uint8_t *) &record.pattern, sizeof(record.pattern));
+
+    snprintf(name, sizeof(name), "PATTERN%d", index);
+
+    return storage_write(name, &record, sizeof(record));
+}
+
+/* Schedules the notes of the given step on all tracks, each on its own channel
+ * (i.e. part of the synth). The notes go through the synth's event queue like
+ * live notes, so they are placed at their exact sample. Controller locks are sent through the MIDI task instead and take
+ * effect at the next control block, like a knob movement would.
+ */
+static void sequencer_play_step(int32_t step, uint32_t sample, float samples_per_step)
+{
+    sequencer_track_t *track;
+    sequencer_step_t steps[SEQUENCER_TRACK_COUNT];
+    uint8_t lengths[SEQUENCER_TRACK_COUNT];
+    uint8_t channels[SEQUENCER_TRACK_COUNT];
+    midi_message_t message = {
+        .length = 2,
+    };
+
+    portENTER_CRITICAL(&m_pattern_lock);
+    for(int i = 0; i < SEQUENCER_TRACK_COUNT; i++) {
+        track = &m_pattern.tracks[i];
+        lengths[i] = track->length;
+        channels[i] = track->channel;
+        if(track->length > 0)
+            steps[i] = track->steps[step % track->length];
+    }
+    portEXIT_CRITICAL(&m_pattern_lock);
+
+    for(int i = 0; i < SEQUENCER_TRACK_COUNT; i++) {
+        if(lengths[i] == 0)
+            continue;
+
+        if(steps[i].velocity > 0) {
+            synth_schedule_key_press(sample, channels[i], steps[i].note, steps[i].velocity);
+            synth_schedule_key_release(sample + (uint32_t) (steps[i].gate * samples_per_step / SEQUENCER_GATE_STEP),
+                                        channels[i], steps[i].note);
+        }
+
+        if(steps[i].cc < 0x80) {
+            message.status = MIDI_SB_CONTROL_CHANGE | (channels[i] & 0x0f);
+            message.data[0] = steps[i].cc;
+            message.data[1] = steps[i].cc_value & 0x7f;
+            midi_inject(&message, sample, 0);
+        }
+    }
+}
+
+void sequencer_process_block(uint32_t block_start, uint32_t block_size)
+{
+    if(!m_playing) {
+        tempo_steps_stop(&m_steps);
+        return;
+    }
+
+    tempo_steps_process(&m_steps, block_start, block_size, m_pattern.tempo, SEQUENCER_TICKS_PER_STEP,
+                        sequencer_play_step);
+}
+
+void sequencer_init(void)
+{
+    for(int i = 0; i < PRESET_COUNT; i++) {
+        sequencer_read(i, &m_bank[i]);
+    }
+
+    sequencer_load(preset_get_current_index());
+}
@@ -0,0 +1,70 @@
+#ifndef SEQUENCER_H
+#define SEQUENCER_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SEQUENCER_TRACK_COUNT       (4)
+#define SEQUENCER_MAX_STEPS         (32)
+#define SEQUENCER_NO_CC             (0xff)
+#define SEQUENCER_GATE_STEP         (16)    // gate length of one full step
+
+/* steps are sixteenth notes */
+typedef struct {
+    uint8_t note;
+    uint8_t velocity;       // 0 for a rest
+    uint8_t gate;           // note length in 1/16 steps (values above 16 tie into the next steps)
+    uint8_t cc;             // controller locked on this step, SEQUENCER_NO_CC if none
+    uint8_t cc_value;
+} sequencer_step_t;
+
+typedef struct {
+    uint8_t channel;        // MIDI channel (0-15) of the notes and controller locks
+    uint8_t length;         // 16 or 32 steps, 0 if the track is not used
+    sequencer_step_t steps[SEQUENCER_MAX_STEPS];
+} sequencer_track_t;
+
+typedef struct {
+    float tempo;            // in BPM, only used if there is no MIDI clock
+    sequencer_track_t tracks[SEQUENCER_TRACK_COUNT];
+} sequencer_pattern_t;
+
+/* reads the patterns of all presets into RAM and loads the first one */
+void sequencer_init(void);
+
+void sequencer_set_playing(uint8_t playing);
+uint8_t sequencer_is_playing(void);
+void sequencer_set_tempo(float bpm);
+float sequencer_get_tempo(void);
+
+/* in record mode, each note that is played is written to the next step of the
+ * first track
+ */
+void sequencer_set_record(uint8_t record);
+uint8_t sequencer_is_recording(void);
+void sequencer_record_note(uint8_t key, uint8_t velocity);
+
+void sequencer_get_track(int index, sequencer_track_t *track);
+void sequencer_set_track(int index, const sequencer_track_t *track);
+
+/* Patterns are stored along with the presets. Loading and saving only copy
+ * between the current pattern and the bank in RAM, sequencer_write() writes a
+ * saved pattern to storage (it is called by the preset task).
+ */
+int sequencer_load(int index);
+int sequencer_save(int index);
+int sequencer_write(int index);
+
+/* called by the render loop for every block, before the note events of that
+ * block are applied; schedules the steps that fall into the block
+ */
+void sequencer_process_block(uint32_t block_start, uint32_t block_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SEQUENCER_H
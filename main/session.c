@@ -0,0 +1,167 @@
+#include "session.h"
+#include "synth.h"
+#include "preset.h"
+
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs_flash.h"
+#include "nvs.h"
+
+static const char *TAG = "SESSION";
+
+#define SESSION_NAMESPACE       "session"
+#define SESSION_KEY             "state"
+#define SESSION_VERSION         (2)    // 2: the patches have a tuning
+
+/* The session is polled instead of being saved with every change, a knob sweep
+ * would otherwise write dozens of times per second. It is written once it has
+ * not changed for SESSION_QUIET_US, and at most once every
+ * SESSION_MIN_INTERVAL_US. NVS spreads the writes over its pages, at this rate
+ * the flash lasts for years of continuous editing.
+ */
+#define SESSION_POLL_MS         (1000)
+#define SESSION_QUIET_US        (2 * 1000000LL)
+#define SESSION_MIN_INTERVAL_US (30 * 1000000LL)
+
+typedef struct {
+    uint8_t version;
+    uint8_t preset;
+    uint8_t part;           // selected part
+    synth_patch_t patches[SYNTH_PART_COUNT];
+} session_t;
+
+static nvs_handle_t m_nvs;
+static uint8_t m_nvs_open;
+
+/* the session as it is stored */
+static session_t m_saved;
+static uint8_t m_saved_valid;
+
+static void session_capture(session_t *session)
+{
+    /* the padding is compared as well */
+    memset(session, 0, sizeof(session_t));
+
+    session->version = SESSION_VERSION;
+    session->preset = preset_get_current_index();
+    session->part = synth_get_selected_part();
+    for(int i = 0; i < SYNTH_PART_COUNT; i++) {
+        synth_get_part_patch(i, &session->patches[i]);
+    }
+}
+
+static int session_write(const session_t *session)
+{
+    int64_t start_us = esp_timer_get_time();
+
+    if((nvs_set_blob(m_nvs, SESSION_KEY, session, sizeof(session_t)) != ESP_OK)
+            || (nvs_commit(m_nvs) != ESP_OK)) {
+        ESP_LOGE(TAG, "Failed to save the session");
+        return -1;
+    }
+
+    ESP_LOGI(TAG, "Session saved in %lld us", esp_timer_get_time() - start_us);
+
+    return 0;
+}
+
+static void session_task(void *pvParameters)
+{
+    static session_t current;
+    static session_t last;
+    int64_t now_us;
+    int64_t changed_us = esp_timer_get_time();
+    int64_t written_us = changed_us;
+
+    session_capture(&last);
+
+    for(;;) {
+        vTaskDelay(SESSION_POLL_MS / portTICK_PERIOD_MS);
+
+        session_capture(&current);
+        now_us = esp_timer_get_time();
+
+        if(memcmp(&current, &last, sizeof(session_t)) != 0) {
+            last = current;
+            changed_us = now_us;
+            continue;
+        }
+
+        if(m_saved_valid && (memcmp(&current, &m_saved, sizeof(session_t)) == 0))
+            continue;
+        if((now_us - changed_us < SESSION_QUIET_US) || (now_us - written_us < SESSION_MIN_INTERVAL_US))
+            continue;
+
+        if(session_write(&current) == 0) {
+            m_saved = current;
+            m_saved_valid = 1;
+            written_us = now_us;
+        }
+    }
+}
+
+int session_init(void)
+{
+    esp_err_t ret;
+    size_t size = sizeof(m_saved);
+
+    ret = nvs_flash_init();
+    if((ret == ESP_ERR_NVS_NO_FREE_PAGES) || (ret == ESP_ERR_NVS_NEW_VERSION_FOUND)) {
+        /* the partition was written by another NVS version or is full */
+        nvs_flash_erase();
+        ret = nvs_flash_init();
+    }
+    if((ret != ESP_OK) || (nvs_open(SESSION_NAMESPACE, NVS_READWRITE, &m_nvs) != ESP_OK)) {
+        ESP_LOGE(TAG, "Failed to open NVS");
+        return -1;
+    }
+    m_nvs_open = 1;
+
+    if(nvs_get_blob(m_nvs, SESSION_KEY, &m_saved, &size) != ESP_OK) {
+        ESP_LOGI(TAG, "No session");
+        return -1;
+    }
+    if((size != sizeof(m_saved)) || (m_saved.version != SESSION_VERSION)) {
+        ESP_LOGE(TAG, "Unsupported session (version %d, %u bytes)", m_saved.version, size);
+        return -1;
+    }
+
+    m_saved_valid = 1;
+
+    return 0;
+}
+
+void session_restore(void)
+{
+    synth_patch_t *patch;
+
+    if(!m_saved_valid)
+        return;
+
+    /* patches that are not valid (any more, e.g. a tuning or waveform that a
+     * later version removed) are rejected by the synth, see
+     * synth_patch_is_valid()
+     */
+    preset_set_current_index(m_saved.preset);
+    for(int i = 0; i < SYNTH_PART_COUNT; i++) {
+        patch = &m_saved.patches[i];
+        synth_select_part(i);
+        synth_update(&patch->osc1, &patch->osc2, &patch->lfo, &patch->envelope, &patch->synth);
+    }
+    synth_select_part(m_saved.part);
+
+    ESP_LOGI(TAG, "Session restored, preset %d", m_saved.preset);
+}
+
+void session_start(void)
+{
+    if(!m_nvs_open)
+        return;
+
+    xTaskCreatePinnedToCore(session_task, "session_task", 3072, NULL, 0, NULL, 0);
+}
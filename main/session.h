@@ -0,0 +1,27 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The session is the current preset and the (possibly edited, unsaved) patches
+ * of all parts. It is kept in NVS, so that the synth comes up as it was left.
+ */
+
+/* initializes NVS and reads the last session, returns -1 if there is none */
+int session_init(void);
+
+/* applies the session that was read, after synth_init() and before the synth
+ * and preset_init() are started
+ */
+void session_restore(void);
+
+/* starts the task that saves the session when it changes */
+void session_start(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SESSION_H
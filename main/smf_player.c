@@ -0,0 +1,416 @@
+#include "smf_player.h"
+#include "midi_input.h"
+#include "midi_parser.h"
+#include "synth.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+static const char *TAG = "SMF_PLAYER";
+
+/* see https://www.cs.cmu.edu/~music/cmsip/readings/Standard-MIDI-file-format-updated.pdf */
+#define SMF_MAX_TRACKS          (16)
+#define SMF_TRACK_BUFFER_SIZE   (64)
+#define SMF_HEADER_SIZE         (14)
+#define SMF_CHUNK_HEADER_SIZE   (8)
+#define SMF_DEFAULT_TEMPO_US    (500000)    // per quarter note, i.e. 120 BPM
+
+#define SMF_META_EVENT          (0xff)
+#define SMF_META_END_OF_TRACK   (0x2f)
+#define SMF_META_TEMPO          (0x51)
+
+/* Notes are passed on this far ahead of time, so that the synth can place them
+ * at their exact sample. It has to cover the time the player task sleeps and
+ * the time the MIDI task needs to pass them on. Other messages take effect up
+ * to this much early.
+ */
+#define SMF_LOOKAHEAD_SAMPLES   (SYNTH_SAMPLING_FREQ / 20)     // 50 ms
+#define SMF_POLL_MS             (10)
+
+/* Every track is read through its own small buffer, so that the memory needed
+ * does not depend on the length of the file. The tracks of a format 1 file are
+ * merged by always taking the next event from the track that is due first.
+ */
+typedef struct {
+    uint32_t position;      // file offset of the data following the buffer
+    uint32_t end;           // file offset of the end of the track
+    uint8_t buffer[SMF_TRACK_BUFFER_SIZE];
+    uint8_t length;
+    uint8_t index;
+    uint8_t running_status;
+    uint8_t done;
+    uint32_t tick;          // time of the next event
+} smf_track_t;
+
+typedef struct {
+    FILE *file;
+    uint16_t track_count;
+    uint16_t division;      // ticks per quarter note
+    smf_track_t tracks[SMF_MAX_TRACKS];
+    /* the tempo is piecewise constant, so samples are counted from the last
+     * tempo change (which avoids accumulating rounding errors)
+     */
+    uint32_t tempo_us;
+    uint32_t tempo_tick;
+    uint32_t tempo_sample;
+    uint8_t keys[16][128 / 8];  // keys that are on per channel, to release them when stopping
+    uint32_t last_sample;       // latest sample a message was injected for
+} smf_t;
+
+static smf_t m_smf;
+static QueueHandle_t m_song_queue;
+
+static uint32_t smf_read_be(const uint8_t *data, int size)
+{
+    uint32_t value = 0;
+
+    for(int i = 0; i < size; i++) {
+        value = (value << 8) | data[i];
+    }
+
+    return value;
+}
+
+static int smf_read_byte(smf_track_t *track, uint8_t *byte)
+{
+    uint32_t size;
+
+    if(track->index == track->length) {
+        size = track->end - track->position;
+        if(size == 0)
+            return -1;
+        if(size > SMF_TRACK_BUFFER_SIZE)
+            size = SMF_TRACK_BUFFER_SIZE;
+
+        if(fseek(m_smf.file, track->position, SEEK_SET) != 0)
+            return -1;
+        track->length = fread(track->buffer, 1, size, m_smf.file);
+        if(track->length == 0)
+            return -1;
+        track->position += track->length;
+        track->index = 0;
+    }
+
+    *byte = track->buffer[track->index++];
+
+    return 0;
+}
+
+/* variable-length quantity, at most 4 bytes */
+static int smf_read_vlq(smf_track_t *track, uint32_t *value)
+{
+    uint8_t byte;
+
+    *value = 0;
+    for(int i = 0; i < 4; i++) {
+        if(smf_read_byte(track, &byte) < 0)
+            return -1;
+        *value = (*value << 7) | (byte & 0x7f);
+        if(!(byte & 0x80))
+            return 0;
+    }
+
+    return -1;
+}
+
+static int smf_skip(smf_track_t *track, uint32_t length)
+{
+    uint32_t buffered = track->length - track->index;
+
+    if(length <= buffered) {
+        track->index += length;
+        return 0;
+    }
+
+    /* drop the buffer and continue reading after the skipped data */
+    length -= buffered;
+    track->index = track->length;
+    if(length > track->end - track->position)
+        return -1;
+    track->position += length;
+
+    return 0;
+}
+
+static uint32_t smf_sample_from_tick(uint32_t tick)
+{
+    return m_smf.tempo_sample + (uint32_t) ((uint64_t) (tick - m_smf.tempo_tick) * m_smf.tempo_us
+                                            * SYNTH_SAMPLING_FREQ / ((uint64_t) m_smf.division * 1000000));
+}
+
+static int smf_open(const char *filename)
+{
+    uint8_t header[SMF_HEADER_SIZE];
+    uint16_t format;
+    long position;
+    uint32_t length;
+    smf_track_t *track;
+
+    memset(&m_smf, 0, sizeof(m_smf));
+
+    m_smf.file = fopen(filename, "r");
+    if(m_smf.file == NULL) {
+        ESP_LOGE(TAG, "Failed to open %s", filename);
+        return -1;
+    }
+
+    if((fread(header, 1, sizeof(header), m_smf.file) != sizeof(header)) || (memcmp(header, "MThd", 4) != 0)
+            || (smf_read_be(&header[4], 4) != 6)) {
+        ESP_LOGE(TAG, "Invalid header");
+        return -1;
+    }
+
+    format = smf_read_be(&header[8], 2);
+    m_smf.division = smf_read_be(&header[12], 2);
+    if((format > 1) || (m_smf.division & 0x8000) || (m_smf.division == 0)) {
+        ESP_LOGE(TAG, "Unsupported format %d or division 0x%04X", format, m_smf.division);
+        return -1;
+    }
+
+    /* find the tracks, other chunks are skipped */
+    position = SMF_HEADER_SIZE;
+    while(fread(header, 1, SMF_CHUNK_HEADER_SIZE, m_smf.file) == SMF_CHUNK_HEADER_SIZE) {
+        length = smf_read_be(&header[4], 4);
+        position += SMF_CHUNK_HEADER_SIZE;
+
+        if(memcmp(header, "MTrk", 4) == 0) {
+            if(m_smf.track_count == SMF_MAX_TRACKS) {
+                ESP_LOGW(TAG, "Too many tracks, only playing the first %d", SMF_MAX_TRACKS);
+                break;
+            }
+            track = &m_smf.tracks[m_smf.track_count++];
+            track->position = position;
+            track->end = position + length;
+        }
+
+        position += length;
+        if(fseek(m_smf.file, position, SEEK_SET) != 0)
+            break;
+    }
+
+    /* time of the first event of each track */
+    for(int i = 0; i < m_smf.track_count; i++) {
+        track = &m_smf.tracks[i];
+        if(smf_read_vlq(track, &track->tick) < 0)
+            track->done = 1;
+    }
+
+    m_smf.tempo_us = SMF_DEFAULT_TEMPO_US;
+
+    ESP_LOGI(TAG, "Playing %s (format %d, %d tracks, %d ticks per quarter note)",
+                filename, format, m_smf.track_count, m_smf.division);
+
+    return 0;
+}
+
+static smf_track_t *smf_next_track(void)
+{
+    smf_track_t *next = NULL;
+
+    for(int i = 0; i < m_smf.track_count; i++) {
+        if(!m_smf.tracks[i].done && ((next == NULL) || (m_smf.tracks[i].tick < next->tick)))
+            next = &m_smf.tracks[i];
+    }
+
+    return next;
+}
+
+static void smf_send(midi_message_t *message, uint32_t sample)
+{
+    uint8_t *keys = m_smf.keys[message->status & 0x0f];
+    uint8_t key = message->data[0];
+
+    /* keep track of the keys that are on */
+    switch(message->status & 0xf0) {
+    case MIDI_SB_NOTE_ON:
+        if(message->data[1] != 0) {
+            keys[key / 8] |= 1 << (key % 8);
+            break;
+        }
+        /* fall through */
+    case MIDI_SB_NOTE_OFF:
+        keys[key / 8] &= ~(1 << (key % 8));
+        break;
+    }
+
+    if((int32_t) (sample - m_smf.last_sample) > 0)
+        m_smf.last_sample = sample;
+
+    midi_inject(message, sample, 1);
+}
+
+/* reads and processes the event at the current position of the track */
+static int smf_process_event(smf_track_t *track, uint32_t sample)
+{
+    midi_message_t message = { 0 };
+    uint8_t byte;
+    uint8_t type;
+    uint8_t data[3];
+    uint32_t length;
+    int index = 0;
+
+    if(smf_read_byte(track, &byte) < 0)
+        return -1;
+
+    if(MIDI_IS_STATUS(byte)) {
+        message.status = byte;
+    } else {
+        /* running status, this is the first data byte */
+        if(track->running_status == 0)
+            return -1;
+        message.status = track->running_status;
+        message.data[index++] = byte;
+    }
+
+    if(message.status == SMF_META_EVENT) {
+        track->running_status = 0;
+        if((smf_read_byte(track, &type) < 0) || (smf_read_vlq(track, &length) < 0))
+            return -1;
+
+        if((type == SMF_META_TEMPO) && (length == 3)) {
+            for(int i = 0; i < 3; i++) {
+                if(smf_read_byte(track, &data[i]) < 0)
+                    return -1;
+            }
+            m_smf.tempo_sample = sample;
+            m_smf.tempo_tick = track->tick;
+            m_smf.tempo_us = smf_read_be(data, 3);
+            return 0;
+        }
+
+        if(type == SMF_META_END_OF_TRACK)
+            track->done = 1;
+
+        return smf_skip(track, length);
+    }
+
+    /* SysEx is not passed on */
+    if((message.status == MIDI_SB_SYSEX_START) || (message.status == MIDI_SB_SYSEX_END)) {
+        track->running_status = 0;
+        if(smf_read_vlq(track, &length) < 0)
+            return -1;
+        return smf_skip(track, length);
+    }
+
+    /* other system messages are not allowed in a file */
+    if(message.status >= MIDI_SB_SYSEX_START)
+        return -1;
+
+    track->running_status = message.status;
+    message.length = ((message.status & 0xf0) == MIDI_SB_PROGRAM_CHANGE)
+                        || ((message.status & 0xf0) == MIDI_SB_CHANNEL_PRESSURE) ? 1 : 2;
+    while(index < message.length) {
+        if(smf_read_byte(track, &message.data[index++]) < 0)
+            return -1;
+    }
+
+    smf_send(&message, sample);
+
+    return 0;
+}
+
+/* returns when the song is over or when another song was requested */
+static void smf_play(void)
+{
+    smf_track_t *track;
+    uint32_t sample;
+    uint32_t delta;
+
+    m_smf.tempo_sample = synth_get_sample_position(esp_timer_get_time()) + SMF_LOOKAHEAD_SAMPLES;
+    m_smf.last_sample = m_smf.tempo_sample;
+
+    while((track = smf_next_track()) != NULL) {
+        sample = smf_sample_from_tick(track->tick);
+
+        /* wait until the event is due (minus the lookahead) */
+        while((int32_t) (sample - SMF_LOOKAHEAD_SAMPLES - synth_get_sample_position(esp_timer_get_time())) > 0) {
+            if(uxQueueMessagesWaiting(m_song_queue) > 0)
+                return;
+            vTaskDelay(SMF_POLL_MS / portTICK_PERIOD_MS);
+        }
+
+        if(smf_process_event(track, sample) < 0) {
+            ESP_LOGE(TAG, "Invalid event in track %d", (int) (track - m_smf.tracks));
+            track->done = 1;
+        }
+
+        if(!track->done) {
+            if(smf_read_vlq(track, &delta) < 0) {
+                track->done = 1;
+            } else {
+                track->tick += delta;
+            }
+        }
+    }
+}
+
+/* Notes are injected up to SMF_LOOKAHEAD_SAMPLES ahead and the synth orders
+ * them by sample, so the releases are placed after the latest note that was
+ * injected; released at the current sample, the notes that are still queued
+ * would start after their release and hang.
+ */
+static void smf_release_keys(void)
+{
+    midi_message_t message = {
+        .length = 2,
+    };
+    uint32_t sample = synth_get_sample_position(esp_timer_get_time());
+
+    if((int32_t) (m_smf.last_sample - sample) > 0)
+        sample = m_smf.last_sample;
+
+    for(int channel = 0; channel < 16; channel++) {
+        message.status = MIDI_SB_NOTE_OFF | channel;
+        for(int key = 0; key < 128; key++) {
+            if(m_smf.keys[channel][key / 8] & (1 << (key % 8))) {
+                message.data[0] = key;
+                smf_send(&message, sample);
+            }
+        }
+    }
+}
+
+static void smf_player_task(void *pvParameters)
+{
+    int index;
+    char *filename;
+
+    for(;;) {
+        xQueueReceive(m_song_queue, &index, portMAX_DELAY);
+        if(index <= 0)
+            continue;
+
+        asprintf(&filename, "/spiffs/SONG%d.MID", index);
+        if(smf_open(filename) == 0) {
+            smf_play();
+            smf_release_keys();
+            ESP_LOGI(TAG, "Stopped %s", filename);
+        }
+        free(filename);
+
+        if(m_smf.file != NULL) {
+            fclose(m_smf.file);
+            m_smf.file = NULL;
+        }
+    }
+}
+
+void smf_player_play(int index)
+{
+    xQueueOverwrite(m_song_queue, &index);
+}
+
+void smf_player_init(void)
+{
+    m_song_queue = xQueueCreate(1, sizeof(int));
+
+    xTaskCreatePinnedToCore(smf_player_task, "smf_player_task", 4096, NULL, 1, NULL, 0);
+}
@@ -0,0 +1,19 @@
+#ifndef SMF_PLAYER_H
+#define SMF_PLAYER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void smf_player_init(void);
+
+/* plays /spiffs/SONG<index>.MID (a Standard MIDI File, format 0 or 1), stopping
+ * the current song; an index of 0 only stops the current song
+ */
+void smf_player_play(int index);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SMF_PLAYER_H
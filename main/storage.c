@@ -0,0 +1,88 @@
+#include "storage.h"
+
+#include <stdio.h>
+
+#include "esp_log.h"
+
+static const char *TAG = "STORAGE";
+
+#define STORAGE_FILENAME_LENGTH     (32)
+
+static void storage_filenames(const char *name, char *filename, char *temp_filename)
+{
+    snprintf(filename, STORAGE_FILENAME_LENGTH, "/spiffs/%s", name);
+    snprintf(temp_filename, STORAGE_FILENAME_LENGTH, "/spiffs/%s.tmp", name);
+}
+
+int storage_write(const char *name, const void *data, size_t size)
+{
+    char filename[STORAGE_FILENAME_LENGTH];
+    char temp_filename[STORAGE_FILENAME_LENGTH];
+    FILE *f;
+    size_t bytes_written;
+
+    storage_filenames(name, filename, temp_filename);
+
+    f = fopen(temp_filename, "w");
+    if(f == NULL) {
+        ESP_LOGE(TAG, "Failed to open file for writing");
+        return -1;
+    }
+
+    bytes_written = fwrite(data, 1, size, f);
+    if((fclose(f) != 0) || (bytes_written != size)) {
+        ESP_LOGE(TAG, "Failed to write %s", name);
+        remove(temp_filename);
+        return -1;
+    }
+
+    remove(filename);
+    if(rename(temp_filename, filename) != 0) {
+        ESP_LOGE(TAG, "Failed to rename %s", name);
+        return -1;
+    }
+
+    ESP_LOGI(TAG, "%u bytes written to %s", bytes_written, name);
+
+    return 0;
+}
+
+static int storage_read_file(const char *filename, uint8_t *data, size_t size, storage_check_fn_t check,
+                                void *context)
+{
+    FILE *f;
+    size_t bytes_read;
+
+    f = fopen(filename, "r");
+    if(f == NULL)
+        return -1;
+
+    bytes_read = fread(data, 1, size, f);
+    fclose(f);
+
+    ESP_LOGI(TAG, "%u bytes read from %s", bytes_read, filename);
+
+    return check(data, bytes_read, context);
+}
+
+int storage_read(const char *name, uint8_t *data, size_t size, storage_check_fn_t check, void *context)
+{
+    char filename[STORAGE_FILENAME_LENGTH];
+    char temp_filename[STORAGE_FILENAME_LENGTH];
+
+    storage_filenames(name, filename, temp_filename);
+
+    if(storage_read_file(filename, data, size, check, context) == 0)
+        return 0;
+
+    /* if writing was interrupted after the old file was removed, the new one
+     * is complete and only has to be renamed
+     */
+    if(storage_read_file(temp_filename, data, size, check, context) == 0) {
+        ESP_LOGW(TAG, "Recovering %s", name);
+        rename(temp_filename, filename);
+        return 0;
+    }
+
+    return -1;
+}
@@ -0,0 +1,35 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Files on the SPIFFS partition that must survive a power loss while they are
+ * written (presets, patterns, the controller map). A file is written to a
+ * temporary file that replaces it once it is complete. SPIFFS cannot rename
+ * onto an existing file, so the old one is removed first; storage_read() picks
+ * up the temporary file if power was lost in between.
+ */
+
+/* writes size bytes to /spiffs/<name>, returns 0 or -1 */
+int storage_write(const char *name, const void *data, size_t size);
+
+/* checks the contents of a file that was read, returns 0 if they are valid */
+typedef int (*storage_check_fn_t)(const uint8_t *data, size_t size, void *context);
+
+/* Reads /spiffs/<name> into data (up to size bytes, a buffer one byte larger
+ * than the largest valid file detects files that are too long) and passes it to
+ * check. Returns 0 if the file or the temporary file of an interrupted
+ * storage_write() was valid, -1 otherwise.
+ */
+int storage_read(const char *name, uint8_t *data, size_t size, storage_check_fn_t check, void *context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // STORAGE_H
@@ -1,18 +1,26 @@
 #include "synth.h"
 #include "pinout.h"
+#include "latency.h"
+#include "logger.h"
+#include "tempo.h"
+#include "sequencer.h"
+#include "arpeggiator.h"
+#include "tables.h"
+#include "tuning.h"
+#include "sampler.h"
 
 #include <math.h>
 #include <string.h>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "driver/i2s.h"
 
-#include "esp_dsp.h"
-
 static const char *TAG = "SYNTH";
 
 #define BUFFER_TIME             (0.01)      // buffer size of 10 ms
@@ -20,13 +28,46 @@ static const char *TAG = "SYNTH";
 #define I2S_TIMEOUT_MS          (100)
 #define I2S_NUM                 (0)
 #define CHANNEL_COUNT           (2)
-#define SAMPLING_FREQ           (44100)
+#define SAMPLING_FREQ           SYNTH_SAMPLING_FREQ
+#define I2S_DMA_BUF_COUNT       (4)
+#define I2S_DMA_BUF_LEN         (512)
 
-#define TIME_STEP                   (1.0 / SAMPLING_FREQ)
-#define BUFFER_SAMPLES_PER_CHANNEL  ((uint32_t) (BUFFER_TIME / TIME_STEP))
+/* an integer constant, so that the buffers are not variably modified */
+#define BUFFER_SAMPLES_PER_CHANNEL  (SAMPLING_FREQ / 100)   // BUFFER_TIME
 #define BUFFER_SAMPLE_COUNT         (BUFFER_SAMPLES_PER_CHANNEL * CHANNEL_COUNT)
 
-#define ENVELOPE_DOWNSAMPLING   (100)
+/* The envelope stages are exponential, i.e. every sample covers a fixed fraction
+ * of the remaining distance to the stage's target. Attack, decay and release are
+ * the times to cover 95 % of that distance (three time constants). The attack
+ * ends at 95 % of the amplitude, the release when the level is inaudible.
+ */
+#define ENVELOPE_TIME_CONSTANTS (3.0)
+#define ENVELOPE_PEAK           (0.95)
+#define ENVELOPE_SILENCE        (0.001)     // as a fraction of the amplitude
+
+#define PHASE_RANGE             (4294967296.0)     // 2^32, one period
+
+/* modulation is evaluated once per block; the smoothing factor is the fraction
+ * of the remaining distance to the target covered in one block (about 30 ms to
+ * reach 95 % at 10 ms per block)
+ */
+#define MOD_SMOOTHING           (0.6)
+#define MOD_VIBRATO_FREQ        (5.5)       // in Hz
+#define MOD_VIBRATO_DEPTH       (0.5)       // in semitones, at full modulation
+#define MOD_BEND_RANGE_DEFAULT  (2.0)       // in semitones
+
+/* the morph amount is smoothed like the modulation; once it is this close to
+ * its target, it is set to the target and the patch is no longer recalculated
+ */
+#define MORPH_SETTLED           (0.001)
+
+/* set to 1 to crossfade from the old to the new patch over one block when a
+ * patch is replaced (e.g. by a preset change), instead of switching at once
+ */
+#define SYNTH_PATCH_CROSSFADE   1
+
+/* maximum number of note events that can be scheduled ahead */
+#define EVENT_QUEUE_SIZE        (64)
 
 /* see https://en.wikipedia.org/wiki/Root_mean_square#In_common_waveforms */
 #define RMS_SINUS               (0.7071)       // 1/sqrt(2)
@@ -35,42 +76,166 @@ static const char *TAG = "SYNTH";
 
 typedef struct {
     oscillator_params_t params;
-    /* this is a buffer for one oscillation; it is particularly important
-     * for sine wave calculation, since it will be too slow to do in real-time;
-     * the lowest frequency it supports is 10 Hz, i.e. an oscillation period of
-     * 100 ms
-     */
-    float buffer[SAMPLING_FREQ / 10];
-    uint32_t buffer_size;
-    /* since the LFO will typically operate at frequencies smaller than 20 Hz (see also
-     * https://en.wikipedia.org/wiki/Low-frequency_oscillation), we use down-sampling,
-     * so that the effective sampling rate is 100 times smaller than the actual sampling rate.
-     * This way, we can buffer oscillations down to 0.1 Hz using the same space.
+    /* The oscillators are phase accumulators: one period corresponds to the
+     * full 32-bit range and the phase simply wraps around. Any frequency up to
+     * the Nyquist frequency can be played without a buffer and pitch modulation
+     * only needs to scale the increment. OSC1 and OSC2 run once per voice, so
+     * their phases are kept in the voices, the LFO's phase is kept in the part.
      */
-    uint32_t downsampling_factor;
+    uint32_t phase_increment;   // for the nominal frequency, without modulation
+    float gain;                 // amplitude, normalized to the RMS value of a sine
 } oscillator_t;
 
+typedef struct {
+    /* targets, as set by the MIDI input */
+    float pitch_bend;           // -1.0 ... 1.0
+    float bend_range;           // in semitones
+    float modulation;           // 0.0 ... 1.0
+    float pressure;             // 0.0 ... 1.0
+    uint8_t sustain;
+    /* smoothed values, only used by the render loop */
+    float bend;                 // in semitones
+    float vibrato_depth;        // in semitones
+    uint32_t vibrato_phase;
+} modulation_t;
+
 typedef struct {
     envelope_params_t params;
-    /* For the envelope, we use a fixed downsampling factor of 100. That means we
-     * can store up to 10 s in this buffer, with a resolution of one sample per
-     * 2 ms (if the original sampling rate is 44.1 kHz).
-     */
-    float attack_decay_buffer[SAMPLING_FREQ / 10];
-    float release_buffer[SAMPLING_FREQ / 10];
-    uint32_t attack_decay_buffer_size;
-    uint32_t release_buffer_size;
-    uint32_t trigger_offset;
-    uint32_t release_offset;
+    /* fraction of the distance to the target covered per sample */
+    float attack_coefficient;
+    float decay_coefficient;
+    float release_coefficient;
+    float peak;                 // end of the attack
+    float sustain_level;
+    float silence;              // end of the release
 } envelope_t;
 
+/* The sound of a part, calculated from a synth_patch_t outside of the render
+ * loop. It is only replaced as a whole, at the start of a block, so that no
+ * block is rendered with a half-applied change.
+ */
+typedef struct {
+    oscillator_t osc1;          // the frequency is set by the key of each voice
+    oscillator_t osc2;
+    oscillator_t lfo;
+    envelope_t envelope;
+    synth_params_t params;
+} patch_t;
+
+typedef enum {
+    PATCH_CURRENT,              // nothing pending
+    PATCH_PENDING,
+    PATCH_PENDING_FADE,         // pending, crossfade to it
+} patch_state_t;
+
+/* A part plays the notes of one MIDI channel with its own patch. The parts
+ * share the voices, and the voices of all parts are rendered in one pass.
+ */
+typedef struct {
+    patch_t patch;
+    /* the latest patch that was set, taken over by the render loop at the start
+     * of the next block; protected by m_patch_lock
+     */
+    patch_t pending;
+    uint8_t pending_state;      // patch_state_t
+    /* the patch that is faded out during the block after a change */
+    patch_t fade_from;
+    uint8_t fading;
+    /* morphing (see synth_set_morph()): the target patch and amount are set by
+     * the MIDI task, protected by m_patch_lock
+     */
+    synth_patch_t morph_to;
+    float morph_target;         // 0.0 ... 1.0
+    uint8_t morph_changed;      // morph_to was replaced
+    /* While morphing, the patches that are set replace morph_from, and the
+     * render loop calculates the patch from morph_from and morph_to. Only
+     * changed by the render loop, under m_patch_lock so that synth_get_patch()
+     * can read it.
+     */
+    synth_patch_t morph_from;
+    uint8_t morphing;
+    float morph;                // smoothed amount
+    modulation_t mod;
+    uint8_t voice_limit;
+    float volume;
+    float pan;                  // -1.0 (left) ... 1.0 (right)
+    /* evaluated once per block, only used by the render loop */
+    uint32_t lfo_phase;
+    float pitch;
+    uint32_t lfo_increment;
+    float gain_left;
+    float gain_right;
+} part_t;
+
+typedef enum {
+    VOICE_OFF,
+    VOICE_ATTACK,
+    VOICE_DECAY,                // includes the sustain
+    VOICE_RELEASE,
+} voice_state_t;
+
+typedef struct {
+    uint8_t state;              // voice_state_t
+    uint8_t part;
+    uint8_t key;
+    uint8_t sustained;          // the key was released while the sustain pedal was held
+    uint32_t age;               // note count when the voice was triggered, for voice stealing
+    uint32_t osc1_phase;
+    uint32_t osc2_phase;
+    uint32_t osc1_increment;    // for the key, without modulation
+    float velocity;
+    float level;                // of the envelope
+} voice_t;
+
+typedef enum {
+    EVENT_KEY_PRESS,
+    EVENT_KEY_RELEASE,
+} event_type_t;
+
+/* a note event at a position on the sample clock */
+typedef struct {
+    uint32_t sample;
+    uint8_t type;               // event_type_t
+    uint8_t channel;
+    uint8_t key;
+    uint8_t velocity;
+} event_t;
+
 static SemaphoreHandle_t m_osc_sem;
-static oscillator_t m_osc1;
-static oscillator_t m_osc2;
-static oscillator_t m_lfo;
-static envelope_t m_envelope;
-static uint8_t m_last_key_pressed;
-static synth_params_t m_synth_params;
+static portMUX_TYPE m_patch_lock = portMUX_INITIALIZER_UNLOCKED;
+static part_t m_parts[SYNTH_PART_COUNT];
+static voice_t m_voices[SYNTH_VOICE_COUNT];
+static uint32_t m_note_count;
+
+/* the part that parameter changes (and presets) apply to */
+static uint8_t m_selected_part;
+
+/* Note events are passed to the render loop through a queue and applied at their
+ * sample position within the block, so that scheduled notes (e.g. from the SMF
+ * player) are sample-accurate. Events are moved from the queue into this list,
+ * which is sorted by sample position, because live notes (scheduled for "now")
+ * can be queued after notes that are scheduled further ahead.
+ */
+static QueueHandle_t m_event_queue;
+static event_t m_events[EVENT_QUEUE_SIZE];
+static int m_event_count;
+
+/* LFO period in clock ticks for each lfo_sync_t value */
+static const uint8_t m_lfo_sync_ticks[] = {
+    [LFO_SYNC_OFF] = 0,
+    [LFO_SYNC_WHOLE] = 4 * TEMPO_PPQN,
+    [LFO_SYNC_HALF] = 2 * TEMPO_PPQN,
+    [LFO_SYNC_QUARTER] = TEMPO_PPQN,
+    [LFO_SYNC_EIGHTH] = TEMPO_PPQN / 2,
+    [LFO_SYNC_SIXTEENTH] = TEMPO_PPQN / 4,
+};
+
+/* start of the block that is currently being rendered, on the sample clock and
+ * on the system timer, to relate MIDI timestamps to samples
+ */
+static portMUX_TYPE m_sample_clock_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t m_sample_clock_offset;
+static int64_t m_sample_clock_us;
 
 struct {
     int16_t buffer[BUFFER_SAMPLE_COUNT];
@@ -79,66 +244,554 @@ struct {
     uint32_t offset;
 } m_buf;
 
-static void synth_calculate_buffer(void)
+/* the voices are mixed (and panned) into this buffer before the conversion to
+ * 16 bit, so that loud chords saturate instead of wrapping around
+ */
+static float m_mix[BUFFER_SAMPLE_COUNT];
+
+/* OSC1 of a voice with WAVEFORM_SAMPLE, read for the part of the block that is
+ * being rendered
+ */
+static float m_sample_values[BUFFER_SAMPLES_PER_CHANNEL];
+
+static uint32_t phase_increment_from_frequency(float freq)
 {
-    float envelope_val = 0.0;
-    float lfo_val = 1.0;
-    float osc2_val;
+    return (uint32_t) (freq * PHASE_RANGE / SAMPLING_FREQ);
+}
 
-    xSemaphoreTake(m_osc_sem, portMAX_DELAY);
+/* the modulated increment is limited to the Nyquist frequency */
+static uint32_t phase_increment_scale(uint32_t increment, float factor)
+{
+    float scaled = increment * factor;
+
+    return (scaled < PHASE_RANGE / 2) ? (uint32_t) scaled : 0x7fffffff;
+}
+
+/* band is the wavetable band for the oscillator's current increment (see
+ * wavetable_band())
+ */
+static inline float oscillator_sample(const oscillator_t *osc, uint32_t phase, int band)
+{
+    switch(osc->params.waveform) {
+    case WAVEFORM_SAWTOOTH:
+        return osc->gain * (WAVETABLE_PEAK / INT16_MAX) * wavetable_sawtooth[band][phase >> (32 - WAVETABLE_BITS)];
+    case WAVEFORM_SQUARE:
+        return osc->gain * (WAVETABLE_PEAK / INT16_MAX) * wavetable_square[band][phase >> (32 - WAVETABLE_BITS)];
+    case WAVEFORM_SINUS:
+    default:
+        return osc->gain * sine_table[phase >> (32 - SINE_TABLE_BITS)];
+    }
+}
+
+static inline float smooth(float value, float target)
+{
+    return value + MOD_SMOOTHING * (target - value);
+}
+
+static uint8_t synth_part_from_channel(uint8_t channel)
+{
+    /* channels without a part of their own play the first part */
+    return (channel < SYNTH_PART_COUNT) ? channel : 0;
+}
+
+/* not threadsafe, should be called after obtaining semaphore; returns the pitch
+ * factor to apply to the part's oscillators for the next block
+ */
+static float synth_calculate_modulation(part_t *part)
+{
+    modulation_t *mod = &part->mod;
+    float depth = (mod->modulation > mod->pressure) ? mod->modulation : mod->pressure;
+    float vibrato;
+
+    mod->bend = smooth(mod->bend, mod->pitch_bend * mod->bend_range);
+    mod->vibrato_depth = smooth(mod->vibrato_depth, depth * MOD_VIBRATO_DEPTH);
+
+    vibrato = mod->vibrato_depth * sine_table[mod->vibrato_phase >> (32 - SINE_TABLE_BITS)];
+    mod->vibrato_phase += phase_increment_from_frequency(MOD_VIBRATO_FREQ) * BUFFER_SAMPLES_PER_CHANNEL;
+
+    return exp2f((mod->bend + vibrato) / 12.0f);
+}
+
+/* not threadsafe, should be called after obtaining semaphore; when synced, the
+ * LFO's phase and frequency are derived from the MIDI clock at the start of
+ * every block, so that it follows tempo changes without drifting
+ */
+static uint32_t synth_calculate_lfo_increment(part_t *part)
+{
+    float ticks;
+    float samples_per_tick;
+    float period;
+    uint8_t sync = part->patch.params.lfo_sync;
+
+    if((sync == LFO_SYNC_OFF) || (sync >= sizeof(m_lfo_sync_ticks))
+            || !tempo_get_position(m_buf.offset, &ticks, &samples_per_tick))
+        return part->patch.lfo.phase_increment;
+
+    period = m_lfo_sync_ticks[sync];
+    ticks = fmodf(ticks, period);
+    part->lfo_phase = (uint32_t) (ticks / period * PHASE_RANGE);
+
+    return (uint32_t) (PHASE_RANGE / (period * samples_per_tick));
+}
+
+/* not threadsafe, should be called after obtaining semaphore; advances the
+ * voice's envelope by one sample
+ */
+static inline float envelope_next(voice_t *voice, const envelope_t *envelope)
+{
+    switch(voice->state) {
+    case VOICE_ATTACK:
+        voice->level += envelope->attack_coefficient * (envelope->params.amplitude - voice->level);
+        if(voice->level >= envelope->peak)
+            voice->state = VOICE_DECAY;
+        break;
+    case VOICE_DECAY:
+        voice->level += envelope->decay_coefficient * (envelope->sustain_level - voice->level);
+        break;
+    case VOICE_RELEASE:
+        voice->level -= envelope->release_coefficient * voice->level;
+        if(voice->level <= envelope->silence) {
+            voice->level = 0.0;
+            voice->state = VOICE_OFF;
+        }
+        break;
+    }
+
+    return voice->level;
+}
+
+static void oscillator_calculate(oscillator_t *osc);
+static void patch_calculate(patch_t *patch, const synth_patch_t *source);
+
+/* returns 1 if voice a should rather be stolen than voice b: released voices
+ * first, then the oldest
+ */
+static int voice_is_better_victim(const voice_t *a, const voice_t *b)
+{
+    if((a->state == VOICE_RELEASE) != (b->state == VOICE_RELEASE))
+        return a->state == VOICE_RELEASE;
+
+    return (int32_t) (a->age - b->age) < 0;
+}
+
+/* not threadsafe, should be called after obtaining semaphore */
+static voice_t *synth_allocate_voice(uint8_t part_index, uint8_t key)
+{
+    voice_t *voice;
+    voice_t *free_voice = NULL;
+    voice_t *part_victim = NULL;
+    voice_t *victim = NULL;
+    int part_voice_count = 0;
+
+    for(int i = 0; i < SYNTH_VOICE_COUNT; i++) {
+        voice = &m_voices[i];
+        if(voice->state == VOICE_OFF) {
+            if(free_voice == NULL)
+                free_voice = voice;
+            continue;
+        }
+
+        /* a key that is played again keeps its voice */
+        if((voice->part == part_index) && (voice->key == key))
+            return voice;
+
+        if((victim == NULL) || voice_is_better_victim(voice, victim))
+            victim = voice;
+        if(voice->part == part_index) {
+            part_voice_count++;
+            if((part_victim == NULL) || voice_is_better_victim(voice, part_victim))
+                part_victim = voice;
+        }
+    }
+
+    /* the part's budget is used up, it steals from itself */
+    if((part_voice_count >= m_parts[part_index].voice_limit) && (part_victim != NULL))
+        return part_victim;
+
+    return (free_voice != NULL) ? free_voice : victim;
+}
+
+/* not threadsafe, should be called after obtaining semaphore */
+static void synth_release_voice(voice_t *voice)
+{
+    /* the sustain pedal holds the note until it is lifted */
+    if(m_parts[voice->part].mod.sustain) {
+        voice->sustained = 1;
+    } else {
+        voice->state = VOICE_RELEASE;
+    }
+}
+
+/* not threadsafe, should be called after obtaining semaphore */
+static void synth_apply_event(const event_t *event, uint32_t sample)
+{
+    uint8_t part_index = synth_part_from_channel(event->channel);
+    voice_t *voice;
+    uint32_t increment;
+
+    switch(event->type) {
+    case EVENT_KEY_PRESS:
+        /* keys that the part's tuning does not map are not played */
+        increment = tuning_get_increments(m_parts[part_index].patch.params.tuning)[event->key & 0x7f];
+        if(increment == 0) {
+#if LATENCY_MEASUREMENT
+            latency_note_dropped(event->channel, event->key);
+#endif
+            break;
+        }
+
+        voice = synth_allocate_voice(part_index, event->key);
+
+        /* a stolen or retriggered voice keeps its level and phases, so that it
+         * does not click
+         */
+        if((voice->state == VOICE_OFF) || (voice->part != part_index)) {
+            voice->osc1_phase = 0;
+            voice->osc2_phase = 0;
+        }
+        voice->part = part_index;
+        voice->key = event->key;
+        voice->sustained = 0;
+        voice->age = m_note_count++;
+        voice->osc1_increment = increment;
+        if(m_parts[part_index].patch.osc1.params.waveform == WAVEFORM_SAMPLE) {
+            sampler_start(voice - m_voices, event->key);
+        } else {
+            sampler_stop(voice - m_voices);
+        }
+        // TODO: implement a better model to map velocity to amplitude:
+        //       https://www.cs.cmu.edu/~rbd/papers/velocity-icmc2006.pdf
+        voice->velocity = (float) event->velocity / 127.0;
+        voice->state = VOICE_ATTACK;
+
+#if LATENCY_MEASUREMENT
+        latency_note_triggered(sample, event->channel, event->key);
+#endif
+        break;
+    case EVENT_KEY_RELEASE:
+        for(int i = 0; i < SYNTH_VOICE_COUNT; i++) {
+            voice = &m_voices[i];
+            if((voice->part == part_index) && (voice->key == event->key)
+                    && ((voice->state == VOICE_ATTACK) || (voice->state == VOICE_DECAY)))
+                synth_release_voice(voice);
+        }
+        break;
+    }
+}
+
+/* not threadsafe, should be called after obtaining semaphore */
+static void synth_receive_events(void)
+{
+    event_t event;
+    int i;
+
+    while((m_event_count < EVENT_QUEUE_SIZE) && (xQueueReceive(m_event_queue, &event, 0) == pdTRUE)) {
+        /* insert after all events at the same or an earlier position */
+        for(i = m_event_count; (i > 0) && ((int32_t) (event.sample - m_events[i - 1].sample) < 0); i--) {
+            m_events[i] = m_events[i - 1];
+        }
+        m_events[i] = event;
+        m_event_count++;
+    }
+}
+
+static void patch_get_params(const patch_t *patch, synth_patch_t *params)
+{
+    params->osc1 = patch->osc1.params;
+    params->osc2 = patch->osc2.params;
+    params->lfo = patch->lfo.params;
+    params->envelope = patch->envelope.params;
+    params->synth = patch->params;
+}
+
+static inline float morph_linear(float a, float b, float x)
+{
+    return a + x * (b - a);
+}
+
+/* frequencies and times are interpolated on a log scale, like their controls
+ * (PARAM_CURVE_EXPONENTIAL); both are always positive
+ */
+static inline float morph_exponential(float a, float b, float x)
+{
+    return a * exp2f(x * log2f(b / a));
+}
+
+static void oscillator_morph(oscillator_params_t *params, const oscillator_params_t *a,
+                                const oscillator_params_t *b, float x)
+{
+    params->amplitude = morph_linear(a->amplitude, b->amplitude, x);
+    params->frequency = morph_exponential(a->frequency, b->frequency, x);
+    params->waveform = (x < 0.5) ? a->waveform : b->waveform;
+}
 
-    for(int i = 0; i < BUFFER_SAMPLES_PER_CHANNEL; i++) {
-        /* calculate envelope */
-        if((m_buf.offset + i) > m_envelope.release_offset) {
-            /* are we still within the release_buffer window? */
-            if((m_buf.offset + i) < (m_envelope.release_offset + m_envelope.release_buffer_size * ENVELOPE_DOWNSAMPLING)) {
-                envelope_val = m_envelope.release_buffer[(m_buf.offset + i - m_envelope.release_offset) / ENVELOPE_DOWNSAMPLING];
+/* Interpolates the continuous parameters, the others switch at the middle. At
+ * x = 0 the result is exactly a. Patches between two valid patches are valid,
+ * so the result is not checked again.
+ */
+static void patch_morph(synth_patch_t *patch, const synth_patch_t *a, const synth_patch_t *b, float x)
+{
+    oscillator_morph(&patch->osc1, &a->osc1, &b->osc1, x);
+    oscillator_morph(&patch->osc2, &a->osc2, &b->osc2, x);
+    oscillator_morph(&patch->lfo, &a->lfo, &b->lfo, x);
+    patch->envelope.attack = morph_exponential(a->envelope.attack, b->envelope.attack, x);
+    patch->envelope.decay = morph_exponential(a->envelope.decay, b->envelope.decay, x);
+    patch->envelope.sustain = morph_linear(a->envelope.sustain, b->envelope.sustain, x);
+    patch->envelope.release = morph_exponential(a->envelope.release, b->envelope.release, x);
+    patch->envelope.amplitude = morph_linear(a->envelope.amplitude, b->envelope.amplitude, x);
+    patch->synth = (x < 0.5) ? a->synth : b->synth;
+    patch->synth.noise_amplitude = morph_linear(a->synth.noise_amplitude, b->synth.noise_amplitude, x);
+}
+
+/* not threadsafe, should be called after obtaining semaphore; recalculates the
+ * part's patch if the smoothed morph amount or one of the two patches changed.
+ * This only interpolates a few floats and recalculates the increments and
+ * envelope coefficients (see patch_calculate()), there are no tables to rebuild.
+ */
+static void synth_calculate_morph(part_t *part, const synth_patch_t *target, float amount, int changed)
+{
+    synth_patch_t morphed;
+    float morph = smooth(part->morph, amount);
+
+    if(fabsf(amount - morph) < MORPH_SETTLED)
+        morph = amount;
+    if((morph == part->morph) && !changed)
+        return;
+    part->morph = morph;
+
+    patch_morph(&morphed, &part->morph_from, target, morph);
+    patch_calculate(&part->patch, &morphed);
+
+    /* back at the part's own patch */
+    if(morph == 0.0) {
+        portENTER_CRITICAL(&m_patch_lock);
+        part->morphing = 0;
+        portEXIT_CRITICAL(&m_patch_lock);
+    }
+}
+
+/* not threadsafe, should be called after obtaining semaphore; takes over the
+ * patches that were set since the last block and evaluates the morph,
+ * modulation, LFO and panning of every part for the next block
+ */
+static void synth_prepare_parts(void)
+{
+    part_t *part;
+    synth_patch_t morph_to;
+    float morph_target;
+    int morph_changed;
+
+    for(int i = 0; i < SYNTH_PART_COUNT; i++) {
+        part = &m_parts[i];
+
+        part->fading = 0;
+        morph_changed = 0;
+        portENTER_CRITICAL(&m_patch_lock);
+        if(part->pending_state != PATCH_CURRENT) {
+#if SYNTH_PATCH_CROSSFADE
+            if(part->pending_state == PATCH_PENDING_FADE) {
+                part->fade_from = part->patch;
+                part->fading = 1;
             }
-            /* otherwise leave at zero */
-        } else if((m_buf.offset + i) > m_envelope.trigger_offset) {
-            /* are we still within the attack_decay_buffer window? */
-            if((m_buf.offset + i) < (m_envelope.trigger_offset + m_envelope.attack_decay_buffer_size * ENVELOPE_DOWNSAMPLING)) {
-                envelope_val = m_envelope.attack_decay_buffer[(m_buf.offset + i - m_envelope.trigger_offset) / ENVELOPE_DOWNSAMPLING];
+#endif
+            if(part->morphing) {
+                /* the patch is edited underneath the morph */
+                patch_get_params(&part->pending, &part->morph_from);
+                morph_changed = 1;
             } else {
-                /* otherwise just take the last value from that buffer (which is the sustain value) */
-                envelope_val = m_envelope.attack_decay_buffer[m_envelope.attack_decay_buffer_size - 1];
+                part->patch = part->pending;
             }
+            part->pending_state = PATCH_CURRENT;
         }
-
-        if(m_synth_params.lfo_enabled) {
-            lfo_val = m_lfo.buffer[((m_buf.offset + i) / m_lfo.downsampling_factor) % m_lfo.buffer_size];
+        if(!part->morphing && (part->morph_target > 0.0)) {
+            patch_get_params(&part->patch, &part->morph_from);
+            part->morphing = 1;
+        }
+        if(part->morphing) {
+            morph_to = part->morph_to;
+            morph_target = part->morph_target;
+            morph_changed |= part->morph_changed;
+            part->morph_changed = 0;
         }
+        portEXIT_CRITICAL(&m_patch_lock);
+
+        if(part->morphing)
+            synth_calculate_morph(part, &morph_to, morph_target, morph_changed);
+
+        part->pitch = synth_calculate_modulation(part);
+        part->lfo_increment = synth_calculate_lfo_increment(part);
+        /* balance: the center keeps the full level on both channels */
+        part->gain_left = part->volume * ((part->pan > 0.0) ? 1.0 - part->pan : 1.0);
+        part->gain_right = part->volume * ((part->pan < 0.0) ? 1.0 + part->pan : 1.0);
+    }
+}
 
-        if(m_synth_params.osc2_sync_enabled) {
-            // TODO: 
-            // - check the sync logic
-            // - this only works correctly if the downsampling factors are equal
-            osc2_val = m_osc2.buffer[(((m_buf.offset + i) / m_osc1.downsampling_factor) % m_osc1.buffer_size) % m_osc2.buffer_size];
+/* wavetable bands of the oscillators of a voice, for one block */
+typedef struct {
+    int osc1;
+    int osc2;
+    int lfo;
+} bands_t;
+
+/* the oscillators of a voice, before the envelope; sampled is the voice's
+ * sample, for OSC1 with WAVEFORM_SAMPLE
+ */
+static inline float patch_sample(const patch_t *patch, const voice_t *voice, uint32_t lfo_phase, float noise,
+                                    float sampled, const bands_t *bands)
+{
+    float lfo_val = 1.0;
+    float osc1_val;
+
+    if(patch->params.lfo_enabled) {
+        lfo_val = oscillator_sample(&patch->lfo, lfo_phase, bands->lfo);
+    }
+
+    if(patch->osc1.params.waveform == WAVEFORM_SAMPLE) {
+        osc1_val = patch->osc1.gain * sampled;
+    } else {
+        osc1_val = oscillator_sample(&patch->osc1, voice->osc1_phase, bands->osc1);
+    }
+
+    return lfo_val * (
+        osc1_val +
+        oscillator_sample(&patch->osc2, voice->osc2_phase, bands->osc2) +
+        noise * patch->params.noise_amplitude
+    );
+}
+
+/* not threadsafe, should be called after obtaining semaphore; adds the samples
+ * start...end-1 of the current block of a voice to the mix
+ */
+static void synth_render_voice(voice_t *voice, int start, int end)
+{
+    part_t *part = &m_parts[voice->part];
+    const patch_t *patch = &part->patch;
+    uint32_t osc1_increment = phase_increment_scale(voice->osc1_increment, part->pitch);
+    uint32_t osc2_increment = phase_increment_scale(patch->osc2.phase_increment, part->pitch);
+    uint32_t lfo_phase = part->lfo_phase + start * part->lfo_increment;
+    bands_t bands = {
+        .osc1 = wavetable_band(osc1_increment),
+        .osc2 = wavetable_band(osc2_increment),
+        .lfo = wavetable_band(part->lfo_increment),
+    };
+    uint8_t index = voice - m_voices;
+    int sample_ended;
+    uint32_t osc1_phase;
+    float noise;
+    float value;
+#if SYNTH_PATCH_CROSSFADE
+    float old;
+#endif
+
+    /* voices that do not play a sample only get silence here */
+    sample_ended = sampler_read(index, osc1_increment, &m_sample_values[start], end - start);
+
+    for(int i = start; i < end; i++) {
+        /* calculate sample */
+        noise = (float) esp_random() / 0xFFFFFFFF;
+        value = patch_sample(patch, voice, lfo_phase, noise, m_sample_values[i], &bands);
+#if SYNTH_PATCH_CROSSFADE
+        if(part->fading) {
+            old = patch_sample(&part->fade_from, voice, lfo_phase, noise, m_sample_values[i], &bands);
+            value = old + (value - old) * (i + 1) / BUFFER_SAMPLES_PER_CHANNEL;
+        }
+#endif
+        value *= envelope_next(voice, &patch->envelope) * voice->velocity;
+        m_mix[CHANNEL_COUNT * i] += part->gain_left * value;
+        m_mix[CHANNEL_COUNT * i + 1] += part->gain_right * value;
+
+        /* advance oscillators; with hard sync, OSC2 restarts with every period of OSC1 */
+        osc1_phase = voice->osc1_phase;
+        voice->osc1_phase += osc1_increment;
+        if(patch->params.osc2_sync_enabled && (voice->osc1_phase < osc1_phase)) {
+            voice->osc2_phase = 0;
         } else {
-            osc2_val = m_osc2.buffer[((m_buf.offset + i) / m_osc2.downsampling_factor) % m_osc2.buffer_size];
+            voice->osc2_phase += osc2_increment;
         }
+        lfo_phase += part->lfo_increment;
+    }
 
-        /* calculate sample */
-        m_buf.buffer[CHANNEL_COUNT * i] = (int16_t) (
-            envelope_val
-            * lfo_val
-            * (
-                m_osc1.buffer[((m_buf.offset + i) / m_osc1.downsampling_factor) % m_osc1.buffer_size] +
-                osc2_val + 
-                (float) esp_random() / 0xFFFFFFFF * m_synth_params.noise_amplitude
-            )
-        );
+    /* a sample that does not loop ends the note */
+    if((sample_ended != 0) && (patch->osc1.params.waveform == WAVEFORM_SAMPLE))
+        voice->state = VOICE_OFF;
+    if(voice->state == VOICE_OFF)
+        sampler_stop(index);
+}
+
+/* not threadsafe, should be called after obtaining semaphore; the cost only
+ * depends on the number of active voices, not on the number of parts
+ */
+static void synth_render(int start, int end)
+{
+    for(int i = 0; i < SYNTH_VOICE_COUNT; i++) {
+        if(m_voices[i].state != VOICE_OFF)
+            synth_render_voice(&m_voices[i], start, end);
     }
+}
+
+static void synth_calculate_buffer(void)
+{
+    int32_t position;
+    int start;
+    int end;
+    float value;
+
+    xSemaphoreTake(m_osc_sem, portMAX_DELAY);
+
+    /* all modulation is evaluated at control rate, i.e. once per block */
+    synth_prepare_parts();
+
+    /* the sequencer's and the arpeggiator's notes are scheduled block by block,
+     * with the same sample accuracy as other notes
+     */
+    sequencer_process_block(m_buf.offset, BUFFER_SAMPLES_PER_CHANNEL);
+    arp_process_block(m_buf.offset, BUFFER_SAMPLES_PER_CHANNEL);
 
-    /* copy signal to other channel(s) */
-    for(int i = 0; i < BUFFER_SAMPLES_PER_CHANNEL; i++) {
-        for(int j = 1; j < CHANNEL_COUNT; j++) {
-            m_buf.buffer[CHANNEL_COUNT * i + j] = m_buf.buffer[CHANNEL_COUNT * i];
+    /* the block is split at every event; events that are late are applied at
+     * the start of the block
+     */
+    memset(m_mix, 0, sizeof(m_mix));
+    synth_receive_events();
+    for(start = 0; start < BUFFER_SAMPLES_PER_CHANNEL; start = end) {
+        end = BUFFER_SAMPLES_PER_CHANNEL;
+        if(m_event_count > 0) {
+            position = (int32_t) (m_events[0].sample - m_buf.offset);
+            if(position < end)
+                end = (position > start) ? position : start;
+        }
+
+        synth_render(start, end);
+
+        if(end < BUFFER_SAMPLES_PER_CHANNEL) {
+            synth_apply_event(&m_events[0], m_buf.offset + end);
+            m_event_count--;
+            memmove(&m_events[0], &m_events[1], m_event_count * sizeof(event_t));
         }
     }
 
+    /* the LFOs run per part, independent of the voices */
+    for(int i = 0; i < SYNTH_PART_COUNT; i++) {
+        m_parts[i].lfo_phase += BUFFER_SAMPLES_PER_CHANNEL * m_parts[i].lfo_increment;
+    }
+
+    for(int i = 0; i < BUFFER_SAMPLE_COUNT; i++) {
+        value = m_mix[i];
+        if(value > INT16_MAX)
+            value = INT16_MAX;
+        if(value < INT16_MIN)
+            value = INT16_MIN;
+        m_buf.buffer[i] = (int16_t) value;
+    }
+
+#if LATENCY_MEASUREMENT
+    latency_block_rendered(m_buf.offset, BUFFER_SAMPLES_PER_CHANNEL);
+#endif
+
     xSemaphoreGive(m_osc_sem);
 
+    /* the sample streams are refilled while this block is written out */
+    sampler_refill();
+
     m_buf.offset += BUFFER_SAMPLES_PER_CHANNEL;
 }
 
@@ -154,8 +807,8 @@ static void i2s_init(void)
         .channel_format = I2S_CHANNEL_FMT_RIGHT_LEFT,
         .communication_format = I2S_COMM_FORMAT_I2S | I2S_COMM_FORMAT_I2S_MSB,
         .intr_alloc_flags = 0,  // default interrupt priority
-        .dma_buf_count = 4,     // num of dma buff
-        .dma_buf_len = 512,     // size of every dma buff, all dma buffs size = dma_buf_count*dma_buf_len;
+        .dma_buf_count = I2S_DMA_BUF_COUNT,     // num of dma buff
+        .dma_buf_len = I2S_DMA_BUF_LEN,         // size of every dma buff, all dma buffs size = dma_buf_count*dma_buf_len;
         .use_apll = false
     };
     i2s_pin_config_t pin_config = {       
@@ -176,14 +829,26 @@ static void synth_task(void *pvParameters)
 
     uint64_t t_us;
     uint64_t calc_time_us;
+#if LATENCY_MEASUREMENT
+    uint32_t block_offset;
+#endif
     // int64_t wait_time_us;
     size_t i2s_bytes_written;
     uint32_t load;
     uint64_t load_last_displayed = 0;
+    int started = 0;
 
     for(;;) {
         t_us = esp_timer_get_time();
 
+        portENTER_CRITICAL(&m_sample_clock_lock);
+        m_sample_clock_offset = m_buf.offset;
+        m_sample_clock_us = t_us;
+        portEXIT_CRITICAL(&m_sample_clock_lock);
+#if LATENCY_MEASUREMENT
+        block_offset = m_buf.offset;
+#endif
+
         /* calculate buffer */
         synth_calculate_buffer();
 
@@ -192,7 +857,7 @@ static void synth_task(void *pvParameters)
         if(esp_timer_get_time() - load_last_displayed > 1000000) {
             calc_time_us = esp_timer_get_time() - t_us;
             load = 100 * calc_time_us / BUFFER_TIME_US;
-            printf("Calculation load: %u %%\n", load);
+            logger_log(LOG_CALCULATION_LOAD, load);
             load_last_displayed = esp_timer_get_time();
         }
 
@@ -203,6 +868,16 @@ static void synth_task(void *pvParameters)
             ESP_LOGW(TAG, "I2S timeout\n");
         }
 
+        /* the DMA buffers are empty at first, so the block is played right away */
+        if(!started) {
+            logger_log(LOG_AUDIO_STARTED, (uint32_t) (esp_timer_get_time() / 1000));
+            started = 1;
+        }
+
+#if LATENCY_MEASUREMENT
+        latency_block_written(block_offset, BUFFER_SAMPLES_PER_CHANNEL, I2S_DMA_BUF_COUNT * I2S_DMA_BUF_LEN);
+#endif
+
         /* how long until we need to calculate next buffer? */
         // NOTE: if we are late, we will never catch up with this logic, since the wait time is over one cycle;
         //       besides we do not really need this wait logic, since i2s_write takes care of buffering out correctly
@@ -213,340 +888,530 @@ static void synth_task(void *pvParameters)
     }
 }
 
+
 /* not threadsafe, should be called after obtaining semaphore */
-static void oscillator_calculate_buffer(oscillator_t *osc)
+static void oscillator_calculate(oscillator_t *osc)
 {
-    /* calculate buffer size */
-    // NOTE: this method will falsiy the frequency for frequencies that do not "fit" into the
-    //       sampling rate
-    osc->buffer_size = SAMPLING_FREQ / osc->downsampling_factor / osc->params.frequency;
+    osc->phase_increment = phase_increment_from_frequency(osc->params.frequency);
 
-    /* calculate buffer for oscillator */
+    /* normalize with respect to sinus */
     switch(osc->params.waveform) {
     case WAVEFORM_SINUS:
-        // NOTE: this is quite slow, can we find a fast implementation of sin() somewhere?
-        // NOTE: the DSP library does not seem to do this any faster than the sin() function in a loop, do we need the library?
-        // NOTE: if we generate this in a different buffer before taking the semaphore and then use memcpy, we risk less to affect the audio
-        dsps_tone_gen_f32(osc->buffer, osc->buffer_size, osc->params.amplitude, osc->params.frequency / SAMPLING_FREQ * osc->downsampling_factor, 0.0);
+        osc->gain = osc->params.amplitude;
         break;
     case WAVEFORM_SAWTOOTH:
-        for(int i = 0; i < osc->buffer_size; i++)
-            /* normalize with respect to sinus */
-            osc->buffer[i] = (- osc->params.amplitude + 2 * osc->params.amplitude * i / osc->buffer_size) * RMS_SINUS / RMS_SAWTOOTH;
+        osc->gain = osc->params.amplitude * RMS_SINUS / RMS_SAWTOOTH;
         break;
     case WAVEFORM_SQUARE:
-        for(int i = 0; i < osc->buffer_size / 2; i++)
-            /* normalize with respect to sinus */
-            osc->buffer[i] = osc->params.amplitude * RMS_SINUS / RMS_SQUARE;
-        for(int i = osc->buffer_size / 2; i < osc->buffer_size; i++)
-            osc->buffer[i] = -osc->params.amplitude * RMS_SINUS / RMS_SQUARE;
+        osc->gain = osc->params.amplitude * RMS_SINUS / RMS_SQUARE;
+        break;
+    case WAVEFORM_SAMPLE:
+        /* samples are played at their recorded level */
+        osc->gain = osc->params.amplitude;
         break;
     }
-
-    /* calculate RMS value */
-    // float rms = 0.0;
-    // for(int i = 0; i < osc->buffer_size; i++) {
-    //     rms += osc->buffer[i] * osc->buffer[i];
-    // }
-    // rms /= osc->buffer_size;
-    // printf("RMS: %.2f\n", sqrt(rms));
 }
 
-static void oscillator_update(oscillator_t *osc, oscillator_params_t *params)
+static int frequency_is_valid(float freq)
 {
-    if((params->frequency * osc->downsampling_factor < 10.0) || (params->frequency * osc->downsampling_factor > SAMPLING_FREQ / 2.0)) {
-        printf("Invalid frequency\n");
-        return;
-    }
-
-    xSemaphoreTake(m_osc_sem, portMAX_DELAY);
-
-    memcpy(&osc->params, params, sizeof(oscillator_params_t));
-
-    oscillator_calculate_buffer(osc);
+    return (freq > 0.0) && (freq < SAMPLING_FREQ / 2.0);
+}
 
-    xSemaphoreGive(m_osc_sem);
+/* fraction of the distance covered per sample, for a stage of the given time */
+static float envelope_coefficient(float time)
+{
+    return 1.0 - expf(-ENVELOPE_TIME_CONSTANTS / (time * SAMPLING_FREQ));
 }
 
-static void envelope_update(envelope_t *envelope, envelope_params_t *envelope_params)
+static int envelope_params_are_valid(const envelope_params_t *envelope_params)
 {
     if(envelope_params->attack <= 0.0) {
-        printf("Invalid attack value: %.2f\n", envelope_params->attack);
-        return;
+        logger_log(LOG_INVALID_ATTACK, envelope_params->attack);
+        return 0;
     }
     if(envelope_params->decay <= 0.0) {
-        printf("Invalid attack value: %.2f\n", envelope_params->decay);
-        return;
+        logger_log(LOG_INVALID_DECAY, envelope_params->decay);
+        return 0;
     }
     if(envelope_params->release <= 0.0) {
-        printf("Invalid release value: %.2f\n", envelope_params->release);
-        return;
+        logger_log(LOG_INVALID_RELEASE, envelope_params->release);
+        return 0;
     }
     if((envelope_params->sustain < 0.0) || (envelope_params->sustain > 1.0)) {
-        printf("Invalid sustain value: %.2f\n", envelope_params->sustain);
-        return;
-    }
-
-    /* calculate required size for attack and decay and check if buffer is large enough */
-    uint32_t attack_size = envelope_params->attack * SAMPLING_FREQ / ENVELOPE_DOWNSAMPLING;
-    uint32_t decay_size = envelope_params->decay * SAMPLING_FREQ / ENVELOPE_DOWNSAMPLING;
-    if(attack_size + decay_size > SAMPLING_FREQ / 10) {
-        printf("Attack/decay buffer too small\n");
-        return;
+        logger_log(LOG_INVALID_SUSTAIN, envelope_params->sustain);
+        return 0;
     }
 
-    /* calculate required size for release and check if buffer is large enough */
-    uint32_t release_size = envelope_params->release * SAMPLING_FREQ / ENVELOPE_DOWNSAMPLING;
-    if(release_size > SAMPLING_FREQ / 10) {
-        printf("Release buffer too small\n");
-        return;
-    }
+    return 1;
+}
 
-    xSemaphoreTake(m_osc_sem, portMAX_DELAY);
+static void envelope_calculate(envelope_t *envelope)
+{
+    /* the voices keep their level, a change takes effect smoothly */
+    envelope->attack_coefficient = envelope_coefficient(envelope->params.attack);
+    envelope->decay_coefficient = envelope_coefficient(envelope->params.decay);
+    envelope->release_coefficient = envelope_coefficient(envelope->params.release);
+    envelope->peak = ENVELOPE_PEAK * envelope->params.amplitude;
+    envelope->sustain_level = envelope->peak * envelope->params.sustain;
+    envelope->silence = ENVELOPE_SILENCE * envelope->params.amplitude;
+}
 
-    memcpy(&envelope->params, envelope_params, sizeof(envelope_params_t));
-    
-    /* calculate envelope attack_decay_buffer */
-    envelope->attack_decay_buffer_size = attack_size + decay_size;
-    for(int i = 0; i < attack_size; i++) {
-        float t = (float) i * ENVELOPE_DOWNSAMPLING / SAMPLING_FREQ;
-        /* NOTE: we will reach 95 % of the final amplitude */
-        envelope->attack_decay_buffer[i] = envelope->params.amplitude * (1.0 - exp(-3.0 * t / envelope->params.attack));
+int synth_patch_is_valid(const synth_patch_t *source)
+{
+    if(!frequency_is_valid(source->osc1.frequency) || !frequency_is_valid(source->osc2.frequency)
+            || !frequency_is_valid(source->lfo.frequency)) {
+        logger_log(LOG_INVALID_FREQUENCY);
+        return 0;
     }
-    for(int i = attack_size; i < envelope->attack_decay_buffer_size; i++) {
-        float t = (float) (i - attack_size) * ENVELOPE_DOWNSAMPLING / SAMPLING_FREQ;
-        /* NOTE: Similarly as above, we use an exponential evolution with a speedup of 3.
-         *       We also correct the amplitude to 95% (see above)
-         */
-        envelope->attack_decay_buffer[i] = 0.95 * envelope->params.amplitude * (1.0 - (
-            (1.0 - envelope->params.sustain) * (1.0 - exp(-3.0 * t / envelope->params.decay))
-        ));
+
+    /* oscillator_calculate() has no gain for other values; samples are only
+     * played by OSC1
+     */
+    if((source->osc1.waveform > WAVEFORM_SAMPLE) || (source->osc2.waveform > WAVEFORM_SQUARE)
+            || (source->lfo.waveform > WAVEFORM_SQUARE)) {
+        logger_log(LOG_INVALID_WAVEFORM, (int) source->osc1.waveform, (int) source->osc2.waveform,
+                    (int) source->lfo.waveform);
+        return 0;
     }
 
-    /* calculate envelope release_buffer */
-    envelope->release_buffer_size = release_size;
-    for(int i = 0; i < envelope->release_buffer_size; i++) {
-        float t = (float) i * ENVELOPE_DOWNSAMPLING / SAMPLING_FREQ;
-        envelope->release_buffer[i] = envelope->attack_decay_buffer[envelope->attack_decay_buffer_size - 1] * exp(-3.0 * t / envelope->params.release);
+    if(source->synth.tuning >= TUNING_COUNT) {
+        logger_log(LOG_INVALID_TUNING, source->synth.tuning);
+        return 0;
     }
 
-    xSemaphoreGive(m_osc_sem);
+    return envelope_params_are_valid(&source->envelope);
+}
+
+static void patch_calculate(patch_t *patch, const synth_patch_t *source)
+{
+    patch->osc1.params = source->osc1;
+    patch->osc2.params = source->osc2;
+    patch->lfo.params = source->lfo;
+    patch->envelope.params = source->envelope;
+    patch->params = source->synth;
+    oscillator_calculate(&patch->osc1);
+    oscillator_calculate(&patch->osc2);
+    oscillator_calculate(&patch->lfo);
+    envelope_calculate(&patch->envelope);
 }
 
-// TODO: this is MIDI specific and should be in midi_input.c
-static float frequency_from_key(uint8_t key)
+/* Sets the patch of the selected part. Everything is calculated here, in the
+ * caller's task, and then handed over to the render loop in one piece (see
+ * synth_prepare_parts()). A patch with an invalid parameter is rejected as a
+ * whole. Patches are only set by one task at a time (the MIDI task).
+ */
+static void synth_set_patch(const synth_patch_t *source, int fade)
 {
-    float m = (float) key;
+    part_t *part = &m_parts[m_selected_part];
+    patch_t patch;
+
+    if(!synth_patch_is_valid(source))
+        return;
+
+    patch_calculate(&patch, source);
 
-    // see https://newt.phys.unsw.edu.au/jw/notes.html
-    return 440.0 * pow(2.0, ((m - 69.0) / 12.0));
+    portENTER_CRITICAL(&m_patch_lock);
+    part->pending = patch;
+    /* a crossfade that is still pending is kept */
+    if(part->pending_state != PATCH_PENDING_FADE)
+        part->pending_state = fade ? PATCH_PENDING_FADE : PATCH_PENDING;
+    portEXIT_CRITICAL(&m_patch_lock);
 }
 
 void synth_update(oscillator_params_t *osc1_params, oscillator_params_t *osc2_params,
                             oscillator_params_t *lfo_params, envelope_params_t *envelope_params,
                             synth_params_t *synth_params)
 {
-    xSemaphoreTake(m_osc_sem, portMAX_DELAY);
-    memcpy(&m_synth_params, synth_params, sizeof(synth_params_t));
-    xSemaphoreGive(m_osc_sem);
+    synth_patch_t patch = {
+        .osc1 = *osc1_params,
+        .osc2 = *osc2_params,
+        .lfo = *lfo_params,
+        .envelope = *envelope_params,
+        .synth = *synth_params,
+    };
 
-    oscillator_update(&m_osc1, osc1_params);
-    oscillator_update(&m_osc2, osc2_params);
-    oscillator_update(&m_lfo, lfo_params);
-    envelope_update(&m_envelope, envelope_params);
+    /* a new patch replaces the sound completely, so it is faded in */
+    synth_set_patch(&patch, 1);
 }
 
-static void synth_update_freq(oscillator_t *osc, float freq)
+void synth_select_part(uint8_t part)
 {
-    if((freq * osc->downsampling_factor < 10.0) || (freq * osc->downsampling_factor > SAMPLING_FREQ / 2.0)) {
-        printf("Invalid frequency\n");
+    if(part >= SYNTH_PART_COUNT)
         return;
-    }
 
-    xSemaphoreTake(m_osc_sem, portMAX_DELAY);
+    m_selected_part = part;
+}
 
-    osc->params.frequency = freq;
-    oscillator_calculate_buffer(osc);
+uint8_t synth_get_selected_part(void)
+{
+    return m_selected_part;
+}
+
+void synth_set_part_voices(uint8_t voices)
+{
+    if(voices < 1)
+        voices = 1;
 
+    xSemaphoreTake(m_osc_sem, portMAX_DELAY);
+    m_parts[m_selected_part].voice_limit = voices;
     xSemaphoreGive(m_osc_sem);
 }
 
-static void synth_update_amp(oscillator_t *osc, float amp)
+uint8_t synth_get_part_voices(void)
+{
+    return m_parts[m_selected_part].voice_limit;
+}
+
+void synth_set_part_volume(float volume)
 {
     xSemaphoreTake(m_osc_sem, portMAX_DELAY);
+    m_parts[m_selected_part].volume = volume;
+    xSemaphoreGive(m_osc_sem);
+}
 
-    osc->params.amplitude = amp;
-    oscillator_calculate_buffer(osc);
+float synth_get_part_volume(void)
+{
+    return m_parts[m_selected_part].volume;
+}
 
+void synth_set_part_pan(float pan)
+{
+    xSemaphoreTake(m_osc_sem, portMAX_DELAY);
+    m_parts[m_selected_part].pan = pan;
     xSemaphoreGive(m_osc_sem);
 }
 
-static void synth_update_waveform(oscillator_t *osc, waveform_t wf)
+float synth_get_part_pan(void)
 {
-    xSemaphoreTake(m_osc_sem, portMAX_DELAY);
+    return m_parts[m_selected_part].pan;
+}
 
-    osc->params.waveform = wf;
-    oscillator_calculate_buffer(osc);
+void synth_set_morph_target(const synth_patch_t *patch)
+{
+    part_t *part = &m_parts[m_selected_part];
 
-    xSemaphoreGive(m_osc_sem);
+    if(!synth_patch_is_valid(patch))
+        return;
+
+    portENTER_CRITICAL(&m_patch_lock);
+    part->morph_to = *patch;
+    part->morph_changed = 1;
+    portEXIT_CRITICAL(&m_patch_lock);
+}
+
+void synth_set_morph(float amount)
+{
+    part_t *part = &m_parts[m_selected_part];
+
+    portENTER_CRITICAL(&m_patch_lock);
+    part->morph_target = amount;
+    portEXIT_CRITICAL(&m_patch_lock);
 }
 
+float synth_get_morph(void)
+{
+    return m_parts[m_selected_part].morph_target;
+}
+
+/* The single parameters change the latest patch (which may not have been taken
+ * over by the render loop yet), without a crossfade: they are usually swept
+ * with a knob and change gradually anyway.
+ */
 void synth_update_osc1_freq(float freq)
 {
-    printf("Upating OSC1 frequency: %.2f Hz\n", freq);
-    synth_update_freq(&m_osc1, freq);
+    synth_patch_t patch;
+
+    logger_log(LOG_OSC1_FREQ, freq);
+
+    synth_get_patch(&patch);
+    patch.osc1.frequency = freq;
+    synth_set_patch(&patch, 0);
 }
 
 void synth_update_osc1_waveform(waveform_t wf)
 {
-    printf("Updating OSC1 waveform: %d\n", (int) wf);
-    synth_update_waveform(&m_osc1, wf);
+    synth_patch_t patch;
+
+    logger_log(LOG_OSC1_WAVEFORM, (int) wf);
+
+    synth_get_patch(&patch);
+    patch.osc1.waveform = wf;
+    synth_set_patch(&patch, 0);
 }
 
 void synth_update_osc1_amp(float amp)
 {
-    printf("Updating OSC1 amplitude: %.2f\n", amp);
-    synth_update_amp(&m_osc1, amp);
+    synth_patch_t patch;
+
+    logger_log(LOG_OSC1_AMP, amp);
+
+    synth_get_patch(&patch);
+    patch.osc1.amplitude = amp;
+    synth_set_patch(&patch, 0);
 }
 
 void synth_update_osc2_freq(float freq)
 {
-    printf("Upating OSC2 frequency: %.2f Hz\n", freq);
-    synth_update_freq(&m_osc2, freq);
+    synth_patch_t patch;
+
+    logger_log(LOG_OSC2_FREQ, freq);
+
+    synth_get_patch(&patch);
+    patch.osc2.frequency = freq;
+    synth_set_patch(&patch, 0);
 }
 
 void synth_update_osc2_amp(float amp)
 {
-    printf("Updating OSC2 amplitude: %.2f\n", amp);
-    synth_update_amp(&m_osc2, amp);
+    synth_patch_t patch;
+
+    logger_log(LOG_OSC2_AMP, amp);
+
+    synth_get_patch(&patch);
+    patch.osc2.amplitude = amp;
+    synth_set_patch(&patch, 0);
 }
 
 void synth_update_osc2_waveform(waveform_t wf)
 {
-    printf("Updating OSC2 waveform: %d\n", (int) wf);
-    synth_update_waveform(&m_osc2, wf);
+    synth_patch_t patch;
+
+    logger_log(LOG_OSC2_WAVEFORM, (int) wf);
+
+    synth_get_patch(&patch);
+    patch.osc2.waveform = wf;
+    synth_set_patch(&patch, 0);
 }
 
 void synth_update_lfo_freq(float freq)
 {
-    printf("Upating LFO frequency: %.2f Hz\n", freq);
-    synth_update_freq(&m_lfo, freq);
+    synth_patch_t patch;
+
+    logger_log(LOG_LFO_FREQ, freq);
+
+    synth_get_patch(&patch);
+    patch.lfo.frequency = freq;
+    synth_set_patch(&patch, 0);
 }
 
 void synth_update_lfo_waveform(waveform_t wf)
 {
-    printf("Updating LFO waveform: %d\n", (int) wf);
-    synth_update_waveform(&m_lfo, wf);
+    synth_patch_t patch;
+
+    logger_log(LOG_LFO_WAVEFORM, (int) wf);
+
+    synth_get_patch(&patch);
+    patch.lfo.waveform = wf;
+    synth_set_patch(&patch, 0);
 }
 
 void synth_update_env_attack(float attack)
 {
-    envelope_params_t params;
+    synth_patch_t patch;
 
-    printf("Updating envelope attack: %.2f s\n", attack);
-    
-    // TODO: same issue as in synth_key_press()
-    memcpy(&params, &m_envelope.params, sizeof(envelope_params_t));
-    params.attack = attack;
-    envelope_update(&m_envelope, &params);    
+    logger_log(LOG_ENV_ATTACK, attack);
+
+    synth_get_patch(&patch);
+    patch.envelope.attack = attack;
+    synth_set_patch(&patch, 0);
 }
 
 void synth_update_env_decay(float decay)
 {
-    envelope_params_t params;
+    synth_patch_t patch;
 
-    printf("Updating envelope decay: %.2f s\n", decay);
-    
-    // TODO: same issue as in synth_key_press()
-    memcpy(&params, &m_envelope.params, sizeof(envelope_params_t));
-    params.decay = decay;
-    envelope_update(&m_envelope, &params);    
+    logger_log(LOG_ENV_DECAY, decay);
+
+    synth_get_patch(&patch);
+    patch.envelope.decay = decay;
+    synth_set_patch(&patch, 0);
 }
 
 void synth_update_env_sustain(float sustain)
 {
-    envelope_params_t params;
+    synth_patch_t patch;
+
+    logger_log(LOG_ENV_SUSTAIN, sustain);
 
-    printf("Updating envelope sustain: %.2f %%\n", sustain);
-    
-    // TODO: same issue as in synth_key_press()
-    memcpy(&params, &m_envelope.params, sizeof(envelope_params_t));
-    params.sustain = sustain;
-    envelope_update(&m_envelope, &params);    
+    synth_get_patch(&patch);
+    patch.envelope.sustain = sustain;
+    synth_set_patch(&patch, 0);
 }
 
 void synth_update_env_release(float release)
 {
-    envelope_params_t params;
+    synth_patch_t patch;
+
+    logger_log(LOG_ENV_RELEASE, release);
 
-    printf("Updating envelope release: %.2f s\n", release);
-    
-    // TODO: same issue as in synth_key_press()
-    memcpy(&params, &m_envelope.params, sizeof(envelope_params_t));
-    params.release = release;
-    envelope_update(&m_envelope, &params);    
+    synth_get_patch(&patch);
+    patch.envelope.release = release;
+    synth_set_patch(&patch, 0);
 }
 
 void synth_update_noise_amp(float amp)
 {
-    xSemaphoreTake(m_osc_sem, portMAX_DELAY);
+    synth_patch_t patch;
 
-    m_synth_params.noise_amplitude = amp;
-
-    xSemaphoreGive(m_osc_sem);
+    synth_get_patch(&patch);
+    patch.synth.noise_amplitude = amp;
+    synth_set_patch(&patch, 0);
 }
 
 void synth_enable_lfo(uint8_t enabled)
 {
-    xSemaphoreTake(m_osc_sem, portMAX_DELAY);
+    synth_patch_t patch;
 
-    m_synth_params.lfo_enabled = enabled;
-
-    xSemaphoreGive(m_osc_sem);
+    synth_get_patch(&patch);
+    patch.synth.lfo_enabled = enabled;
+    synth_set_patch(&patch, 0);
 }
 
 void synth_enable_osc2_sync(uint8_t enabled)
 {
-    xSemaphoreTake(m_osc_sem, portMAX_DELAY);
+    synth_patch_t patch;
 
-    m_synth_params.osc2_sync_enabled = enabled;
+    synth_get_patch(&patch);
+    patch.synth.osc2_sync_enabled = enabled;
+    synth_set_patch(&patch, 0);
+}
 
-    xSemaphoreGive(m_osc_sem);
+void synth_set_lfo_sync(lfo_sync_t sync)
+{
+    synth_patch_t patch;
+
+    synth_get_patch(&patch);
+    patch.synth.lfo_sync = sync;
+    synth_set_patch(&patch, 0);
 }
 
-void synth_key_press(uint8_t key, uint8_t velocity)
+void synth_set_tuning(uint8_t tuning)
 {
-    envelope_params_t params;
+    synth_patch_t patch;
 
-    m_last_key_pressed = key;
+    synth_get_patch(&patch);
+    patch.synth.tuning = tuning;
+    synth_set_patch(&patch, 0);
+}
+
+uint32_t synth_get_sample_position(int64_t time_us)
+{
+    uint32_t offset;
+    int64_t block_us;
 
-    synth_update_osc1_freq(frequency_from_key(key));
+    portENTER_CRITICAL(&m_sample_clock_lock);
+    offset = m_sample_clock_offset;
+    block_us = m_sample_clock_us;
+    portEXIT_CRITICAL(&m_sample_clock_lock);
 
-    // TODO: this is a very inefficient way of updating the envelope's
-    //       amplitude; the amplitude could simply be multiplied in 
-    //       synth_calculate_buffer()
-    // TODO: implement a better model to map velocity to amplitude:
-    //       https://www.cs.cmu.edu/~rbd/papers/velocity-icmc2006.pdf
-    memcpy(&params, &m_envelope.params, sizeof(envelope_params_t));
-    params.amplitude = (float) velocity / 127.0;
-    envelope_update(&m_envelope, &params);
+    return offset + (int32_t) ((time_us - block_us) * SAMPLING_FREQ / 1000000);
+}
 
+static int synth_schedule_event(uint32_t sample, event_type_t type, uint8_t channel, uint8_t key,
+                                uint8_t velocity)
+{
+    event_t event = {
+        .sample = sample,
+        .type = type,
+        .channel = channel,
+        .key = key,
+        .velocity = velocity,
+    };
+
+    if(xQueueSend(m_event_queue, &event, 0) != pdTRUE) {
+        logger_log(LOG_EVENT_QUEUE_FULL);
+        return -1;
+    }
+
+    return 0;
+}
+
+int synth_schedule_key_press(uint32_t sample, uint8_t channel, uint8_t key, uint8_t velocity)
+{
+    return synth_schedule_event(sample, EVENT_KEY_PRESS, channel, key, velocity);
+}
+
+int synth_schedule_key_release(uint32_t sample, uint8_t channel, uint8_t key)
+{
+    return synth_schedule_event(sample, EVENT_KEY_RELEASE, channel, key, 0);
+}
+
+/* the block that is being rendered may already be past m_buf.offset, in that
+ * case the event is applied at the start of the next block
+ */
+void synth_key_press(uint8_t channel, uint8_t key, uint8_t velocity)
+{
+    synth_schedule_key_press(m_buf.offset, channel, key, velocity);
+}
+
+void synth_key_release(uint8_t channel, uint8_t key)
+{
+    synth_schedule_key_release(m_buf.offset, channel, key);
+}
+
+void synth_set_pitch_bend(uint8_t channel, float bend)
+{
     xSemaphoreTake(m_osc_sem, portMAX_DELAY);
+    m_parts[synth_part_from_channel(channel)].mod.pitch_bend = bend;
+    xSemaphoreGive(m_osc_sem);
+}
 
-    m_envelope.trigger_offset = m_buf.offset;
-    m_envelope.release_offset = 0xFFFFFFFF;   // far in the future
+void synth_set_pitch_bend_range(uint8_t channel, float semitones)
+{
+    xSemaphoreTake(m_osc_sem, portMAX_DELAY);
+    m_parts[synth_part_from_channel(channel)].mod.bend_range = semitones;
+    xSemaphoreGive(m_osc_sem);
+}
 
+void synth_set_modulation(uint8_t channel, float modulation)
+{
+    xSemaphoreTake(m_osc_sem, portMAX_DELAY);
+    m_parts[synth_part_from_channel(channel)].mod.modulation = modulation;
     xSemaphoreGive(m_osc_sem);
 }
 
-void synth_key_release(uint8_t key)
+void synth_set_pressure(uint8_t channel, float pressure)
 {
-    if(key != m_last_key_pressed)
-        return;
+    xSemaphoreTake(m_osc_sem, portMAX_DELAY);
+    m_parts[synth_part_from_channel(channel)].mod.pressure = pressure;
+    xSemaphoreGive(m_osc_sem);
+}
+
+void synth_set_key_pressure(uint8_t channel, uint8_t key, float pressure)
+{
+    uint8_t part_index = synth_part_from_channel(channel);
+    int playing = 0;
+
+    /* vibrato is evaluated per part, so this acts like channel pressure while
+     * the key is playing
+     */
+    xSemaphoreTake(m_osc_sem, portMAX_DELAY);
+    for(int i = 0; i < SYNTH_VOICE_COUNT; i++) {
+        if((m_voices[i].state != VOICE_OFF) && (m_voices[i].part == part_index) && (m_voices[i].key == key))
+            playing = 1;
+    }
+    if(playing)
+        m_parts[part_index].mod.pressure = pressure;
+    xSemaphoreGive(m_osc_sem);
+}
+
+void synth_set_sustain(uint8_t channel, uint8_t enabled)
+{
+    uint8_t part_index = synth_part_from_channel(channel);
+    voice_t *voice;
 
     xSemaphoreTake(m_osc_sem, portMAX_DELAY);
 
-    m_envelope.release_offset = m_buf.offset;
+    m_parts[part_index].mod.sustain = enabled;
+    if(!enabled) {
+        for(int i = 0; i < SYNTH_VOICE_COUNT; i++) {
+            voice = &m_voices[i];
+            if((voice->part == part_index) && voice->sustained) {
+                voice->sustained = 0;
+                voice->state = VOICE_RELEASE;
+            }
+        }
+    }
 
     xSemaphoreGive(m_osc_sem);
 }
@@ -555,63 +1420,93 @@ void synth_get_params(oscillator_params_t *osc1_params, oscillator_params_t *osc
                         oscillator_params_t *lfo_params, envelope_params_t *envelope_params,
                         synth_params_t *synth_params)
 {
-    xSemaphoreTake(m_osc_sem, portMAX_DELAY);
+    synth_patch_t patch;
 
-    memcpy(osc1_params, &m_osc1.params, sizeof(oscillator_params_t));
-    memcpy(osc2_params, &m_osc2.params, sizeof(oscillator_params_t));
-    memcpy(lfo_params, &m_lfo.params, sizeof(oscillator_params_t));
-    memcpy(envelope_params, &m_envelope.params, sizeof(envelope_params_t));
-    memcpy(synth_params, &m_synth_params, sizeof(synth_params_t));
+    synth_get_patch(&patch);
 
-    xSemaphoreGive(m_osc_sem);
+    memcpy(osc1_params, &patch.osc1, sizeof(oscillator_params_t));
+    memcpy(osc2_params, &patch.osc2, sizeof(oscillator_params_t));
+    memcpy(lfo_params, &patch.lfo, sizeof(oscillator_params_t));
+    memcpy(envelope_params, &patch.envelope, sizeof(envelope_params_t));
+    memcpy(synth_params, &patch.synth, sizeof(synth_params_t));
+}
+
+/* the latest patch that was set, even if the render loop has not taken it over
+ * yet; while morphing, this is the part's own patch, not the morphed one
+ */
+void synth_get_patch(synth_patch_t *patch)
+{
+    synth_get_part_patch(m_selected_part, patch);
+}
+
+void synth_get_part_patch(uint8_t part_index, synth_patch_t *patch)
+{
+    part_t *part = &m_parts[part_index];
+
+    portENTER_CRITICAL(&m_patch_lock);
+    if(part->pending_state != PATCH_CURRENT)
+        patch_get_params(&part->pending, patch);
+    else if(part->morphing)
+        *patch = part->morph_from;
+    else
+        patch_get_params(&part->patch, patch);
+    portEXIT_CRITICAL(&m_patch_lock);
+}
+
+/* the envelope (normalized to the amplitude) t seconds after the start of the
+ * given stage
+ */
+static float envelope_shape(const envelope_params_t *params, voice_state_t stage, float t)
+{
+    float sustain = ENVELOPE_PEAK * params->sustain;
+
+    switch(stage) {
+    case VOICE_ATTACK:
+        return 1.0 - expf(-ENVELOPE_TIME_CONSTANTS * t / params->attack);
+    case VOICE_DECAY:
+        return sustain + (ENVELOPE_PEAK - sustain) * expf(-ENVELOPE_TIME_CONSTANTS * t / params->decay);
+    case VOICE_RELEASE:
+        return sustain * expf(-ENVELOPE_TIME_CONSTANTS * t / params->release);
+    default:
+        return 0.0;
+    }
 }
 
 void synth_map_envelope(uint8_t *buffer, uint16_t width, uint8_t height, float *time_window)
 {
-    xSemaphoreTake(m_osc_sem, portMAX_DELAY);
+    synth_patch_t patch;
+    envelope_params_t params;
+    float step;
+    float t;
 
-    float sample;
-    int total_envelope_buffer_size = m_envelope.attack_decay_buffer_size + m_envelope.release_buffer_size;
-    /* calculate the steps by which we sample the envelope buffers;
-     * we leave 20% of the total width for a "sustain plateau";
-     * we round up (+1) this increment to avoid missing parts of the
-     * envelope due to rounding errors
-     */
-    int increment = total_envelope_buffer_size / (width - width / 5) + 1;
-    /* width of the "sustain plateau" in terms of envelope buffer
-     * samples
-     */
-    int sustain_plateau_width = increment * width / 5;
-    int offset = 0;
+    synth_get_patch(&patch);
+    params = patch.envelope;
 
-    /* calculate time window (envelope buffers are downsampled by a factor of 100
-     * with respect to SAMPLING_FREQ)
+    /* each stage is drawn for its nominal time; we leave 20% of the total width
+     * for a "sustain plateau"
      */
-    *time_window = (float) width * increment / SAMPLING_FREQ * 100;
+    step = (params.attack + params.decay + params.release) / (width - width / 5);
+    *time_window = width * step;
 
-    /* downsample the envelope buffers to fit into buffer */
     for(int i = 0; i < width; i++) {
-        /* are we in the sustain plateau? */
-        if((offset >= m_envelope.attack_decay_buffer_size) &&
-            (offset < m_envelope.attack_decay_buffer_size + sustain_plateau_width)) {
-            sample = m_envelope.attack_decay_buffer[m_envelope.attack_decay_buffer_size - 1];
-        /* are we within the window of the two envelope buffers? */
-        } else if (offset < total_envelope_buffer_size + sustain_plateau_width) {
-            sample = (offset < m_envelope.attack_decay_buffer_size)
-                    ? m_envelope.attack_decay_buffer[offset]
-                    : m_envelope.release_buffer[offset - sustain_plateau_width - m_envelope.attack_decay_buffer_size];
-        /* if the total envelope buffer size is smaller than the width we want to plot, set zeros */
-        } else {
-            buffer[i] = 0;
+        t = i * step;
+        if(t < params.attack) {
+            buffer[i] = envelope_shape(&params, VOICE_ATTACK, t) * height;
             continue;
         }
-
-        buffer[i] = sample / m_envelope.params.amplitude * height;
-
-        offset += increment;
+        t -= params.attack;
+        if(t < params.decay) {
+            buffer[i] = envelope_shape(&params, VOICE_DECAY, t) * height;
+            continue;
+        }
+        t -= params.decay;
+        if(t < step * (width / 5)) {
+            buffer[i] = envelope_shape(&params, VOICE_DECAY, params.decay) * height;
+            continue;
+        }
+        t -= step * (width / 5);
+        buffer[i] = (t < params.release) ? envelope_shape(&params, VOICE_RELEASE, t) * height : 0;
     }
-
-    xSemaphoreGive(m_osc_sem);
 }
 
 int synth_init(oscillator_params_t *osc1_params, oscillator_params_t *osc2_params,
@@ -622,18 +1517,25 @@ int synth_init(oscillator_params_t *osc1_params, oscillator_params_t *osc2_param
     m_osc_sem = xSemaphoreCreateBinary();
     xSemaphoreGive(m_osc_sem);
 
-    /* set parameters */
-    m_osc1.downsampling_factor = 1;
-    m_osc2.downsampling_factor = 1;
-    m_lfo.downsampling_factor = 100;
+    m_event_queue = xQueueCreate(EVENT_QUEUE_SIZE, sizeof(event_t));
 
-    m_envelope.trigger_offset = 0xFFFFFFFF;
-    m_envelope.release_offset = 0xFFFFFFFF;
+    /* all parts start with the same patch, which is also their morph target
+     * until another one is set
+     */
+    for(int i = 0; i < SYNTH_PART_COUNT; i++) {
+        m_parts[i].mod.bend_range = MOD_BEND_RANGE_DEFAULT;
+        m_parts[i].voice_limit = SYNTH_VOICE_COUNT;
+        m_parts[i].volume = 1.0;
+        m_selected_part = i;
+        synth_update(osc1_params, osc2_params, lfo_params, envelope_params, synth_params);
+        synth_get_patch(&m_parts[i].morph_to);
+    }
+    m_selected_part = 0;
 
-    synth_update(osc1_params, osc2_params, lfo_params, envelope_params, synth_params);
+    return 0;
+}
 
-    /* start synth_task */
+void synth_start(void)
+{
     xTaskCreatePinnedToCore(synth_task, "synth_task", 4096, NULL, 1, NULL, 1);
-
-    return 0;
-}
\ No newline at end of file
+}
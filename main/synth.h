@@ -7,10 +7,19 @@
 extern "C" {
 #endif
 
+#define SYNTH_SAMPLING_FREQ     (44100)
+
+/* MIDI channels 1 to SYNTH_PART_COUNT are played by a part each, the other
+ * channels by the first part; all parts share the voices
+ */
+#define SYNTH_PART_COUNT        (4)
+#define SYNTH_VOICE_COUNT       (8)
+
 typedef enum {
     WAVEFORM_SINUS,
     WAVEFORM_SAWTOOTH,
     WAVEFORM_SQUARE,
+    WAVEFORM_SAMPLE,        // OSC1 only, see sampler.h
 } waveform_t;
 
 typedef struct {
@@ -27,29 +36,113 @@ typedef struct {
     float amplitude;
 } envelope_params_t;
 
+/* LFO period when synced to MIDI clock */
+typedef enum {
+    LFO_SYNC_OFF,
+    LFO_SYNC_WHOLE,
+    LFO_SYNC_HALF,
+    LFO_SYNC_QUARTER,
+    LFO_SYNC_EIGHTH,
+    LFO_SYNC_SIXTEENTH,
+} lfo_sync_t;
+
 typedef struct {
     uint8_t lfo_enabled;
     uint8_t osc2_sync_enabled;
     float noise_amplitude;
+    uint8_t lfo_sync;       // lfo_sync_t
+    uint8_t tuning;         // see tuning.h
 } synth_params_t;
 
+/* the complete set of sound parameters */
+typedef struct {
+    oscillator_params_t osc1;
+    oscillator_params_t osc2;
+    oscillator_params_t lfo;
+    envelope_params_t envelope;
+    synth_params_t synth;
+} synth_patch_t;
+
+/* synth_init() sets up all parts with the same patch, which can then be changed
+ * (e.g. to restore the last session) before synth_start() starts rendering
+ */
 int synth_init(oscillator_params_t *osc1_params, oscillator_params_t *osc2_params,
                 oscillator_params_t *lfo_params, envelope_params_t *envelope_params,
                 synth_params_t *synth_params);
+void synth_start(void);
 void synth_update(oscillator_params_t *osc1_params, oscillator_params_t *osc2_params,
                             oscillator_params_t *lfo_params, envelope_params_t *envelope_params,
                             synth_params_t *synth_params);
-void synth_key_press(uint8_t key, uint8_t velocity);
-void synth_key_release(uint8_t key);
+
+/* returns 1 if all parameters of a patch are in range; patches that are not are
+ * rejected by synth_update(), they should not be stored either
+ */
+int synth_patch_is_valid(const synth_patch_t *patch);
+
+/* The patch functions (synth_update(), synth_get_params(), synth_update_*(),
+ * ...) act on the selected part.
+ */
+void synth_select_part(uint8_t part);
+uint8_t synth_get_selected_part(void);
+
+/* mixer settings of the selected part; the voice limit is the number of voices
+ * after which the part steals its own voices
+ */
+void synth_set_part_voices(uint8_t voices);
+uint8_t synth_get_part_voices(void);
+void synth_set_part_volume(float volume);
+float synth_get_part_volume(void);
+void synth_set_part_pan(float pan);         // -1.0 (left) ... 1.0 (right)
+float synth_get_part_pan(void);
+
+/* Morphing of the selected part: at a morph amount above 0, every continuous
+ * parameter is interpolated between the part's own patch (as set with the
+ * functions above) and the target patch, the other parameters switch at 0.5.
+ * The amount is smoothed and evaluated once per block by the render loop.
+ */
+void synth_set_morph_target(const synth_patch_t *patch);
+void synth_set_morph(float amount);         // 0.0 ... 1.0
+float synth_get_morph(void);
+
+void synth_key_press(uint8_t channel, uint8_t key, uint8_t velocity);
+void synth_key_release(uint8_t channel, uint8_t key);
+
+/* schedules a note event at a position on the sample clock (see
+ * synth_get_sample_position()); events in the past are applied at the start of
+ * the next block; returns -1 if too many events are pending
+ */
+int synth_schedule_key_press(uint32_t sample, uint8_t channel, uint8_t key, uint8_t velocity);
+int synth_schedule_key_release(uint32_t sample, uint8_t channel, uint8_t key);
+
+/* Modulation sources of a channel's part; they are smoothed and applied once
+ * per block. Pitch bend is -1.0 ... 1.0 and scaled by the bend range (in
+ * semitones), modulation and pressure (0.0 ... 1.0) control the vibrato depth.
+ */
+void synth_set_pitch_bend(uint8_t channel, float bend);
+void synth_set_pitch_bend_range(uint8_t channel, float semitones);
+void synth_set_modulation(uint8_t channel, float modulation);
+void synth_set_pressure(uint8_t channel, float pressure);
+void synth_set_key_pressure(uint8_t channel, uint8_t key, float pressure);
+void synth_set_sustain(uint8_t channel, uint8_t enabled);
 
 void synth_get_params(oscillator_params_t *osc1_params, oscillator_params_t *osc2_params,
                         oscillator_params_t *lfo_params, envelope_params_t *envelope_params,
                         synth_params_t *synth_params);
 
+void synth_get_patch(synth_patch_t *patch);
+void synth_get_part_patch(uint8_t part, synth_patch_t *patch);     // of any part
+
 void synth_map_envelope(uint8_t *buffer, uint16_t width, uint8_t height, float *time_window);
 
 void synth_enable_lfo(uint8_t enabled);
 void synth_enable_osc2_sync(uint8_t enabled);
+void synth_set_lfo_sync(lfo_sync_t sync);
+void synth_set_tuning(uint8_t tuning);
+
+/* converts a time (esp_timer_get_time() time base) to a position on the sample
+ * clock, i.e. the sample that is being rendered at that time
+ */
+uint32_t synth_get_sample_position(int64_t time_us);
 
 void synth_update_osc1_freq(float freq);
 void synth_update_osc1_amp(float amp);
@@ -0,0 +1,204 @@
+#include "sysex.h"
+#include "preset.h"
+#include "midi_parser.h"
+
+#include <string.h>
+
+#include "esp_log.h"
+
+static const char *TAG = "SYSEX";
+
+#define SYSEX_HEADER_LENGTH         (3)     // manufacturer, model, command
+
+/* one outgoing message, including the framing bytes; messages are built and
+ * sent one at a time, so a dump never needs more memory than this
+ */
+static uint8_t m_message[1 + SYSEX_MAX_LENGTH + 1];
+
+static size_t sysex_pack(uint8_t *dst, const uint8_t *src, size_t size)
+{
+    size_t length = 0;
+    size_t group;
+    uint8_t *msbs;
+
+    for(size_t i = 0; i < size; i += 7) {
+        msbs = &dst[length++];
+        *msbs = 0;
+        group = (size - i < 7) ? size - i : 7;
+        for(size_t j = 0; j < group; j++) {
+            *msbs |= (src[i + j] >> 7) << j;
+            dst[length++] = src[i + j] & 0x7f;
+        }
+    }
+
+    return length;
+}
+
+/* returns the number of unpacked bytes */
+static size_t sysex_unpack(uint8_t *dst, size_t dst_size, const uint8_t *src, size_t length)
+{
+    size_t size = 0;
+    uint8_t msbs = 0;
+
+    for(size_t i = 0; i < length; i++) {
+        if(i % 8 == 0) {
+            msbs = src[i];
+            continue;
+        }
+        if(size == dst_size)
+            break;
+        dst[size++] = src[i] | (((msbs >> (i % 8 - 1)) & 0x01) << 7);
+    }
+
+    return size;
+}
+
+static uint8_t sysex_checksum(const uint8_t *data, size_t length)
+{
+    uint8_t sum = 0;
+
+    for(size_t i = 0; i < length; i++) {
+        sum += data[i];
+    }
+
+    return (128 - (sum & 0x7f)) & 0x7f;
+}
+
+static void sysex_send(uint8_t command, uint8_t index, const void *data, size_t size, sysex_send_t send)
+{
+    size_t length = 0;
+
+    m_message[length++] = MIDI_SB_SYSEX_START;
+    m_message[length++] = SYSEX_MANUFACTURER_ID;
+    m_message[length++] = SYSEX_MODEL_ID;
+    m_message[length++] = command;
+    m_message[length++] = index;
+    length += sysex_pack(&m_message[length], (const uint8_t *) data, size);
+    m_message[length] = sysex_checksum(&m_message[1 + SYSEX_HEADER_LENGTH], length - 1 - SYSEX_HEADER_LENGTH);
+    length++;
+    m_message[length++] = MIDI_SB_SYSEX_END;
+
+    send(m_message, length);
+}
+
+static void sysex_dump(sysex_send_t send)
+{
+    synth_patch_t patch;
+    uint8_t record[PRESET_MAX_RECORD_SIZE];
+    sequencer_track_t track;
+
+    if(send == NULL) {
+        ESP_LOGE(TAG, "Dump requested on an input without output");
+        return;
+    }
+
+    ESP_LOGI(TAG, "Dumping presets");
+
+    for(int i = 0; i < PRESET_COUNT; i++) {
+        if(preset_read(i, &patch) == 0)
+            sysex_send(SYSEX_CMD_PRESET, i, record, preset_encode(&patch, record), send);
+    }
+
+    synth_get_patch(&patch);
+    sysex_send(SYSEX_CMD_PRESET, SYSEX_INDEX_CURRENT, record, preset_encode(&patch, record), send);
+
+    for(int i = 0; i < SEQUENCER_TRACK_COUNT; i++) {
+        sequencer_get_track(i, &track);
+        sysex_send(SYSEX_CMD_PATTERN_TRACK, i, &track, sizeof(track), send);
+    }
+}
+
+/* checks length and checksum of a message with index, data (of at most
+ * max_size bytes) and checksum
+ */
+static int sysex_check(const uint8_t *data, uint16_t length, size_t max_size)
+{
+    if((length < 2) || (length > 1 + SYSEX_PACKED_SIZE(max_size) + 1)) {
+        ESP_LOGE(TAG, "Invalid length: %u", length);
+        return -1;
+    }
+
+    if(sysex_checksum(data, length) != 0) {
+        ESP_LOGE(TAG, "Invalid checksum");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* the preset goes through the same checks as one that is read from storage
+ * (including the range of its parameters) before it is applied or stored
+ */
+static void sysex_load(const uint8_t *data, uint16_t length)
+{
+    uint8_t record[PRESET_MAX_RECORD_SIZE];
+    size_t size;
+    synth_patch_t patch;
+    uint8_t index;
+
+    if(sysex_check(data, length, sizeof(record)) < 0)
+        return;
+
+    index = data[0];
+    size = sysex_unpack(record, sizeof(record), &data[1], length - 2);
+
+    if(preset_decode(record, size, &patch) < 0) {
+        ESP_LOGE(TAG, "Invalid preset");
+        return;
+    }
+
+    if(index == SYSEX_INDEX_CURRENT) {
+        ESP_LOGI(TAG, "Loading current patch");
+        synth_update(&patch.osc1, &patch.osc2, &patch.lfo, &patch.envelope, &patch.synth);
+    } else if(index < PRESET_COUNT) {
+        ESP_LOGI(TAG, "Loading preset %d", index);
+        preset_write(index, &patch);
+    } else {
+        ESP_LOGE(TAG, "Invalid preset index: %d", index);
+    }
+}
+
+static void sysex_load_track(const uint8_t *data, uint16_t length)
+{
+    sequencer_track_t track;
+    uint8_t index;
+
+    if(sysex_check(data, length, sizeof(track)) < 0)
+        return;
+
+    index = data[0];
+    if(index >= SEQUENCER_TRACK_COUNT) {
+        ESP_LOGE(TAG, "Invalid track index: %d", index);
+        return;
+    }
+
+    if(sysex_unpack((uint8_t *) &track, sizeof(track), &data[1], length - 2) != sizeof(track)) {
+        ESP_LOGE(TAG, "Invalid track length: %u", length);
+        return;
+    }
+
+    ESP_LOGI(TAG, "Loading track %d", index);
+    sequencer_set_track(index, &track);
+}
+
+void sysex_process(const uint8_t *data, uint16_t length, sysex_send_t send)
+{
+    /* not addressed to us */
+    if((length < SYSEX_HEADER_LENGTH) || (data[0] != SYSEX_MANUFACTURER_ID) || (data[1] != SYSEX_MODEL_ID))
+        return;
+
+    switch(data[2]) {
+    case SYSEX_CMD_DUMP_REQUEST:
+        sysex_dump(send);
+        break;
+    case SYSEX_CMD_PRESET:
+        sysex_load(&data[SYSEX_HEADER_LENGTH], length - SYSEX_HEADER_LENGTH);
+        break;
+    case SYSEX_CMD_PATTERN_TRACK:
+        sysex_load_track(&data[SYSEX_HEADER_LENGTH], length - SYSEX_HEADER_LENGTH);
+        break;
+    default:
+        ESP_LOGE(TAG, "Unknown command: 0x%02X", data[2]);
+        break;
+    }
+}
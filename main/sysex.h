@@ -0,0 +1,62 @@
+#ifndef SYSEX_H
+#define SYSEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "preset.h"
+#include "sequencer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* SysEx messages of the synth have the format
+ *
+ *     F0 7D 53 <command> [<index> <data> <checksum>] F7
+ *
+ * 0x7D is the manufacturer ID for non-commercial use, 0x53 identifies this
+ * synth. Preset data is a preset record (see preset.h) and pattern data a
+ * sequencer track (see sequencer.h, it is all bytes), packed into 7-bit
+ * bytes: every group of up to 7 bytes is preceded by a byte holding their most
+ * significant bits (bit i for byte i of the group). The checksum is chosen so
+ * that the sum of index, data and checksum is 0 (modulo 128).
+ */
+#define SYSEX_MANUFACTURER_ID       (0x7d)
+#define SYSEX_MODEL_ID              (0x53)
+
+/* requests a dump of all stored presets, the current patch and the current
+ * pattern
+ */
+#define SYSEX_CMD_DUMP_REQUEST      (0x01)
+/* one preset; sent in a dump and accepted to load a preset */
+#define SYSEX_CMD_PRESET            (0x02)
+
+/* one track of the current pattern, the index is the track number; sent in a
+ * dump and accepted to load a track (it is saved with the preset)
+ */
+#define SYSEX_CMD_PATTERN_TRACK     (0x03)
+
+/* preset index of the current (unsaved) patch */
+#define SYSEX_INDEX_CURRENT         (0x7f)
+
+#define SYSEX_PACKED_SIZE(size)     ((size) + ((size) + 6) / 7)
+
+#define SYSEX_MAX(a, b)             (((a) > (b)) ? (a) : (b))
+
+/* largest message, without the F0 and F7 framing bytes */
+#define SYSEX_MAX_LENGTH            (3 + 1 + SYSEX_PACKED_SIZE(SYSEX_MAX(PRESET_MAX_RECORD_SIZE, \
+                                                                sizeof(sequencer_track_t))) + 1)
+
+typedef void (*sysex_send_t)(const uint8_t *data, size_t length);
+
+/* processes a received SysEx message (without the F0 and F7 framing bytes);
+ * replies are passed to send, which may be NULL if there is no output
+ */
+void sysex_process(const uint8_t *data, uint16_t length, sysex_send_t send);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SYSEX_H
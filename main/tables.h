@@ -0,0 +1,58 @@
+#ifndef TABLES_H
+#define TABLES_H
+
+#include <stdint.h>
+
+#include "synth.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Lookup tables of the synth, generated by tables.py at build time (see
+ * CMakeLists.txt). They are const, so they stay in flash and nothing is
+ * calculated at boot. The constants have to match the ones in tables.py.
+ */
+
+/* one period of a sine, indexed by the upper SINE_TABLE_BITS bits of the phase */
+#define SINE_TABLE_BITS         (11)
+#define SINE_TABLE_SIZE         (1 << SINE_TABLE_BITS)
+extern const float sine_table[SINE_TABLE_SIZE];
+
+/* phase increment (2^32 per period) of each MIDI note at SYNTH_SAMPLING_FREQ,
+ * equal temperament with A4 (note 69) at 440 Hz
+ */
+#define NOTE_COUNT              (128)
+extern const uint32_t note_phase_increments[NOTE_COUNT];
+
+/* Band-limited sawtooth and square waves. Band b is for phase increments below
+ * 2^(WAVETABLE_FIRST_BAND_BITS + b) and only has the harmonics that stay below
+ * the Nyquist frequency at that increment, so the oscillators do not alias.
+ * The samples are scaled by WAVETABLE_PEAK, which leaves room for the overshoot
+ * at the edges (Gibbs phenomenon) and for the fundamental of the square wave
+ * alone (4/pi).
+ */
+#define WAVETABLE_BITS              (11)
+#define WAVETABLE_SIZE              (1 << WAVETABLE_BITS)
+#define WAVETABLE_BANDS             (11)
+#define WAVETABLE_FIRST_BAND_BITS   (21)
+#define WAVETABLE_PEAK              (1.3f)
+extern const int16_t wavetable_sawtooth[WAVETABLE_BANDS][WAVETABLE_SIZE];
+extern const int16_t wavetable_square[WAVETABLE_BANDS][WAVETABLE_SIZE];
+
+/* the band for a phase increment */
+static inline int wavetable_band(uint32_t increment)
+{
+    int bits = (increment != 0) ? 32 - __builtin_clz(increment) : 0;
+    int band = bits - WAVETABLE_FIRST_BAND_BITS;
+
+    if(band < 0)
+        return 0;
+    return (band < WAVETABLE_BANDS) ? band : WAVETABLE_BANDS - 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TABLES_H
@@ -0,0 +1,122 @@
+"""Generates the synth's lookup tables (tables.c) at build time, so that they are
+const arrays in flash and nothing has to be calculated at boot or per note.
+
+See tables.h for the layout of the tables; the constants here have to match it.
+"""
+import argparse
+import math
+
+SINE_TABLE_BITS = 11
+WAVETABLE_BITS = 11
+WAVETABLE_BANDS = 11
+WAVETABLE_FIRST_BAND_BITS = 21
+WAVETABLE_PEAK = 1.3
+NOTE_COUNT = 128
+PHASE_RANGE = 2 ** 32
+
+
+def note_frequency(key):
+    return 440.0 * 2.0 ** ((key - 69) / 12.0)
+
+
+def phase_increment(frequency, sampling_freq):
+    return int(frequency * PHASE_RANGE / sampling_freq)
+
+
+def band_harmonics(band):
+    """Number of harmonics of a band: its highest fundamental is
+    2^(WAVETABLE_FIRST_BAND_BITS + band) as a phase increment, and all
+    harmonics have to stay below the Nyquist frequency (2^31), and below the
+    Nyquist frequency of the table."""
+    harmonics = 2 ** (31 - WAVETABLE_FIRST_BAND_BITS - band)
+    return max(1, min(harmonics, 2 ** (WAVETABLE_BITS - 1) - 1))
+
+
+def additive(weight, size):
+    """Returns the tables of all bands for the harmonic weights weight(k). The
+    bands share their lower harmonics, so they are summed up from the band with
+    the fewest harmonics."""
+    sine = [math.sin(2.0 * math.pi * i / size) for i in range(size)]
+    values = [0.0] * size
+    tables = [None] * WAVETABLE_BANDS
+    k = 1
+    for band in reversed(range(WAVETABLE_BANDS)):
+        while k <= band_harmonics(band):
+            w = weight(k)
+            if w:
+                for i in range(size):
+                    values[i] += w * sine[k * i % size]
+            k += 1
+        tables[band] = list(values)
+    return tables
+
+
+def sawtooth(k):
+    """Rising from -1 to 1 like the naive sawtooth (phase / 2^31 - 1)."""
+    return -2.0 / math.pi / k
+
+
+def square(k):
+    """1 in the first half of the period, -1 in the second one."""
+    return 4.0 / math.pi / k if k % 2 else 0.0
+
+
+def format_array(values, per_line, fmt):
+    lines = []
+    for i in range(0, len(values), per_line):
+        lines.append("    " + " ".join(fmt.format(v) + "," for v in values[i:i + per_line]))
+    return "\n".join(lines)
+
+
+def float_literal(value):
+    literal = "{:.9g}".format(value)
+    return literal + ("f" if ("." in literal or "e" in literal) else ".0f")
+
+
+def to_int16(value):
+    return max(-32767, min(32767, round(value / WAVETABLE_PEAK * 32767)))
+
+
+def generate(sampling_freq):
+    size = 2 ** WAVETABLE_BITS
+    sine = [math.sin(2.0 * math.pi * i / 2 ** SINE_TABLE_BITS) for i in range(2 ** SINE_TABLE_BITS)]
+    increments = [phase_increment(note_frequency(key), sampling_freq) for key in range(NOTE_COUNT)]
+
+    out = ["/* generated by tables.py, do not edit */",
+           '#include "tables.h"',
+           "",
+           "_Static_assert(SYNTH_SAMPLING_FREQ == {}, \"tables.py was run for another sampling rate\");"
+           .format(sampling_freq),
+           "",
+           "const float sine_table[SINE_TABLE_SIZE] = {",
+           format_array([float_literal(v) for v in sine], 8, "{}"),
+           "};",
+           "",
+           "const uint32_t note_phase_increments[NOTE_COUNT] = {",
+           format_array(increments, 8, "{:#010x}"),
+           "};",
+           ""]
+    for name, weight in (("sawtooth", sawtooth), ("square", square)):
+        tables = additive(weight, size)
+        out.append("const int16_t wavetable_{}[WAVETABLE_BANDS][WAVETABLE_SIZE] = {{".format(name))
+        for band in range(WAVETABLE_BANDS):
+            out.append("    {{   // {} harmonics".format(band_harmonics(band)))
+            out.append(format_array([to_int16(v) for v in tables[band]], 12, "{:6d}"))
+            out.append("    },")
+        out.append("};")
+        out.append("")
+    return "\n".join(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Generate the synth's lookup tables")
+    parser.add_argument("filename", help="C file to write")
+    parser.add_argument("--sampling-freq", type=int, default=44100)
+    args = parser.parse_args()
+
+    with open(args.filename, "w") as f:
+        f.write(generate(args.sampling_freq))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,318 @@
+#include "tempo.h"
+#include "synth.h"
+
+#include <math.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "esp_timer.h"
+
+#define SAMPLES_PER_TICK(bpm)   (60.0 * SYNTH_SAMPLING_FREQ / TEMPO_PPQN / (bpm))
+
+/* Loop gains of the PLL. The clock bytes are timestamped when the MIDI task
+ * reads them, so they carry a jitter of up to a few milliseconds (i.e. a good
+ * fraction of a tick at fast tempos). The phase gain pulls the predicted tick
+ * towards the measured one, the frequency gain corrects the tick length. With
+ * PLL_FREQUENCY_GAIN = PLL_PHASE_GAIN^2 / 4 the loop is critically damped and
+ * settles within about 50 clocks (two beats).
+ */
+#define PLL_PHASE_GAIN          (0.2)
+#define PLL_FREQUENCY_GAIN      (0.01)
+
+/* a clock that is off by more than this many ticks restarts the estimation */
+#define PLL_MAX_ERROR_TICKS     (2.0)
+
+/* number of clocks after which the estimate is considered to be locked */
+#define PLL_LOCK_CLOCKS         (TEMPO_PPQN)
+
+/* the position is not extrapolated further than this many ticks beyond the
+ * last clock, so that synced modulation stops when the clock stops
+ */
+#define MAX_EXTRAPOLATION_TICKS (4.0)
+
+/* a clock that has not been received for this many ticks is considered to have
+ * stopped, the estimation starts over with the next one
+ */
+#define PLL_TIMEOUT_TICKS       (8.0)
+
+typedef struct {
+    uint32_t clock_count;       // number of clocks since the estimation (re)started
+    uint32_t last_sample;       // arrival of the last clock
+    /* filtered time of the last tick (integer part and fraction) */
+    uint32_t tick_sample;
+    float tick_fraction;
+    float samples_per_tick;
+    /* song position in ticks; -1 means the next clock is the first tick after
+     * a start message
+     */
+    int32_t ticks;
+    /* clocks received since the transport stopped; they do not move the song
+     * position, but synced modulation keeps following them
+     */
+    uint32_t stopped_ticks;
+    uint8_t running;
+} tempo_t;
+
+static portMUX_TYPE m_lock = portMUX_INITIALIZER_UNLOCKED;
+static tempo_t m_tempo = {
+    .samples_per_tick = SAMPLES_PER_TICK(120.0),
+};
+
+static float tempo_clamp_samples_per_tick(float samples_per_tick)
+{
+    if(samples_per_tick < SAMPLES_PER_TICK(TEMPO_BPM_MAX))
+        return SAMPLES_PER_TICK(TEMPO_BPM_MAX);
+    if(samples_per_tick > SAMPLES_PER_TICK(TEMPO_BPM_MIN))
+        return SAMPLES_PER_TICK(TEMPO_BPM_MIN);
+    return samples_per_tick;
+}
+
+/* not threadsafe, should be called with the lock taken */
+static void tempo_restart(uint32_t sample)
+{
+    m_tempo.clock_count = 1;
+    m_tempo.tick_sample = sample;
+    m_tempo.tick_fraction = 0.0;
+}
+
+/* This is a second order PLL that runs once per clock, in constant time. */
+void tempo_clock(uint32_t sample)
+{
+    float error;
+    float advance;
+    float whole;
+
+    portENTER_CRITICAL(&m_lock);
+
+    /* DAWs keep sending the clock while they are stopped, continue has to
+     * resume where the transport stopped
+     */
+    if(m_tempo.running) {
+        m_tempo.ticks++;
+    } else {
+        m_tempo.stopped_ticks++;
+    }
+
+    if(m_tempo.clock_count == 0) {
+        tempo_restart(sample);
+    } else if(m_tempo.clock_count == 1) {
+        /* the first interval is the initial estimate */
+        m_tempo.samples_per_tick = tempo_clamp_samples_per_tick((int32_t) (sample - m_tempo.last_sample));
+        tempo_restart(sample);
+        m_tempo.clock_count = 2;
+    } else {
+        /* deviation of this clock from the predicted one */
+        error = (float) (int32_t) (sample - m_tempo.tick_sample) - m_tempo.tick_fraction - m_tempo.samples_per_tick;
+
+        if(fabsf(error) > PLL_MAX_ERROR_TICKS * m_tempo.samples_per_tick) {
+            /* the clock was interrupted or the tempo jumped */
+            tempo_restart(sample);
+        } else {
+            advance = m_tempo.tick_fraction + m_tempo.samples_per_tick + PLL_PHASE_GAIN * error;
+            whole = floorf(advance);
+            m_tempo.tick_sample += (int32_t) whole;
+            m_tempo.tick_fraction = advance - whole;
+            m_tempo.samples_per_tick = tempo_clamp_samples_per_tick(
+                m_tempo.samples_per_tick + PLL_FREQUENCY_GAIN * error);
+            m_tempo.clock_count++;
+        }
+    }
+    m_tempo.last_sample = sample;
+
+    portEXIT_CRITICAL(&m_lock);
+}
+
+void tempo_start(void)
+{
+    portENTER_CRITICAL(&m_lock);
+    m_tempo.ticks = -1;
+    m_tempo.running = 1;
+    portEXIT_CRITICAL(&m_lock);
+}
+
+void tempo_continue(void)
+{
+    portENTER_CRITICAL(&m_lock);
+    m_tempo.running = 1;
+    portEXIT_CRITICAL(&m_lock);
+}
+
+void tempo_stop(void)
+{
+    portENTER_CRITICAL(&m_lock);
+    m_tempo.running = 0;
+    m_tempo.stopped_ticks = 0;
+    portEXIT_CRITICAL(&m_lock);
+}
+
+void tempo_set_song_position(uint16_t beats)
+{
+    portENTER_CRITICAL(&m_lock);
+    /* the next clock plays the given position */
+    m_tempo.ticks = (int32_t) beats * (TEMPO_PPQN / 4) - 1;
+    m_tempo.stopped_ticks = 0;
+    portEXIT_CRITICAL(&m_lock);
+}
+
+/* not threadsafe, should be called with the lock taken; returns 1 if the
+ * estimate is locked to a clock that is still received at the given sample
+ */
+static int tempo_is_locked(uint32_t sample)
+{
+    if(m_tempo.clock_count < PLL_LOCK_CLOCKS)
+        return 0;
+
+    if((int32_t) (sample - m_tempo.last_sample) > PLL_TIMEOUT_TICKS * m_tempo.samples_per_tick) {
+        m_tempo.clock_count = 0;
+        return 0;
+    }
+
+    return 1;
+}
+
+float tempo_get_bpm(void)
+{
+    uint32_t sample = synth_get_sample_position(esp_timer_get_time());
+    float samples_per_tick;
+    int locked;
+
+    portENTER_CRITICAL(&m_lock);
+    samples_per_tick = m_tempo.samples_per_tick;
+    locked = tempo_is_locked(sample);
+    portEXIT_CRITICAL(&m_lock);
+
+    if(!locked)
+        return 0.0;
+
+    return 60.0 * SYNTH_SAMPLING_FREQ / TEMPO_PPQN / samples_per_tick;
+}
+
+int tempo_is_running(void)
+{
+    return m_tempo.running;
+}
+
+int tempo_get_position(uint32_t sample, float *ticks, float *samples_per_tick)
+{
+    tempo_t tempo;
+    float fraction;
+    int locked;
+
+    portENTER_CRITICAL(&m_lock);
+    locked = tempo_is_locked(sample);
+    tempo = m_tempo;
+    portEXIT_CRITICAL(&m_lock);
+
+    if(!locked)
+        return 0;
+
+    fraction = ((float) (int32_t) (sample - tempo.tick_sample) - tempo.tick_fraction) / tempo.samples_per_tick;
+    if(fraction < 0.0)
+        fraction = 0.0;
+    if(fraction > MAX_EXTRAPOLATION_TICKS)
+        fraction = MAX_EXTRAPOLATION_TICKS;
+
+    *ticks = (tempo.ticks < 0 ? 0 : tempo.ticks) + (tempo.running ? 0 : tempo.stopped_ticks) + fraction;
+    *samples_per_tick = tempo.samples_per_tick;
+
+    return 1;
+}
+
+void tempo_steps_start(tempo_steps_t *steps, uint32_t sample)
+{
+    steps->running = 1;
+    steps->clock_locked = 0;
+    steps->held = 0;
+    steps->step = 0;
+    steps->sample = sample;
+    steps->fraction = 0.0;
+}
+
+void tempo_steps_stop(tempo_steps_t *steps)
+{
+    steps->running = 0;
+    steps->held = 0;
+}
+
+/* the position of each step is accumulated with its fraction, so the tempo
+ * does not drift by rounding
+ */
+static void tempo_steps_internal(tempo_steps_t *steps, uint32_t block_start, uint32_t block_size,
+                                    float samples_per_step, tempo_step_fn_t play)
+{
+    float next;
+
+    if(!steps->running)
+        tempo_steps_start(steps, block_start);
+
+    while((int32_t) (steps->sample - (block_start + block_size)) < 0) {
+        play(steps->step++, steps->sample, samples_per_step);
+
+        next = steps->fraction + samples_per_step;
+        steps->sample += (uint32_t) next;
+        steps->fraction = next - floorf(next);
+    }
+}
+
+/* steps of the MIDI clock, placed at the sample where the clock's estimated
+ * position crosses them
+ */
+static void tempo_steps_clock(tempo_steps_t *steps, uint32_t block_start, uint32_t block_size, float ticks,
+                                float samples_per_tick, int ticks_per_step, tempo_step_fn_t play)
+{
+    int32_t step = (int32_t) ceilf(ticks / ticks_per_step);
+    float end = ticks + block_size / samples_per_tick;
+    float position;
+
+    /* The estimate is corrected with every clock, so a step can fall slightly
+     * before the block (it is then played at the start of the block) or be
+     * reached again (it is not repeated). Anything more is a start or a jump
+     * of the song position pointer.
+     */
+    if(!steps->running || !steps->clock_locked || (steps->step < step - 1) || (steps->step > step + 1)) {
+        steps->running = 1;
+        steps->clock_locked = 1;
+        steps->held = 0;
+        steps->step = step;
+    }
+
+    for(; (float) steps->step * ticks_per_step < end; steps->step++) {
+        position = ((float) steps->step * ticks_per_step - ticks) * samples_per_tick;
+        play(steps->step, block_start + ((position > 0.0) ? (uint32_t) position : 0),
+                samples_per_tick * ticks_per_step);
+    }
+}
+
+void tempo_steps_process(tempo_steps_t *steps, uint32_t block_start, uint32_t block_size, float bpm,
+                            int ticks_per_step, tempo_step_fn_t play)
+{
+    float ticks;
+    float samples_per_tick;
+
+    /* While the MIDI clock is received, the steps follow its transport, i.e.
+     * they are silent after a stop. Steps that were stopped by the transport, or
+     * that were following a clock that is no longer received (see
+     * PLL_TIMEOUT_TICKS), stay stopped until they are started again locally
+     * (tempo_steps_stop() and tempo_steps_start()); only then, or if they never
+     * followed the clock, do they run on the internal tempo.
+     */
+    if(tempo_get_position(block_start, &ticks, &samples_per_tick)) {
+        if(tempo_is_running()) {
+            tempo_steps_clock(steps, block_start, block_size, ticks, samples_per_tick, ticks_per_step, play);
+        } else {
+            steps->running = 0;
+            steps->held = 1;
+        }
+        return;
+    }
+
+    if(steps->clock_locked) {
+        steps->running = 0;
+        steps->clock_locked = 0;
+        steps->held = 1;
+    }
+    if(steps->held)
+        return;
+
+    tempo_steps_internal(steps, block_start, block_size, SAMPLES_PER_TICK(bpm) * ticks_per_step, play);
+}
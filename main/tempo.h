@@ -0,0 +1,72 @@
+#ifndef TEMPO_H
+#define TEMPO_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* MIDI clock resolution, in ticks per quarter note */
+#define TEMPO_PPQN              (24)
+
+/* tempo range that is accepted, in BPM */
+#define TEMPO_BPM_MIN           (20.0)
+#define TEMPO_BPM_MAX           (300.0)
+
+/* called by the MIDI task for the corresponding real-time messages; sample is
+ * the arrival time of the clock byte on the synth's sample clock (see
+ * synth_get_sample_position())
+ */
+void tempo_clock(uint32_t sample);
+void tempo_start(void);
+void tempo_continue(void);
+void tempo_stop(void);
+
+/* song position pointer, in MIDI beats (sixteenth notes) */
+void tempo_set_song_position(uint16_t beats);
+
+/* returns the estimated tempo in BPM, or 0 if no clock is received */
+float tempo_get_bpm(void);
+
+/* returns 1 if the transport is running (between start/continue and stop) */
+int tempo_is_running(void);
+
+/* Returns the position at the given sample in clock ticks since the last start
+ * (including the fraction of the current tick) and the length of a tick in
+ * samples. While the transport is stopped, the clocks that are still received
+ * are added on top of the song position, which only moves while it runs.
+ * Returns 0 if the tempo is not known, or if the clock stopped being received.
+ */
+int tempo_get_position(uint32_t sample, float *ticks, float *samples_per_tick);
+
+/* Step clock for the render loop (sequencer, arpeggiator): divides either the
+ * MIDI clock (while it is received, following its transport) or an internal
+ * tempo into steps of a number of ticks, and calls play with the exact sample
+ * of every step that falls into a block. Once the steps followed the MIDI
+ * transport, a stop or the loss of the clock keeps them stopped until they are
+ * stopped and started locally; they never start on the internal tempo by
+ * themselves.
+ */
+typedef void (*tempo_step_fn_t)(int32_t step, uint32_t sample, float samples_per_step);
+
+typedef struct {
+    uint8_t running;
+    uint8_t clock_locked;       // following the MIDI clock
+    uint8_t held;               // stopped by the MIDI transport or clock
+    int32_t step;               // next step to be played
+    uint32_t sample;            // position of the next step, on the internal clock
+    float fraction;             // fractional part of sample
+} tempo_steps_t;
+
+/* (re)starts the internal clock with step 0 at the given sample */
+void tempo_steps_start(tempo_steps_t *steps, uint32_t sample);
+void tempo_steps_stop(tempo_steps_t *steps);
+void tempo_steps_process(tempo_steps_t *steps, uint32_t block_start, uint32_t block_size, float bpm,
+                            int ticks_per_step, tempo_step_fn_t play);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TEMPO_H
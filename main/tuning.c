@@ -0,0 +1,310 @@
+#include "tuning.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+static const char *TAG = "TUNING";
+
+#define TUNING_FILENAME_LENGTH  (32)
+#define TUNING_MAX_FILE_SIZE    (8192)
+#define TUNING_LINE_LENGTH      (128)
+
+#define PHASE_RANGE             (4294967296.0)     // 2^32, one period
+
+/* Only written by tuning_init(), before any notes are played; tuning 0 is
+ * the generated table.
+ */
+static uint32_t m_tables[TUNING_COUNT][NOTE_COUNT];
+static uint8_t m_loaded[TUNING_COUNT];
+
+/* copies the next line that is not a comment into line (truncated if it is too
+ * long) and advances text past it; returns -1 at the end of the text
+ */
+static int tuning_next_line(const char **text, char *line)
+{
+    const char *start;
+    size_t length;
+
+    while(**text != '\0') {
+        start = *text;
+        length = strcspn(start, "\r\n");
+        *text = start + length;
+        if(**text == '\r')
+            (*text)++;
+        if(**text == '\n')
+            (*text)++;
+
+        if(start[0] == '!')
+            continue;
+
+        if(length >= TUNING_LINE_LENGTH)
+            length = TUNING_LINE_LENGTH - 1;
+        memcpy(line, start, length);
+        line[length] = '\0';
+        return 0;
+    }
+
+    return -1;
+}
+
+/* as tuning_next_line(), but also skips empty lines */
+static int tuning_next_value(const char **text, char *line)
+{
+    do {
+        if(tuning_next_line(text, line) != 0)
+            return -1;
+    } while(line[strspn(line, " \t")] == '\0');
+
+    return 0;
+}
+
+static int tuning_parse_int(const char *line, int *value)
+{
+    char *end;
+    long parsed = strtol(line, &end, 10);
+
+    if(end == line)
+        return -1;
+
+    *value = (int) parsed;
+    return 0;
+}
+
+/* a pitch is in cents if it contains a period, otherwise it is a ratio ("3/2")
+ * or an integer ("2"); anything after the value is ignored
+ */
+static int tuning_parse_pitch(const char *line, double *cents)
+{
+    char value[TUNING_LINE_LENGTH];
+    long numerator;
+    long denominator = 1;
+    char *end;
+
+    if(sscanf(line, "%127s", value) != 1)
+        return -1;
+
+    if(strchr(value, '.') != NULL) {
+        *cents = strtod(value, &end);
+        return (end == value) ? -1 : 0;
+    }
+
+    numerator = strtol(value, &end, 10);
+    if(end == value)
+        return -1;
+    if(*end == '/')
+        denominator = strtol(end + 1, &end, 10);
+    if((numerator <= 0) || (denominator <= 0))
+        return -1;
+
+    *cents = 1200.0 * log2((double) numerator / denominator);
+    return 0;
+}
+
+int tuning_parse_scl(const char *text, tuning_scale_t *scale)
+{
+    char line[TUNING_LINE_LENGTH];
+
+    /* the description, which may be empty */
+    if(tuning_next_line(&text, line) != 0) {
+        ESP_LOGE(TAG, "Empty scale");
+        return -1;
+    }
+
+    if((tuning_next_value(&text, line) != 0) || (tuning_parse_int(line, &scale->count) != 0)
+            || (scale->count < 1) || (scale->count > TUNING_MAX_NOTES)) {
+        ESP_LOGE(TAG, "Invalid number of notes");
+        return -1;
+    }
+
+    for(int i = 0; i < scale->count; i++) {
+        if((tuning_next_value(&text, line) != 0) || (tuning_parse_pitch(line, &scale->cents[i]) != 0)) {
+            ESP_LOGE(TAG, "Invalid pitch of degree %d", i + 1);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int tuning_parse_kbm(const char *text, tuning_keymap_t *keymap)
+{
+    char line[TUNING_LINE_LENGTH];
+    int degree;
+    int *header[] = {
+        &keymap->size, &keymap->first, &keymap->last, &keymap->middle, &keymap->reference,
+    };
+
+    for(size_t i = 0; i < sizeof(header) / sizeof(header[0]); i++) {
+        if((tuning_next_value(&text, line) != 0) || (tuning_parse_int(line, header[i]) != 0)) {
+            ESP_LOGE(TAG, "Invalid keyboard mapping header");
+            return -1;
+        }
+    }
+    if((tuning_next_value(&text, line) != 0) || (sscanf(line, "%lf", &keymap->frequency) != 1)
+            || (keymap->frequency <= 0.0)
+            || (tuning_next_value(&text, line) != 0) || (tuning_parse_int(line, &keymap->octave_degree) != 0)) {
+        ESP_LOGE(TAG, "Invalid keyboard mapping header");
+        return -1;
+    }
+    if((keymap->size < 0) || (keymap->size > NOTE_COUNT)) {
+        ESP_LOGE(TAG, "Invalid keyboard mapping size: %d", keymap->size);
+        return -1;
+    }
+
+    /* entries that are missing at the end are not mapped */
+    for(int i = 0; i < keymap->size; i++) {
+        keymap->map[i] = TUNING_UNMAPPED;
+        if(tuning_next_value(&text, line) != 0)
+            continue;
+        if(line[strspn(line, " \t")] == 'x')
+            continue;
+        if(tuning_parse_int(line, &degree) != 0) {
+            ESP_LOGE(TAG, "Invalid keyboard mapping entry %d", i);
+            return -1;
+        }
+        keymap->map[i] = degree;
+    }
+
+    return 0;
+}
+
+void tuning_default_keymap(tuning_keymap_t *keymap, const tuning_scale_t *scale)
+{
+    keymap->size = 0;
+    keymap->first = 0;
+    keymap->last = NOTE_COUNT - 1;
+    keymap->middle = 60;
+    keymap->reference = 69;
+    keymap->frequency = 440.0;
+    keymap->octave_degree = scale->count;
+}
+
+/* rounds towards negative infinity, for keys below the middle key */
+static int floor_div(int a, int b)
+{
+    return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+/* the scale degree of a key, returns -1 if the key is not mapped */
+static int tuning_key_degree(const tuning_scale_t *scale, const tuning_keymap_t *keymap, int key, int *degree)
+{
+    int offset = key - keymap->middle;
+    int octave_degree = (keymap->octave_degree > 0) ? keymap->octave_degree : scale->count;
+    int pattern;
+    int index;
+
+    if(keymap->size == 0) {
+        *degree = offset;
+        return 0;
+    }
+
+    pattern = floor_div(offset, keymap->size);
+    index = offset - pattern * keymap->size;
+    if(keymap->map[index] == TUNING_UNMAPPED)
+        return -1;
+
+    *degree = keymap->map[index] + pattern * octave_degree;
+    return 0;
+}
+
+/* the pitch of a degree above degree 0, the scale repeats at its last degree
+ * (which need not be an octave)
+ */
+static double tuning_degree_cents(const tuning_scale_t *scale, int degree)
+{
+    int period = floor_div(degree, scale->count);
+    int step = degree - period * scale->count;
+
+    return period * scale->cents[scale->count - 1] + ((step > 0) ? scale->cents[step - 1] : 0.0);
+}
+
+int tuning_calculate(const tuning_scale_t *scale, const tuning_keymap_t *keymap,
+                        uint32_t increments[NOTE_COUNT])
+{
+    int degree;
+    double reference_cents;
+    double frequency;
+    double increment;
+
+    if(tuning_key_degree(scale, keymap, keymap->reference, &degree) != 0) {
+        ESP_LOGE(TAG, "The reference key %d is not mapped", keymap->reference);
+        return -1;
+    }
+    reference_cents = tuning_degree_cents(scale, degree);
+
+    for(int key = 0; key < NOTE_COUNT; key++) {
+        increments[key] = 0;
+        if((key < keymap->first) || (key > keymap->last)
+                || (tuning_key_degree(scale, keymap, key, &degree) != 0))
+            continue;
+
+        frequency = keymap->frequency * exp2((tuning_degree_cents(scale, degree) - reference_cents) / 1200.0);
+        increment = frequency * PHASE_RANGE / SYNTH_SAMPLING_FREQ;
+        /* limited to the Nyquist frequency, like the modulated increments */
+        increments[key] = (increment < PHASE_RANGE / 2) ? (uint32_t) increment : 0x7fffffff;
+    }
+
+    return 0;
+}
+
+/* reads a whole file into buffer (null-terminated) */
+static int tuning_read_file(const char *filename, char *buffer, size_t size)
+{
+    FILE *f;
+    size_t bytes_read;
+
+    f = fopen(filename, "r");
+    if(f == NULL)
+        return -1;
+
+    bytes_read = fread(buffer, 1, size, f);
+    fclose(f);
+
+    if(bytes_read >= size) {
+        ESP_LOGE(TAG, "%s is too large", filename);
+        return -1;
+    }
+    buffer[bytes_read] = '\0';
+
+    return 0;
+}
+
+void tuning_init(void)
+{
+    /* only used here, at boot */
+    static char text[TUNING_MAX_FILE_SIZE + 1];
+    static tuning_scale_t scale;
+    static tuning_keymap_t keymap;
+    char filename[TUNING_FILENAME_LENGTH];
+
+    for(int i = 1; i < TUNING_COUNT; i++) {
+        snprintf(filename, sizeof(filename), "/spiffs/TUNING%d.SCL", i);
+        if(tuning_read_file(filename, text, sizeof(text)) != 0)
+            continue;
+        if(tuning_parse_scl(text, &scale) != 0)
+            continue;
+
+        tuning_default_keymap(&keymap, &scale);
+        snprintf(filename, sizeof(filename), "/spiffs/TUNING%d.KBM", i);
+        if((tuning_read_file(filename, text, sizeof(text)) == 0) && (tuning_parse_kbm(text, &keymap) != 0))
+            continue;
+
+        if(tuning_calculate(&scale, &keymap, m_tables[i]) != 0)
+            continue;
+
+        m_loaded[i] = 1;
+        ESP_LOGI(TAG, "Tuning %d: %d notes, period %.2f cents", i, scale.count, scale.cents[scale.count - 1]);
+    }
+}
+
+const uint32_t *tuning_get_increments(uint8_t index)
+{
+    if((index < TUNING_COUNT) && m_loaded[index])
+        return m_tables[index];
+
+    return note_phase_increments;
+}
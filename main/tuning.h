@@ -0,0 +1,71 @@
+#ifndef TUNING_H
+#define TUNING_H
+
+#include <stdint.h>
+
+#include "tables.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Tunings map the MIDI notes to phase increments. Tuning 0 is equal
+ * temperament with A4 at 440 Hz, tunings 1 ... TUNING_COUNT - 1 are Scala
+ * files (/spiffs/TUNING<n>.SCL, with an optional keyboard mapping in
+ * /spiffs/TUNING<n>.KBM). The files are parsed into tables once, by
+ * tuning_init(), so that a note only needs a table lookup.
+ */
+#define TUNING_COUNT            (8)
+#define TUNING_MAX_NOTES        (128)       // of a scale
+
+/* the degrees 1 ... count of a scale in cents, the last one is the period
+ * (usually an octave); degree 0 is the implicit 1/1
+ */
+typedef struct {
+    int count;
+    double cents[TUNING_MAX_NOTES];
+} tuning_scale_t;
+
+#define TUNING_UNMAPPED         (-1)
+
+/* a keyboard mapping, see https://www.huygens-fokker.org/scala/help.htm#mappings */
+typedef struct {
+    int size;               // 0 maps the keys to consecutive degrees
+    int first;              // keys outside first ... last are not mapped
+    int last;
+    int middle;             // key of degree 0
+    int reference;          // key that is tuned to frequency
+    double frequency;
+    int octave_degree;      // degree at which the mapping repeats
+    int16_t map[NOTE_COUNT];    // degree of each key in the pattern, TUNING_UNMAPPED for none
+} tuning_keymap_t;
+
+/* parse the text of .scl and .kbm files (null-terminated), return -1 if it is
+ * not valid
+ */
+int tuning_parse_scl(const char *text, tuning_scale_t *scale);
+int tuning_parse_kbm(const char *text, tuning_keymap_t *keymap);
+
+/* the mapping that is used without a .kbm file: consecutive keys, degree 0 at
+ * middle C (60), A4 (69) at 440 Hz
+ */
+void tuning_default_keymap(tuning_keymap_t *keymap, const tuning_scale_t *scale);
+
+/* calculates the phase increment of every key at SYNTH_SAMPLING_FREQ; keys that
+ * are not mapped get an increment of 0; returns -1 if the reference key is not
+ * mapped
+ */
+int tuning_calculate(const tuning_scale_t *scale, const tuning_keymap_t *keymap,
+                        uint32_t increments[NOTE_COUNT]);
+
+/* loads the tunings from SPIFFS */
+void tuning_init(void);
+
+/* the phase increments of a tuning (equal temperament if it is not loaded) */
+const uint32_t *tuning_get_increments(uint8_t index);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TUNING_H
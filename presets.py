@@ -0,0 +1,98 @@
+import argparse
+
+from PyQt5.QtCore import QIODevice
+from PyQt5.QtSerialPort import QSerialPort
+
+# see main/sysex.h
+SYSEX_START = 0xf0
+SYSEX_END = 0xf7
+SYSEX_HEADER = bytes([0x7d, 0x53])
+SYSEX_CMD_DUMP_REQUEST = 0x01
+SYSEX_CMD_PRESET = 0x02
+SYSEX_CMD_PATTERN_TRACK = 0x03
+
+DUMP_TIMEOUT_MS = 2000
+
+
+def open_port(port_name):
+    port = QSerialPort()
+    port.setPortName(port_name)
+    port.setBaudRate(115200)
+    if not port.open(QIODevice.ReadWrite):
+        raise RuntimeError("Cannot open serial port: " + port_name)
+    return port
+
+
+def find_message(data, start):
+    """Returns the position of the next preset or pattern track message, or -1."""
+    positions = [data.find(bytes([SYSEX_START]) + SYSEX_HEADER + bytes([command]), start)
+                 for command in (SYSEX_CMD_PRESET, SYSEX_CMD_PATTERN_TRACK)]
+    positions = [p for p in positions if p >= 0]
+    return min(positions) if positions else -1
+
+
+def split_messages(data):
+    """Returns the synth's preset and pattern track messages (including framing)
+    found in data. The console also carries log output, so everything outside of
+    them is skipped."""
+    messages = []
+    start = find_message(data, 0)
+    while start >= 0:
+        end = data.find(bytes([SYSEX_END]), start)
+        if end < 0:
+            break
+        message = data[start:end + 1]
+        # index, data and checksum sum up to 0 (modulo 128)
+        if all(b < 0x80 for b in message[1:-1]) and sum(message[4:-1]) % 128 == 0:
+            messages.append(message)
+        else:
+            print("Skipping corrupted message for index", message[4])
+        start = find_message(data, end)
+    return messages
+
+
+def dump(port, filename):
+    port.write(bytes([SYSEX_START]) + SYSEX_HEADER + bytes([SYSEX_CMD_DUMP_REQUEST, SYSEX_END]))
+    port.waitForBytesWritten(DUMP_TIMEOUT_MS)
+
+    data = bytearray()
+    while port.waitForReadyRead(DUMP_TIMEOUT_MS):
+        data += bytes(port.readAll())
+
+    messages = split_messages(data)
+    with open(filename, "wb") as f:
+        for message in messages:
+            f.write(message)
+    print("{} presets and pattern tracks written to {}".format(len(messages), filename))
+
+
+def load(port, filename):
+    with open(filename, "rb") as f:
+        messages = split_messages(f.read())
+
+    for message in messages:
+        port.write(message)
+        port.waitForBytesWritten(DUMP_TIMEOUT_MS)
+        # give the synth time to write the preset to flash
+        port.waitForReadyRead(500)
+        port.readAll()
+    print("{} presets and pattern tracks loaded from {}".format(len(messages), filename))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Back up and restore presets via SysEx")
+    parser.add_argument("command", choices=["dump", "load"])
+    parser.add_argument("port_name")
+    parser.add_argument("filename", help="SysEx (.syx) file")
+    args = parser.parse_args()
+
+    port = open_port(args.port_name)
+    if args.command == "dump":
+        dump(port, args.filename)
+    else:
+        load(port, args.filename)
+    port.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -5,4 +5,9 @@
 
 esp_err_t sgtl5000_init(i2c_port_t port, uint8_t i2c_address);
 
+/* polls the chip ID until the codec answers, which it only does once it is
+ * powered and SYS_MCLK is running; returns ESP_ERR_TIMEOUT after timeout_ms
+ */
+esp_err_t sgtl5000_wait_ready(i2c_port_t port, uint8_t i2c_address, uint32_t timeout_ms);
+
 #endif // SGTL5000_H
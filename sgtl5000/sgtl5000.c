@@ -1,5 +1,8 @@
 #include "sgtl5000.h"
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
 #include "esp_log.h"
 
 static const char *TAG = "CODEC";
@@ -95,6 +98,26 @@ static esp_err_t sgtl5000_write_reg(uint16_t reg_addr, uint16_t val)
     return ret;
 }
 
+esp_err_t sgtl5000_wait_ready(i2c_port_t port, uint8_t i2c_address, uint32_t timeout_ms)
+{
+    TickType_t start = xTaskGetTickCount();
+    uint16_t reg_val;
+
+    hw_config.i2c_port = port;
+    hw_config.i2c_address = i2c_address;
+
+    for(;;) {
+        if((sgtl5000_read_reg(SGTL5000_REG_CHIP_ID, &reg_val) == ESP_OK) && ((reg_val & 0xFF00) == 0xA000))
+            return ESP_OK;
+
+        if(xTaskGetTickCount() - start >= timeout_ms / portTICK_PERIOD_MS) {
+            ESP_LOGE(TAG, "No answer after %u ms", timeout_ms);
+            return ESP_ERR_TIMEOUT;
+        }
+        vTaskDelay(1);
+    }
+}
+
 esp_err_t sgtl5000_init(i2c_port_t port, uint8_t i2c_address)
 {
     uint16_t reg_val;
@@ -0,0 +1,44 @@
+"""Writes the files that test_assets bundles with assets.py; test_assets.c
+checks the bundle against the same formulas."""
+import os
+import struct
+import sys
+
+PRESET_SIZE = 63            # not a multiple of the alignment
+WAVETABLE_SIZE = 256
+
+
+def frame(index, i):
+    return (i * (97 + index)) % 65535 - 32767
+
+
+def wav(index, sampling_freq, frames, root_key=None, loop=None):
+    data = struct.pack("<{}h".format(frames), *(frame(index, i) for i in range(frames)))
+    chunks = struct.pack("<4sIHHIIHH", b"fmt ", 16, 1, 1, sampling_freq, sampling_freq * 2, 2, 16)
+    chunks += struct.pack("<4sI", b"data", len(data)) + data + bytes(len(data) & 1)
+    if root_key is not None:
+        smpl = struct.pack("<9I", 0, 0, 0, root_key, 0, 0, 0, 1 if loop else 0, 0)
+        if loop:
+            smpl += struct.pack("<6I", 0, 0, loop[0], loop[1] - 1, 0, 0)   # the end is inclusive
+        chunks += struct.pack("<4sI", b"smpl", len(smpl)) + smpl
+    return struct.pack("<4sI4s", b"RIFF", 4 + len(chunks), b"WAVE") + chunks
+
+
+def main():
+    directory = sys.argv[1]
+    os.makedirs(directory, exist_ok=True)
+    files = {
+        "PRESET0": bytes(range(PRESET_SIZE)),
+        "saw.raw": struct.pack("<{}h".format(WAVETABLE_SIZE), *(-32767 + 256 * i for i in range(WAVETABLE_SIZE))),
+        # zones: root key 48 with a loop, 72 without one, and 60 without a smpl chunk
+        "low.wav": wav(0, 22050, 1001, 48, (100, 900)),
+        "high.wav": wav(1, 44100, 777, 72),
+        "mid.wav": wav(2, 32000, 500),
+    }
+    for name, data in files.items():
+        with open(os.path.join(directory, name), "wb") as f:
+            f.write(data)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,152 @@
+#include "fakes.h"
+
+#include "synth.h"
+#include "arpeggiator.h"
+#include "sequencer.h"
+#include "tempo.h"
+#include "sysex.h"
+#include "preset.h"
+#include "smf_player.h"
+#include "midi_learn.h"
+#include "logger.h"
+
+param_id_t fake_cc_map[128] = {
+    [0 ... 127] = PARAM_NONE,
+};
+
+synth_patch_t fake_patch;
+
+int fake_cc_count;
+float fake_modulation;
+float fake_bend_range;
+int fake_notes_on;
+void (*fake_cc_hook)(uint8_t cc);
+
+void synth_set_pitch_bend(uint8_t channel, float bend) {}
+void synth_set_pitch_bend_range(uint8_t channel, float semitones) { fake_bend_range = semitones; }
+void synth_set_modulation(uint8_t channel, float modulation) { fake_modulation = modulation; }
+void synth_set_pressure(uint8_t channel, float pressure) {}
+void synth_set_key_pressure(uint8_t channel, uint8_t key, float pressure) {}
+void synth_set_sustain(uint8_t channel, uint8_t enabled) {}
+
+static struct {
+    uint8_t part;
+    uint8_t voices;
+    float volume;
+    float pan;
+    float morph;
+    int preset;
+    int morph_target;
+    int song;
+    uint8_t seq_playing;
+    uint8_t seq_recording;
+    float seq_tempo;
+    arp_mode_t arp_mode;
+    uint8_t arp_octaves;
+    arp_rate_t arp_rate;
+    uint8_t arp_latch;
+} m_state;
+
+void synth_get_patch(synth_patch_t *patch) { *patch = fake_patch; }
+void synth_update_osc1_amp(float amp) { fake_patch.osc1.amplitude = amp; }
+void synth_update_osc1_waveform(waveform_t wf) { fake_patch.osc1.waveform = wf; }
+void synth_update_osc2_freq(float freq) { fake_patch.osc2.frequency = freq; }
+void synth_update_osc2_amp(float amp) { fake_patch.osc2.amplitude = amp; }
+void synth_update_osc2_waveform(waveform_t wf) { fake_patch.osc2.waveform = wf; }
+void synth_update_lfo_freq(float freq) { fake_patch.lfo.frequency = freq; }
+void synth_update_lfo_waveform(waveform_t wf) { fake_patch.lfo.waveform = wf; }
+void synth_update_env_attack(float attack) { fake_patch.envelope.attack = attack; }
+void synth_update_env_decay(float decay) { fake_patch.envelope.decay = decay; }
+void synth_update_env_sustain(float sustain) { fake_patch.envelope.sustain = sustain; }
+void synth_update_env_release(float release) { fake_patch.envelope.release = release; }
+void synth_update_noise_amp(float amp) { fake_patch.synth.noise_amplitude = amp; }
+void synth_enable_lfo(uint8_t enabled) { fake_patch.synth.lfo_enabled = enabled; }
+void synth_enable_osc2_sync(uint8_t enabled) { fake_patch.synth.osc2_sync_enabled = enabled; }
+void synth_set_lfo_sync(lfo_sync_t sync) { fake_patch.synth.lfo_sync = sync; }
+void synth_set_tuning(uint8_t tuning) { fake_patch.synth.tuning = tuning; }
+
+void synth_select_part(uint8_t part) { m_state.part = part; }
+uint8_t synth_get_selected_part(void) { return m_state.part; }
+void synth_set_part_voices(uint8_t voices) { m_state.voices = voices; }
+uint8_t synth_get_part_voices(void) { return m_state.voices; }
+void synth_set_part_volume(float volume) { m_state.volume = volume; }
+float synth_get_part_volume(void) { return m_state.volume; }
+void synth_set_part_pan(float pan) { m_state.pan = pan; }
+float synth_get_part_pan(void) { return m_state.pan; }
+void synth_set_morph(float amount) { m_state.morph = amount; }
+float synth_get_morph(void) { return m_state.morph; }
+
+void preset_select(int index) { m_state.preset = index; }
+void preset_save(void) {}
+int preset_get_current_index(void) { return m_state.preset; }
+void preset_set_morph_target(int index) { m_state.morph_target = index; }
+int preset_get_morph_target(void) { return m_state.morph_target; }
+
+void smf_player_play(int index) { m_state.song = index; }
+
+void sequencer_set_playing(uint8_t playing) { m_state.seq_playing = playing; }
+uint8_t sequencer_is_playing(void) { return m_state.seq_playing; }
+void sequencer_set_tempo(float bpm) { m_state.seq_tempo = bpm; }
+float sequencer_get_tempo(void) { return m_state.seq_tempo; }
+void sequencer_set_record(uint8_t record) { m_state.seq_recording = record; }
+uint8_t sequencer_is_recording(void) { return m_state.seq_recording; }
+
+void arp_set_mode(arp_mode_t mode) { m_state.arp_mode = mode; }
+arp_mode_t arp_get_mode(void) { return m_state.arp_mode; }
+void arp_set_octaves(uint8_t octaves) { m_state.arp_octaves = octaves; }
+uint8_t arp_get_octaves(void) { return m_state.arp_octaves; }
+void arp_set_rate(arp_rate_t rate) { m_state.arp_rate = rate; }
+arp_rate_t arp_get_rate(void) { return m_state.arp_rate; }
+void arp_set_latch(uint8_t latch) { m_state.arp_latch = latch; }
+uint8_t arp_get_latch(void) { return m_state.arp_latch; }
+
+int synth_schedule_key_press(uint32_t sample, uint8_t channel, uint8_t key, uint8_t velocity)
+{
+    fake_notes_on++;
+    return 0;
+}
+
+int synth_schedule_key_release(uint32_t sample, uint8_t channel, uint8_t key)
+{
+    return 0;
+}
+
+uint32_t synth_get_sample_position(int64_t time_us)
+{
+    return time_us * SYNTH_SAMPLING_FREQ / 1000000;
+}
+
+int arp_key_press(uint32_t sample, uint8_t channel, uint8_t key, uint8_t velocity) { return 0; }
+int arp_key_release(uint32_t sample, uint8_t channel, uint8_t key) { return 0; }
+
+void sequencer_record_note(uint8_t key, uint8_t velocity) {}
+
+void tempo_clock(uint32_t sample) {}
+void tempo_start(void) {}
+void tempo_continue(void) {}
+void tempo_stop(void) {}
+void tempo_set_song_position(uint16_t beats) {}
+float tempo_get_bpm(void) { return 120.0; }
+
+void sysex_process(const uint8_t *data, uint16_t length, sysex_send_t send) {}
+
+void midi_learn_init(void) {}
+void midi_learn_start(param_id_t id) {}
+void midi_learn_reset(void) {}
+
+param_id_t midi_learn_get_param(uint8_t cc)
+{
+    return fake_cc_map[cc & 0x7f];
+}
+
+int midi_learn_process_cc(uint8_t cc)
+{
+    fake_cc_count++;
+    if(fake_cc_hook != NULL)
+        fake_cc_hook(cc);
+    return 0;
+}
+
+void logger_log(logger_message_t id, ...) {}
+void logger_console_lock(void) {}
+void logger_console_unlock(void) {}
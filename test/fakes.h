@@ -0,0 +1,28 @@
+/* Stand-ins for the modules around the MIDI task and the parameters (synth,
+ * presets, arpeggiator, sequencer, tempo, SysEx, controller map and logger).
+ * They only keep what they were set to, so that the tests of midi_input.c and
+ * params.c can check it; the getters return it.
+ */
+#ifndef FAKES_H
+#define FAKES_H
+
+#include <stdint.h>
+
+#include "params.h"
+
+/* controller map returned by midi_learn_get_param(), all PARAM_NONE initially */
+extern param_id_t fake_cc_map[128];
+
+/* the patch of the selected part, as set with the synth_update_*() functions */
+extern synth_patch_t fake_patch;
+
+/* controllers and notes as they were passed on to the synth */
+extern int fake_cc_count;
+extern float fake_modulation;
+extern float fake_bend_range;
+extern int fake_notes_on;
+
+/* called for every control change that reaches midi_learn_process_cc() */
+extern void (*fake_cc_hook)(uint8_t cc);
+
+#endif // FAKES_H
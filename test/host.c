@@ -0,0 +1,723 @@
+#include "host.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_crc.h"
+#include "esp_partition.h"
+
+#include "driver/gpio.h"
+#include "driver/i2s.h"
+
+#define HOST_GPIO_COUNT         (40)
+#define HOST_UART_BUFFER_SIZE   (4096)
+#define HOST_QUEUE_SET_SIZE     (8)
+#define HOST_PARTITION_COUNT    (4)
+#define HOST_MMU_PAGE_SIZE      (0x10000)
+
+int64_t host_time_us;
+int host_failures;
+
+/* pending falling edges of all UARTs, in the order of their time */
+typedef struct {
+    int64_t t_us;
+    int gpio_num;
+} host_edge_t;
+
+static host_edge_t *m_edges;
+static size_t m_edge_count;
+static size_t m_edge_capacity;
+
+static struct {
+    gpio_isr_t handler;
+    void *arg;
+} m_gpio_isr[HOST_GPIO_COUNT];
+static int m_isr_service_installed;
+
+struct host_queue {
+    uint8_t *items;
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t head;
+    UBaseType_t count;
+    /* members, if this is a queue set */
+    struct host_queue *members[HOST_QUEUE_SET_SIZE];
+    int member_count;
+};
+
+/* bytes of a UART with the time their stop bit is received */
+typedef struct {
+    uint8_t data[HOST_UART_BUFFER_SIZE];
+    int64_t received_us[HOST_UART_BUFFER_SIZE];
+    size_t head;
+    size_t tail;
+    size_t signalled;       // bytes for which an event was posted
+    int64_t line_free_us;   // end of the last byte that was sent
+    QueueHandle_t event_queue;
+    uint8_t *output;
+    size_t output_length;
+} host_uart_t;
+
+static host_uart_t m_uarts[UART_NUM_MAX];
+
+static struct {
+    double frame_us;
+    uint32_t dma_frames;
+    double end_us;
+} m_i2s;
+
+int64_t esp_timer_get_time(void)
+{
+    return host_time_us;
+}
+
+static int host_edge_compare(const void *a, const void *b)
+{
+    const host_edge_t *edge_a = a;
+    const host_edge_t *edge_b = b;
+
+    return (edge_a->t_us > edge_b->t_us) - (edge_a->t_us < edge_b->t_us);
+}
+
+static void host_add_edge(int64_t t_us, int gpio_num)
+{
+    if(m_edge_count == m_edge_capacity) {
+        m_edge_capacity = m_edge_capacity ? 2 * m_edge_capacity : 256;
+        m_edges = realloc(m_edges, m_edge_capacity * sizeof(host_edge_t));
+    }
+    m_edges[m_edge_count].t_us = t_us;
+    m_edges[m_edge_count].gpio_num = gpio_num;
+    m_edge_count++;
+}
+
+/* the driver posts an event for every byte that was received */
+static void host_uart_signal(host_uart_t *uart)
+{
+    uart_event_t event = {
+        .type = UART_DATA,
+        .size = 1,
+    };
+
+    while((uart->signalled != uart->head)
+            && (uart->received_us[uart->signalled % HOST_UART_BUFFER_SIZE] <= host_time_us)) {
+        if(uart->event_queue != NULL)
+            xQueueSend(uart->event_queue, &event, 0);
+        uart->signalled++;
+    }
+}
+
+void host_run_until(int64_t t_us)
+{
+    size_t i;
+
+    for(i = 0; (i < m_edge_count) && (m_edges[i].t_us <= t_us); i++) {
+        if(m_edges[i].t_us > host_time_us)
+            host_time_us = m_edges[i].t_us;
+        if(m_gpio_isr[m_edges[i].gpio_num].handler != NULL)
+            m_gpio_isr[m_edges[i].gpio_num].handler(m_gpio_isr[m_edges[i].gpio_num].arg);
+    }
+    memmove(m_edges, &m_edges[i], (m_edge_count - i) * sizeof(host_edge_t));
+    m_edge_count -= i;
+
+    if(t_us > host_time_us)
+        host_time_us = t_us;
+
+    for(int uart = 0; uart < UART_NUM_MAX; uart++)
+        host_uart_signal(&m_uarts[uart]);
+}
+
+int64_t host_uart_send(uart_port_t uart_num, int rx_gpio, int baud_rate, int64_t start_us,
+                        const uint8_t *data, size_t length)
+{
+    host_uart_t *uart = &m_uarts[uart_num];
+    double bit_us = 1000000.0 / baud_rate;
+    int64_t first_us;
+    double byte_us;
+    int level;
+    int bit;
+
+    if(start_us < host_time_us)
+        start_us = host_time_us;
+    if(start_us < uart->line_free_us)
+        start_us = uart->line_free_us;
+    byte_us = start_us;
+    first_us = start_us;
+
+    for(size_t i = 0; i < length; i++) {
+        /* start bit, 8 data bits (LSB first), stop bit; the line idles high */
+        level = 1;
+        for(int b = 0; b < 10; b++) {
+            bit = (b == 0) ? 0 : (b == 9) ? 1 : (data[i] >> (b - 1)) & 1;
+            if(level && !bit)
+                host_add_edge((int64_t) (byte_us + b * bit_us), rx_gpio);
+            level = bit;
+        }
+        byte_us += 10 * bit_us;
+
+        uart->data[uart->head % HOST_UART_BUFFER_SIZE] = data[i];
+        uart->received_us[uart->head % HOST_UART_BUFFER_SIZE] = (int64_t) byte_us;
+        uart->head++;
+    }
+    uart->line_free_us = (int64_t) byte_us;
+
+    qsort(m_edges, m_edge_count, sizeof(host_edge_t), host_edge_compare);
+
+    return first_us;
+}
+
+int uart_read_bytes(uart_port_t uart_num, void *buf, uint32_t length, TickType_t ticks_to_wait)
+{
+    host_uart_t *uart = &m_uarts[uart_num];
+    uint8_t *data = buf;
+    int count = 0;
+
+    while((count < length) && (uart->tail != uart->head)
+            && (uart->received_us[uart->tail % HOST_UART_BUFFER_SIZE] <= host_time_us)) {
+        data[count++] = uart->data[uart->tail % HOST_UART_BUFFER_SIZE];
+        uart->tail++;
+    }
+
+    return count;
+}
+
+esp_err_t uart_get_buffered_data_len(uart_port_t uart_num, size_t *size)
+{
+    host_uart_t *uart = &m_uarts[uart_num];
+    size_t tail;
+
+    for(tail = uart->tail; (tail != uart->head)
+            && (uart->received_us[tail % HOST_UART_BUFFER_SIZE] <= host_time_us); tail++)
+        ;
+    *size = tail - uart->tail;
+
+    return ESP_OK;
+}
+
+esp_err_t uart_flush_input(uart_port_t uart_num)
+{
+    host_uart_t *uart = &m_uarts[uart_num];
+
+    while((uart->tail != uart->head) && (uart->received_us[uart->tail % HOST_UART_BUFFER_SIZE] <= host_time_us))
+        uart->tail++;
+
+    return ESP_OK;
+}
+
+esp_err_t uart_param_config(uart_port_t uart_num, const uart_config_t *uart_config)
+{
+    return ESP_OK;
+}
+
+esp_err_t uart_set_pin(uart_port_t uart_num, int tx_io_num, int rx_io_num, int rts_io_num, int cts_io_num)
+{
+    return ESP_OK;
+}
+
+esp_err_t uart_driver_install(uart_port_t uart_num, int rx_buffer_size, int tx_buffer_size,
+                                int queue_size, QueueHandle_t *uart_queue, int intr_alloc_flags)
+{
+    m_uarts[uart_num].event_queue = xQueueCreate(queue_size, sizeof(uart_event_t));
+    if(uart_queue != NULL)
+        *uart_queue = m_uarts[uart_num].event_queue;
+
+    return ESP_OK;
+}
+
+esp_err_t uart_set_rx_full_threshold(uart_port_t uart_num, int threshold)
+{
+    return ESP_OK;
+}
+
+esp_err_t uart_set_rx_timeout(uart_port_t uart_num, const uint8_t tout_thresh)
+{
+    return ESP_OK;
+}
+
+int uart_write_bytes(uart_port_t uart_num, const void *src, size_t size)
+{
+    host_uart_t *uart = &m_uarts[uart_num];
+
+    uart->output = realloc(uart->output, uart->output_length + size);
+    memcpy(&uart->output[uart->output_length], src, size);
+    uart->output_length += size;
+
+    return size;
+}
+
+esp_err_t uart_wait_tx_done(uart_port_t uart_num, TickType_t ticks_to_wait)
+{
+    return ESP_OK;
+}
+
+const uint8_t *host_uart_output(uart_port_t uart_num, size_t *length)
+{
+    *length = m_uarts[uart_num].output_length;
+    return m_uarts[uart_num].output;
+}
+
+void host_uart_output_clear(uart_port_t uart_num)
+{
+    m_uarts[uart_num].output_length = 0;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    QueueHandle_t queue = calloc(1, sizeof(struct host_queue));
+
+    queue->items = calloc(length ? length : 1, item_size ? item_size : 1);
+    queue->length = length;
+    queue->item_size = item_size;
+
+    return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait)
+{
+    if(queue->count == queue->length)
+        return pdFALSE;
+
+    memcpy(&queue->items[((queue->head + queue->count) % queue->length) * queue->item_size], item, queue->item_size);
+    queue->count++;
+
+    return pdTRUE;
+}
+
+BaseType_t xQueueOverwrite(QueueHandle_t queue, const void *item)
+{
+    if(queue->count == queue->length)
+        queue->count--;
+
+    return xQueueSend(queue, item, 0);
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *buffer, TickType_t ticks_to_wait)
+{
+    if(queue->count == 0)
+        return pdFALSE;
+
+    memcpy(buffer, &queue->items[queue->head * queue->item_size], queue->item_size);
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+
+    return pdTRUE;
+}
+
+BaseType_t xQueueReset(QueueHandle_t queue)
+{
+    queue->head = 0;
+    queue->count = 0;
+
+    return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+    return queue->count;
+}
+
+QueueSetHandle_t xQueueCreateSet(UBaseType_t length)
+{
+    return calloc(1, sizeof(struct host_queue));
+}
+
+BaseType_t xQueueAddToSet(QueueSetMemberHandle_t member, QueueSetHandle_t set)
+{
+    if(set->member_count == HOST_QUEUE_SET_SIZE)
+        return pdFAIL;
+
+    set->members[set->member_count++] = member;
+    return pdPASS;
+}
+
+QueueSetMemberHandle_t xQueueSelectFromSet(QueueSetHandle_t set, TickType_t ticks_to_wait)
+{
+    for(int i = 0; i < set->member_count; i++) {
+        if(set->members[i]->count > 0)
+            return set->members[i];
+    }
+
+    return NULL;
+}
+
+esp_err_t gpio_install_isr_service(int intr_alloc_flags)
+{
+    if(m_isr_service_installed)
+        return ESP_ERR_INVALID_STATE;
+
+    m_isr_service_installed = 1;
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_intr_type(gpio_num_t gpio_num, gpio_int_type_t intr_type)
+{
+    return ((gpio_num >= 0) && (gpio_num < HOST_GPIO_COUNT)) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t gpio_isr_handler_add(gpio_num_t gpio_num, gpio_isr_t isr_handler, void *args)
+{
+    if(!m_isr_service_installed)
+        return ESP_ERR_INVALID_STATE;
+
+    m_gpio_isr[gpio_num].handler = isr_handler;
+    m_gpio_isr[gpio_num].arg = args;
+
+    return ESP_OK;
+}
+
+esp_err_t gpio_intr_enable(gpio_num_t gpio_num)
+{
+    return ESP_OK;
+}
+
+void host_i2s_init(uint32_t dma_frames, uint32_t sampling_freq)
+{
+    m_i2s.frame_us = 1000000.0 / sampling_freq;
+    m_i2s.dma_frames = dma_frames;
+    m_i2s.end_us = host_time_us;
+}
+
+double host_i2s_end_us(void)
+{
+    return m_i2s.end_us;
+}
+
+esp_err_t i2s_write(i2s_port_t i2s_num, const void *src, size_t size, size_t *bytes_written, TickType_t ticks_to_wait)
+{
+    uint32_t frames = size / (2 * sizeof(int16_t));
+    double free_us;
+
+    /* an underrun: the frames are played as soon as they are written */
+    if(m_i2s.end_us < host_time_us)
+        m_i2s.end_us = host_time_us;
+
+    /* wait until the frames fit into the DMA buffers */
+    free_us = m_i2s.end_us - (double) (m_i2s.dma_frames - frames) * m_i2s.frame_us;
+    if(free_us > host_time_us)
+        host_run_until((int64_t) (free_us + 0.999));
+
+    m_i2s.end_us += frames * m_i2s.frame_us;
+    *bytes_written = size;
+
+    return ESP_OK;
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void)
+{
+    pthread_mutex_t *mutex = malloc(sizeof(pthread_mutex_t));
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    return mutex;
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t semaphore, TickType_t ticks_to_wait)
+{
+    return (pthread_mutex_lock(semaphore) == 0) ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t semaphore)
+{
+    return (pthread_mutex_unlock(semaphore) == 0) ? pdTRUE : pdFALSE;
+}
+
+vprintf_like_t esp_log_set_vprintf(vprintf_like_t func)
+{
+    return vprintf;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char *name, uint32_t stack_depth,
+                                    void *parameters, UBaseType_t priority, TaskHandle_t *handle,
+                                    BaseType_t core_id)
+{
+    if(handle != NULL)
+        *handle = (TaskHandle_t) task;
+
+    return pdPASS;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    host_run_until(host_time_us + (int64_t) ticks * portTICK_PERIOD_MS * 1000);
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+}
+
+/* one notification value for all tasks, the tests only notify one; the task is
+ * not run, the test takes the value with xTaskNotifyWait()
+ */
+static uint32_t m_notification;
+static int m_notified;
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action)
+{
+    switch(action) {
+    case eSetBits:
+        m_notification |= value;
+        break;
+    case eIncrement:
+        m_notification++;
+        break;
+    case eSetValueWithOverwrite:
+    case eSetValueWithoutOverwrite:
+        if(m_notified && (action == eSetValueWithoutOverwrite))
+            return pdFAIL;
+        m_notification = value;
+        break;
+    default:
+        break;
+    }
+    m_notified = 1;
+
+    return pdPASS;
+}
+
+/* does not block, returns pdFALSE if there was no notification */
+BaseType_t xTaskNotifyWait(uint32_t clear_on_entry, uint32_t clear_on_exit, uint32_t *value, TickType_t ticks)
+{
+    if(!m_notified) {
+        m_notification &= ~clear_on_entry;
+        return pdFALSE;
+    }
+
+    if(value != NULL)
+        *value = m_notification;
+    m_notification &= ~clear_on_exit;
+    m_notified = 0;
+
+    return pdTRUE;
+}
+
+/* CRC-32 as in the ESP32's ROM (reflected, polynomial 0xedb88320) */
+uint32_t esp_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len)
+{
+    crc = ~crc;
+    while(len--) {
+        crc ^= *buf++;
+        for(int i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+
+    return ~crc;
+}
+
+/* The files in /spiffs are kept in a temporary directory of the test, which
+ * is removed when it exits. The file functions are wrapped by the linker (see
+ * CMakeLists.txt), so that the modules open their files unchanged.
+ */
+#define HOST_SPIFFS_PREFIX      "/spiffs/"
+
+static char m_spiffs_dir[] = "/tmp/spiffs.XXXXXX";
+static int m_spiffs_created;
+
+FILE *__real_fopen(const char *path, const char *mode);
+int __real_remove(const char *path);
+int __real_rename(const char *old_path, const char *new_path);
+
+static void host_spiffs_remove(void)
+{
+    char path[PATH_MAX];
+    struct dirent *entry;
+    DIR *dir;
+
+    dir = opendir(m_spiffs_dir);
+    if(dir == NULL)
+        return;
+    while((entry = readdir(dir)) != NULL) {
+        if(entry->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", m_spiffs_dir, entry->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+    rmdir(m_spiffs_dir);
+}
+
+static const char *host_spiffs_path(const char *path, char *buffer, size_t size)
+{
+    if(strncmp(path, HOST_SPIFFS_PREFIX, strlen(HOST_SPIFFS_PREFIX)) != 0)
+        return path;
+
+    if(!m_spiffs_created) {
+        if(mkdtemp(m_spiffs_dir) == NULL) {
+            perror("mkdtemp");
+            abort();
+        }
+        m_spiffs_created = 1;
+        atexit(host_spiffs_remove);
+    }
+
+    snprintf(buffer, size, "%s/%s", m_spiffs_dir, &path[strlen(HOST_SPIFFS_PREFIX)]);
+    return buffer;
+}
+
+FILE *__wrap_fopen(const char *path, const char *mode)
+{
+    char buffer[PATH_MAX];
+
+    return __real_fopen(host_spiffs_path(path, buffer, sizeof(buffer)), mode);
+}
+
+int __wrap_remove(const char *path)
+{
+    char buffer[PATH_MAX];
+
+    return __real_remove(host_spiffs_path(path, buffer, sizeof(buffer)));
+}
+
+int __wrap_rename(const char *old_path, const char *new_path)
+{
+    char old_buffer[PATH_MAX];
+    char new_buffer[PATH_MAX];
+
+    return __real_rename(host_spiffs_path(old_path, old_buffer, sizeof(old_buffer)),
+                            host_spiffs_path(new_path, new_buffer, sizeof(new_buffer)));
+}
+
+typedef struct {
+    esp_partition_t partition;
+    char filename[PATH_MAX];
+} host_partition_t;
+
+static host_partition_t m_partitions[HOST_PARTITION_COUNT];
+static int m_partition_count;
+
+/* the mappings by their handle - 1 */
+static struct {
+    void *data;
+    size_t size;
+} m_mappings[HOST_PARTITION_COUNT];
+
+int host_partition_add(const char *label, const char *filename)
+{
+    host_partition_t *partition = NULL;
+    FILE *f;
+    long size;
+
+    for(int i = 0; i < m_partition_count; i++) {
+        if(strcmp(m_partitions[i].partition.label, label) == 0)
+            partition = &m_partitions[i];
+    }
+    if(partition == NULL) {
+        if(m_partition_count == HOST_PARTITION_COUNT)
+            return -1;
+        partition = &m_partitions[m_partition_count++];
+    }
+
+    f = fopen(filename, "rb");
+    if(f == NULL)
+        return -1;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fclose(f);
+
+    memset(partition, 0, sizeof(*partition));
+    partition->partition.type = ESP_PARTITION_TYPE_DATA;
+    partition->partition.subtype = ESP_PARTITION_SUBTYPE_ANY;
+    partition->partition.size = (size + HOST_MMU_PAGE_SIZE - 1) / HOST_MMU_PAGE_SIZE * HOST_MMU_PAGE_SIZE;
+    snprintf(partition->partition.label, sizeof(partition->partition.label), "%s", label);
+    snprintf(partition->filename, sizeof(partition->filename), "%s", filename);
+
+    return 0;
+}
+
+int host_partition_mapped(void)
+{
+    int count = 0;
+
+    for(int i = 0; i < HOST_PARTITION_COUNT; i++)
+        count += (m_mappings[i].data != NULL);
+
+    return count;
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                                                const char *label)
+{
+    for(int i = 0; i < m_partition_count; i++) {
+        if((m_partitions[i].partition.type == type)
+                && ((subtype == ESP_PARTITION_SUBTYPE_ANY) || (m_partitions[i].partition.subtype == subtype))
+                && ((label == NULL) || (strcmp(m_partitions[i].partition.label, label) == 0)))
+            return &m_partitions[i].partition;
+    }
+
+    return NULL;
+}
+
+/* the mapping is read-only, like flash mapped into the data address space */
+esp_err_t esp_partition_mmap(const esp_partition_t *partition, size_t offset, size_t size,
+                                spi_flash_mmap_memory_t memory, const void **out_ptr,
+                                spi_flash_mmap_handle_t *out_handle)
+{
+    const host_partition_t *host_partition = (const host_partition_t *) partition;
+    uint8_t *data;
+    FILE *f;
+    int handle;
+
+    if((offset > partition->size) || (size > partition->size - offset))
+        return ESP_ERR_INVALID_ARG;
+
+    for(handle = 0; (handle < HOST_PARTITION_COUNT) && (m_mappings[handle].data != NULL); handle++)
+        ;
+    if(handle == HOST_PARTITION_COUNT)
+        return ESP_ERR_NO_MEM;
+
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(data == MAP_FAILED)
+        return ESP_ERR_NO_MEM;
+    memset(data, 0xff, size);
+
+    f = fopen(host_partition->filename, "rb");
+    if(f == NULL) {
+        munmap(data, size);
+        return ESP_FAIL;
+    }
+    fseek(f, offset, SEEK_SET);
+    fread(data, 1, size, f);
+    fclose(f);
+    mprotect(data, size, PROT_READ);
+
+    m_mappings[handle].data = data;
+    m_mappings[handle].size = size;
+    *out_ptr = data;
+    *out_handle = handle + 1;
+
+    return ESP_OK;
+}
+
+void spi_flash_munmap(spi_flash_mmap_handle_t handle)
+{
+    if((handle == 0) || (handle > HOST_PARTITION_COUNT) || (m_mappings[handle - 1].data == NULL)) {
+        fprintf(stderr, "spi_flash_munmap: invalid handle %u\n", handle);
+        abort();
+    }
+
+    munmap(m_mappings[handle - 1].data, m_mappings[handle - 1].size);
+    m_mappings[handle - 1].data = NULL;
+}
+
+int host_report(const char *name)
+{
+    if(host_failures) {
+        printf("%s: %d checks failed\n", name, host_failures);
+        return 1;
+    }
+
+    printf("%s: passed\n", name);
+    return 0;
+}
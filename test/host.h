@@ -0,0 +1,70 @@
+#ifndef HOST_H
+#define HOST_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "driver/uart.h"
+
+/* Stand-ins for the ESP-IDF and FreeRTOS functions that the modules under test
+ * call. Time is simulated: esp_timer_get_time() returns host_time_us, which only
+ * moves forward with host_run_until() (or a blocking i2s_write()), so the
+ * results do not depend on the speed of the host.
+ */
+extern int64_t host_time_us;
+
+/* advances the simulated time, delivering the UART edges up to t_us in order */
+void host_run_until(int64_t t_us);
+
+/* Sends bytes to a simulated UART (8N1), back to back from start_us (or later if
+ * that has passed or the previous bytes are still being sent). Each falling
+ * edge (the start bit and the 0 bits after a 1) is passed to the GPIO interrupt
+ * handler of rx_gpio, a byte can be read with uart_read_bytes() once its stop
+ * bit has been received. Returns the time of the first start bit.
+ */
+int64_t host_uart_send(uart_port_t uart_num, int rx_gpio, int baud_rate, int64_t start_us,
+                        const uint8_t *data, size_t length);
+
+/* the bytes written to a UART with uart_write_bytes() */
+const uint8_t *host_uart_output(uart_port_t uart_num, size_t *length);
+void host_uart_output_clear(uart_port_t uart_num);
+
+/* Simulated I2S output with DMA buffers of dma_frames (stereo) frames in total,
+ * played at sampling_freq. Playback starts with the first i2s_write(); if the
+ * buffers run empty, the next frames are played as soon as they are written.
+ */
+void host_i2s_init(uint32_t dma_frames, uint32_t sampling_freq);
+
+/* time at which the last frame written so far leaves the I2S bus */
+double host_i2s_end_us(void);
+
+/* Files in /spiffs (fopen(), remove() and rename()) are kept in a temporary
+ * directory per test, which starts out empty.
+ */
+
+/* Makes a file the contents of a data partition (replacing the partition of
+ * the same label), padded with erased flash (0xff) to a multiple of the 64 kB
+ * MMU pages, as the partition is larger than what was flashed to it. The file
+ * is read when the partition is mapped with esp_partition_mmap(). Returns -1 if
+ * there are too many partitions.
+ */
+int host_partition_add(const char *label, const char *filename);
+
+/* mappings that were not unmapped with spi_flash_munmap() */
+int host_partition_mapped(void);
+
+/* test results; a failed check is printed and makes host_report() fail */
+extern int host_failures;
+
+#define CHECK(condition) do {                                                   \
+        if(!(condition)) {                                                      \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);   \
+            host_failures++;                                                    \
+        }                                                                       \
+    } while(0)
+
+/* prints the result, returns the exit code of the test */
+int host_report(const char *name);
+
+#endif // HOST_H
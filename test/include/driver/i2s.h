@@ -0,0 +1,18 @@
+#ifndef I2S_H
+#define I2S_H
+
+#include <stddef.h>
+
+#include "freertos/FreeRTOS.h"
+
+typedef int i2s_port_t;
+
+#define I2S_NUM_0       (0)
+
+/* Writes 16-bit stereo frames to the simulated DMA buffers (see
+ * host_i2s_init()); blocks, i.e. advances the simulated time, until there is
+ * room for all of them.
+ */
+esp_err_t i2s_write(i2s_port_t i2s_num, const void *src, size_t size, size_t *bytes_written, TickType_t ticks_to_wait);
+
+#endif // I2S_H
@@ -0,0 +1,8 @@
+#ifndef ESP_CRC_H
+#define ESP_CRC_H
+
+#include <stdint.h>
+
+uint32_t esp_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len);
+
+#endif // ESP_CRC_H
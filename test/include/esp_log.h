@@ -0,0 +1,18 @@
+#ifndef ESP_LOG_H
+#define ESP_LOG_H
+
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "esp_err.h"
+
+#define ESP_LOGE(tag, format, ...)  printf("E (%s) " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...)  printf("W (%s) " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...)  printf("I (%s) " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...)  do { } while(0)
+
+typedef int (*vprintf_like_t)(const char *format, va_list args);
+
+vprintf_like_t esp_log_set_vprintf(vprintf_like_t func);
+
+#endif // ESP_LOG_H
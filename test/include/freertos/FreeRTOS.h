@@ -0,0 +1,37 @@
+#ifndef FREERTOS_H
+#define FREERTOS_H
+
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_attr.h"
+#include "sdkconfig.h"
+
+/* The modules under test run in a single thread on the host, the critical
+ * sections only have to compile.
+ */
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdTRUE                  (1)
+#define pdFALSE                 (0)
+#define pdPASS                  (1)
+#define pdFAIL                  (0)
+#define portMAX_DELAY           ((TickType_t) 0xffffffff)
+#define portTICK_PERIOD_MS      (1)
+#define pdMS_TO_TICKS(ms)       ((TickType_t) (ms))
+
+typedef struct {
+    int count;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED    { 0 }
+
+#define portENTER_CRITICAL(mux)         ((mux)->count++)
+#define portEXIT_CRITICAL(mux)          ((mux)->count--)
+#define portENTER_CRITICAL_ISR(mux)     ((mux)->count++)
+#define portEXIT_CRITICAL_ISR(mux)      ((mux)->count--)
+#define portYIELD_FROM_ISR()            do { } while(0)
+
+#endif // FREERTOS_H
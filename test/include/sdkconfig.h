@@ -0,0 +1,7 @@
+#ifndef SDKCONFIG_H
+#define SDKCONFIG_H
+
+/* the options of sdkconfig.defaults that the modules under test use */
+#define CONFIG_ESP_CONSOLE_UART_BAUDRATE    (115200)
+
+#endif // SDKCONFIG_H
@@ -0,0 +1,289 @@
+/* Host test of the asset bundle: a bundle built with assets.py (from the files
+ * that assets_inputs.py writes, see CMakeLists.txt) is mapped from a simulated
+ * partition and every asset is checked against what was put in. Then damaged
+ * copies of it, which must be rejected as a whole.
+ */
+#include "host.h"
+
+#include "assets.c"
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#define PRESET_SIZE             (63)
+#define WAVETABLE_SIZE          (256)
+
+#define SAMPLE_MAGIC            (0x4d53)
+#define SAMPLE_FLAG_LOOP        (0x01)
+
+/* see sampler.c */
+typedef struct __attribute__((packed)) {
+    uint16_t magic;
+    uint8_t root_key;
+    uint8_t flags;
+    uint8_t low_key;
+    uint8_t high_key;
+    uint16_t reserved;
+    uint32_t sampling_freq;
+    uint32_t frames;
+    uint32_t loop_start;
+    uint32_t loop_end;
+} test_sample_header_t;
+
+/* the zones of assets_inputs.py, by their index */
+static const struct {
+    uint8_t root_key;
+    uint8_t low_key;
+    uint8_t high_key;
+    uint32_t sampling_freq;
+    uint32_t frames;
+    uint32_t loop_start;
+    uint32_t loop_end;
+} m_zones[] = {
+    { 48, 0, 54, 22050, 1001, 100, 900 },
+    { 72, 67, 127, 44100, 777, 0, 0 },
+    { 60, 55, 66, 32000, 500, 0, 0 },
+};
+
+#define ZONE_COUNT              (sizeof(m_zones) / sizeof(m_zones[0]))
+
+static uint8_t *m_file;
+static size_t m_file_size;
+
+static int16_t test_frame(int index, int i)
+{
+    return (i * (97 + index)) % 65535 - 32767;
+}
+
+static void test_read_bundle(void)
+{
+    FILE *f;
+
+    f = fopen(TEST_ASSETS_BUNDLE, "rb");
+    if(f == NULL) {
+        perror(TEST_ASSETS_BUNDLE);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    m_file_size = ftell(f);
+    rewind(f);
+    m_file = malloc(m_file_size + ASSETS_ALIGNMENT);
+    CHECK(fread(m_file, 1, m_file_size, f) == m_file_size);
+    fclose(f);
+}
+
+/* makes data the contents of the assets partition and opens it */
+static int test_open(const uint8_t *data, size_t size)
+{
+    FILE *f;
+
+    f = fopen("/spiffs/assets.bin", "wb");
+    fwrite(data, 1, size, f);
+    fclose(f);
+    CHECK(host_partition_add("assets", "/spiffs/assets.bin") == 0);
+
+    return assets_open("assets");
+}
+
+static assets_entry_t *test_entry(uint8_t *data, int i)
+{
+    return (assets_entry_t *) &data[sizeof(assets_header_t) + i * sizeof(assets_entry_t)];
+}
+
+/* after a directory entry was changed */
+static void test_update_crc(uint8_t *data)
+{
+    assets_header_t *header = (assets_header_t *) data;
+
+    header->crc = esp_crc32_le(0, (const uint8_t *) test_entry(data, 0), header->count * sizeof(assets_entry_t));
+}
+
+static void test_contents(void)
+{
+    const test_sample_header_t *sample;
+    const uint8_t *preset;
+    const int16_t *frames;
+    int wrong = 0;
+    size_t size;
+
+    CHECK(test_open(m_file, m_file_size) == 0);
+    CHECK(m_count == 2 + ZONE_COUNT);
+    CHECK(m_bundle != NULL);
+
+    preset = assets_find(ASSET_PRESET, 0, &size);
+    CHECK((preset != NULL) && (size == PRESET_SIZE) && ((uintptr_t) preset % ASSETS_ALIGNMENT == 0));
+    for(int i = 0; (preset != NULL) && (i < PRESET_SIZE); i++)
+        wrong += (preset[i] != i);
+
+    frames = assets_find(ASSET_WAVETABLE, 0, &size);
+    CHECK((frames != NULL) && (size == WAVETABLE_SIZE * sizeof(int16_t)) && ((uintptr_t) frames % ASSETS_ALIGNMENT == 0));
+    for(int i = 0; (frames != NULL) && (i < WAVETABLE_SIZE); i++)
+        wrong += (frames[i] != -32767 + 256 * i);
+
+    /* the zones as sampler.c reads them, with the key ranges split between the
+     * root keys
+     */
+    for(int z = 0; z < ZONE_COUNT; z++) {
+        sample = assets_find(ASSET_SAMPLE, z, &size);
+        CHECK((sample != NULL) && ((uintptr_t) sample % ASSETS_ALIGNMENT == 0));
+        if(sample == NULL)
+            continue;
+        CHECK(sample->magic == SAMPLE_MAGIC);
+        CHECK(sample->root_key == m_zones[z].root_key);
+        CHECK((sample->low_key == m_zones[z].low_key) && (sample->high_key == m_zones[z].high_key));
+        CHECK(sample->sampling_freq == m_zones[z].sampling_freq);
+        CHECK(sample->frames == m_zones[z].frames);
+        CHECK(size == sizeof(*sample) + m_zones[z].frames * sizeof(int16_t));
+        CHECK(!(sample->flags & SAMPLE_FLAG_LOOP) == (m_zones[z].loop_end == 0));
+        CHECK((sample->loop_start == m_zones[z].loop_start) && (sample->loop_end == m_zones[z].loop_end));
+        frames = (const int16_t *) &sample[1];
+        for(int i = 0; i < m_zones[z].frames; i++)
+            wrong += (frames[i] != test_frame(z, i));
+    }
+    CHECK(wrong == 0);
+
+    /* assets that are not in the bundle */
+    CHECK(assets_find(ASSET_PRESET, 1, &size) == NULL);
+    CHECK(assets_find(ASSET_WAVETABLE, 1, &size) == NULL);
+    CHECK(assets_find(ASSET_SAMPLE, ZONE_COUNT, &size) == NULL);
+    CHECK(assets_find(0, 0, &size) == NULL);
+
+    /* opening it again replaces the mapping */
+    CHECK(assets_open("assets") == 0);
+    CHECK(host_partition_mapped() == 1);
+    assets_close();
+    CHECK(host_partition_mapped() == 0);
+    CHECK(assets_find(ASSET_PRESET, 0, &size) == NULL);
+}
+
+/* opening a damaged bundle fails, finds nothing afterwards and leaves nothing
+ * mapped
+ */
+static int test_rejected(const uint8_t *data, size_t size)
+{
+    size_t asset_size;
+    int ok;
+
+    CHECK(test_open(m_file, m_file_size) == 0);
+    ok = (test_open(data, size) == -1) && (assets_find(ASSET_PRESET, 0, &asset_size) == NULL)
+            && (host_partition_mapped() == 0);
+    assets_close();
+
+    return ok;
+}
+
+static void test_damaged(void)
+{
+    uint8_t *data = malloc(m_file_size + ASSETS_ALIGNMENT);
+    const assets_header_t *header = (const assets_header_t *) m_file;
+    assets_entry_t *entry;
+    size_t positions[3];
+    size_t padding;
+    int rejected = 0;
+    int tried = 0;
+
+    /* any bit of the header (but the size, which only has to cover the assets)
+     * and the directory, and of the first, a middle and the last byte of each
+     * asset
+     */
+    memcpy(data, m_file, m_file_size);
+    for(size_t i = 0; i < sizeof(assets_header_t) + header->count * sizeof(assets_entry_t); i++) {
+        if((i >= offsetof(assets_header_t, size)) && (i < offsetof(assets_header_t, crc)))
+            continue;
+        for(int bit = 0; bit < 8; bit++) {
+            data[i] ^= 1 << bit;
+            rejected += test_rejected(data, m_file_size);
+            tried++;
+            data[i] ^= 1 << bit;
+        }
+    }
+    for(int i = 0; i < header->count; i++) {
+        entry = test_entry(m_file, i);
+        positions[0] = entry->offset;
+        positions[1] = entry->offset + entry->size / 2;
+        positions[2] = entry->offset + entry->size - 1;
+        for(int j = 0; j < 3; j++) {
+            data[positions[j]] ^= 0x01;
+            rejected += test_rejected(data, m_file_size);
+            tried++;
+            data[positions[j]] ^= 0x01;
+        }
+    }
+    CHECK(rejected == tried);
+
+    /* the padding between the assets is not checked */
+    entry = test_entry(m_file, 0);
+    padding = entry->offset + entry->size;
+    CHECK(padding % ASSETS_ALIGNMENT != 0);
+    data[padding] ^= 0x01;
+    CHECK(test_open(data, m_file_size) == 0);
+    data[padding] ^= 0x01;
+
+    /* truncated; an erased partition; no partition */
+    CHECK(test_rejected(data, m_file_size - 1));
+    CHECK(test_rejected(data, sizeof(assets_header_t) - 1));
+    memset(data, 0xff, m_file_size);
+    CHECK(test_rejected(data, m_file_size));
+    memcpy(data, m_file, m_file_size);
+    assets_close();
+    CHECK(assets_open("nothing") == -1);
+    CHECK(host_partition_mapped() == 0);
+
+    /* directories with a valid CRC: an asset that is not aligned */
+    entry = test_entry(data, 0);
+    entry->offset++;
+    entry->size--;
+    entry->crc = esp_crc32_le(0, &data[entry->offset], entry->size);
+    test_update_crc(data);
+    CHECK(test_rejected(data, m_file_size));
+    memcpy(data, m_file, m_file_size);
+
+    /* the last asset reaching past the end of the bundle (into the rest of
+     * the partition, whose CRC is right)
+     */
+    memset(&data[m_file_size], 0xff, ASSETS_ALIGNMENT);
+    entry = test_entry(data, header->count - 1);
+    entry->size += ASSETS_ALIGNMENT;
+    entry->crc = esp_crc32_le(0, &data[entry->offset], entry->size);
+    test_update_crc(data);
+    CHECK(test_rejected(data, m_file_size + ASSETS_ALIGNMENT));
+    memcpy(data, m_file, m_file_size);
+
+    /* a bundle that ends before its last asset, one larger than the partition,
+     * and a directory larger than the bundle
+     */
+    ((assets_header_t *) data)->size = header->size - 1;
+    CHECK(test_rejected(data, m_file_size));
+    ((assets_header_t *) data)->size = 0x10000 + 1;
+    CHECK(test_rejected(data, m_file_size));
+    ((assets_header_t *) data)->size = header->size;
+    ((assets_header_t *) data)->count = 0xffff;
+    CHECK(test_rejected(data, m_file_size));
+
+    /* a bundle of only a header, whose size does not cover the directory after
+     * it, although the (empty) asset in it is valid
+     */
+    memset(data, 0, sizeof(assets_header_t) + sizeof(assets_entry_t));
+    ((assets_header_t *) data)->magic = ASSETS_MAGIC;
+    ((assets_header_t *) data)->version = ASSETS_VERSION;
+    ((assets_header_t *) data)->count = 1;
+    ((assets_header_t *) data)->size = sizeof(assets_header_t);
+    test_entry(data, 0)->type = ASSET_PRESET;
+    test_update_crc(data);
+    CHECK(test_rejected(data, sizeof(assets_header_t) + sizeof(assets_entry_t)));
+    ((assets_header_t *) data)->size = sizeof(assets_header_t) + sizeof(assets_entry_t);
+    CHECK(test_open(data, sizeof(assets_header_t) + sizeof(assets_entry_t)) == 0);
+    assets_close();
+
+    free(data);
+}
+
+int main(void)
+{
+    test_read_bundle();
+    test_contents();
+    test_damaged();
+    free(m_file);
+
+    return host_report("test_assets");
+}
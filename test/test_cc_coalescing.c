@@ -0,0 +1,252 @@
+/* Host stress test of the coalescing of control changes: knob sweeps of 1000
+ * CCs/s arrive on the simulated MIDI UART and go through the MIDI task. Every
+ * parameter update takes the synth's patch lock, which the render loop takes at
+ * the start of each block; a block whose render loop finds the lock held is
+ * counted as a stall. Before the coalescing, every CC was applied when it was
+ * processed, which is what the "before" numbers are computed from.
+ */
+#include "host.h"
+#include "fakes.h"
+
+#include "midi_input.c"
+
+#define MIDI_BAUDRATE       (31250)
+#define STEP_US             (100)
+#define SWEEP_CCS           (1000)
+#define CC_INTERVAL_US      (1000000 / SWEEP_CCS)
+/* time an update holds the patch lock (synth_get_patch() and synth_set_patch()
+ * copy a patch each), an estimate; the stalls scale with it
+ */
+#define UPDATE_LOCK_US      (10)
+/* phases of the render loop relative to the MIDI input that are tried */
+#define RENDER_PHASE_STEP_US    (10)
+#define MAX_UPDATES         (4 * SWEEP_CCS)
+
+typedef struct {
+    int64_t t_us;
+    param_id_t id;
+    uint16_t raw;
+} update_t;
+
+static param_desc_t m_descs[PARAM_COUNT] = {
+    [PARAM_SELECT_PRESET] = { .flags = PARAM_FLAG_IMMEDIATE },
+    [PARAM_SAVE_PRESET] = { .flags = PARAM_FLAG_IMMEDIATE },
+    [PARAM_DUMP_PARAMS] = { .flags = PARAM_FLAG_IMMEDIATE },
+};
+
+/* parameter updates with coalescing, and the CCs as they were processed */
+static update_t m_updates[MAX_UPDATES];
+static int m_update_count;
+static update_t m_ccs[MAX_UPDATES];
+static int m_cc_count;
+
+const param_desc_t *param_get_desc(param_id_t id)
+{
+    return &m_descs[id];
+}
+
+uint16_t param_to_raw(param_id_t id, float value)
+{
+    return 0;
+}
+
+void param_apply_raw(param_id_t id, uint16_t raw)
+{
+    if(m_update_count < MAX_UPDATES) {
+        m_updates[m_update_count].t_us = host_time_us;
+        m_updates[m_update_count].id = id;
+        m_updates[m_update_count].raw = raw;
+        m_update_count++;
+    }
+}
+
+static void test_record_cc(uint8_t cc)
+{
+    if((m_cc_count < MAX_UPDATES) && (fake_cc_map[cc] != PARAM_NONE)) {
+        m_ccs[m_cc_count].t_us = host_time_us;
+        m_ccs[m_cc_count].id = fake_cc_map[cc];
+        m_cc_count++;
+    }
+}
+
+/* runs the MIDI task until end_us, waking it every STEP_US */
+static void test_run_until(int64_t end_us)
+{
+    while(host_time_us < end_us) {
+        host_run_until(host_time_us + STEP_US);
+        do {
+            midi_process_queues();
+        } while(xQueueSelectFromSet(m_queue_set, 0) != NULL);
+    }
+}
+
+/* Stalls in one second for every phase of the render loop (in steps of
+ * RENDER_PHASE_STEP_US); returns the average and the worst phase. Updates in
+ * the same pass of the MIDI task hold the lock one after the other.
+ */
+static void test_count_stalls(const update_t *updates, int count, int64_t start_us, int64_t end_us,
+                                int *max_stalls, double *avg_stalls)
+{
+    static int64_t hold_start_us[MAX_UPDATES];
+    static int64_t hold_end_us[MAX_UPDATES];
+    int phases = CONTROL_BLOCK_US / RENDER_PHASE_STEP_US;
+    int holds = 0;
+    int64_t total = 0;
+    int stalls;
+    int h;
+
+    for(int i = 0; i < count; i++) {
+        if((holds > 0) && (updates[i].t_us == hold_start_us[holds - 1])) {
+            hold_end_us[holds - 1] += UPDATE_LOCK_US;
+        } else {
+            hold_start_us[holds] = updates[i].t_us;
+            hold_end_us[holds] = updates[i].t_us + UPDATE_LOCK_US;
+            holds++;
+        }
+    }
+
+    *max_stalls = 0;
+    for(int p = 0; p < phases; p++) {
+        stalls = 0;
+        h = 0;
+        for(int64_t t_us = start_us + p * RENDER_PHASE_STEP_US; t_us < end_us; t_us += CONTROL_BLOCK_US) {
+            while((h < holds) && (hold_end_us[h] <= t_us))
+                h++;
+            if((h < holds) && (hold_start_us[h] <= t_us))
+                stalls++;
+        }
+        total += stalls;
+        if(stalls > *max_stalls)
+            *max_stalls = stalls;
+    }
+    *avg_stalls = (double) total / phases;
+}
+
+static int test_max_per_block(const update_t *updates, int count, int64_t start_us)
+{
+    int max = 0;
+    int n = 0;
+    int64_t block = -1;
+
+    for(int i = 0; i < count; i++) {
+        if((updates[i].t_us - start_us) / CONTROL_BLOCK_US != block) {
+            block = (updates[i].t_us - start_us) / CONTROL_BLOCK_US;
+            n = 0;
+        }
+        if(++n > max)
+            max = n;
+    }
+
+    return max;
+}
+
+/* one second of sweeps on knob_count knobs, taking turns */
+static void test_sweep(int knob_count)
+{
+    uint8_t data[3] = { 0xb0 };
+    uint8_t last_value[4];
+    uint16_t last_applied[PARAM_COUNT];
+    int64_t last_update_us[PARAM_COUNT];
+    int64_t start_us;
+    int64_t end_us;
+    int max_before;
+    int max_after;
+    double avg_before;
+    double avg_after;
+    int length;
+    int c;
+    int j;
+
+    m_update_count = 0;
+    m_cc_count = 0;
+    fake_cc_count = 0;
+    for(int i = 0; i < knob_count; i++)
+        fake_cc_map[0x10 + i] = PARAM_OSC1_AMP + i;
+
+    /* running status after the first CC, as a controller would send it */
+    start_us = host_time_us + CONTROL_BLOCK_US;
+    for(int i = 0; i < SWEEP_CCS; i++) {
+        c = i % knob_count;
+        data[1] = 0x10 + c;
+        data[2] = (i / knob_count) & 0x7f;
+        last_value[c] = data[2];
+        length = (i == 0) ? 3 : 2;
+        host_uart_send(UART_NUM_2, MIDI_UART_RX_GPIO, MIDI_BAUDRATE, start_us + i * CC_INTERVAL_US,
+                        &data[3 - length], length);
+    }
+    end_us = start_us + SWEEP_CCS * CC_INTERVAL_US;
+    test_run_until(end_us + 2 * CONTROL_BLOCK_US);
+
+    CHECK(fake_cc_count == SWEEP_CCS);
+    CHECK(m_cc_count == SWEEP_CCS);
+    CHECK(m_param_dirty == 0);
+
+    /* at most one update per parameter and control block, the last value wins */
+    for(int i = 0; i < PARAM_COUNT; i++)
+        last_update_us[i] = -CONTROL_BLOCK_US;
+    for(int i = 0; i < m_update_count; i++) {
+        CHECK(m_updates[i].t_us - last_update_us[m_updates[i].id] >= CONTROL_BLOCK_US);
+        last_update_us[m_updates[i].id] = m_updates[i].t_us;
+        last_applied[m_updates[i].id] = m_updates[i].raw;
+    }
+    for(int i = 0; i < knob_count; i++)
+        CHECK(last_applied[PARAM_OSC1_AMP + i] == midi_raw_from_msb(last_value[i]));
+
+    /* no CC waits for more than a control block (and the task's wake-up) */
+    for(int i = 0, u = 0; i < m_cc_count; i++) {
+        while((u < m_update_count) && (m_updates[u].t_us < m_ccs[i].t_us))
+            u++;
+        j = u;
+        while((j < m_update_count) && (m_updates[j].id != m_ccs[i].id))
+            j++;
+        CHECK((j < m_update_count) && (m_updates[j].t_us - m_ccs[i].t_us <= CONTROL_BLOCK_US + STEP_US));
+    }
+
+    test_count_stalls(m_ccs, m_cc_count, start_us, end_us, &max_before, &avg_before);
+    test_count_stalls(m_updates, m_update_count, start_us, end_us, &max_after, &avg_after);
+
+    CHECK(m_update_count <= knob_count * (SWEEP_CCS * CC_INTERVAL_US / CONTROL_BLOCK_US + 2));
+    CHECK(avg_after < avg_before / 2);
+
+    printf("%d knob(s), %d CCs/s: before %d updates (max %d per block), %.1f stalls/s (worst phase %d); "
+            "after %d updates (max %d per block), %.1f stalls/s (worst phase %d)\n",
+            knob_count, SWEEP_CCS, m_cc_count, test_max_per_block(m_ccs, m_cc_count, start_us), avg_before, max_before,
+            m_update_count, test_max_per_block(m_updates, m_update_count, start_us), avg_after, max_after);
+
+    for(int i = 0; i < knob_count; i++)
+        fake_cc_map[0x10 + i] = PARAM_NONE;
+}
+
+/* a parameter that acts on the whole set applies everything pending first */
+static void test_immediate(void)
+{
+    const uint8_t data[] = { 0xb0, 0x10, 0x20, 0x11, 0x05 };
+
+    fake_cc_map[0x10] = PARAM_OSC1_AMP;
+    fake_cc_map[0x11] = PARAM_SELECT_PRESET;
+    m_update_count = 0;
+
+    test_run_until(host_time_us + 2 * CONTROL_BLOCK_US);
+    host_uart_send(UART_NUM_2, MIDI_UART_RX_GPIO, MIDI_BAUDRATE, host_time_us, data, sizeof(data));
+    test_run_until(host_time_us + 2 * STEP_US + sizeof(data) * MIDI_BYTE_TIME_US(MIDI_BAUDRATE));
+
+    CHECK(m_update_count == 2);
+    CHECK((m_updates[0].id == PARAM_OSC1_AMP) && (m_updates[0].raw == midi_raw_from_msb(0x20)));
+    CHECK((m_updates[1].id == PARAM_SELECT_PRESET) && (m_updates[1].raw == midi_raw_from_msb(0x05)));
+    CHECK(m_param_dirty == 0);
+
+    fake_cc_map[0x10] = PARAM_NONE;
+    fake_cc_map[0x11] = PARAM_NONE;
+}
+
+int main(void)
+{
+    fake_cc_hook = test_record_cc;
+    midi_init();
+
+    test_sweep(1);
+    test_sweep(4);
+    test_immediate();
+
+    return host_report("test_cc_coalescing");
+}
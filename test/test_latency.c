@@ -0,0 +1,237 @@
+/* Host test of the latency measurement against the simulated UART and I2S
+ * output. The MIDI task polls the UART every 10 ms and the render loop writes
+ * blocks of 10 ms to the I2S DMA buffers, as in midi_input.c and synth.c; the
+ * histograms have to match the latencies that the simulation knows exactly.
+ */
+#include "host.h"
+
+#include "latency.c"
+
+#include <math.h>
+
+#include "driver/i2s.h"
+
+#define BLOCK_FRAMES        (SYNTH_SAMPLING_FREQ / 100)
+#define DMA_FRAMES          (4 * 512)
+#define POLL_INTERVAL_US    (10000)
+#define MIDI_BAUDRATE       (31250)
+#define BYTE_US             (10 * 1000000 / MIDI_BAUDRATE)
+#define CONSOLE_BAUDRATE    CONFIG_ESP_CONSOLE_UART_BAUDRATE
+#define CONSOLE_BIT_US      (1000000.0 / CONSOLE_BAUDRATE)
+
+/* the report task is not run */
+void logger_console_lock(void)
+{
+}
+
+void logger_console_unlock(void)
+{
+}
+
+static uint32_t m_block_offset;
+static int64_t m_next_poll_us;
+static int16_t m_block[2 * BLOCK_FRAMES];
+
+/* note that was received and has to be started with the next block */
+static int m_pending_key = -1;
+
+/* what the measurement should report */
+static struct {
+    uint32_t count;
+    int64_t input_sum_us;
+    double output_sum_us;
+} m_expected;
+
+/* the part of the MIDI task that reads the MIDI input (note on only) */
+static void midi_poll(void)
+{
+    static uint8_t message[3];
+    static int length;
+    static int64_t arrival_us;
+    uint8_t byte;
+
+    if(host_time_us < m_next_poll_us)
+        return;
+    m_next_poll_us += POLL_INTERVAL_US;
+
+    while(uart_read_bytes(UART_NUM_2, &byte, 1, 0) == 1) {
+        if(byte & 0x80) {
+            arrival_us = latency_byte_read(LATENCY_SOURCE_UART2);
+            length = 0;
+        } else {
+            latency_byte_read(LATENCY_SOURCE_UART2);
+        }
+        message[length++] = byte;
+        if((length == 3) && (message[0] == 0x90)) {
+            latency_note_on(arrival_us, 0, message[1]);
+            m_pending_key = message[1];
+            length = 0;
+        }
+    }
+}
+
+/* one pass of the render loop; a pending note is started at the first sample
+ * of the block
+ */
+static void render_block(int64_t arrival_us)
+{
+    uint32_t block_offset = m_block_offset;
+    size_t bytes_written;
+    int64_t render_us = -1;
+    int triggered = 0;
+
+    midi_poll();
+
+    if(m_pending_key >= 0) {
+        latency_note_triggered(block_offset, 0, m_pending_key);
+        m_pending_key = -1;
+        triggered = 1;
+    }
+
+    latency_block_rendered(block_offset, BLOCK_FRAMES);
+    render_us = host_time_us;
+
+    i2s_write(I2S_NUM_0, m_block, sizeof(m_block), &bytes_written, portMAX_DELAY);
+
+    if(triggered && (arrival_us >= 0)) {
+        m_expected.count++;
+        m_expected.input_sum_us += render_us - arrival_us;
+        m_expected.output_sum_us += host_i2s_end_us() - BLOCK_FRAMES * 1000000.0 / SYNTH_SAMPLING_FREQ - render_us;
+    }
+
+    latency_block_written(block_offset, BLOCK_FRAMES, DMA_FRAMES);
+    m_block_offset += BLOCK_FRAMES;
+}
+
+static void test_note_latency(void)
+{
+    const uint8_t note_on[] = { 0x90, 0x3c, 0x64 };
+    int64_t arrival_us;
+    int64_t send_us;
+
+    /* until the DMA buffers are full, as assumed by latency_block_written() */
+    for(int i = 0; i < 10; i++)
+        render_block(-1);
+
+    /* the notes arrive at every phase of the poll and block periods */
+    for(int n = 0; n < 50; n++) {
+        send_us = host_time_us + 100000 + n * 730;
+        arrival_us = host_uart_send(UART_NUM_2, MIDI_UART_RX_GPIO, MIDI_BAUDRATE, send_us,
+                                    note_on, sizeof(note_on));
+        for(int i = 0; (i < 100) && ((m_note.state != NOTE_IDLE) || (m_expected.count < n + 1)); i++)
+            render_block(arrival_us);
+    }
+
+    CHECK(m_input.count == m_expected.count);
+    CHECK(m_total.count == m_expected.count);
+    CHECK(m_input.sum_us == m_expected.input_sum_us);
+    /* the output time is rounded to whole microseconds */
+    CHECK(fabs(m_output.sum_us - m_expected.output_sum_us) <= 2.0 * m_expected.count);
+    CHECK(m_total.sum_us == m_input.sum_us + m_output.sum_us);
+
+    /* the note waits for the poll (up to 10 ms) and for the next block, and
+     * leaves the I2S bus after the DMA buffers (46 ms)
+     */
+    CHECK(m_input.min_us >= 3 * BYTE_US);
+    CHECK(m_input.max_us <= 3 * BYTE_US + 2 * POLL_INTERVAL_US);
+    CHECK(m_output.min_us >= (DMA_FRAMES - BLOCK_FRAMES) * 1000000LL / SYNTH_SAMPLING_FREQ);
+    CHECK(m_output.max_us <= DMA_FRAMES * 1000000LL / SYNTH_SAMPLING_FREQ + 1);
+
+    printf("MIDI in -> I2S out: n=%u avg=%.2f ms (min %.2f, max %.2f)\n", m_total.count,
+            (double) m_total.sum_us / m_total.count / 1000.0, m_total.min_us / 1000.0, m_total.max_us / 1000.0);
+}
+
+/* notes that do not reach a voice must not block the measurement */
+static void test_note_dropped(void)
+{
+    uint32_t count = m_total.count;
+
+    latency_note_on(host_time_us, 0, 60);
+    latency_note_dropped(0, 61);
+    CHECK(m_note.state == NOTE_RECEIVED);
+    latency_note_dropped(0, 60);
+    CHECK(m_note.state == NOTE_IDLE);
+
+    /* only the received note starts the measurement */
+    latency_note_on(host_time_us, 1, 62);
+    latency_note_triggered(m_block_offset, 0, 62);
+    CHECK(m_note.state == NOTE_RECEIVED);
+    latency_note_triggered(m_block_offset, 1, 62);
+    CHECK(m_note.state == NOTE_TRIGGERED);
+    render_block(-1);
+    CHECK(m_note.state == NOTE_IDLE);
+    CHECK(m_total.count == count + 1);
+}
+
+/* a reader that falls behind by more than RX_FIFO_SIZE bytes loses the oldest
+ * timestamps, the following bytes keep their own
+ */
+static void test_fifo_overflow(void)
+{
+    rx_source_t *source = &m_sources[LATENCY_SOURCE_UART0];
+    uint8_t data[RX_FIFO_SIZE + 36];
+    uint8_t byte;
+    int64_t start_us;
+    int64_t t_us;
+    uint32_t lost = source->lost;
+
+    /* 0x55 has a falling edge in every other bit, they must not count as bytes */
+    memset(data, 0x55, sizeof(data));
+    start_us = host_uart_send(UART_NUM_0, CONSOLE_UART_RX_GPIO, CONSOLE_BAUDRATE, host_time_us, data, sizeof(data));
+    host_run_until(host_time_us + 20000);
+
+    for(int i = 0; i < sizeof(data); i++) {
+        CHECK(uart_read_bytes(UART_NUM_0, &byte, 1, 0) == 1);
+        t_us = latency_byte_read(LATENCY_SOURCE_UART0);
+        if(i < sizeof(data) - RX_FIFO_SIZE) {
+            CHECK(t_us == host_time_us);
+        } else {
+            CHECK(t_us == (int64_t) (start_us + 10 * i * CONSOLE_BIT_US));
+        }
+    }
+    CHECK(source->lost == lost + sizeof(data) - RX_FIFO_SIZE);
+    CHECK(source->head == source->tail);
+}
+
+/* after the input was flushed, the bytes are matched with their timestamps again */
+static void test_flush(void)
+{
+    rx_source_t *source = &m_sources[LATENCY_SOURCE_UART0];
+    const uint8_t data[] = { 0x90, 0x40, 0x7f };
+    uint8_t byte;
+    int64_t start_us;
+
+    host_uart_send(UART_NUM_0, CONSOLE_UART_RX_GPIO, CONSOLE_BAUDRATE, host_time_us, data, sizeof(data));
+    host_run_until(host_time_us + 20000);
+    uart_flush_input(UART_NUM_0);
+    latency_flush(LATENCY_SOURCE_UART0);
+    CHECK(source->flushes == 1);
+
+    start_us = host_uart_send(UART_NUM_0, CONSOLE_UART_RX_GPIO, CONSOLE_BAUDRATE, host_time_us + 500,
+                                data, sizeof(data));
+    host_run_until(host_time_us + 20000);
+    for(int i = 0; i < sizeof(data); i++) {
+        CHECK(uart_read_bytes(UART_NUM_0, &byte, 1, 0) == 1);
+        CHECK(latency_byte_read(LATENCY_SOURCE_UART0) == (int64_t) (start_us + 10 * i * CONSOLE_BIT_US));
+    }
+
+    /* a byte without a start bit gets its read time and does not move the FIFO */
+    CHECK(latency_byte_read(LATENCY_SOURCE_UART0) == host_time_us);
+    CHECK(source->head == source->tail);
+}
+
+int main(void)
+{
+    /* the service may have been installed by another driver */
+    ESP_ERROR_CHECK(gpio_install_isr_service(0));
+    latency_init();
+
+    host_i2s_init(DMA_FRAMES, SYNTH_SAMPLING_FREQ);
+
+    test_note_latency();
+    test_note_dropped();
+    test_fifo_overflow();
+    test_flush();
+
+    return host_report("test_latency");
+}
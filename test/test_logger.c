@@ -0,0 +1,218 @@
+/* Host test of the deferred logger: formatting of the records, dropping when
+ * the ring is full, producers in several threads against a concurrent consumer,
+ * and the cost of logging a control change compared to printing it on the
+ * console.
+ */
+#include "host.h"
+
+#include "logger.c"
+
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CONSOLE_BAUDRATE    CONFIG_ESP_CONSOLE_UART_BAUDRATE
+#define PRODUCER_COUNT      (4)
+#define PRODUCER_RECORDS    (20000)
+
+static FILE *m_console;
+static FILE *m_stdout;
+
+/* the printed lines go to a temporary file instead of the terminal */
+static void test_capture_start(void)
+{
+    m_console = tmpfile();
+    m_stdout = stdout;
+    stdout = m_console;
+}
+
+static size_t test_capture_end(char *output, size_t size)
+{
+    size_t length;
+
+    fflush(m_console);
+    stdout = m_stdout;
+    rewind(m_console);
+    length = fread(output, 1, size - 1, m_console);
+    output[length] = '\0';
+    fclose(m_console);
+
+    return length;
+}
+
+static void test_format(void)
+{
+    char output[512];
+
+    test_capture_start();
+    logger_log(LOG_CONTROL_CHANGE, 0x07, 0x40);
+    logger_log(LOG_INVALID_ATTACK, 1.5);
+    logger_log(LOG_CALCULATION_LOAD, 42);
+    logger_log(LOG_INVALID_WAVEFORM, 1, 2, 3);
+    logger_log(LOG_ENV_SUSTAIN, 75.0);
+    logger_flush();
+    test_capture_end(output, sizeof(output));
+
+    CHECK(strcmp(output, "Control change: 07 = 40\n"
+                            "Invalid attack value: 1.50\n"
+                            "Calculation load: 42 %\n"
+                            "Invalid waveform: 1 2 3\n"
+                            "Updating envelope sustain: 75.00 %\n") == 0);
+}
+
+/* a full ring drops the new records and counts them, it never blocks */
+static void test_full_ring(void)
+{
+    static char output[LOGGER_RING_SIZE * 32 + 64];
+    unsigned int dropped = atomic_load(&m_dropped);
+    const char *last_line;
+
+    test_capture_start();
+    for(int i = 0; i < LOGGER_RING_SIZE + 10; i++)
+        logger_log(LOG_CONTROL_CHANGE, i & 0x7f, 0);
+    CHECK(atomic_load(&m_dropped) == dropped + 10);
+    logger_flush();
+    test_capture_end(output, sizeof(output));
+
+    last_line = strrchr(output, '\n');
+    while((last_line > output) && (last_line[-1] != '\n'))
+        last_line--;
+    CHECK(strcmp(last_line, "10 log messages dropped\n") == 0);
+
+    /* the slots are free again */
+    logger_log(LOG_CONTROL_CHANGE, 0, 0);
+    CHECK(atomic_load(&m_dropped) == dropped + 10);
+    test_capture_start();
+    logger_flush();
+    test_capture_end(output, sizeof(output));
+    CHECK(strcmp(output, "Control change: 00 = 00\n") == 0);
+}
+
+static void *test_producer(void *arg)
+{
+    int producer = (int) (intptr_t) arg;
+
+    /* yielding now and then lets the consumer keep up some of the time */
+    for(int i = 0; i < PRODUCER_RECORDS; i++) {
+        logger_log(LOG_PRESET_SELECT, producer, i);
+        if(i % 16 == 0)
+            sched_yield();
+    }
+
+    return NULL;
+}
+
+static volatile int m_producers_done;
+
+static void *test_consumer(void *arg)
+{
+    /* like the logger task, which flushes every LOGGER_FLUSH_INTERVAL_MS */
+    while(!m_producers_done) {
+        logger_flush();
+        usleep(100);
+    }
+    logger_flush();
+
+    return NULL;
+}
+
+/* every record is either printed once, in the order it was logged, or counted
+ * as dropped
+ */
+static void test_concurrent(void)
+{
+    pthread_t producers[PRODUCER_COUNT];
+    pthread_t consumer;
+    int last[PRODUCER_COUNT];
+    unsigned int dropped_before = atomic_load(&m_dropped);
+    unsigned int dropped_printed = 0;
+    unsigned int printed = 0;
+    unsigned int value;
+    char line[LOGGER_LINE_LENGTH];
+    int producer;
+    int sequence;
+
+    test_capture_start();
+    pthread_create(&consumer, NULL, test_consumer, NULL);
+    for(int i = 0; i < PRODUCER_COUNT; i++)
+        pthread_create(&producers[i], NULL, test_producer, (void *) (intptr_t) i);
+    for(int i = 0; i < PRODUCER_COUNT; i++)
+        pthread_join(producers[i], NULL);
+    m_producers_done = 1;
+    pthread_join(consumer, NULL);
+
+    fflush(m_console);
+    stdout = m_stdout;
+    rewind(m_console);
+
+    for(int i = 0; i < PRODUCER_COUNT; i++)
+        last[i] = -1;
+
+    while(fgets(line, sizeof(line), m_console) != NULL) {
+        if(sscanf(line, "Preset %d selected in %u us", &producer, &value) == 2) {
+            sequence = value;
+            CHECK((producer >= 0) && (producer < PRODUCER_COUNT));
+            if((producer < 0) || (producer >= PRODUCER_COUNT))
+                continue;
+            CHECK(sequence > last[producer]);
+            last[producer] = sequence;
+            printed++;
+        } else if(sscanf(line, "%u log messages dropped", &value) == 1) {
+            dropped_printed += value;
+        } else {
+            CHECK(0);
+        }
+    }
+    fclose(m_console);
+
+    CHECK(dropped_printed == atomic_load(&m_dropped) - dropped_before);
+    CHECK(printed + dropped_printed == PRODUCER_COUNT * PRODUCER_RECORDS);
+
+    printf("concurrent: %u records printed, %u dropped\n", printed, dropped_printed);
+}
+
+/* A knob sweep of 1000 CCs in one second, with the logger task printing every
+ * 20 ms. The MIDI task only pays for logger_log(), the console time is spent
+ * in the logger task.
+ */
+static void test_throughput(void)
+{
+    static char output[64 * 1024];
+    struct timespec start;
+    struct timespec end;
+    double logging_us = 0.0;
+    double console_us;
+    size_t printed = 0;
+
+    for(int block = 0; block < 50; block++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(int i = 0; i < 20; i++)
+            logger_log(LOG_CONTROL_CHANGE, 0x4c, (block * 20 + i) & 0x7f);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        logging_us += (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+
+        test_capture_start();
+        logger_flush();
+        printed += test_capture_end(output, sizeof(output));
+    }
+
+    /* 10 bits per character */
+    console_us = printed * 10 * 1e6 / CONSOLE_BAUDRATE;
+    CHECK(logging_us < console_us / 100);
+
+    printf("1000 CCs: %.1f us in the MIDI task, %.1f ms on the console\n", logging_us, console_us / 1000.0);
+}
+
+int main(void)
+{
+    logger_init();
+
+    test_format();
+    test_full_ring();
+    test_concurrent();
+    test_throughput();
+
+    return host_report("test_logger");
+}
@@ -0,0 +1,400 @@
+/* Host test of the MIDI parser: running status, SysEx, real-time bytes in the
+ * middle of messages, a fuzz test that mutates the streams in corpus/midi_parser
+ * and a throughput benchmark.
+ */
+#include "host.h"
+
+#include "midi_parser.c"
+
+#include <string.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <time.h>
+
+#define SYSEX_SIZE          (256)
+#define CORPUS_DIR          "corpus/midi_parser"
+#define MAX_STREAM_LENGTH   (4096)
+#define FUZZ_MUTATIONS      (2000)
+
+typedef struct {
+    uint8_t status;
+    uint8_t length;
+    uint8_t data[2];
+    uint16_t sysex_length;
+    uint8_t sysex_truncated;
+    uint32_t sysex_hash;
+} recorded_t;
+
+static uint32_t m_random = 1;
+
+/* deterministic, so that a failure can be reproduced */
+static uint32_t test_random(void)
+{
+    m_random = m_random * 1664525u + 1013904223u;
+    return m_random >> 8;
+}
+
+static uint32_t test_hash(const uint8_t *data, size_t length)
+{
+    uint32_t hash = 2166136261u;
+
+    for(size_t i = 0; i < length; i++)
+        hash = (hash ^ data[i]) * 16777619u;
+
+    return hash;
+}
+
+/* parses a stream, returns the number of messages written to messages */
+static size_t test_parse(const uint8_t *stream, size_t length, recorded_t *messages)
+{
+    static uint8_t sysex_buffer[SYSEX_SIZE];
+    midi_parser_t parser;
+    midi_message_t message;
+    size_t count = 0;
+
+    midi_parser_init(&parser, sysex_buffer, sizeof(sysex_buffer));
+
+    for(size_t i = 0; i < length; i++) {
+        if(!midi_parser_feed(&parser, stream[i], &message))
+            continue;
+
+        memset(&messages[count], 0, sizeof(recorded_t));
+        messages[count].status = message.status;
+        messages[count].length = message.length;
+        memcpy(messages[count].data, message.data, message.length);
+        if(message.status == MIDI_SB_SYSEX_START) {
+            messages[count].sysex_length = message.sysex_length;
+            messages[count].sysex_truncated = message.sysex_truncated;
+            messages[count].sysex_hash = test_hash(message.sysex, message.sysex_length);
+        }
+        count++;
+    }
+
+    return count;
+}
+
+static int test_expected_length(uint8_t status)
+{
+    switch(status & 0xf0) {
+    case MIDI_SB_PROGRAM_CHANGE:
+    case MIDI_SB_CHANNEL_PRESSURE:
+        return 1;
+    case 0xf0:
+        break;
+    default:
+        return 2;
+    }
+
+    switch(status) {
+    case MIDI_SB_TIME_CODE:
+    case MIDI_SB_SONG_SELECT:
+        return 1;
+    case MIDI_SB_SONG_POSITION:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+/* properties of every message the parser returns, whatever the input */
+static void test_check_messages(const recorded_t *messages, size_t count)
+{
+    for(size_t i = 0; i < count; i++) {
+        CHECK(MIDI_IS_STATUS(messages[i].status));
+        CHECK(messages[i].length == test_expected_length(messages[i].status));
+        for(int j = 0; j < messages[i].length; j++)
+            CHECK(!MIDI_IS_STATUS(messages[i].data[j]));
+        CHECK((messages[i].status != 0xf4) && (messages[i].status != 0xf5) && (messages[i].status != MIDI_SB_SYSEX_END)
+                && (messages[i].status != 0xf9) && (messages[i].status != 0xfd));
+        CHECK(messages[i].sysex_length <= SYSEX_SIZE);
+    }
+}
+
+static void test_expect(const char *name, const uint8_t *stream, size_t length,
+                        const recorded_t *expected, size_t expected_count)
+{
+    recorded_t messages[64];
+    size_t count = test_parse(stream, length, messages);
+
+    CHECK(count == expected_count);
+    if(count != expected_count) {
+        printf("%s: %u messages instead of %u\n", name, (unsigned) count, (unsigned) expected_count);
+        return;
+    }
+
+    for(size_t i = 0; i < count; i++) {
+        CHECK(messages[i].status == expected[i].status);
+        CHECK(messages[i].length == expected[i].length);
+        CHECK(memcmp(messages[i].data, expected[i].data, expected[i].length) == 0);
+        CHECK(messages[i].sysex_length == expected[i].sysex_length);
+        CHECK(messages[i].sysex_truncated == expected[i].sysex_truncated);
+    }
+}
+
+#define EXPECT(name, stream, ...) do {                                          \
+        static const uint8_t stream_[] = stream;                                \
+        static const recorded_t expected_[] = { __VA_ARGS__ };                  \
+        test_expect(name, stream_, sizeof(stream_), expected_, sizeof(expected_) / sizeof(expected_[0])); \
+    } while(0)
+
+#define BYTES(...)      { __VA_ARGS__ }
+#define MSG0(s)         { .status = (s), .length = 0 }
+#define MSG1(s, a)      { .status = (s), .length = 1, .data = { (a) } }
+#define MSG2(s, a, b)   { .status = (s), .length = 2, .data = { (a), (b) } }
+
+static void test_running_status(void)
+{
+    EXPECT("note on", BYTES(0x90, 0x3c, 0x64, 0x3e, 0x64, 0x3c, 0x00),
+            MSG2(0x90, 0x3c, 0x64), MSG2(0x90, 0x3e, 0x64), MSG2(0x90, 0x3c, 0x00));
+    EXPECT("program change", BYTES(0xc3, 0x01, 0x02, 0x03),
+            MSG1(0xc3, 0x01), MSG1(0xc3, 0x02), MSG1(0xc3, 0x03));
+    EXPECT("channel pressure", BYTES(0xd0, 0x10, 0xe0, 0x00, 0x40, 0x7f, 0x7f),
+            MSG1(0xd0, 0x10), MSG2(0xe0, 0x00, 0x40), MSG2(0xe0, 0x7f, 0x7f));
+
+    /* system common messages cancel running status, real-time messages do not */
+    EXPECT("song select", BYTES(0xb0, 0x07, 0x10, 0xf3, 0x02, 0x08, 0x20),
+            MSG2(0xb0, 0x07, 0x10), MSG1(0xf3, 0x02));
+    EXPECT("clock", BYTES(0xb0, 0x07, 0x10, 0xf8, 0x08, 0x20),
+            MSG2(0xb0, 0x07, 0x10), MSG0(0xf8), MSG2(0xb0, 0x08, 0x20));
+
+    /* data bytes without a status are ignored */
+    EXPECT("no status", BYTES(0x3c, 0x64, 0x80, 0x3c, 0x00),
+            MSG2(0x80, 0x3c, 0x00));
+}
+
+static void test_realtime(void)
+{
+    EXPECT("interleaved", BYTES(0x90, 0xf8, 0x3c, 0xfe, 0x64, 0xfa, 0xf2, 0xfc, 0x10, 0xfb, 0x00, 0xff),
+            MSG0(0xf8), MSG0(0xfe), MSG2(0x90, 0x3c, 0x64), MSG0(0xfa), MSG0(0xfc), MSG0(0xfb),
+            MSG2(0xf2, 0x10, 0x00), MSG0(0xff));
+
+    /* undefined real-time and system common bytes */
+    EXPECT("undefined", BYTES(0x90, 0x3c, 0xf9, 0xfd, 0x64, 0xf4, 0x01, 0xf5, 0x02),
+            MSG2(0x90, 0x3c, 0x64));
+    EXPECT("tune request", BYTES(0xf6, 0x01),
+            MSG0(0xf6));
+}
+
+static void test_sysex(void)
+{
+    static uint8_t stream[SYSEX_SIZE + 16];
+    recorded_t messages[8];
+    size_t count;
+
+    EXPECT("sysex", BYTES(0xf0, 0x7d, 0x01, 0xf8, 0x02, 0xf7, 0x40),
+            MSG0(0xf8), { .status = MIDI_SB_SYSEX_START, .sysex_length = 3 });
+
+    /* a SysEx message that is ended by another status byte is dropped */
+    EXPECT("unterminated", BYTES(0xf0, 0x7d, 0x01, 0x90, 0x3c, 0x64, 0xf7),
+            MSG2(0x90, 0x3c, 0x64));
+
+    /* a message larger than the buffer is returned truncated */
+    memset(stream, 0x55, sizeof(stream));
+    stream[0] = MIDI_SB_SYSEX_START;
+    stream[SYSEX_SIZE + 10] = MIDI_SB_SYSEX_END;
+    count = test_parse(stream, SYSEX_SIZE + 11, messages);
+    CHECK(count == 1);
+    CHECK(messages[0].sysex_length == SYSEX_SIZE);
+    CHECK(messages[0].sysex_truncated == 1);
+
+    /* and the next one is complete again */
+    stream[9] = MIDI_SB_SYSEX_END;
+    count = test_parse(stream, 10, messages);
+    CHECK(count == 1);
+    CHECK(messages[0].sysex_length == 8);
+    CHECK(messages[0].sysex_truncated == 0);
+}
+
+/* the messages of a stream must not change when real-time bytes are inserted
+ * anywhere; the real-time messages are returned in addition
+ */
+static void test_fuzz_stream(const uint8_t *stream, size_t length)
+{
+    static uint8_t plain[MAX_STREAM_LENGTH];
+    static uint8_t mixed[2 * MAX_STREAM_LENGTH];
+    static recorded_t plain_messages[2 * MAX_STREAM_LENGTH];
+    static recorded_t mixed_messages[2 * MAX_STREAM_LENGTH];
+    static const uint8_t realtime[] = { 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff };
+    size_t plain_length = 0;
+    size_t mixed_length = 0;
+    size_t plain_count;
+    size_t mixed_count;
+    size_t inserted = 0;
+    size_t j = 0;
+
+    for(size_t i = 0; i < length; i++) {
+        if(!MIDI_IS_REALTIME(stream[i]))
+            plain[plain_length++] = stream[i];
+    }
+
+    for(size_t i = 0; i < plain_length; i++) {
+        if(test_random() % 4 == 0) {
+            mixed[mixed_length] = realtime[test_random() % sizeof(realtime)];
+            if((mixed[mixed_length] != 0xf9) && (mixed[mixed_length] != 0xfd))
+                inserted++;
+            mixed_length++;
+        }
+        mixed[mixed_length++] = plain[i];
+    }
+
+    plain_count = test_parse(plain, plain_length, plain_messages);
+    mixed_count = test_parse(mixed, mixed_length, mixed_messages);
+    test_check_messages(plain_messages, plain_count);
+    test_check_messages(mixed_messages, mixed_count);
+
+    CHECK(mixed_count == plain_count + inserted);
+    for(size_t i = 0; i < mixed_count; i++) {
+        if(MIDI_IS_REALTIME(mixed_messages[i].status))
+            continue;
+        CHECK(j < plain_count);
+        if(j >= plain_count)
+            break;
+        CHECK(memcmp(&mixed_messages[i], &plain_messages[j], sizeof(recorded_t)) == 0);
+        j++;
+    }
+    CHECK(j == plain_count);
+}
+
+static size_t test_mutate(uint8_t *stream, size_t length)
+{
+    size_t position;
+    int mutations = 1 + test_random() % 8;
+
+    for(int i = 0; i < mutations; i++) {
+        position = length ? test_random() % length : 0;
+        switch(test_random() % 4) {
+        case 0:     // replace a byte, with a bias towards status bytes
+            if(length)
+                stream[position] = (test_random() % 2) ? (0x80 | test_random()) : test_random();
+            break;
+        case 1:     // insert a byte
+            if(length < MAX_STREAM_LENGTH) {
+                memmove(&stream[position + 1], &stream[position], length - position);
+                stream[position] = test_random();
+                length++;
+            }
+            break;
+        case 2:     // delete a byte
+            if(length) {
+                memmove(&stream[position], &stream[position + 1], length - position - 1);
+                length--;
+            }
+            break;
+        default:    // cut the stream
+            length = position;
+            break;
+        }
+    }
+
+    return length;
+}
+
+static void test_fuzz(void)
+{
+    static uint8_t seed[MAX_STREAM_LENGTH];
+    static uint8_t stream[MAX_STREAM_LENGTH];
+    struct dirent *entry;
+    char path[512];
+    size_t seed_length;
+    size_t length;
+    int seeds = 0;
+    DIR *dir;
+    FILE *f;
+
+    dir = opendir(CORPUS_DIR);
+    CHECK(dir != NULL);
+    if(dir == NULL)
+        return;
+
+    while((entry = readdir(dir)) != NULL) {
+        if(entry->d_name[0] == '.')
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%s", CORPUS_DIR, entry->d_name);
+        f = fopen(path, "rb");
+        CHECK(f != NULL);
+        if(f == NULL)
+            continue;
+        seed_length = fread(seed, 1, sizeof(seed), f);
+        fclose(f);
+        seeds++;
+
+        test_fuzz_stream(seed, seed_length);
+        for(int i = 0; i < FUZZ_MUTATIONS; i++) {
+            memcpy(stream, seed, seed_length);
+            length = test_mutate(stream, seed_length);
+            test_fuzz_stream(stream, length);
+        }
+    }
+    closedir(dir);
+
+    CHECK(seeds > 0);
+    printf("fuzz: %d seeds, %d mutations each\n", seeds, FUZZ_MUTATIONS);
+}
+
+/* a mix of what a keyboard, a clock and a preset dump send */
+static void test_benchmark(void)
+{
+    static uint8_t stream[1 << 20];
+    uint8_t sysex_buffer[SYSEX_SIZE];
+    midi_parser_t parser;
+    midi_message_t message;
+    struct timespec start;
+    struct timespec end;
+    size_t length = 0;
+    uint32_t messages = 0;
+    double elapsed_us;
+    const int rounds = 20;
+
+    while(length < sizeof(stream) - 128) {
+        switch(test_random() % 4) {
+        case 0:
+            stream[length++] = 0x90;
+            for(int i = 0; i < 8; i++) {
+                stream[length++] = test_random() & 0x7f;
+                stream[length++] = test_random() & 0x7f;
+            }
+            break;
+        case 1:
+            stream[length++] = 0xb0;
+            stream[length++] = 0x07;
+            stream[length++] = 0xf8;
+            stream[length++] = test_random() & 0x7f;
+            break;
+        case 2:
+            stream[length++] = 0xf0;
+            for(int i = 0; i < 64; i++)
+                stream[length++] = test_random() & 0x7f;
+            stream[length++] = 0xf7;
+            break;
+        default:
+            stream[length++] = 0xe0;
+            stream[length++] = test_random() & 0x7f;
+            stream[length++] = test_random() & 0x7f;
+            break;
+        }
+    }
+
+    midi_parser_init(&parser, sysex_buffer, sizeof(sysex_buffer));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int round = 0; round < rounds; round++) {
+        for(size_t i = 0; i < length; i++)
+            messages += midi_parser_feed(&parser, stream[i], &message);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    elapsed_us = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+    printf("throughput: %.1f bytes/us (%u messages)\n", rounds * length / elapsed_us, messages);
+}
+
+int main(void)
+{
+    test_running_status();
+    test_realtime();
+    test_sysex();
+    test_fuzz();
+    test_benchmark();
+
+    return host_report("test_midi_parser");
+}
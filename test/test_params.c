@@ -0,0 +1,291 @@
+/* Host test of the parameter map: the curves in both directions, 14-bit
+ * controller pairs, NRPN and RPN data entry through the MIDI task, and the
+ * parameter dump, which has to read back the values that were sent.
+ */
+#include "host.h"
+#include "fakes.h"
+
+#include "params.c"
+#include "midi_input.c"
+
+#include <math.h>
+
+static FILE *m_console;
+static FILE *m_stdout;
+
+static void test_cc(uint8_t cc, uint8_t value)
+{
+    midi_message_t message = {
+        .status = MIDI_SB_CONTROL_CHANGE,
+        .data = { cc, value },
+        .length = 2,
+    };
+
+    midi_process_message(&message, 0, 0);
+    midi_apply_pending_params();
+}
+
+static int test_close(float a, float b)
+{
+    return fabsf(a - b) <= 1e-5 * fmaxf(fabsf(a), fabsf(b)) + 1e-6;
+}
+
+/* the full range is reached from 7-bit controllers as well */
+static void test_endpoints(void)
+{
+    const param_desc_t *desc;
+
+    CHECK(midi_raw_from_msb(0x00) == 0);
+    CHECK(midi_raw_from_msb(0x7f) == PARAM_RAW_MAX);
+
+    for(int id = 0; id < PARAM_COUNT; id++) {
+        desc = param_get_desc(id);
+        CHECK(desc->name != NULL);
+        CHECK(desc->set != NULL);
+
+        switch(desc->curve) {
+        case PARAM_CURVE_LINEAR:
+        case PARAM_CURVE_EXPONENTIAL:
+            CHECK(test_close(param_from_raw(id, 0), desc->min));
+            CHECK(test_close(param_from_raw(id, PARAM_RAW_MAX), desc->max));
+            break;
+        case PARAM_CURVE_STEPPED:
+            CHECK(desc->step > 0);
+            CHECK(param_from_raw(id, 0) == 0);
+            CHECK(param_from_raw(id, PARAM_RAW_MAX) == fminf(127 / desc->step, desc->max));
+            break;
+        case PARAM_CURVE_TOGGLE:
+            CHECK(param_from_raw(id, 0) == 0.0);
+            CHECK(param_from_raw(id, 1) == 1.0);
+            CHECK(param_from_raw(id, PARAM_RAW_MAX) == 1.0);
+            CHECK(param_to_raw(id, 0.0) == 0);
+            CHECK(param_to_raw(id, 1.0) >> 7 == 1);
+            break;
+        }
+    }
+}
+
+/* every 14-bit value maps back to itself, and the curves are monotonic */
+static void test_continuous(void)
+{
+    const param_desc_t *desc;
+    float value;
+    float last;
+    int error;
+    int max_error = 0;
+
+    for(int id = 0; id < PARAM_COUNT; id++) {
+        desc = param_get_desc(id);
+        if((desc->curve != PARAM_CURVE_LINEAR) && (desc->curve != PARAM_CURVE_EXPONENTIAL))
+            continue;
+
+        last = -INFINITY;
+        for(int raw = 0; raw <= PARAM_RAW_MAX; raw++) {
+            value = param_from_raw(id, raw);
+            CHECK(value > last);
+            last = value;
+            error = abs(param_to_raw(id, value) - raw);
+            if(error > max_error)
+                max_error = error;
+        }
+
+        /* out of range values are clamped */
+        CHECK(param_to_raw(id, desc->min - 1.0) == 0);
+        CHECK(param_to_raw(id, desc->max * 2.0) == PARAM_RAW_MAX);
+
+        /* the center is the geometric mean, i.e. every octave gets the same travel */
+        if(desc->curve == PARAM_CURVE_EXPONENTIAL) {
+            CHECK(desc->min > 0.0);
+            CHECK(test_close(param_from_raw(id, PARAM_RAW_MAX / 2),
+                                desc->min * powf(desc->max / desc->min, (float) (PARAM_RAW_MAX / 2) / PARAM_RAW_MAX)));
+        }
+    }
+
+    CHECK(max_error == 0);
+}
+
+/* a step every `step` 7-bit values, and the values map back to the start of
+ * their step
+ */
+static void test_stepped(void)
+{
+    const param_desc_t *desc;
+    float value;
+
+    for(int id = 0; id < PARAM_COUNT; id++) {
+        desc = param_get_desc(id);
+        if(desc->curve != PARAM_CURVE_STEPPED)
+            continue;
+
+        for(int v = 0; v < 128; v++) {
+            value = param_from_raw(id, midi_raw_from_msb(v));
+            CHECK(value == fminf(v / desc->step, desc->max));
+            CHECK(param_from_raw(id, param_to_raw(id, value)) == value);
+        }
+    }
+}
+
+static void test_capture_start(void)
+{
+    m_console = tmpfile();
+    m_stdout = stdout;
+    stdout = m_console;
+}
+
+/* returns the value that the dump reports for a controller, or -1 */
+static int test_capture_end(uint8_t cc)
+{
+    char line[64];
+    unsigned int dump_cc;
+    unsigned int value;
+    int result = -1;
+
+    fflush(m_console);
+    stdout = m_stdout;
+    rewind(m_console);
+    while(fgets(line, sizeof(line), m_console) != NULL) {
+        if((sscanf(line, "%X:%X", &dump_cc, &value) == 2) && (dump_cc == cc))
+            result = value;
+    }
+    fclose(m_console);
+
+    return result;
+}
+
+/* the dump reads back every 7-bit value sent to a parameter (the start of its
+ * step for stepped parameters)
+ */
+static void test_dump(void)
+{
+    const param_desc_t *desc;
+    const uint8_t cc = 0x10;
+    int expected;
+    int value;
+
+    for(int id = 0; id < PARAM_COUNT; id++) {
+        desc = param_get_desc(id);
+        if(desc->get == NULL)
+            continue;
+
+        fake_cc_map[cc] = id;
+        for(int v = 0; v < 128; v++) {
+            test_cc(cc, v);
+
+            test_capture_start();
+            midi_dump_params();
+            value = test_capture_end(cc);
+
+            switch(desc->curve) {
+            case PARAM_CURVE_STEPPED:
+                expected = (int) fminf(v / desc->step, desc->max) * desc->step;
+                break;
+            case PARAM_CURVE_TOGGLE:
+                expected = (v != 0);
+                break;
+            default:
+                expected = v;
+                break;
+            }
+            if(value != expected)
+                printf("%s: sent %d, dumped %d, expected %d\n", desc->name, v, value, expected);
+            CHECK(value == expected);
+        }
+        fake_cc_map[cc] = PARAM_NONE;
+    }
+}
+
+/* controllers 0-31 with their LSBs 32-63 */
+static void test_14bit_pair(void)
+{
+    fake_cc_map[0x10] = PARAM_OSC1_AMP;
+
+    test_cc(0x10, 0x40);
+    CHECK(fake_patch.osc1.amplitude == param_from_raw(PARAM_OSC1_AMP, (0x40 << 7) | 0x40));
+    test_cc(0x30, 0x05);
+    CHECK(fake_patch.osc1.amplitude == param_from_raw(PARAM_OSC1_AMP, (0x40 << 7) | 0x05));
+    test_cc(0x30, 0x7f);
+    CHECK(fake_patch.osc1.amplitude == param_from_raw(PARAM_OSC1_AMP, (0x40 << 7) | 0x7f));
+    /* a new MSB on its own is a 7-bit value again */
+    test_cc(0x10, 0x7f);
+    CHECK(fake_patch.osc1.amplitude == param_get_desc(PARAM_OSC1_AMP)->max);
+
+    /* the LSB of a controller that is not assigned does nothing */
+    test_cc(0x31, 0x00);
+    CHECK(fake_patch.osc1.amplitude == param_get_desc(PARAM_OSC1_AMP)->max);
+
+    fake_cc_map[0x10] = PARAM_NONE;
+
+    /* modulation is 14 bits as well */
+    test_cc(MIDI_CC_MODULATION, 0x7f);
+    CHECK(fake_modulation == 1.0);
+    test_cc(MIDI_CC_MODULATION_LSB, 0x00);
+    CHECK(fake_modulation == (float) (0x7f << 7) / PARAM_RAW_MAX);
+}
+
+/* NRPN numbers are the parameter ids */
+static void test_nrpn(void)
+{
+    float attack;
+
+    test_cc(MIDI_CC_NRPN_MSB, 0x00);
+    test_cc(MIDI_CC_NRPN_LSB, PARAM_ENV_ATTACK);
+    test_cc(MIDI_CC_DATA_ENTRY_MSB, 0x40);
+    CHECK(fake_patch.envelope.attack == param_from_raw(PARAM_ENV_ATTACK, (0x40 << 7) | 0x40));
+    test_cc(MIDI_CC_DATA_ENTRY_LSB, 0x01);
+    CHECK(fake_patch.envelope.attack == param_from_raw(PARAM_ENV_ATTACK, (0x40 << 7) | 0x01));
+    attack = fake_patch.envelope.attack;
+
+    /* another NRPN changes another parameter */
+    test_cc(MIDI_CC_NRPN_LSB, PARAM_ENV_DECAY);
+    test_cc(MIDI_CC_DATA_ENTRY_MSB, 0x7f);
+    CHECK(fake_patch.envelope.decay == param_get_desc(PARAM_ENV_DECAY)->max);
+    CHECK(fake_patch.envelope.attack == attack);
+
+    /* numbers that are not a parameter, and the null NRPN, are ignored */
+    test_cc(MIDI_CC_NRPN_LSB, PARAM_COUNT);
+    test_cc(MIDI_CC_DATA_ENTRY_MSB, 0x00);
+    test_cc(MIDI_CC_NRPN_MSB, 0x7f);
+    test_cc(MIDI_CC_NRPN_LSB, 0x7f);
+    test_cc(MIDI_CC_DATA_ENTRY_MSB, 0x00);
+    CHECK(fake_patch.envelope.decay == param_get_desc(PARAM_ENV_DECAY)->max);
+    CHECK(fake_patch.envelope.attack == attack);
+
+    /* RPN 0 is the pitch bend range, semitones and cents; selecting it
+     * deselects the NRPN
+     */
+    test_cc(MIDI_CC_NRPN_MSB, 0x00);
+    test_cc(MIDI_CC_NRPN_LSB, PARAM_ENV_ATTACK);
+    test_cc(MIDI_CC_RPN_MSB, 0x00);
+    test_cc(MIDI_CC_RPN_LSB, 0x00);
+    test_cc(MIDI_CC_DATA_ENTRY_MSB, 12);
+    CHECK(fake_bend_range == 12.0);
+    test_cc(MIDI_CC_DATA_ENTRY_LSB, 50);
+    CHECK(fake_bend_range == 12.5);
+    CHECK(fake_patch.envelope.attack == attack);
+
+    /* a new MSB resets the cents */
+    test_cc(MIDI_CC_DATA_ENTRY_MSB, 2);
+    CHECK(fake_bend_range == 2.0);
+
+    /* either half of an NRPN number, even the null one, deselects the RPN */
+    test_cc(MIDI_CC_NRPN_MSB, 0x7f);
+    test_cc(MIDI_CC_DATA_ENTRY_MSB, 24);
+    CHECK(fake_bend_range == 2.0);
+    test_cc(MIDI_CC_RPN_MSB, 0x00);
+    test_cc(MIDI_CC_RPN_LSB, 0x00);
+    test_cc(MIDI_CC_NRPN_LSB, 0x7f);
+    test_cc(MIDI_CC_DATA_ENTRY_MSB, 24);
+    CHECK(fake_bend_range == 2.0);
+}
+
+int main(void)
+{
+    test_endpoints();
+    test_continuous();
+    test_stepped();
+    test_dump();
+    test_14bit_pair();
+    test_nrpn();
+
+    return host_report("test_params");
+}
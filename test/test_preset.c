@@ -0,0 +1,420 @@
+/* Host test of the preset records: valid records of this and of other versions,
+ * files of the first version, and corrupt, truncated and out of range ones,
+ * which must never give a patch. Then the same through the files in SPIFFS and
+ * the factory presets of the asset bundle, as preset_init() reads them.
+ */
+#include "host.h"
+
+#include "preset.c"
+
+#include <stddef.h>
+
+#include "tuning.h"
+
+static synth_patch_t m_applied;
+static int m_apply_count;
+
+/* factory presets returned by assets_find() */
+static uint8_t m_factory[PRESET_COUNT][PRESET_MAX_RECORD_SIZE];
+static size_t m_factory_size[PRESET_COUNT];
+
+/* the checks of synth.c, which cannot be built on the host */
+int synth_patch_is_valid(const synth_patch_t *source)
+{
+    const oscillator_params_t *oscs[] = { &source->osc1, &source->osc2, &source->lfo };
+
+    for(int i = 0; i < 3; i++) {
+        if((oscs[i]->frequency <= 0.0) || (oscs[i]->frequency >= SYNTH_SAMPLING_FREQ / 2.0))
+            return 0;
+    }
+    if((source->osc1.waveform > WAVEFORM_SAMPLE) || (source->osc2.waveform > WAVEFORM_SQUARE)
+            || (source->lfo.waveform > WAVEFORM_SQUARE))
+        return 0;
+    if(source->synth.tuning >= TUNING_COUNT)
+        return 0;
+
+    return (source->envelope.attack > 0.0) && (source->envelope.decay > 0.0) && (source->envelope.release > 0.0)
+            && (source->envelope.sustain >= 0.0) && (source->envelope.sustain <= 1.0);
+}
+
+void synth_update(oscillator_params_t *osc1_params, oscillator_params_t *osc2_params,
+                    oscillator_params_t *lfo_params, envelope_params_t *envelope_params,
+                    synth_params_t *synth_params)
+{
+    m_applied.osc1 = *osc1_params;
+    m_applied.osc2 = *osc2_params;
+    m_applied.lfo = *lfo_params;
+    m_applied.envelope = *envelope_params;
+    m_applied.synth = *synth_params;
+    m_apply_count++;
+}
+
+void synth_get_patch(synth_patch_t *patch) { *patch = m_applied; }
+void synth_set_morph_target(const synth_patch_t *patch) {}
+uint8_t synth_get_selected_part(void) { return 0; }
+
+int sequencer_load(int index) { return 0; }
+int sequencer_save(int index) { return 0; }
+int sequencer_write(int index) { return 0; }
+
+void midi_learn_write(void) {}
+
+void logger_log(logger_message_t id, ...) {}
+
+const void *assets_find(asset_type_t type, uint16_t index, size_t *size)
+{
+    if((type != ASSET_PRESET) || (index >= PRESET_COUNT) || (m_factory_size[index] == 0))
+        return NULL;
+
+    *size = m_factory_size[index];
+    return m_factory[index];
+}
+
+/* a valid patch with no field at its default */
+static void test_patch(synth_patch_t *patch, int variant)
+{
+    memset(patch, 0, sizeof(*patch));
+    patch->osc1.amplitude = 5000.0 + variant;
+    patch->osc1.frequency = 220.0;
+    patch->osc1.waveform = WAVEFORM_SQUARE;
+    patch->osc2.amplitude = 0.25;
+    patch->osc2.frequency = 330.0;
+    patch->osc2.waveform = WAVEFORM_SINUS;
+    patch->lfo.amplitude = 0.5;
+    patch->lfo.frequency = 3.0;
+    patch->lfo.waveform = WAVEFORM_SQUARE;
+    patch->envelope.attack = 0.01;
+    patch->envelope.decay = 0.2;
+    patch->envelope.sustain = 0.75;
+    patch->envelope.release = 0.3;
+    patch->envelope.amplitude = 0.9;
+    patch->synth.lfo_enabled = 1;
+    patch->synth.osc2_sync_enabled = 1;
+    patch->synth.noise_amplitude = 0.125;
+    patch->synth.lfo_sync = LFO_SYNC_QUARTER;
+    patch->synth.tuning = 3;
+}
+
+/* compares what is stored of two patches */
+static int test_same(const synth_patch_t *a, const synth_patch_t *b)
+{
+    preset_fields_t fields_a;
+    preset_fields_t fields_b;
+
+    preset_to_fields(&fields_a, a);
+    preset_to_fields(&fields_b, b);
+
+    return memcmp(&fields_a, &fields_b, sizeof(fields_a)) == 0;
+}
+
+/* a record with the fields of length bytes of patch (and zeros after them) */
+static size_t test_record(uint8_t *data, const synth_patch_t *patch, int length)
+{
+    preset_header_t header = {
+        .magic = PRESET_MAGIC,
+        .version = PRESET_VERSION,
+        .length = length,
+    };
+    preset_fields_t fields;
+
+    memset(data, 0, sizeof(header) + length);
+    preset_to_fields(&fields, patch);
+    memcpy(&data[sizeof(header)], &fields, MIN(length, sizeof(fields)));
+    header.crc = esp_crc32_le(0, &data[sizeof(header)], length);
+    memcpy(data, &header, sizeof(header));
+
+    return sizeof(header) + length;
+}
+
+static void test_write_file(const char *name, const uint8_t *data, size_t size)
+{
+    char filename[32];
+    FILE *f;
+
+    snprintf(filename, sizeof(filename), "/spiffs/%s", name);
+    f = fopen(filename, "w");
+    CHECK(f != NULL);
+    fwrite(data, 1, size, f);
+    fclose(f);
+}
+
+static void test_round_trip(void)
+{
+    uint8_t data[PRESET_MAX_RECORD_SIZE];
+    synth_patch_t patch;
+    synth_patch_t decoded;
+    size_t size;
+
+    test_patch(&patch, 0);
+    size = preset_encode(&patch, data);
+    CHECK(size == sizeof(preset_record_t));
+    CHECK(preset_decode(data, size, &decoded) == 0);
+    CHECK(test_same(&patch, &decoded));
+
+    /* the samples of OSC1 */
+    patch.osc1.waveform = WAVEFORM_SAMPLE;
+    size = preset_encode(&patch, data);
+    CHECK(preset_decode(data, size, &decoded) == 0);
+    CHECK(decoded.osc1.waveform == WAVEFORM_SAMPLE);
+}
+
+/* records of other versions that only differ in their fields */
+static void test_versions(void)
+{
+    uint8_t data[PRESET_MAX_RECORD_SIZE];
+    preset_fields_t expected;
+    preset_fields_t fields;
+    synth_patch_t patch;
+    synth_patch_t decoded;
+    size_t size;
+
+    /* an older record that ends before the envelope gets the defaults of the
+     * fields after it
+     */
+    test_patch(&patch, 0);
+    size = test_record(data, &patch, offsetof(preset_fields_t, attack));
+    CHECK(preset_decode(data, size, &decoded) == 0);
+    preset_to_fields(&expected, &patch);
+    memcpy((uint8_t *) &expected + offsetof(preset_fields_t, attack), (const uint8_t *) &m_defaults
+            + offsetof(preset_fields_t, attack), sizeof(expected) - offsetof(preset_fields_t, attack));
+    preset_to_fields(&fields, &decoded);
+    CHECK(memcmp(&fields, &expected, sizeof(fields)) == 0);
+    CHECK(decoded.envelope.sustain == m_defaults.sustain);
+
+    /* the fields a newer record has after them are skipped */
+    size = test_record(data, &patch, sizeof(preset_fields_t) + 8);
+    CHECK(preset_decode(data, size, &decoded) == 0);
+    CHECK(test_same(&patch, &decoded));
+
+    /* up to the largest record that is read */
+    size = test_record(data, &patch, PRESET_MAX_RECORD_SIZE - sizeof(preset_header_t));
+    CHECK(preset_decode(data, size, &decoded) == 0);
+    CHECK(test_same(&patch, &decoded));
+}
+
+/* files of the first version */
+static void test_legacy(void)
+{
+    preset_legacy_t legacy = {
+        .osc1_amplitude = 10000.0,
+        .osc1_frequency = 440.0,
+        .osc1_waveform = WAVEFORM_SAWTOOTH,
+        .osc2_amplitude = 0.5,
+        .osc2_frequency = 523.25,
+        .osc2_waveform = WAVEFORM_SQUARE,
+        .lfo_amplitude = 1.0,
+        .lfo_frequency = 10.0,
+        .lfo_waveform = WAVEFORM_SINUS,
+        .attack = 0.1,
+        .decay = 0.2,
+        .sustain = 0.5,
+        .release = 1.0,
+        .envelope_amplitude = 1.0,
+        .lfo_enabled = 1,
+        .osc2_sync_enabled = 0,
+        .noise_amplitude = 0.25,
+    };
+    uint8_t data[sizeof(legacy) + 1];
+    uint8_t raw[sizeof(synth_patch_t)];
+    synth_patch_t decoded;
+    synth_patch_t before;
+
+    memcpy(data, &legacy, sizeof(legacy));
+    CHECK(preset_decode(data, sizeof(legacy), &decoded) == 0);
+    CHECK(decoded.osc1.waveform == WAVEFORM_SAWTOOTH);
+    CHECK(decoded.osc2.frequency == (float) 523.25);
+    CHECK(decoded.osc2.waveform == WAVEFORM_SQUARE);
+    CHECK(decoded.envelope.decay == (float) 0.2);
+    CHECK(decoded.synth.lfo_enabled == 1);
+    CHECK(decoded.synth.noise_amplitude == (float) 0.25);
+    /* the fields the first version did not have */
+    CHECK(decoded.synth.lfo_sync == LFO_SYNC_OFF);
+    CHECK(decoded.synth.tuning == 0);
+
+    /* other sizes are not a file of the first version */
+    test_patch(&before, 0);
+    decoded = before;
+    CHECK(preset_decode(data, sizeof(legacy) - 1, &decoded) == -1);
+    data[sizeof(legacy)] = 0;
+    CHECK(preset_decode(data, sizeof(legacy) + 1, &decoded) == -1);
+
+    /* waveforms that do not fit a byte are not truncated into valid ones */
+    legacy.osc2_waveform = 0x100 | WAVEFORM_SINUS;
+    memcpy(data, &legacy, sizeof(legacy));
+    CHECK(preset_decode(data, sizeof(legacy), &decoded) == -1);
+    legacy.osc2_waveform = WAVEFORM_SQUARE;
+    legacy.lfo_waveform = 9;
+    memcpy(data, &legacy, sizeof(legacy));
+    CHECK(preset_decode(data, sizeof(legacy), &decoded) == -1);
+
+    /* neither is a patch as it is in memory */
+    memcpy(raw, &before, sizeof(before));
+    CHECK(preset_decode(raw, sizeof(raw), &decoded) == -1);
+
+    CHECK(test_same(&decoded, &before));
+}
+
+/* none of these give a patch, and the patch is left as it was */
+static void test_invalid(void)
+{
+    uint8_t data[PRESET_MAX_RECORD_SIZE + 1];
+    preset_header_t header;
+    synth_patch_t patch;
+    synth_patch_t decoded;
+    synth_patch_t before;
+    size_t size;
+
+    test_patch(&before, 1);
+    decoded = before;
+    test_patch(&patch, 0);
+    size = preset_encode(&patch, data);
+
+    /* any byte of the fields changed */
+    for(size_t i = sizeof(header); i < size; i++) {
+        data[i] ^= 0x01;
+        CHECK(preset_decode(data, size, &decoded) == -1);
+        data[i] ^= 0x01;
+    }
+    /* or of the CRC */
+    data[offsetof(preset_header_t, crc)] ^= 0x80;
+    CHECK(preset_decode(data, size, &decoded) == -1);
+    data[offsetof(preset_header_t, crc)] ^= 0x80;
+    CHECK(preset_decode(data, size, &decoded) == 0);
+    decoded = before;
+
+    /* truncated anywhere, or with more than the length */
+    for(size_t i = 0; i < size; i++)
+        CHECK(preset_decode(data, i, &decoded) == -1);
+    data[size] = 0;
+    CHECK(preset_decode(data, size + 1, &decoded) == -1);
+
+    /* a newer, incompatible version */
+    memcpy(&header, data, sizeof(header));
+    header.version = PRESET_VERSION + 1;
+    memcpy(data, &header, sizeof(header));
+    CHECK(preset_decode(data, size, &decoded) == -1);
+
+    /* valid records of patches that are out of range */
+    patch.envelope.attack = 0.0;
+    size = preset_encode(&patch, data);
+    CHECK(preset_decode(data, size, &decoded) == -1);
+    test_patch(&patch, 0);
+    patch.osc2.waveform = WAVEFORM_SAMPLE;
+    size = preset_encode(&patch, data);
+    CHECK(preset_decode(data, size, &decoded) == -1);
+    test_patch(&patch, 0);
+    patch.synth.tuning = TUNING_COUNT;
+    size = preset_encode(&patch, data);
+    CHECK(preset_decode(data, size, &decoded) == -1);
+    test_patch(&patch, 0);
+    patch.lfo.frequency = 0.0;
+    size = preset_encode(&patch, data);
+    CHECK(preset_decode(data, size, &decoded) == -1);
+
+    CHECK(test_same(&decoded, &before));
+}
+
+/* the files in SPIFFS and the factory presets, as preset_init() reads them */
+static void test_init(void)
+{
+    uint8_t data[PRESET_MAX_RECORD_SIZE + 2];
+    synth_patch_t patches[PRESET_COUNT];
+    synth_patch_t patch;
+    size_t size;
+
+    for(int i = 0; i < PRESET_COUNT; i++)
+        test_patch(&patches[i], i);
+
+    /* 0: saved; 1: a factory preset only; 2: neither; 3: a corrupt file, the
+     * factory preset is used; 4: a file that is too long and no factory preset;
+     * 5: a file of the first version that was saved over the factory preset;
+     * 6: a corrupt factory preset
+     */
+    CHECK(preset_store(0, &patches[0]) == 0);
+
+    m_factory_size[1] = preset_encode(&patches[1], m_factory[1]);
+
+    size = preset_encode(&patches[3], data);
+    data[size - 1] ^= 0xff;
+    test_write_file("PRESET3", data, size);
+    m_factory_size[3] = preset_encode(&patches[3], m_factory[3]);
+
+    size = test_record(data, &patches[4], PRESET_MAX_RECORD_SIZE + 2 - sizeof(preset_header_t));
+    test_write_file("PRESET4", data, size);
+
+    memset(data, 0, sizeof(preset_legacy_t));
+    ((preset_legacy_t *) data)->osc1_frequency = 110.0;
+    ((preset_legacy_t *) data)->osc2_frequency = 110.0;
+    ((preset_legacy_t *) data)->lfo_frequency = 1.0;
+    ((preset_legacy_t *) data)->attack = 1.0;
+    ((preset_legacy_t *) data)->decay = 1.0;
+    ((preset_legacy_t *) data)->release = 1.0;
+    test_write_file("PRESET5", data, sizeof(preset_legacy_t));
+    m_factory_size[5] = preset_encode(&patches[5], m_factory[5]);
+
+    m_factory_size[6] = preset_encode(&patches[6], m_factory[6]) - 1;
+
+    preset_init();
+
+    CHECK((preset_read(0, &patch) == 0) && test_same(&patch, &patches[0]));
+    CHECK((preset_read(1, &patch) == 0) && test_same(&patch, &patches[1]));
+    CHECK(preset_read(2, &patch) == -1);
+    CHECK((preset_read(3, &patch) == 0) && test_same(&patch, &patches[3]));
+    CHECK(preset_read(4, &patch) == -1);
+    CHECK((preset_read(5, &patch) == 0) && (patch.osc1.frequency == (float) 110.0));
+    CHECK(preset_read(6, &patch) == -1);
+
+    /* a file of the first version is replaced by a record once it is saved */
+    CHECK(preset_store(5, &patch) == 0);
+    memset(&patches[5], 0, sizeof(patches[5]));
+    CHECK((preset_load(5, &patches[5]) == 0) && test_same(&patch, &patches[5]));
+}
+
+/* saving writes the preset in the background; selecting a preset applies it */
+static void test_select(void)
+{
+    synth_patch_t patch;
+    synth_patch_t loaded;
+    uint32_t pending;
+
+    xTaskNotifyWait(0, UINT32_MAX, &pending, 0);
+
+    test_patch(&patch, 100);
+    patch.synth.tuning = 5;
+    CHECK(preset_write(2, &patch) == 0);
+    CHECK(xTaskNotifyWait(0, UINT32_MAX, &pending, 0) == pdTRUE);
+    CHECK(pending == PRESET_PENDING_PATCH(2));
+    /* what the task does for it */
+    CHECK(preset_store(2, &patch) == 0);
+    CHECK((preset_load(2, &loaded) == 0) && test_same(&patch, &loaded));
+
+    preset_set_current_index(0);
+    m_apply_count = 0;
+    preset_select(2);
+    CHECK((m_apply_count == 1) && test_same(&m_applied, &patch));
+    CHECK(preset_get_current_index() == 2);
+
+    /* a preset that was never saved leaves the patch as it is */
+    preset_select(4);
+    CHECK(m_apply_count == 1);
+    CHECK(preset_get_current_index() == 4);
+
+    /* saving the current preset writes its pattern as well */
+    m_applied.osc1.amplitude = 1234.0;
+    preset_save();
+    CHECK(xTaskNotifyWait(0, UINT32_MAX, &pending, 0) == pdTRUE);
+    CHECK(pending == (PRESET_PENDING_PATCH(4) | PRESET_PENDING_PATTERN(4)));
+    CHECK((preset_read(4, &loaded) == 0) && (loaded.osc1.amplitude == (float) 1234.0));
+}
+
+int main(void)
+{
+    test_round_trip();
+    test_versions();
+    test_legacy();
+    test_invalid();
+    test_init();
+    test_select();
+
+    return host_report("test_preset");
+}
@@ -0,0 +1,375 @@
+/* Host test of the step sequencer: a pattern is rendered block by block and the
+ * notes have to start (and stop) on their exact sample, on the internal tempo
+ * and following a MIDI clock; the pattern records have to survive a round trip
+ * through the storage and be rejected when they are damaged.
+ */
+#include "host.h"
+
+#include "sequencer.c"
+
+#define BLOCK_FRAMES        (SYNTH_SAMPLING_FREQ / 100)
+#define MAX_EVENTS          (4096)
+#define SAMPLES_PER_STEP(bpm)   (60.0 * SYNTH_SAMPLING_FREQ / 4 / (bpm))
+
+typedef struct {
+    uint32_t sample;
+    uint8_t channel;
+    uint8_t key;
+    uint8_t velocity;       // 0 for a release
+} event_t;
+
+static event_t m_events[MAX_EVENTS];
+static int m_event_count;
+static event_t m_injected[MAX_EVENTS];
+static int m_injected_count;
+
+static void test_add_event(event_t *events, int *count, uint32_t sample, uint8_t channel, uint8_t key,
+                            uint8_t velocity)
+{
+    if(*count < MAX_EVENTS) {
+        events[*count].sample = sample;
+        events[*count].channel = channel;
+        events[*count].key = key;
+        events[*count].velocity = velocity;
+        (*count)++;
+    }
+}
+
+int synth_schedule_key_press(uint32_t sample, uint8_t channel, uint8_t key, uint8_t velocity)
+{
+    test_add_event(m_events, &m_event_count, sample, channel, key, velocity);
+    return 0;
+}
+
+int synth_schedule_key_release(uint32_t sample, uint8_t channel, uint8_t key)
+{
+    test_add_event(m_events, &m_event_count, sample, channel, key, 0);
+    return 0;
+}
+
+uint32_t synth_get_sample_position(int64_t time_us)
+{
+    return time_us * SYNTH_SAMPLING_FREQ / 1000000;
+}
+
+int midi_inject(const midi_message_t *message, uint32_t sample, int wait)
+{
+    CHECK(!wait);
+    test_add_event(m_injected, &m_injected_count, sample, message->status & 0x0f, message->data[0],
+                    message->data[1]);
+    return 0;
+}
+
+int preset_get_current_index(void)
+{
+    return 0;
+}
+
+/* renders blocks of block_size frames from start to end; the clocks that were
+ * received while the previous block was rendered are on the sample clock
+ * before the block (see synth_get_sample_position())
+ */
+static void test_render(uint32_t start, uint32_t end, uint32_t block_size, double clock_samples,
+                        uint32_t *next_clock)
+{
+    uint32_t block;
+
+    for(uint32_t sample = start; sample < end; sample += block) {
+        block = (end - sample < block_size) ? end - sample : block_size;
+        while((next_clock != NULL) && ((double) *next_clock * clock_samples < sample)) {
+            tempo_clock((uint32_t) (*next_clock * clock_samples));
+            (*next_clock)++;
+        }
+        sequencer_process_block(sample, block);
+    }
+}
+
+static void test_pattern(void)
+{
+    sequencer_track_t track;
+
+    sequencer_clear(&m_pattern);
+
+    /* a note on every step but every fourth, with different gates */
+    sequencer_get_track(0, &track);
+    track.length = 16;
+    for(int i = 0; i < 16; i++) {
+        track.steps[i].note = 60 + i;
+        track.steps[i].velocity = (i % 4 == 3) ? 0 : 100;
+        track.steps[i].gate = 1 + i;
+    }
+    track.steps[2].cc = 0x4a;
+    track.steps[2].cc_value = 0x33;
+    sequencer_set_track(0, &track);
+
+    /* a second track of 3 steps on another channel, i.e. polymetric */
+    sequencer_get_track(1, &track);
+    track.length = 3;
+    track.channel = 5;
+    track.steps[0].note = 36;
+    track.steps[0].velocity = 127;
+    track.steps[0].gate = 8;
+    sequencer_set_track(1, &track);
+}
+
+/* The note of step n starts at the sample where step n begins on the internal
+ * tempo, rounded down; the fraction is carried, so the onsets stay exact over
+ * a long run. Rendering in other block sizes gives the same events.
+ */
+static void test_internal_tempo(float bpm)
+{
+    static event_t events[MAX_EVENTS];
+    const uint32_t start = 1000;
+    const int steps = 400;
+    double samples_per_step = SAMPLES_PER_STEP(bpm);
+    float samples_per_step_float = 60.0 * SYNTH_SAMPLING_FREQ / TEMPO_PPQN / bpm * SEQUENCER_TICKS_PER_STEP;
+    uint32_t end = start + (uint32_t) (steps * samples_per_step);
+    uint32_t onset;
+    int max_error = 0;
+    int count;
+    int step;
+    int notes = 0;
+
+    test_pattern();
+    sequencer_set_tempo(bpm);
+
+    for(int b = 0; b < 3; b++) {
+        m_event_count = 0;
+        m_injected_count = 0;
+        sequencer_set_playing(1);
+        /* the first block starts the steps */
+        test_render(start, end, (b == 0) ? BLOCK_FRAMES : (b == 1) ? 64 : 1013, 0.0, NULL);
+        sequencer_set_playing(0);
+        sequencer_process_block(end, BLOCK_FRAMES);
+
+        if(b == 0) {
+            memcpy(events, m_events, sizeof(events));
+            count = m_event_count;
+            continue;
+        }
+
+        CHECK(m_event_count == count);
+        for(int i = 0; (i < count) && (i < m_event_count); i++)
+            CHECK(memcmp(&m_events[i], &events[i], sizeof(event_t)) == 0);
+    }
+
+    for(int i = 0; i < count; i++) {
+        if(events[i].velocity == 0)
+            continue;
+        notes++;
+
+        if(events[i].channel == 0) {
+            CHECK(events[i + 1].velocity == 0);
+            /* step n of the run is played n times the step length after the start */
+            step = (int) ((events[i].sample - start) / samples_per_step + 0.5);
+            CHECK(events[i].key == 60 + step % 16);
+            onset = start + (uint32_t) (step * (double) samples_per_step_float);
+            if(abs((int) (events[i].sample - onset)) > max_error)
+                max_error = abs((int) (events[i].sample - onset));
+            /* the gate is in sixteenths of a step */
+            CHECK(events[i + 1].sample == events[i].sample
+                    + (uint32_t) ((step % 16 + 1) * samples_per_step_float / SEQUENCER_GATE_STEP));
+        }
+    }
+    CHECK(max_error <= 1);
+
+    /* 12 notes per 16 steps on track 0, one per 3 steps on track 1 */
+    CHECK(notes == steps - steps / 4 + (steps + 2) / 3);
+
+    /* the CC lock of step 2 at its sample, injected without waiting */
+    CHECK(m_injected_count == (steps + 13) / 16);
+    CHECK((m_injected[0].key == 0x4a) && (m_injected[0].velocity == 0x33));
+    CHECK(m_injected[0].sample == start + (uint32_t) (2 * samples_per_step_float));
+
+    printf("%.1f BPM: %d notes in %d steps, onsets within %d sample(s) of the exact position\n", bpm, notes,
+            steps, max_error);
+}
+
+/* Following a MIDI clock at 24 PPQN, a step starts every 6 clocks once the
+ * estimate is locked; the steps stop with the transport.
+ */
+static void test_midi_clock(float bpm)
+{
+    double clock_samples = 60.0 * SYNTH_SAMPLING_FREQ / TEMPO_PPQN / bpm;
+    uint32_t clock = 0;
+    uint32_t start;
+    uint32_t end;
+    int32_t offset;
+    int max_error = 0;
+    int notes = 0;
+    int step;
+
+    test_pattern();
+    /* not the clock's tempo, it must not matter */
+    sequencer_set_tempo(90.0);
+
+    m_event_count = 0;
+    tempo_start();
+    sequencer_set_playing(1);
+    end = (uint32_t) (TEMPO_PPQN * 16 * clock_samples);
+    test_render(0, end, BLOCK_FRAMES, clock_samples, &clock);
+
+    for(int i = 0; i < m_event_count; i++) {
+        if((m_events[i].velocity == 0) || (m_events[i].channel != 0))
+            continue;
+        /* after two beats to lock */
+        if(m_events[i].sample < 2 * TEMPO_PPQN * clock_samples)
+            continue;
+        step = (int) (m_events[i].sample / (SEQUENCER_TICKS_PER_STEP * clock_samples) + 0.5);
+        CHECK(m_events[i].key == 60 + step % 16);
+        offset = (int32_t) (m_events[i].sample - (uint32_t) (step * SEQUENCER_TICKS_PER_STEP * clock_samples));
+        if(abs(offset) > max_error)
+            max_error = abs(offset);
+        notes++;
+    }
+    CHECK(notes > 0);
+    CHECK(max_error <= 2);
+
+    /* the transport stops the steps, the clock keeps running */
+    tempo_stop();
+    m_event_count = 0;
+    start = end;
+    end += (uint32_t) (TEMPO_PPQN * 4 * clock_samples);
+    test_render(start, end, BLOCK_FRAMES, clock_samples, &clock);
+    for(int i = 0; i < m_event_count; i++)
+        CHECK(m_events[i].velocity == 0);
+
+    sequencer_set_playing(0);
+    sequencer_process_block(end, BLOCK_FRAMES);
+
+    printf("MIDI clock at %.1f BPM: %d notes within %d sample(s) of the clock\n", bpm, notes, max_error);
+
+    /* the clock stops, the estimate times out */
+    test_render(end, end + SYNTH_SAMPLING_FREQ, BLOCK_FRAMES, 0.0, NULL);
+}
+
+static void test_write_file(const char *name, const void *data, size_t size)
+{
+    char filename[32];
+    FILE *f;
+
+    snprintf(filename, sizeof(filename), "/spiffs/%s", name);
+    f = fopen(filename, "w");
+    CHECK(f != NULL);
+    if(f == NULL)
+        return;
+    fwrite(data, 1, size, f);
+    fclose(f);
+}
+
+static int test_is_clear(const sequencer_pattern_t *pattern)
+{
+    sequencer_pattern_t clear;
+
+    sequencer_clear(&clear);
+    return memcmp(pattern, &clear, sizeof(clear)) == 0;
+}
+
+static void test_records(void)
+{
+    sequencer_record_t record;
+    sequencer_pattern_t pattern;
+    uint8_t data[sizeof(record) + 1];
+    FILE *f;
+
+    /* a pattern that was never saved is empty */
+    sequencer_read(4, &pattern);
+    CHECK(test_is_clear(&pattern));
+
+    test_pattern();
+    sequencer_set_tempo(97.0);
+    sequencer_save(2);
+    CHECK(sequencer_write(2) == 0);
+    sequencer_read(2, &pattern);
+    CHECK(memcmp(&pattern, &m_bank[2], sizeof(pattern)) == 0);
+    CHECK(pattern.tempo == 97.0);
+
+    /* the write was interrupted after the old file was removed */
+    CHECK(rename("/spiffs/PATTERN2", "/spiffs/PATTERN2.tmp") == 0);
+    sequencer_read(2, &pattern);
+    CHECK(memcmp(&pattern, &m_bank[2], sizeof(pattern)) == 0);
+    f = fopen("/spiffs/PATTERN2", "r");
+    CHECK(f != NULL);
+    if(f != NULL)
+        fclose(f);
+
+    record.header.magic = SEQUENCER_MAGIC;
+    record.header.version = SEQUENCER_VERSION;
+    record.header.reserved = 0;
+    record.header.length = sizeof(sequencer_pattern_t);
+    record.pattern = m_bank[2];
+    record.header.crc = esp_crc32_le(0, (const uint8_t *) &record.pattern, sizeof(record.pattern));
+
+    /* a tempo or length out of range with a valid CRC is clamped */
+    record.pattern.tempo = NAN;
+    record.pattern.tracks[3].length = 200;
+    record.header.crc = esp_crc32_le(0, (const uint8_t *) &record.pattern, sizeof(record.pattern));
+    test_write_file("PATTERN3", &record, sizeof(record));
+    sequencer_read(3, &pattern);
+    CHECK(pattern.tempo == SEQUENCER_DEFAULT_TEMPO);
+    CHECK(pattern.tracks[3].length == SEQUENCER_MAX_STEPS);
+    record.pattern.tempo = 1000.0;
+    record.header.crc = esp_crc32_le(0, (const uint8_t *) &record.pattern, sizeof(record.pattern));
+    test_write_file("PATTERN3", &record, sizeof(record));
+    sequencer_read(3, &pattern);
+    CHECK(pattern.tempo == TEMPO_BPM_MAX);
+
+    /* damaged records give an empty pattern */
+    record.pattern = m_bank[2];
+    record.header.crc = esp_crc32_le(0, (const uint8_t *) &record.pattern, sizeof(record.pattern));
+
+    record.pattern.tracks[1].steps[0].note ^= 0x01;
+    test_write_file("PATTERN3", &record, sizeof(record));
+    sequencer_read(3, &pattern);
+    CHECK(test_is_clear(&pattern));
+    record.pattern.tracks[1].steps[0].note ^= 0x01;
+
+    test_write_file("PATTERN3", &record, sizeof(record) - 1);
+    sequencer_read(3, &pattern);
+    CHECK(test_is_clear(&pattern));
+
+    test_write_file("PATTERN3", &record, sizeof(record.header) - 1);
+    sequencer_read(3, &pattern);
+    CHECK(test_is_clear(&pattern));
+
+    record.header.version = SEQUENCER_VERSION + 1;
+    test_write_file("PATTERN3", &record, sizeof(record));
+    sequencer_read(3, &pattern);
+    CHECK(test_is_clear(&pattern));
+    record.header.version = SEQUENCER_VERSION;
+
+    record.header.magic = ~SEQUENCER_MAGIC;
+    test_write_file("PATTERN3", &record, sizeof(record));
+    sequencer_read(3, &pattern);
+    CHECK(test_is_clear(&pattern));
+    record.header.magic = SEQUENCER_MAGIC;
+
+    /* the pattern without the header, as written before the records */
+    test_write_file("PATTERN3", &record.pattern, sizeof(record.pattern));
+    sequencer_read(3, &pattern);
+    CHECK(test_is_clear(&pattern));
+
+    /* a file that is longer than a record */
+    memcpy(data, &record, sizeof(record));
+    data[sizeof(record)] = 0;
+    test_write_file("PATTERN3", data, sizeof(data));
+    sequencer_read(3, &pattern);
+    CHECK(test_is_clear(&pattern));
+
+    /* and the valid one */
+    test_write_file("PATTERN3", &record, sizeof(record));
+    sequencer_read(3, &pattern);
+    CHECK(memcmp(&pattern, &m_bank[2], sizeof(pattern)) == 0);
+}
+
+int main(void)
+{
+    test_internal_tempo(120.0);
+    test_internal_tempo(133.0);
+    test_internal_tempo(TEMPO_BPM_MAX);
+    test_midi_clock(120.0);
+    test_midi_clock(97.0);
+    test_records();
+
+    return host_report("test_sequencer");
+}
@@ -0,0 +1,283 @@
+/* Host test of the lookup tables that tables.py generates (see CMakeLists.txt):
+ * the tables against the formulas that they replaced at run time, and the
+ * band-limited wavetables against the harmonics each band may have, as the
+ * oscillators in synth.c read them.
+ */
+#include "host.h"
+
+#include "tables.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#define PHASE_RANGE             (4294967296.0)
+/* samples of a rendered tone that the aliasing is measured over */
+#define ALIAS_SAMPLES           (4096)
+/* bins around each harmonic that are counted as the harmonic (Hann window) */
+#define ALIAS_BINS              (3)
+
+static double m_cos[WAVETABLE_SIZE];
+static double m_sin[WAVETABLE_SIZE];
+
+/* the oscillators before the tables: the note's frequency rounded to a float,
+ * and the naive waveforms
+ */
+static uint32_t test_increment_float(uint8_t key)
+{
+    float frequency = 440.0 * pow(2.0, (key - 69.0) / 12.0);
+
+    return (uint32_t) (frequency * PHASE_RANGE / SYNTH_SAMPLING_FREQ);
+}
+
+static float test_naive(int square, uint32_t phase)
+{
+    if(square)
+        return (phase < 0x80000000) ? 1.0f : -1.0f;
+
+    return (float) phase / (PHASE_RANGE / 2) - 1.0f;
+}
+
+/* as oscillator_sample() in synth.c */
+static float test_wavetable(int square, int band, uint32_t phase)
+{
+    const int16_t *table = square ? wavetable_square[band] : wavetable_sawtooth[band];
+
+    return (WAVETABLE_PEAK / INT16_MAX) * table[phase >> (32 - WAVETABLE_BITS)];
+}
+
+/* the harmonics a band has (see band_harmonics() in tables.py) */
+static int test_band_harmonics(int band)
+{
+    int harmonics = 1 << (31 - WAVETABLE_FIRST_BAND_BITS - band);
+
+    if(harmonics > WAVETABLE_SIZE / 2 - 1)
+        harmonics = WAVETABLE_SIZE / 2 - 1;
+
+    return (harmonics < 1) ? 1 : harmonics;
+}
+
+/* amplitude of harmonic h of a table, in full scale */
+static double test_harmonic(const int16_t *table, int h)
+{
+    double re = 0.0;
+    double im = 0.0;
+
+    for(int i = 0; i < WAVETABLE_SIZE; i++) {
+        re += table[i] * m_cos[(h * i) % WAVETABLE_SIZE];
+        im += table[i] * m_sin[(h * i) % WAVETABLE_SIZE];
+    }
+
+    return sqrt(re * re + im * im) * 2.0 / WAVETABLE_SIZE * WAVETABLE_PEAK / INT16_MAX;
+}
+
+static double test_db(double ratio)
+{
+    return 10.0 * log10(ratio);
+}
+
+/* fraction of the energy of a rendered tone that is not at one of its
+ * harmonics, i.e. that was aliased
+ */
+static double test_aliasing(int square, int wavetable, uint32_t increment)
+{
+    static float samples[ALIAS_SAMPLES];
+    static double window_cos[ALIAS_SAMPLES];
+    static double window_sin[ALIAS_SAMPLES];
+    static double window[ALIAS_SAMPLES];
+    int band = wavetable_band(increment);
+    double f0 = increment / PHASE_RANGE * ALIAS_SAMPLES;
+    double total = 0.0;
+    double aliased = 0.0;
+    double re;
+    double im;
+    double h;
+    uint32_t phase = 0;
+
+    for(int i = 0; i < ALIAS_SAMPLES; i++) {
+        window[i] = 0.5 - 0.5 * cos(2.0 * M_PI * i / ALIAS_SAMPLES);
+        window_cos[i] = cos(2.0 * M_PI * i / ALIAS_SAMPLES);
+        window_sin[i] = sin(2.0 * M_PI * i / ALIAS_SAMPLES);
+        samples[i] = wavetable ? test_wavetable(square, band, phase) : test_naive(square, phase);
+        phase += increment;
+    }
+
+    for(int k = 1; k < ALIAS_SAMPLES / 2; k++) {
+        re = 0.0;
+        im = 0.0;
+        for(int i = 0; i < ALIAS_SAMPLES; i++) {
+            re += window[i] * samples[i] * window_cos[(k * i) % ALIAS_SAMPLES];
+            im += window[i] * samples[i] * window_sin[(k * i) % ALIAS_SAMPLES];
+        }
+        total += re * re + im * im;
+        h = k / f0;
+        if(fabs(h - round(h)) * f0 > ALIAS_BINS)
+            aliased += re * re + im * im;
+    }
+
+    return aliased / total;
+}
+
+static void test_sine(void)
+{
+    float expected;
+    float error;
+    int wrong = 0;
+
+    /* rounded to the nearest float */
+    for(int i = 0; i < SINE_TABLE_SIZE; i++) {
+        expected = sin(2.0 * M_PI * i / SINE_TABLE_SIZE);
+        error = fabsf(sine_table[i] - expected);
+        wrong += (error > nextafterf(fabsf(expected), INFINITY) - fabsf(expected));
+    }
+    CHECK(wrong == 0);
+
+    CHECK(sine_table[0] == 0.0f);
+    CHECK(sine_table[SINE_TABLE_SIZE / 4] == 1.0f);
+    CHECK(sine_table[3 * SINE_TABLE_SIZE / 4] == -1.0f);
+}
+
+static void test_note_increments(void)
+{
+    double frequency;
+    uint32_t expected;
+    int max_error = 0;
+    int error;
+    int differ = 0;
+
+    for(int key = 0; key < NOTE_COUNT; key++) {
+        frequency = 440.0 * pow(2.0, (key - 69) / 12.0);
+        expected = (uint32_t) (frequency * PHASE_RANGE / SYNTH_SAMPLING_FREQ);
+        CHECK(abs((int) (note_phase_increments[key] - expected)) <= 1);
+
+        /* the float path rounded the frequency */
+        error = abs((int) (note_phase_increments[key] - test_increment_float(key)));
+        differ += (error != 0);
+        if(error > max_error)
+            max_error = error;
+    }
+    CHECK((double) max_error / note_phase_increments[NOTE_COUNT - 1] < 1e-6);
+
+    CHECK(note_phase_increments[69] == (uint32_t) (440.0 * PHASE_RANGE / SYNTH_SAMPLING_FREQ));
+    CHECK(note_phase_increments[81] == (uint32_t) (880.0 * PHASE_RANGE / SYNTH_SAMPLING_FREQ));
+
+    printf("note increments: %d of %d differ from the float path, by at most %d\n", differ, NOTE_COUNT,
+            max_error);
+}
+
+/* the band of each note has no harmonics above the Nyquist frequency, the one
+ * below it would have had
+ */
+static void test_bands(void)
+{
+    uint32_t increment;
+    int band;
+
+    for(int key = 0; key < NOTE_COUNT; key++) {
+        increment = note_phase_increments[key];
+        band = wavetable_band(increment);
+        CHECK((double) test_band_harmonics(band) * increment < PHASE_RANGE / 2);
+        if(band > 0)
+            CHECK((double) test_band_harmonics(band - 1) * increment >= PHASE_RANGE / 2 / 2);
+    }
+
+    CHECK(wavetable_band(0) == 0);
+    CHECK(wavetable_band(0x7fffffff) == WAVETABLE_BANDS - 1);
+    CHECK(wavetable_band(UINT32_MAX) == WAVETABLE_BANDS - 1);
+}
+
+static void test_wavetables(void)
+{
+    const int16_t *table;
+    double expected;
+    double error;
+    double worst;
+    double limit;
+    int harmonics;
+    int peak;
+    int n;
+
+    for(int i = 0; i < WAVETABLE_SIZE; i++) {
+        m_cos[i] = cos(2.0 * M_PI * i / WAVETABLE_SIZE);
+        m_sin[i] = sin(2.0 * M_PI * i / WAVETABLE_SIZE);
+    }
+
+    for(int square = 0; square < 2; square++) {
+        /* band 0 follows the naive waveform, away from its edges */
+        error = 0.0;
+        n = 0;
+        for(int i = 0; i < WAVETABLE_SIZE; i++) {
+            int edge = square ? (i % (WAVETABLE_SIZE / 2)) : i;
+            uint32_t phase = (uint32_t) i << (32 - WAVETABLE_BITS);
+
+            if((edge < 40) || (edge > (square ? WAVETABLE_SIZE / 2 : WAVETABLE_SIZE) - 40))
+                continue;
+            error += fabsf(test_wavetable(square, 0, phase) - test_naive(square, phase));
+            n++;
+        }
+        CHECK(error / n < 0.002);
+
+        peak = 0;
+        worst = 0.0;
+        limit = 0.0;
+        for(int band = 0; band < WAVETABLE_BANDS; band++) {
+            table = square ? wavetable_square[band] : wavetable_sawtooth[band];
+            for(int i = 0; i < WAVETABLE_SIZE; i++) {
+                if(abs(table[i]) > peak)
+                    peak = abs(table[i]);
+            }
+
+            /* the harmonics of the band have the amplitudes of the waveform,
+             * there is nothing above them
+             */
+            harmonics = test_band_harmonics(band);
+            for(int h = 1; h < WAVETABLE_SIZE / 2; h++) {
+                if((h > 32) && (h < harmonics - 32) && (h % 97 != 0))
+                    continue;
+                expected = (h > harmonics) ? 0.0 : square ? ((h % 2) ? 4.0 / M_PI / h : 0.0) : 2.0 / M_PI / h;
+                error = fabs(test_harmonic(table, h) - expected);
+                if((h > harmonics) && (error > worst))
+                    worst = error;
+                if((h <= harmonics) && (error > limit))
+                    limit = error;
+            }
+        }
+
+        /* no clipping */
+        CHECK(peak < INT16_MAX);
+        CHECK(limit < 1e-4);
+        CHECK(20.0 * log10(worst) < -80.0);
+
+        printf("%s: peak %.3f of full scale, harmonics within %.1e, %.1f dB above the limit of each band\n",
+                square ? "square" : "sawtooth", (double) peak / INT16_MAX, limit, 20.0 * log10(worst));
+    }
+}
+
+/* the high notes, where the naive waveforms alias */
+static void test_aliasing_keys(void)
+{
+    const uint8_t keys[] = { 60, 84, 96, 108 };
+    double naive;
+    double wavetable;
+
+    for(int square = 0; square < 2; square++) {
+        for(int i = 0; i < sizeof(keys); i++) {
+            naive = test_db(test_aliasing(square, 0, note_phase_increments[keys[i]]));
+            wavetable = test_db(test_aliasing(square, 1, note_phase_increments[keys[i]]));
+            CHECK(wavetable < -35.0);
+            CHECK(wavetable < naive - 10.0);
+            printf("%s, key %d: %.1f dB aliased, %.1f dB with the naive waveform\n",
+                    square ? "square" : "sawtooth", keys[i], wavetable, naive);
+        }
+    }
+}
+
+int main(void)
+{
+    test_sine();
+    test_note_increments();
+    test_bands();
+    test_wavetables();
+    test_aliasing_keys();
+
+    return host_report("test_tables");
+}
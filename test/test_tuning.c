@@ -0,0 +1,224 @@
+/* Host test of the Scala tunings: scales with an octave period and without
+ * one, keyboard mappings, invalid files, and the tunings that tuning_init()
+ * loads from SPIFFS. Equal temperament has to give the generated table.
+ */
+#include "host.h"
+
+#include "tuning.c"
+
+#define TEST_FREQ(increment)    ((increment) * (double) SYNTH_SAMPLING_FREQ / PHASE_RANGE)
+
+/* a truncated increment is less than one step (1e-5 Hz) below the frequency */
+static int test_near(uint32_t increment, double frequency)
+{
+    double error = frequency - TEST_FREQ(increment);
+
+    return (error >= -1e-9 * frequency) && (error < 2e-5 + 1e-9 * frequency);
+}
+
+static const char m_equal[] =
+    "! 12tet.scl\n"
+    "!\n"
+    "12-tone equal temperament\n"
+    " 12\n"
+    "!\n"
+    "100.0\n200.\n300.0\n400.0\n500.0\n600.0\n700.0\n800.0\n900.0\n1000.0\n1100.0\n"
+    "2/1\n";
+
+/* just intonation on the white keys, the black keys are not mapped, with C4 as
+ * the reference and no keys below C3; the entry of B is missing
+ */
+static const char m_just[] = "just major\n7\n9/8\n5/4\n4/3\n3/2\n5/3\n15/8\n2/1\n";
+static const char m_just_keymap[] =
+    "! just.kbm\r\n12\r\n48\r\n127\r\n60\r\n60\r\n261.63\r\n7\r\n0\r\nx\r\n1\r\nx\r\n2\r\n3\r\nx\r\n4\r\nx\r\n5\r\nx\r\n";
+
+/* Bohlen-Pierce: 13 equal steps of the tritave (3/1) */
+static void test_bohlen_pierce(char *text, size_t size)
+{
+    int n = snprintf(text, size, "Bohlen-Pierce equal\n13\n");
+
+    for(int i = 1; i < 13; i++)
+        n += snprintf(&text[n], size - n, "%.6f cents\n", i * 1200.0 * log2(3.0) / 13);
+    snprintf(&text[n], size - n, "3\n");
+}
+
+static void test_write_file(const char *name, const char *text)
+{
+    char filename[TUNING_FILENAME_LENGTH];
+    FILE *f;
+
+    snprintf(filename, sizeof(filename), "/spiffs/%s", name);
+    f = fopen(filename, "w");
+    CHECK(f != NULL);
+    fputs(text, f);
+    fclose(f);
+}
+
+static void test_equal(void)
+{
+    tuning_scale_t scale;
+    tuning_keymap_t keymap;
+    uint32_t increments[NOTE_COUNT];
+    int wrong = 0;
+
+    CHECK(tuning_parse_scl(m_equal, &scale) == 0);
+    CHECK(scale.count == 12);
+    CHECK(scale.cents[11] == 1200.0);
+    tuning_default_keymap(&keymap, &scale);
+    CHECK(tuning_calculate(&scale, &keymap, increments) == 0);
+
+    for(int key = 0; key < NOTE_COUNT; key++)
+        wrong += (increments[key] != note_phase_increments[key]);
+    CHECK(wrong == 0);
+    CHECK(test_near(increments[69], 440.0));
+    CHECK(test_near(increments[60], 261.6255653));
+}
+
+/* scales whose period is not an octave */
+static void test_non_octave(void)
+{
+    tuning_scale_t scale;
+    tuning_keymap_t keymap;
+    uint32_t increments[NOTE_COUNT];
+    char text[1024];
+
+    test_bohlen_pierce(text, sizeof(text));
+    CHECK(tuning_parse_scl(text, &scale) == 0);
+    CHECK(scale.count == 13);
+    tuning_default_keymap(&keymap, &scale);
+    CHECK(tuning_calculate(&scale, &keymap, increments) == 0);
+    CHECK(test_near(increments[69], 440.0));
+    CHECK(test_near(increments[69 + 13], 1320.0));
+    CHECK(test_near(increments[69 - 13], 440.0 / 3));
+    CHECK(test_near(increments[70], 440.0 * pow(3.0, 1.0 / 13)));
+    /* up to the Nyquist frequency */
+    CHECK(increments[NOTE_COUNT - 1] == 0x7fffffff);
+    CHECK(increments[0] > 0);
+
+    /* Carlos Alpha: a single step of 78 cents, which is the period */
+    CHECK(tuning_parse_scl("Carlos Alpha\n1\n78.0\n", &scale) == 0);
+    tuning_default_keymap(&keymap, &scale);
+    CHECK(tuning_calculate(&scale, &keymap, increments) == 0);
+    CHECK(test_near(increments[69], 440.0));
+    CHECK(test_near(increments[79], 440.0 * pow(2.0, 780.0 / 1200)));
+    CHECK(test_near(increments[59], 440.0 * pow(2.0, -780.0 / 1200)));
+    for(int key = 1; key < NOTE_COUNT; key++)
+        CHECK(increments[key] > increments[key - 1]);
+}
+
+static void test_keymap(void)
+{
+    tuning_scale_t scale;
+    tuning_keymap_t keymap;
+    uint32_t increments[NOTE_COUNT];
+
+    CHECK(tuning_parse_scl(m_just, &scale) == 0);
+    CHECK(tuning_parse_kbm(m_just_keymap, &keymap) == 0);
+    CHECK((keymap.size == 12) && (keymap.first == 48) && (keymap.middle == 60) && (keymap.octave_degree == 7));
+    CHECK((keymap.map[0] == 0) && (keymap.map[1] == TUNING_UNMAPPED) && (keymap.map[11] == TUNING_UNMAPPED));
+    CHECK(tuning_calculate(&scale, &keymap, increments) == 0);
+
+    CHECK(test_near(increments[60], 261.63));
+    CHECK(test_near(increments[62], 261.63 * 9 / 8));
+    CHECK(test_near(increments[67], 261.63 * 3 / 2));
+    CHECK(test_near(increments[69], 261.63 * 5 / 3));
+    CHECK(test_near(increments[72], 261.63 * 2));
+    CHECK(test_near(increments[48], 261.63 / 2));
+    CHECK(test_near(increments[57], 261.63 / 2 * 5 / 3));
+    /* black keys, B (missing) and keys outside the range */
+    CHECK((increments[61] == 0) && (increments[66] == 0) && (increments[71] == 0) && (increments[59] == 0));
+    CHECK((increments[47] == 0) && (increments[45] == 0));
+
+    /* a mapping that repeats every 7 degrees of a 12-note scale, like the
+     * white keys of equal temperament
+     */
+    CHECK(tuning_parse_scl(m_equal, &scale) == 0);
+    CHECK(tuning_parse_kbm("7\n0\n127\n60\n65\n440.0\n12\n0\n2\n4\n5\n7\n9\n11\n", &keymap) == 0);
+    CHECK(tuning_calculate(&scale, &keymap, increments) == 0);
+    CHECK(test_near(increments[60], 440.0 * pow(2.0, -9.0 / 12)));
+    CHECK(test_near(increments[65], 440.0));
+    CHECK(test_near(increments[67], 880.0 * pow(2.0, -9.0 / 12)));
+    CHECK(test_near(increments[58], 440.0 / 2));
+
+    /* a whole-tone scale: every key is 2 degrees of the 12-note scale, up to
+     * key 100
+     */
+    CHECK(tuning_parse_kbm("1\n0\n100\n60\n69\n440.0\n2\n0\n", &keymap) == 0);
+    CHECK(tuning_calculate(&scale, &keymap, increments) == 0);
+    CHECK(test_near(increments[69], 440.0));
+    CHECK(test_near(increments[60], 440.0 * pow(2.0, -18.0 / 12)));
+    CHECK(test_near(increments[61], 440.0 * pow(2.0, -16.0 / 12)));
+    CHECK(test_near(increments[75], 880.0));
+    CHECK((increments[100] != 0) && (increments[101] == 0));
+
+    /* the reference key has to be mapped */
+    CHECK(tuning_parse_kbm("12\n0\n127\n60\n61\n440.0\n7\n0\nx\n", &keymap) == 0);
+    CHECK(tuning_calculate(&scale, &keymap, increments) == -1);
+}
+
+static void test_invalid(void)
+{
+    tuning_scale_t scale;
+    tuning_keymap_t keymap;
+
+    CHECK(tuning_parse_scl("", &scale) == -1);
+    CHECK(tuning_parse_scl("no count\n", &scale) == -1);
+    CHECK(tuning_parse_scl("no notes\n0\n", &scale) == -1);
+    CHECK(tuning_parse_scl("too many notes\n129\n", &scale) == -1);
+    CHECK(tuning_parse_scl("missing\n3\n100.0\n200.0\n", &scale) == -1);
+    CHECK(tuning_parse_scl("bad ratio\n1\n3/0\n", &scale) == -1);
+    CHECK(tuning_parse_scl("negative ratio\n1\n-3/2\n", &scale) == -1);
+    CHECK(tuning_parse_scl("not a pitch\n1\nfoo\n", &scale) == -1);
+
+    CHECK(tuning_parse_kbm("12\n0\n127\n", &keymap) == -1);
+    CHECK(tuning_parse_kbm("12\n0\n127\n60\n69\n0.0\n12\n", &keymap) == -1);
+    CHECK(tuning_parse_kbm("129\n0\n127\n60\n69\n440.0\n12\n", &keymap) == -1);
+    CHECK(tuning_parse_kbm("12\n0\n127\n60\n69\n440.0\n12\nfoo\n", &keymap) == -1);
+}
+
+/* the tunings in SPIFFS; the ones that are not valid keep equal temperament */
+static void test_init(void)
+{
+    static char large[TUNING_MAX_FILE_SIZE + 2];
+    char text[1024];
+    const uint32_t *increments;
+
+    test_bohlen_pierce(text, sizeof(text));
+    test_write_file("TUNING1.SCL", text);
+    test_write_file("TUNING2.SCL", m_just);
+    test_write_file("TUNING2.KBM", m_just_keymap);
+    test_write_file("TUNING3.SCL", "missing\n3\n100.0\n200.0\n");
+    test_write_file("TUNING4.SCL", m_just);
+    test_write_file("TUNING4.KBM", "12\n0\n127\n");
+    test_write_file("TUNING5.SCL", m_just);
+    test_write_file("TUNING5.KBM", "12\n0\n127\n60\n61\n440.0\n7\n0\nx\n");
+    /* a file that is too large, although it starts with a valid scale */
+    memset(large, ' ', sizeof(large) - 1);
+    memcpy(large, m_equal, strlen(m_equal));
+    test_write_file("TUNING6.SCL", large);
+    /* TUNING7 does not exist */
+
+    tuning_init();
+
+    CHECK(tuning_get_increments(0) == note_phase_increments);
+    increments = tuning_get_increments(1);
+    CHECK(increments != note_phase_increments);
+    CHECK(test_near(increments[69 + 13], 1320.0));
+    increments = tuning_get_increments(2);
+    CHECK(test_near(increments[60], 261.63) && (increments[61] == 0));
+    for(int i = 3; i < TUNING_COUNT; i++)
+        CHECK(tuning_get_increments(i) == note_phase_increments);
+    CHECK(tuning_get_increments(TUNING_COUNT) == note_phase_increments);
+    CHECK(tuning_get_increments(200) == note_phase_increments);
+}
+
+int main(void)
+{
+    test_equal();
+    test_non_octave();
+    test_keymap();
+    test_invalid();
+    test_init();
+
+    return host_report("test_tuning");
+}
@@ -1,4 +1,4 @@
-from .button_selector_widgets import WaveformSelectorWidget, PresetSelectorWidget
+from .button_selector_widgets import WaveformSelectorWidget, LfoSyncSelectorWidget, PresetSelectorWidget
 from .push_button_widget import PushButtonWidget
 from .toggle_button_widget import ToggleButtonWidget
 from .slider_widget import SliderWidget
\ No newline at end of file
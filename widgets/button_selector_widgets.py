@@ -46,6 +46,17 @@ class WaveformSelectorWidget(ButtonSelectorWidget):
     }
 
 
+class LfoSyncSelectorWidget(ButtonSelectorWidget):
+    buttons = {
+        0: {"label": "Free", "midi_value": 0},
+        1: {"label": "1/1", "midi_value": 16},
+        2: {"label": "1/2", "midi_value": 32},
+        3: {"label": "1/4", "midi_value": 48},
+        4: {"label": "1/8", "midi_value": 64},
+        5: {"label": "1/16", "midi_value": 80},
+    }
+
+
 class PresetSelectorWidget(ButtonSelectorWidget):
     buttons = {
         0: {"label": "P0", "midi_value": 0},